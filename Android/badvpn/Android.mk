@@ -25,6 +25,7 @@ LOCAL_SRC_FILES := \
         system/BTime.c \
         system/BUnixSignal.c \
         system/BNetwork.c \
+        system/BThreadSignal.c \
         flow/StreamRecvInterface.c \
         flow/PacketRecvInterface.c \
         flow/PacketPassInterface.c \
@@ -38,6 +39,8 @@ LOCAL_SRC_FILES := \
         flow/PacketPassFairQueue.c \
         flow/PacketProtoEncoder.c \
         flow/PacketProtoDecoder.c \
+        flow/PacketChunk.c \
+        flow/FlowProfile.c \
         socksclient/BSocksClient.c \
         tuntap/BTap.c \
         lwip/src/core/timers.c \
@@ -68,8 +71,11 @@ LOCAL_SRC_FILES := \
         base/BLog.c \
         base/BPending.c \
         flowextra/PacketPassInactivityMonitor.c \
+        flowextra/PacketStreamCoalescer.c \
+        flowextra/FlowProfileDumper.c \
         tun2socks/SocksUdpGwClient.c \
-        udpgw_client/UdpGwClient.c
+        udpgw_client/UdpGwClient.c \
+        random/BRandom2.c
 
 include $(BUILD_SHARED_LIBRARY)
 
@@ -302,6 +302,7 @@ void DPReceiveReceiver_Init (DPReceiveReceiver *o, DPReceivePeer *peer)
     
     // init receive interface
     PacketPassInterface_Init(&o->recv_if, device->packet_mtu, (PacketPassInterface_handler_send)receiver_recv_handler_send, o, BReactor_PendingGroup(device->reactor));
+    PacketPassInterface_SetName(&o->recv_if, "DPReceivePeer");
     
     DebugCounter_Increment(&peer->d_receivers_ctr);
     DebugObject_Init(&o->d_obj);
@@ -45,6 +45,15 @@ static void recv_decoder_notifier_handler (DatagramPeerIO *o, uint8_t *data, int
 
 void init_io (DatagramPeerIO *o)
 {
+#ifndef BADVPN_USE_WINAPI
+    if (o->shared) {
+        // connect source and sink
+        PacketRecvConnector_ConnectInput(&o->recv_connector, DatagramSharedSocketPeer_GetRecvIf(&o->shared_peer));
+        PacketPassConnector_ConnectOutput(&o->send_connector, DatagramSharedSocketPeer_GetSendIf(&o->shared_peer));
+        return;
+    }
+#endif
+    
     // init dgram recv interface
     BDatagram_RecvAsync_Init(&o->dgram, o->effective_socket_mtu);
     
@@ -63,6 +72,14 @@ void free_io (DatagramPeerIO *o)
     // disconnect sink
     PacketPassConnector_DisconnectOutput(&o->send_connector);
     
+#ifndef BADVPN_USE_WINAPI
+    if (o->shared) {
+        // disconnect source
+        PacketRecvConnector_DisconnectInput(&o->recv_connector);
+        return;
+    }
+#endif
+    
     // free dgram send interface
     BDatagram_SendAsync_Free(&o->dgram);
     
@@ -104,8 +121,15 @@ void reset_mode (DatagramPeerIO *o)
     // free I/O
     free_io(o);
     
-    // free datagram object
-    BDatagram_Free(&o->dgram);
+    if (o->shared) {
+#ifndef BADVPN_USE_WINAPI
+        // free shared socket peer
+        DatagramSharedSocketPeer_Free(&o->shared_peer);
+#endif
+    } else {
+        // free datagram object
+        BDatagram_Free(&o->dgram);
+    }
     
     // set mode
     o->mode = DATAGRAMPEERIO_MODE_NONE;
@@ -116,6 +140,21 @@ void recv_decoder_notifier_handler (DatagramPeerIO *o, uint8_t *data, int data_l
     ASSERT(o->mode == DATAGRAMPEERIO_MODE_BIND)
     DebugObject_Access(&o->d_obj);
     
+#ifndef BADVPN_USE_WINAPI
+    if (o->shared) {
+        // obtain addresses from last received packet
+        BAddr addr;
+        BIPAddr local_addr;
+        ASSERT_EXECUTE(DatagramSharedSocketPeer_GetLastReceiveAddrs(&o->shared_peer, &addr, &local_addr))
+        
+        // update addresses
+        if (!DatagramSharedSocketPeer_SetSendAddrs(&o->shared_peer, addr, local_addr)) {
+            PeerLog(o, BLOG_WARNING, "receive address is used by another peer");
+        }
+        return;
+    }
+#endif
+    
     // obtain addresses from last received packet
     BAddr addr;
     BIPAddr local_addr;
@@ -309,6 +348,7 @@ int DatagramPeerIO_Connect (DatagramPeerIO *o, BAddr addr)
         PeerLog(o, BLOG_ERROR, "BDatagram_Init failed");
         goto fail0;
     }
+    o->shared = 0;
     
     // set send address
     BIPAddr local_addr;
@@ -346,6 +386,7 @@ int DatagramPeerIO_Bind (DatagramPeerIO *o, BAddr addr)
         PeerLog(o, BLOG_INFO, "BDatagram_Bind failed");
         goto fail1;
     }
+    o->shared = 0;
     
     // init I/O
     init_io(o);
@@ -364,6 +405,54 @@ fail0:
     return 0;
 }
 
+#ifndef BADVPN_USE_WINAPI
+
+int DatagramPeerIO_ConnectShared (DatagramPeerIO *o, DatagramSharedSocket *s, BAddr addr)
+{
+    DebugObject_Access(&o->d_obj);
+    
+    // reset mode
+    reset_mode(o);
+    
+    // init shared socket peer
+    if (!DatagramSharedSocketPeer_InitConnect(&o->shared_peer, s, o->effective_socket_mtu, addr)) {
+        PeerLog(o, BLOG_ERROR, "DatagramSharedSocketPeer_InitConnect failed");
+        return 0;
+    }
+    o->shared = 1;
+    
+    // init I/O
+    init_io(o);
+    
+    // set mode
+    o->mode = DATAGRAMPEERIO_MODE_CONNECT;
+    
+    return 1;
+}
+
+void DatagramPeerIO_BindShared (DatagramPeerIO *o, DatagramSharedSocket *s)
+{
+    DebugObject_Access(&o->d_obj);
+    
+    // reset mode
+    reset_mode(o);
+    
+    // init shared socket peer
+    DatagramSharedSocketPeer_InitBind(&o->shared_peer, s, o->effective_socket_mtu);
+    o->shared = 1;
+    
+    // init I/O
+    init_io(o);
+    
+    // set recv notifier handler
+    PacketPassNotifier_SetHandler(&o->recv_notifier, (PacketPassNotifier_handler_notify)recv_decoder_notifier_handler, o);
+    
+    // set mode
+    o->mode = DATAGRAMPEERIO_MODE_BIND;
+}
+
+#endif
+
 void DatagramPeerIO_SetEncryptionKey (DatagramPeerIO *o, uint8_t *encryption_key)
 {
     ASSERT(SPPROTO_HAVE_ENCRYPTION(o->sp_params))
@@ -54,6 +54,9 @@
 #include <client/FragmentProtoAssembler.h>
 #include <client/SPProtoEncoder.h>
 #include <client/SPProtoDecoder.h>
+#ifndef BADVPN_USE_WINAPI
+#include <client/DatagramSharedSocket.h>
+#endif
 
 /**
  * Callback function invoked when an error occurs with the peer connection.
@@ -95,6 +98,9 @@ typedef void (*DatagramPeerIO_handler_otp_ready) (void *user);
  *                 Datagrams are being received on the socket. Datagrams are not being
  *                 sent initially. When a datagram is received, its source address is
  *                 used as a destination address for sending datagrams.
+ *
+ * In connecting and binding mode, the object either has its own socket, or uses a
+ * {@link DatagramSharedSocket} together with other peers (not available on Windows).
  */
 typedef struct {
     DebugObject d_obj;
@@ -122,9 +128,15 @@ typedef struct {
     
     // mode
     int mode;
+    int shared;
     
     // datagram object
     BDatagram dgram;
+    
+#ifndef BADVPN_USE_WINAPI
+    // peer of shared socket
+    DatagramSharedSocketPeer shared_peer;
+#endif
 } DatagramPeerIO;
 
 /**
@@ -213,6 +225,34 @@ int DatagramPeerIO_Connect (DatagramPeerIO *o, BAddr addr) WARN_UNUSED;
  */
 int DatagramPeerIO_Bind (DatagramPeerIO *o, BAddr addr) WARN_UNUSED;
 
+#ifndef BADVPN_USE_WINAPI
+/**
+ * Like {@link DatagramPeerIO_Connect}, but communicates through a shared socket.
+ * Only datagrams from the given address are received.
+ *
+ * @param o the object
+ * @param s shared socket to use. Its MTU must be >= the socket_mtu given to
+ *          {@link DatagramPeerIO_Init}.
+ * @param addr address to send packets to. Its family must be that of the socket.
+ * @return 1 on success, 0 on failure
+ */
+int DatagramPeerIO_ConnectShared (DatagramPeerIO *o, DatagramSharedSocket *s, BAddr addr) WARN_UNUSED;
+
+/**
+ * Like {@link DatagramPeerIO_Bind}, but communicates through a shared socket, which
+ * the user has bound. Datagrams from addresses no other peer of the socket uses are
+ * received, and the source address of one which decodes successfully becomes the
+ * destination address. Since only decoding tells peers apart in this case, the
+ * security parameters should include encryption with hashes, or OTPs.
+ * The interface enters binding mode.
+ *
+ * @param o the object
+ * @param s shared socket to use. Its MTU must be >= the socket_mtu given to
+ *          {@link DatagramPeerIO_Init}.
+ */
+void DatagramPeerIO_BindShared (DatagramPeerIO *o, DatagramSharedSocket *s);
+#endif
+
 /**
  * Sets the encryption key to use for sending and receiving.
  * Encryption must be enabled.
@@ -0,0 +1,492 @@
+/**
+ * @file DatagramSharedSocket.c
+ * @author Psiphon Inc.
+ * 
+ * @section LICENSE
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <string.h>
+
+#include <misc/offset.h>
+#include <misc/balloc.h>
+#include <base/BLog.h>
+
+#include "DatagramSharedSocket.h"
+
+#include <generated/blog_channel_DatagramSharedSocket.h>
+
+#include "DatagramSharedSocket_addrs_tree.h"
+#include <structure/SAvl_impl.h>
+
+static void dgram_handler (DatagramSharedSocket *o, int event);
+static void dgram_batch_handler (DatagramSharedSocket *o);
+static void recv_if_handler_done (DatagramSharedSocket *o, int data_len);
+static void deliver (DatagramSharedSocketPeer *peer);
+static void schedule_flush (DatagramSharedSocket *o);
+static void flush (DatagramSharedSocket *o);
+static void flush_timer_handler (BSmallTimer *timer);
+static void init_peer (DatagramSharedSocketPeer *o, DatagramSharedSocket *s, int mtu);
+static void peer_send_if_handler_send (DatagramSharedSocketPeer *o, uint8_t *data, int data_len);
+static void peer_recv_if_handler_recv (DatagramSharedSocketPeer *o, uint8_t *data);
+
+static void dgram_handler (DatagramSharedSocket *o, int event)
+{
+    DebugObject_Access(&o->d_obj);
+    
+    BLog(BLOG_ERROR, "socket error");
+    
+    // report error
+    o->handler_error(o->user);
+    return;
+}
+
+static void dgram_batch_handler (DatagramSharedSocket *o)
+{
+    DebugObject_Access(&o->d_obj);
+    ASSERT(o->send_waiting)
+    
+    // set not waiting
+    o->send_waiting = 0;
+    
+    // continue sending
+    flush(o);
+}
+
+static void recv_if_handler_done (DatagramSharedSocket *o, int data_len)
+{
+    DebugObject_Access(&o->d_obj);
+    ASSERT(data_len >= 0)
+    ASSERT(data_len <= o->mtu)
+    
+    ASSERT(!o->recv_blocked_peer)
+    
+    // remember datagram
+    o->recv_len = data_len;
+    ASSERT_EXECUTE(BDatagram_GetLastReceiveAddrs(&o->dgram, &o->recv_remote_addr, &o->recv_local_addr))
+    
+    // deliver to the peer using this address
+    DatagramSharedSocketPeer *peer = DSSAddrsTree_LookupExact(&o->addrs_tree, 0, &o->recv_remote_addr);
+    if (peer) {
+        if (!peer->recv_data) {
+            // wait for the peer to finish with its previous datagram, so that bursts
+            // are not dropped; other datagrams wait in the socket buffer meanwhile
+            o->recv_blocked_peer = peer;
+            return;
+        }
+        deliver(peer);
+    } else {
+        // offer to binding peers; the one which can decode it will claim the address
+        for (LinkedList1Node *ln = LinkedList1_GetFirst(&o->binding_list); ln; ln = LinkedList1Node_Next(ln)) {
+            DatagramSharedSocketPeer *bpeer = UPPER_OBJECT(ln, DatagramSharedSocketPeer, binding_list_node);
+            if (!bpeer->recv_data) {
+                BLog(BLOG_DEBUG, "binding peer not ready, not offering datagram");
+                continue;
+            }
+            deliver(bpeer);
+        }
+    }
+    
+    // receive next datagram
+    PacketRecvInterface_Receiver_Recv(BDatagram_RecvAsync_GetIf(&o->dgram), o->recv_buf);
+}
+
+static void deliver (DatagramSharedSocketPeer *peer)
+{
+    DatagramSharedSocket *o = peer->s;
+    ASSERT(peer->recv_data)
+    
+    // drop if too large for the peer
+    if (o->recv_len > peer->mtu) {
+        BLog(BLOG_DEBUG, "datagram too large for peer, dropping");
+        return;
+    }
+    
+    // copy
+    memcpy(peer->recv_data, o->recv_buf, o->recv_len);
+    
+    // remember addresses
+    peer->recv_have_addrs = 1;
+    peer->recv_remote_addr = o->recv_remote_addr;
+    peer->recv_local_addr = o->recv_local_addr;
+    
+    // set not receiving
+    peer->recv_data = NULL;
+    
+    // done
+    PacketRecvInterface_Done(&peer->recv_iface, o->recv_len);
+}
+
+static void schedule_flush (DatagramSharedSocket *o)
+{
+    // run after the handlers of all I/O events of this reactor iteration, so that
+    // everything sent in response to them goes out in one batch
+    if (!o->send_waiting && !BSmallTimer_IsRunning(&o->flush_timer)) {
+        BReactor_SetSmallTimer(o->reactor, &o->flush_timer, BTIMER_SET_RELATIVE, 0);
+    }
+}
+
+static void flush (DatagramSharedSocket *o)
+{
+    ASSERT(!o->send_waiting)
+    
+    while (!LinkedList1_IsEmpty(&o->send_list)) {
+        struct BDatagram_batch_msg msgs[BDATAGRAM_BATCH_MAX];
+        DatagramSharedSocketPeer *peers[BDATAGRAM_BATCH_MAX];
+        int num = 0;
+        
+        // collect datagrams
+        for (LinkedList1Node *ln = LinkedList1_GetFirst(&o->send_list); ln && num < BDATAGRAM_BATCH_MAX; ln = LinkedList1Node_Next(ln)) {
+            DatagramSharedSocketPeer *peer = UPPER_OBJECT(ln, DatagramSharedSocketPeer, send_list_node);
+            ASSERT(peer->send_queued)
+            ASSERT(peer->have_addrs)
+            
+            msgs[num].data = peer->send_data;
+            msgs[num].data_len = peer->send_data_len;
+            msgs[num].remote_addr = peer->remote_addr;
+            msgs[num].local_addr = peer->local_addr;
+            peers[num] = peer;
+            num++;
+        }
+        
+        // submit
+        int done = BDatagram_SendBatch(&o->dgram, msgs, num);
+        
+        // complete the submitted datagrams
+        for (int i = 0; i < done; i++) {
+            DatagramSharedSocketPeer *peer = peers[i];
+            
+            // remove from send list
+            LinkedList1_Remove(&o->send_list, &peer->send_list_node);
+            
+            // set not queued
+            peer->send_queued = 0;
+            peer->send_data = NULL;
+            
+            // done
+            PacketPassInterface_Done(&peer->send_iface);
+        }
+        
+        if (done < num) {
+            // wait for socket to become writable
+            o->send_waiting = 1;
+            return;
+        }
+    }
+}
+
+static void flush_timer_handler (BSmallTimer *timer)
+{
+    DatagramSharedSocket *o = UPPER_OBJECT(timer, DatagramSharedSocket, flush_timer);
+    DebugObject_Access(&o->d_obj);
+    
+    if (o->send_waiting) {
+        return;
+    }
+    
+    flush(o);
+}
+
+static void init_peer (DatagramSharedSocketPeer *o, DatagramSharedSocket *s, int mtu)
+{
+    DebugObject_Access(&s->d_obj);
+    ASSERT(mtu >= 0)
+    ASSERT(mtu <= s->mtu)
+    
+    // init arguments
+    o->s = s;
+    o->mtu = mtu;
+    
+    // init send interface
+    PacketPassInterface_Init(&o->send_iface, o->mtu, (PacketPassInterface_handler_send)peer_send_if_handler_send, o, BReactor_PendingGroup(s->reactor));
+    PacketPassInterface_SetName(&o->send_iface, "DatagramSharedSocket");
+    o->send_data = NULL;
+    o->send_queued = 0;
+    
+    // init receive interface
+    PacketRecvInterface_Init(&o->recv_iface, o->mtu, (PacketRecvInterface_handler_recv)peer_recv_if_handler_recv, o, BReactor_PendingGroup(s->reactor));
+    o->recv_data = NULL;
+    o->recv_have_addrs = 0;
+    
+    DebugCounter_Increment(&s->d_peers_ctr);
+    DebugObject_Init(&o->d_obj);
+}
+
+static void peer_send_if_handler_send (DatagramSharedSocketPeer *o, uint8_t *data, int data_len)
+{
+    DebugObject_Access(&o->d_obj);
+    ASSERT(!o->send_data)
+    ASSERT(data_len >= 0)
+    ASSERT(data_len <= o->mtu)
+    
+    // remember data
+    o->send_data = data;
+    o->send_data_len = data_len;
+    
+    // if we have no addresses, wait
+    if (!o->have_addrs) {
+        return;
+    }
+    
+    // queue
+    LinkedList1_Append(&o->s->send_list, &o->send_list_node);
+    o->send_queued = 1;
+    
+    schedule_flush(o->s);
+}
+
+static void peer_recv_if_handler_recv (DatagramSharedSocketPeer *o, uint8_t *data)
+{
+    DebugObject_Access(&o->d_obj);
+    ASSERT(!o->recv_data)
+    ASSERT(data)
+    
+    DatagramSharedSocket *s = o->s;
+    
+    // wait for a datagram
+    o->recv_data = data;
+    
+    // if the socket is waiting for us, take its datagram and let it continue
+    if (s->recv_blocked_peer == o) {
+        s->recv_blocked_peer = NULL;
+        deliver(o);
+        PacketRecvInterface_Receiver_Recv(BDatagram_RecvAsync_GetIf(&s->dgram), s->recv_buf);
+    }
+}
+
+int DatagramSharedSocket_Init (DatagramSharedSocket *o, int family, int mtu, BReactor *reactor, void *user,
+                               DatagramSharedSocket_handler_error handler_error)
+{
+    ASSERT(BDatagram_AddressFamilySupported(family))
+    ASSERT(mtu >= 0)
+    ASSERT(handler_error)
+    
+    // init arguments
+    o->reactor = reactor;
+    o->mtu = mtu;
+    o->user = user;
+    o->handler_error = handler_error;
+    
+    // allocate receive buffer
+    if (!(o->recv_buf = (uint8_t *)BAlloc(o->mtu))) {
+        BLog(BLOG_ERROR, "BAlloc failed");
+        goto fail0;
+    }
+    
+    // init dgram
+    if (!BDatagram_Init(&o->dgram, family, o->reactor, o, (BDatagram_handler)dgram_handler)) {
+        BLog(BLOG_ERROR, "BDatagram_Init failed");
+        goto fail1;
+    }
+    
+    // init batched sending
+    BDatagram_SendBatch_Init(&o->dgram, (BDatagram_batch_handler)dgram_batch_handler, o);
+    
+    // init receiving; this only starts once the socket is bound or has sent something
+    BDatagram_RecvAsync_Init(&o->dgram, o->mtu);
+    PacketRecvInterface_Receiver_Init(BDatagram_RecvAsync_GetIf(&o->dgram), (PacketRecvInterface_handler_done)recv_if_handler_done, o);
+    PacketRecvInterface_Receiver_Recv(BDatagram_RecvAsync_GetIf(&o->dgram), o->recv_buf);
+    
+    // set not blocked
+    o->recv_blocked_peer = NULL;
+    
+    // init peer structures
+    DSSAddrsTree_Init(&o->addrs_tree);
+    LinkedList1_Init(&o->binding_list);
+    LinkedList1_Init(&o->send_list);
+    
+    // set not waiting
+    o->send_waiting = 0;
+    
+    // init flush timer
+    BSmallTimer_Init(&o->flush_timer, flush_timer_handler);
+    
+    DebugCounter_Init(&o->d_peers_ctr);
+    DebugObject_Init(&o->d_obj);
+    return 1;
+    
+fail1:
+    BFree(o->recv_buf);
+fail0:
+    return 0;
+}
+
+void DatagramSharedSocket_Free (DatagramSharedSocket *o)
+{
+    DebugObject_Free(&o->d_obj);
+    DebugCounter_Free(&o->d_peers_ctr);
+    ASSERT(LinkedList1_IsEmpty(&o->send_list))
+    
+    // free flush timer
+    BReactor_RemoveSmallTimer(o->reactor, &o->flush_timer);
+    
+    // free dgram
+    BDatagram_RecvAsync_Free(&o->dgram);
+    BDatagram_SendBatch_Free(&o->dgram);
+    BDatagram_Free(&o->dgram);
+    
+    // free receive buffer
+    BFree(o->recv_buf);
+}
+
+int DatagramSharedSocket_Bind (DatagramSharedSocket *o, BAddr addr)
+{
+    DebugObject_Access(&o->d_obj);
+    
+    return BDatagram_Bind(&o->dgram, addr);
+}
+
+int DatagramSharedSocketPeer_InitConnect (DatagramSharedSocketPeer *o, DatagramSharedSocket *s, int mtu, BAddr addr)
+{
+    ASSERT(BDatagram_AddressFamilySupported(addr.type))
+    
+    // set addresses
+    o->remote_addr = addr;
+    BIPAddr_InitInvalid(&o->local_addr);
+    
+    // insert to addresses tree
+    if (!DSSAddrsTree_Insert(&s->addrs_tree, 0, o, NULL)) {
+        BLog(BLOG_ERROR, "address is already used by another peer");
+        return 0;
+    }
+    
+    // set have addresses, not binding
+    o->have_addrs = 1;
+    o->binding = 0;
+    
+    init_peer(o, s, mtu);
+    return 1;
+}
+
+void DatagramSharedSocketPeer_InitBind (DatagramSharedSocketPeer *o, DatagramSharedSocket *s, int mtu)
+{
+    // insert to binding list
+    LinkedList1_Append(&s->binding_list, &o->binding_list_node);
+    
+    // set no addresses, binding
+    o->have_addrs = 0;
+    o->binding = 1;
+    
+    init_peer(o, s, mtu);
+}
+
+void DatagramSharedSocketPeer_Free (DatagramSharedSocketPeer *o)
+{
+    DebugObject_Free(&o->d_obj);
+    DatagramSharedSocket *s = o->s;
+    DebugCounter_Decrement(&s->d_peers_ctr);
+    
+    // remove from send list
+    if (o->send_queued) {
+        LinkedList1_Remove(&s->send_list, &o->send_list_node);
+    }
+    
+    // if the socket is waiting for us, drop its datagram and let it continue
+    if (s->recv_blocked_peer == o) {
+        s->recv_blocked_peer = NULL;
+        PacketRecvInterface_Receiver_Recv(BDatagram_RecvAsync_GetIf(&s->dgram), s->recv_buf);
+    }
+    
+    // remove from addresses tree
+    if (o->have_addrs) {
+        DSSAddrsTree_Remove(&s->addrs_tree, 0, o);
+    }
+    
+    // remove from binding list
+    if (o->binding) {
+        LinkedList1_Remove(&s->binding_list, &o->binding_list_node);
+    }
+    
+    // free interfaces
+    PacketRecvInterface_Free(&o->recv_iface);
+    PacketPassInterface_Free(&o->send_iface);
+}
+
+int DatagramSharedSocketPeer_SetSendAddrs (DatagramSharedSocketPeer *o, BAddr remote_addr, BIPAddr local_addr)
+{
+    DebugObject_Access(&o->d_obj);
+    ASSERT(o->binding)
+    ASSERT(BDatagram_AddressFamilySupported(remote_addr.type))
+    
+    DatagramSharedSocket *s = o->s;
+    
+    if (!o->have_addrs || BAddr_CompareOrder(&o->remote_addr, &remote_addr) != 0) {
+        // check that no other peer uses the address
+        if (DSSAddrsTree_LookupExact(&s->addrs_tree, 0, &remote_addr)) {
+            return 0;
+        }
+        
+        // re-key in addresses tree
+        if (o->have_addrs) {
+            DSSAddrsTree_Remove(&s->addrs_tree, 0, o);
+        }
+        o->remote_addr = remote_addr;
+        ASSERT_EXECUTE(DSSAddrsTree_Insert(&s->addrs_tree, 0, o, NULL))
+    }
+    
+    // set local address
+    o->local_addr = local_addr;
+    
+    if (!o->have_addrs) {
+        // set have addresses
+        o->have_addrs = 1;
+        
+        // start sending
+        if (o->send_data) {
+            LinkedList1_Append(&s->send_list, &o->send_list_node);
+            o->send_queued = 1;
+            schedule_flush(s);
+        }
+    }
+    
+    return 1;
+}
+
+int DatagramSharedSocketPeer_GetLastReceiveAddrs (DatagramSharedSocketPeer *o, BAddr *remote_addr, BIPAddr *local_addr)
+{
+    DebugObject_Access(&o->d_obj);
+    
+    if (!o->recv_have_addrs) {
+        return 0;
+    }
+    
+    *remote_addr = o->recv_remote_addr;
+    *local_addr = o->recv_local_addr;
+    return 1;
+}
+
+PacketPassInterface * DatagramSharedSocketPeer_GetSendIf (DatagramSharedSocketPeer *o)
+{
+    DebugObject_Access(&o->d_obj);
+    
+    return &o->send_iface;
+}
+
+PacketRecvInterface * DatagramSharedSocketPeer_GetRecvIf (DatagramSharedSocketPeer *o)
+{
+    DebugObject_Access(&o->d_obj);
+    
+    return &o->recv_iface;
+}
@@ -0,0 +1,230 @@
+/**
+ * @file DatagramSharedSocket.h
+ * @author Psiphon Inc.
+ * 
+ * @section LICENSE
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ * @section DESCRIPTION
+ * 
+ * Datagram socket shared by many peers, with batched sending.
+ */
+
+
+#ifndef BADVPN_CLIENT_DATAGRAMSHAREDSOCKET_H
+#define BADVPN_CLIENT_DATAGRAMSHAREDSOCKET_H
+
+#include <stdint.h>
+
+#include <misc/debug.h>
+#include <misc/debugcounter.h>
+#include <structure/LinkedList1.h>
+#include <structure/SAvl.h>
+#include <base/DebugObject.h>
+#include <system/BReactor.h>
+#include <system/BAddr.h>
+#include <system/BDatagram.h>
+#include <flow/PacketPassInterface.h>
+#include <flow/PacketRecvInterface.h>
+
+/**
+ * Handler called when the socket has failed.
+ * All peers must be freed, followed by the socket itself.
+ * 
+ * @param user as in {@link DatagramSharedSocket_Init}
+ */
+typedef void (*DatagramSharedSocket_handler_error) (void *user);
+
+struct DatagramSharedSocketPeer_s;
+
+typedef BAddr *DSSAddrsTree_key;
+
+#include "DatagramSharedSocket_addrs_tree.h"
+#include <structure/SAvl_decl.h>
+
+/**
+ * A datagram socket serving many peers, as an alternative to each
+ * {@link DatagramPeerIO} having its own socket.
+ * 
+ * Received datagrams are delivered to the peer whose remote address matches
+ * the source address. Datagrams from other addresses are offered to all peers
+ * in binding mode; such a peer adopts the address once it has verified a datagram
+ * (see {@link DatagramSharedSocketPeer_SetSendAddrs}). If the peer a datagram is for
+ * is not ready to receive, receiving pauses until it is; a datagram offered to binding
+ * peers is dropped for those which are not ready.
+ * 
+ * Datagrams sent by peers are collected, and submitted to the system together
+ * once per reactor iteration using {@link BDatagram_SendBatch}.
+ */
+typedef struct {
+    BReactor *reactor;
+    int mtu;
+    void *user;
+    DatagramSharedSocket_handler_error handler_error;
+    BDatagram dgram;
+    uint8_t *recv_buf;
+    int recv_len;
+    BAddr recv_remote_addr;
+    BIPAddr recv_local_addr;
+    struct DatagramSharedSocketPeer_s *recv_blocked_peer;
+    DSSAddrsTree addrs_tree;
+    LinkedList1 binding_list;
+    LinkedList1 send_list;
+    int send_waiting;
+    BSmallTimer flush_timer;
+    DebugCounter d_peers_ctr;
+    DebugObject d_obj;
+} DatagramSharedSocket;
+
+/**
+ * A peer using a {@link DatagramSharedSocket}.
+ * It provides a send and a receive interface like {@link BDatagram}.
+ */
+typedef struct DatagramSharedSocketPeer_s {
+    DatagramSharedSocket *s;
+    int mtu;
+    int binding;
+    int have_addrs;
+    BAddr remote_addr;
+    BIPAddr local_addr;
+    DSSAddrsTreeNode tree_node; // node in addrs_tree if have_addrs
+    LinkedList1Node binding_list_node; // node in binding_list if binding
+    PacketPassInterface send_iface;
+    const uint8_t *send_data;
+    int send_data_len;
+    int send_queued;
+    LinkedList1Node send_list_node; // node in send_list if send_queued
+    PacketRecvInterface recv_iface;
+    uint8_t *recv_data;
+    int recv_have_addrs;
+    BAddr recv_remote_addr;
+    BIPAddr recv_local_addr;
+    DebugObject d_obj;
+} DatagramSharedSocketPeer;
+
+/**
+ * Initializes the socket.
+ * {@link BNetwork_GlobalInit} must have been done.
+ * 
+ * @param o the object
+ * @param family address family. Must be supported according to {@link BDatagram_AddressFamilySupported}.
+ * @param mtu maximum datagram size. Must be >=0.
+ * @param reactor reactor we live in
+ * @param user argument to handler
+ * @param handler_error error handler
+ * @return 1 on success, 0 on failure
+ */
+int DatagramSharedSocket_Init (DatagramSharedSocket *o, int family, int mtu, BReactor *reactor, void *user,
+                               DatagramSharedSocket_handler_error handler_error) WARN_UNUSED;
+
+/**
+ * Frees the socket.
+ * There must be no peers.
+ * 
+ * @param o the object
+ */
+void DatagramSharedSocket_Free (DatagramSharedSocket *o);
+
+/**
+ * Binds the socket to a local address.
+ * A socket which is not bound gets an ephemeral port when it first sends.
+ * 
+ * @param o the object
+ * @param addr address to bind to. Its family must be that of the socket.
+ * @return 1 on success, 0 on failure
+ */
+int DatagramSharedSocket_Bind (DatagramSharedSocket *o, BAddr addr) WARN_UNUSED;
+
+/**
+ * Initializes a peer which sends to the given address and receives datagrams
+ * from it only.
+ * 
+ * @param o the object
+ * @param s socket to use
+ * @param mtu maximum datagram size. Must be >=0 and <= the MTU of the socket.
+ * @param addr remote address. Its family must be that of the socket.
+ * @return 1 on success, 0 if another peer already uses this address
+ */
+int DatagramSharedSocketPeer_InitConnect (DatagramSharedSocketPeer *o, DatagramSharedSocket *s, int mtu, BAddr addr) WARN_UNUSED;
+
+/**
+ * Initializes a peer in binding mode. It has no addresses for sending at first,
+ * and receives datagrams from addresses no other peer uses.
+ * 
+ * @param o the object
+ * @param s socket to use
+ * @param mtu maximum datagram size. Must be >=0 and <= the MTU of the socket.
+ */
+void DatagramSharedSocketPeer_InitBind (DatagramSharedSocketPeer *o, DatagramSharedSocket *s, int mtu);
+
+/**
+ * Frees the peer.
+ * 
+ * @param o the object
+ */
+void DatagramSharedSocketPeer_Free (DatagramSharedSocketPeer *o);
+
+/**
+ * Sets the addresses for sending, and receiving in the case of the remote address,
+ * of a peer in binding mode.
+ * 
+ * @param o the object
+ * @param remote_addr remote address. Its family must be that of the socket.
+ * @param local_addr local source IP address. May be an invalid address.
+ * @return 1 on success, 0 if another peer already uses this remote address
+ */
+int DatagramSharedSocketPeer_SetSendAddrs (DatagramSharedSocketPeer *o, BAddr remote_addr, BIPAddr local_addr) WARN_UNUSED;
+
+/**
+ * Returns the remote and local address of the last datagram delivered to the peer.
+ * Fails if and only if no datagrams have been delivered yet.
+ * 
+ * @param o the object
+ * @param remote_addr returns the remote source address of the datagram
+ * @param local_addr returns the local destination IP address. May be an invalid address.
+ * @return 1 on success, 0 on failure
+ */
+int DatagramSharedSocketPeer_GetLastReceiveAddrs (DatagramSharedSocketPeer *o, BAddr *remote_addr, BIPAddr *local_addr);
+
+/**
+ * Returns the send interface.
+ * Its MTU is as in {@link DatagramSharedSocketPeer_InitConnect} or
+ * {@link DatagramSharedSocketPeer_InitBind}.
+ * 
+ * @param o the object
+ * @return send interface
+ */
+PacketPassInterface * DatagramSharedSocketPeer_GetSendIf (DatagramSharedSocketPeer *o);
+
+/**
+ * Returns the receive interface.
+ * Its MTU is as in {@link DatagramSharedSocketPeer_InitConnect} or
+ * {@link DatagramSharedSocketPeer_InitBind}.
+ * 
+ * @param o the object
+ * @return receive interface
+ */
+PacketRecvInterface * DatagramSharedSocketPeer_GetRecvIf (DatagramSharedSocketPeer *o);
+
+#endif
@@ -0,0 +1,9 @@
+#define SAVL_PARAM_NAME DSSAddrsTree
+#define SAVL_PARAM_FEATURE_COUNTS 0
+#define SAVL_PARAM_FEATURE_NOKEYS 0
+#define SAVL_PARAM_TYPE_ENTRY struct DatagramSharedSocketPeer_s
+#define SAVL_PARAM_TYPE_KEY DSSAddrsTree_key
+#define SAVL_PARAM_TYPE_ARG int
+#define SAVL_PARAM_FUN_COMPARE_ENTRIES(arg, entry1, entry2) BAddr_CompareOrder(&(entry1)->remote_addr, &(entry2)->remote_addr)
+#define SAVL_PARAM_FUN_COMPARE_KEY_ENTRY(arg, key1, entry2) BAddr_CompareOrder((key1), &(entry2)->remote_addr)
+#define SAVL_PARAM_MEMBER_NODE tree_node
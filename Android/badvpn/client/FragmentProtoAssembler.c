@@ -33,6 +33,8 @@
 #include <misc/offset.h>
 #include <misc/byteorder.h>
 #include <misc/balloc.h>
+#include <misc/balign.h>
+#include <misc/minmax.h>
 
 #include "FragmentProtoAssembler.h"
 
@@ -40,15 +42,61 @@
 
 #define PeerLog(_o, ...) BLog_LogViaFunc((_o)->logfunc, (_o)->user, BLOG_CURRENT_CHANNEL, __VA_ARGS__)
 
-#include "FragmentProtoAssembler_tree.h"
-#include <structure/SAvl_impl.h>
+#define INDEX_MAX_SIZE (1 << (8 * sizeof(fragmentproto_frameid)))
+
+static uint64_t bitmap_mask (int bit, int n)
+{
+    ASSERT(bit >= 0)
+    ASSERT(n > 0)
+    ASSERT(n <= 64 - bit)
+    
+    return (n == 64 ? UINT64_MAX : (((uint64_t)1 << n) - 1) << bit);
+}
+
+static int bitmap_range_is_clear (const uint64_t *bitmap, int start, int end)
+{
+    while (start < end) {
+        int bit = start % 64;
+        int n = bmin_int(64 - bit, end - start);
+        if (bitmap[start / 64] & bitmap_mask(bit, n)) {
+            return 0;
+        }
+        start += n;
+    }
+    
+    return 1;
+}
+
+static void bitmap_set_range (uint64_t *bitmap, int start, int end)
+{
+    while (start < end) {
+        int bit = start % 64;
+        int n = bmin_int(64 - bit, end - start);
+        bitmap[start / 64] |= bitmap_mask(bit, n);
+        start += n;
+    }
+}
+
+static struct FragmentProtoAssembler_frame ** index_slot (FragmentProtoAssembler *o, fragmentproto_frameid id)
+{
+    return &o->frames_index[id & o->index_mask];
+}
+
+static struct FragmentProtoAssembler_frame * lookup_frame (FragmentProtoAssembler *o, fragmentproto_frameid id)
+{
+    struct FragmentProtoAssembler_frame *frame = *index_slot(o, id);
+    
+    return ((frame && frame->id == id) ? frame : NULL);
+}
 
 static void free_frame (FragmentProtoAssembler *o, struct FragmentProtoAssembler_frame *frame)
 {
+    ASSERT(*index_slot(o, frame->id) == frame)
+    
     // remove from used list
     LinkedList1_Remove(&o->frames_used, &frame->list_node);
-    // remove from used tree
-    FPAFramesTree_Remove(&o->frames_used_tree, 0, frame);
+    // remove from index
+    *index_slot(o, frame->id) = NULL;
     
     // append to free list
     LinkedList1_Append(&o->frames_free, &frame->list_node);
@@ -69,7 +117,15 @@ static void free_oldest_frame (FragmentProtoAssembler *o)
 
 static struct FragmentProtoAssembler_frame * allocate_new_frame (FragmentProtoAssembler *o, fragmentproto_frameid id)
 {
-    ASSERT(!FPAFramesTree_LookupExact(&o->frames_used_tree, 0, id))
+    ASSERT(!lookup_frame(o, id))
+    
+    // if the index slot is taken by a frame with a different ID, free that frame;
+    // since IDs are ascending, it is far behind the frames we are receiving
+    struct FragmentProtoAssembler_frame *old_frame = *index_slot(o, id);
+    if (old_frame) {
+        PeerLog(o, BLOG_INFO, "freeing used frame (index collision)");
+        free_frame(o, old_frame);
+    }
     
     // if there are no free entries, free the oldest used one
     if (LinkedList1_IsEmpty(&o->frames_free)) {
@@ -93,20 +149,17 @@ static struct FragmentProtoAssembler_frame * allocate_new_frame (FragmentProtoAs
     frame->length = -1;
     frame->length_so_far = 0;
     
+    // clear bitmap
+    memset(frame->bitmap, 0, o->bitmap_words * sizeof(frame->bitmap[0]));
+    
     // append to used list
     LinkedList1_Append(&o->frames_used, &frame->list_node);
-    // insert to used tree
-    int res = FPAFramesTree_Insert(&o->frames_used_tree, 0, frame, NULL);
-    ASSERT_EXECUTE(res)
+    // insert to index
+    *index_slot(o, id) = frame;
     
     return frame;
 }
 
-static int chunks_overlap (int c1_start, int c1_len, int c2_start, int c2_len)
-{
-    return (c1_start + c1_len > c2_start && c2_start + c2_len > c1_start);
-}
-
 static int frame_is_timed_out (FragmentProtoAssembler *o, struct FragmentProtoAssembler_frame *frame)
 {
     ASSERT(frame->time <= o->time)
@@ -114,30 +167,33 @@ static int frame_is_timed_out (FragmentProtoAssembler *o, struct FragmentProtoAs
     return (o->time - frame->time > o->time_tolerance);
 }
 
-static void reduce_times (FragmentProtoAssembler *o)
+static void expire_frames (FragmentProtoAssembler *o)
 {
-    // find the frame with minimal time, removing timed out frames
-    struct FragmentProtoAssembler_frame *minframe = NULL;
-    LinkedList1Node *list_node = LinkedList1_GetFirst(&o->frames_used);
-    while (list_node) {
-        LinkedList1Node *next = LinkedList1Node_Next(list_node);
+    // used frames are ordered by time, so timed out frames are at the front
+    LinkedList1Node *list_node;
+    while (list_node = LinkedList1_GetFirst(&o->frames_used)) {
         struct FragmentProtoAssembler_frame *frame = UPPER_OBJECT(list_node, struct FragmentProtoAssembler_frame, list_node);
-        if (frame_is_timed_out(o, frame)) {
-            PeerLog(o, BLOG_INFO, "freeing timed out frame (while reducing times)");
-            free_frame(o, frame);
-        } else {
-            if (!minframe || frame->time < minframe->time) {
-                minframe = frame;
-            }
+        if (!frame_is_timed_out(o, frame)) {
+            break;
         }
-        list_node = next;
+        PeerLog(o, BLOG_INFO, "freeing timed out frame");
+        free_frame(o, frame);
     }
+}
+
+static void reduce_times (FragmentProtoAssembler *o)
+{
+    // remove timed out frames
+    expire_frames(o);
     
-    if (!minframe) {
+    // the first frame has the minimal time
+    LinkedList1Node *list_node = LinkedList1_GetFirst(&o->frames_used);
+    if (!list_node) {
         // have no frames, set packet time to zero
         o->time = 0;
         return;
     }
+    struct FragmentProtoAssembler_frame *minframe = UPPER_OBJECT(list_node, struct FragmentProtoAssembler_frame, list_node);
     
     uint32_t min_time = minframe->time;
     
@@ -177,30 +233,20 @@ static int process_chunk (FragmentProtoAssembler *o, fragmentproto_frameid frame
     ASSERT(chunk_end <= o->output_mtu)
     
     // lookup frame
-    struct FragmentProtoAssembler_frame *frame = FPAFramesTree_LookupExact(&o->frames_used_tree, 0, frame_id);
+    struct FragmentProtoAssembler_frame *frame = lookup_frame(o, frame_id);
     if (!frame) {
         // frame not found, add a new one
         frame = allocate_new_frame(o, frame_id);
-    } else {
-        // have existing frame with that ID
-        // check frame time
-        if (frame_is_timed_out(o, frame)) {
-            // frame is timed out, remove it and use a new one
-            PeerLog(o, BLOG_INFO, "freeing timed out frame (while processing chunk)");
-            free_frame(o, frame);
-            frame = allocate_new_frame(o, frame_id);
-        }
     }
     
+    // timed out frames are freed as soon as packet time advances
+    ASSERT(!frame_is_timed_out(o, frame))
     ASSERT(frame->num_chunks < o->num_chunks)
     
     // check if the chunk overlaps with any existing chunks
-    for (int i = 0; i < frame->num_chunks; i++) {
-        struct FragmentProtoAssembler_chunk *chunk = &frame->chunks[i];
-        if (chunks_overlap(chunk->start, chunk->len, chunk_start, chunk_len)) {
-            PeerLog(o, BLOG_INFO, "chunk overlaps with existing chunk");
-            goto fail_frame;
-        }
+    if (!bitmap_range_is_clear(frame->bitmap, chunk_start, chunk_end)) {
+        PeerLog(o, BLOG_INFO, "chunk overlaps with existing chunk");
+        goto fail_frame;
     }
     
     if (is_last) {
@@ -227,13 +273,13 @@ static int process_chunk (FragmentProtoAssembler *o, fragmentproto_frameid frame
     
     // chunk is good, add it
     
-    // update frame time
+    // update frame time, keeping used frames ordered by time
     frame->time = o->time;
+    LinkedList1_Remove(&o->frames_used, &frame->list_node);
+    LinkedList1_Append(&o->frames_used, &frame->list_node);
     
-    // add chunk entry
-    struct FragmentProtoAssembler_chunk *chunk = &frame->chunks[frame->num_chunks];
-    chunk->start = chunk_start;
-    chunk->len = chunk_len;
+    // mark chunk received
+    bitmap_set_range(frame->bitmap, chunk_start, chunk_end);
     frame->num_chunks++;
     
     // update sum
@@ -338,6 +384,9 @@ static void process_input (FragmentProtoAssembler *o)
         o->time++;
     }
     
+    // free frames which have now timed out
+    expire_frames(o);
+    
     // set no input packet
     o->in_len = -1;
     
@@ -382,6 +431,7 @@ int FragmentProtoAssembler_Init (FragmentProtoAssembler *o, int input_mtu, Packe
     
     // init input
     PacketPassInterface_Init(&o->input, input_mtu, (PacketPassInterface_handler_send)input_handler_send, o, pg);
+    PacketPassInterface_SetName(&o->input, "FragmentProtoAssembler");
     
     // init output
     PacketPassInterface_Sender_Init(o->output, (PacketPassInterface_handler_done)output_handler_done, o);
@@ -400,8 +450,9 @@ int FragmentProtoAssembler_Init (FragmentProtoAssembler *o, int input_mtu, Packe
         goto fail1;
     }
     
-    // allocate chunks
-    if (!(o->frames_chunks = (struct FragmentProtoAssembler_chunk *)BAllocArray2(num_frames, o->num_chunks, sizeof(o->frames_chunks[0])))) {
+    // allocate bitmaps
+    o->bitmap_words = bdivide_up(o->output_mtu, 64);
+    if (!(o->frames_bitmap = (uint64_t *)BAllocArray2(num_frames, o->bitmap_words, sizeof(o->frames_bitmap[0])))) {
         goto fail2;
     }
     
@@ -410,6 +461,22 @@ int FragmentProtoAssembler_Init (FragmentProtoAssembler *o, int input_mtu, Packe
         goto fail3;
     }
     
+    // choose index size, a power of two with room for IDs of frames which
+    // are received out of order, but no larger than the ID space
+    int index_size = 1;
+    while (index_size / 4 < num_frames && index_size < INDEX_MAX_SIZE) {
+        index_size *= 2;
+    }
+    o->index_mask = index_size - 1;
+    
+    // allocate index
+    if (!(o->frames_index = (struct FragmentProtoAssembler_frame **)BAllocArray(index_size, sizeof(o->frames_index[0])))) {
+        goto fail4;
+    }
+    for (int i = 0; i < index_size; i++) {
+        o->frames_index[i] = NULL;
+    }
+    
     // init frame lists
     LinkedList1_Init(&o->frames_free);
     LinkedList1_Init(&o->frames_used);
@@ -417,17 +484,14 @@ int FragmentProtoAssembler_Init (FragmentProtoAssembler *o, int input_mtu, Packe
     // initialize frame entries
     for (int i = 0; i < num_frames; i++) {
         struct FragmentProtoAssembler_frame *frame = &o->frames_entries[i];
-        // set chunks array pointer
-        frame->chunks = o->frames_chunks + (size_t)i * o->num_chunks;
+        // set bitmap pointer
+        frame->bitmap = o->frames_bitmap + (size_t)i * o->bitmap_words;
         // set buffer pointer
         frame->buffer = o->frames_buffer + (size_t)i * o->output_mtu;
         // add to free list
         LinkedList1_Append(&o->frames_free, &frame->list_node);
     }
     
-    // init tree
-    FPAFramesTree_Init(&o->frames_used_tree);
-    
     // have no input packet
     o->in_len = -1;
     
@@ -435,8 +499,10 @@ int FragmentProtoAssembler_Init (FragmentProtoAssembler *o, int input_mtu, Packe
     
     return 1;
     
+fail4:
+    BFree(o->frames_buffer);
 fail3:
-    BFree(o->frames_chunks);
+    BFree(o->frames_bitmap);
 fail2:
     BFree(o->frames_entries);
 fail1:
@@ -447,12 +513,15 @@ fail1:
 void FragmentProtoAssembler_Free (FragmentProtoAssembler *o)
 {
     DebugObject_Free(&o->d_obj);
+    
+    // free index
+    BFree(o->frames_index);
 
     // free buffers
     BFree(o->frames_buffer);
     
-    // free chunks
-    BFree(o->frames_chunks);
+    // free bitmaps
+    BFree(o->frames_bitmap);
     
     // free frames
     BFree(o->frames_entries);
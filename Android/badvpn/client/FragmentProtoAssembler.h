@@ -42,30 +42,18 @@
 #include <base/DebugObject.h>
 #include <base/BLog.h>
 #include <structure/LinkedList1.h>
-#include <structure/SAvl.h>
 #include <flow/PacketPassInterface.h>
 
 #define FPA_MAX_TIME UINT32_MAX
 
-struct FragmentProtoAssembler_frame;
-
-#include "FragmentProtoAssembler_tree.h"
-#include <structure/SAvl_decl.h>
-
-struct FragmentProtoAssembler_chunk {
-    int start;
-    int len;
-};
-
 struct FragmentProtoAssembler_frame {
     LinkedList1Node list_node; // node in free or used list
-    struct FragmentProtoAssembler_chunk *chunks; // array of chunks, up to num_chunks
+    uint64_t *bitmap; // bitmap of received bytes, output_mtu bits
     uint8_t *buffer; // buffer with frame data, size output_mtu
     // everything below only defined when frame entry is used
     fragmentproto_frameid id; // frame identifier
     uint32_t time; // packet time when the last chunk was received
-    FPAFramesTreeNode tree_node; // node fields in tree for searching frames by id
-    int num_chunks; // number of valid chunks
+    int num_chunks; // number of received chunks
     int sum; // sum of all chunks' lengths
     int length; // length of the frame, or -1 if not yet known
     int length_so_far; // if length=-1, current data set's upper bound
@@ -86,12 +74,14 @@ typedef struct {
     int num_chunks;
     uint32_t time;
     int time_tolerance;
+    int bitmap_words;
     struct FragmentProtoAssembler_frame *frames_entries;
-    struct FragmentProtoAssembler_chunk *frames_chunks;
+    uint64_t *frames_bitmap;
     uint8_t *frames_buffer;
     LinkedList1 frames_free;
-    LinkedList1 frames_used;
-    FPAFramesTree frames_used_tree;
+    LinkedList1 frames_used; // ordered by time
+    struct FragmentProtoAssembler_frame **frames_index; // used frames indexed by (id & index_mask)
+    int index_mask;
     int in_len;
     uint8_t *in;
     int in_pos;
@@ -66,6 +66,19 @@ static int compare_macs (const uint8_t *mac1, const uint8_t *mac2)
 #include "FrameDecider_multicast_tree.h"
 #include <structure/SAvl_impl.h>
 
+static void invalidate_cache (FrameDecider *d)
+{
+    d->cache_generation++;
+    
+    // on wraparound, make sure no stale entry can match
+    if (d->cache_generation == 0) {
+        for (int i = 0; i < FRAMEDECIDER_CACHE_SIZE; i++) {
+            d->cache[i].generation = 0;
+        }
+        d->cache_generation = 1;
+    }
+}
+
 static void add_mac_to_peer (FrameDeciderPeer *o, uint8_t *mac)
 {
     FrameDecider *d = o->d;
@@ -81,11 +94,15 @@ static void add_mac_to_peer (FrameDeciderPeer *o, uint8_t *mac)
         }
         
         // some other peer has that MAC; disassociate it
+        // (the cache is invalidated below)
         FDMacsTree_Remove(&d->macs_tree, 0, e_entry);
         LinkedList1_Remove(&e_entry->peer->mac_entries_used, &e_entry->list_node);
         LinkedList1_Append(&e_entry->peer->mac_entries_free, &e_entry->list_node);
     }
     
+    // MAC tree is changing, invalidate cached lookups
+    invalidate_cache(d);
+    
     // aquire MAC address entry, if there are no free ones reuse the oldest used one
     LinkedList1Node *list_node;
     struct _FrameDecider_mac_entry *entry;
@@ -148,6 +165,9 @@ static void add_to_multicast (FrameDecider *d, struct _FrameDecider_group_entry
     } else {
         // make this entry master
         
+        // new master for this sig, invalidate cached lookups
+        invalidate_cache(d);
+        
         // set master
         group_entry->is_master = 1;
         
@@ -169,6 +189,9 @@ static void remove_from_multicast (FrameDecider *d, struct _FrameDecider_group_e
     uint32_t sig = compute_sig_for_group(group_entry->group);
     
     if (group_entry->is_master) {
+        // master for this sig is changing, invalidate cached lookups
+        invalidate_cache(d);
+        
         // remove master from multicast tree
         FDMulticastTree_Remove(&d->multicast_tree, 0, group_entry);
         
@@ -313,6 +336,36 @@ static void lower_group_timers_to_lmqt (FrameDecider *d, uint32_t group)
     }
 }
 
+static void * lookup_destination (FrameDecider *d, uint8_t *mac, int multicast)
+{
+    // locate cache slot
+    uint32_t hash = ((uint32_t)mac[3] * 31 + mac[4]) * 31 + mac[5];
+    struct _FrameDecider_cache_entry *ce = &d->cache[hash & (FRAMEDECIDER_CACHE_SIZE - 1)];
+    
+    if (ce->generation == d->cache_generation && !memcmp(ce->mac, mac, sizeof(ce->mac))) {
+        return ce->result;
+    }
+    
+    void *result;
+    if (multicast) {
+        // look up the MAC's sig in multicast tree
+        struct _FrameDecider_group_entry *master = FDMulticastTree_LookupExact(&d->multicast_tree, 0, compute_sig_for_mac(mac));
+        ASSERT(!master || master->is_master)
+        result = master;
+    } else {
+        // look up MAC in MAC tree
+        struct _FrameDecider_mac_entry *entry = FDMacsTree_LookupExact(&d->macs_tree, 0, mac);
+        result = (entry ? entry->peer : NULL);
+    }
+    
+    // remember result
+    ce->generation = d->cache_generation;
+    memcpy(ce->mac, mac, sizeof(ce->mac));
+    ce->result = result;
+    
+    return result;
+}
+
 static void group_entry_timer_handler (struct _FrameDecider_group_entry *group_entry)
 {
     DebugObject_Access(&group_entry->peer->d_obj);
@@ -347,6 +400,12 @@ void FrameDecider_Init (FrameDecider *o, int max_peer_macs, int max_peer_groups,
     // set no current flood peer
     o->decide_flood_current = NULL;
     
+    // init cache with all entries invalid
+    o->cache_generation = 1;
+    for (int i = 0; i < FRAMEDECIDER_CACHE_SIZE; i++) {
+        o->cache[i].generation = 0;
+    }
+    
     DebugObject_Init(&o->d_obj);
 }
 
@@ -480,11 +539,8 @@ out:;
     
     // if it's multicast, forward to all peers with the given sig
     if (!memcmp(eh.dest, multicast_mac_header, sizeof(multicast_mac_header))) {
-        // extract group's sig from destination MAC
-        uint32_t sig = compute_sig_for_mac(eh.dest);
-        
-        // look up the sig in multicast tree
-        struct _FrameDecider_group_entry *master = FDMulticastTree_LookupExact(&o->multicast_tree, 0, sig);
+        // look up the group's sig in multicast tree
+        struct _FrameDecider_group_entry *master = lookup_destination(o, eh.dest, 1);
         if (master) {
             ASSERT(master->is_master)
             
@@ -495,11 +551,11 @@ out:;
         return;
     }
     
-    // look for MAC entry
-    struct _FrameDecider_mac_entry *entry = FDMacsTree_LookupExact(&o->macs_tree, 0, eh.dest);
-    if (entry) {
+    // look for peer owning the MAC
+    FrameDeciderPeer *peer = lookup_destination(o, eh.dest, 0);
+    if (peer) {
         o->decide_state = DECIDE_STATE_UNICAST;
-        o->decide_unicast_peer = entry->peer;
+        o->decide_unicast_peer = peer;
         return;
     }
     
@@ -647,6 +703,9 @@ void FrameDeciderPeer_Free (FrameDeciderPeer *o)
         BReactor_RemoveTimer(d->reactor, &entry->timer);
     }
     
+    // MAC and multicast trees are changing, invalidate cached lookups
+    invalidate_cache(d);
+    
     // remove used MAC entries from tree
     for (node = LinkedList1_GetFirst(&o->mac_entries_used); node; node = LinkedList1Node_Next(node)) {
         struct _FrameDecider_mac_entry *entry = UPPER_OBJECT(node, struct _FrameDecider_mac_entry, list_node);
@@ -44,6 +44,9 @@
 #include <base/BLog.h>
 #include <system/BReactor.h>
 
+// number of entries in the destination cache; must be a power of two
+#define FRAMEDECIDER_CACHE_SIZE 64
+
 struct _FrameDeciderPeer;
 struct _FrameDecider_mac_entry;
 struct _FrameDecider_group_entry;
@@ -86,6 +89,15 @@ struct _FrameDecider_group_entry {
     } master;
 };
 
+struct _FrameDecider_cache_entry {
+    uint32_t generation; // valid if equal to FrameDecider.cache_generation
+    uint8_t mac[6]; // destination MAC
+    // result of the lookup for mac (NULL if not found):
+    // for unicast MACs, the peer owning the MAC;
+    // for multicast MACs, the master group entry for the MAC's sig
+    void *result;
+};
+
 /**
  * Object that represents a local device.
  */
@@ -102,6 +114,8 @@ typedef struct {
     LinkedList1Node *decide_flood_current;
     struct _FrameDeciderPeer *decide_unicast_peer;
     LinkedList3Iterator decide_multicast_it;
+    uint32_t cache_generation;
+    struct _FrameDecider_cache_entry cache[FRAMEDECIDER_CACHE_SIZE];
     DebugObject d_obj;
 } FrameDecider;
 
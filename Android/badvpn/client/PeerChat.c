@@ -312,6 +312,7 @@ int PeerChat_Init (PeerChat *o, peerid_t peer_id, int ssl_mode, int ssl_flags, C
         
         // init receive interface
         PacketPassInterface_Init(&o->ssl_recv_if, SC_MAX_MSGLEN, (PacketPassInterface_handler_send)ssl_recv_if_handler_send, o, pg);
+        PacketPassInterface_SetName(&o->ssl_recv_if, "PeerChat SSL receive");
         
         // init receive decoder
         if (!PacketProtoDecoder_Init(&o->ssl_recv_decoder, BSSLConnection_GetRecvIf(&o->ssl_con), &o->ssl_recv_if, pg, o, (PacketProtoDecoder_handler_error)ssl_recv_decoder_handler_error)) {
@@ -268,6 +268,7 @@ int SPProtoDecoder_Init (SPProtoDecoder *o, PacketPassInterface *output, struct
     
     // init input
     PacketPassInterface_Init(&o->input, o->input_mtu, (PacketPassInterface_handler_send)input_handler_send, o, pg);
+    PacketPassInterface_SetName(&o->input, "SPProtoDecoder");
     
     // init OTP checker
     if (SPPROTO_HAVE_OTP(o->sp_params)) {
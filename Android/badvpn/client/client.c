@@ -57,6 +57,7 @@
 #include <server_connection/ServerConnection.h>
 #include <tuntap/BTap.h>
 #include <threadwork/BThreadWork.h>
+#include <flowextra/FlowProfileDumper.h>
 
 #ifndef BADVPN_USE_WINAPI
 #include <base/BLog_syslog.h>
@@ -113,6 +114,7 @@ struct {
     int otp_num;
     int otp_num_warn;
     int fragmentation_latency;
+    int udp_shared_socket;
     int peer_ssl;
     int peer_tcp_socket_sndbuf;
     int send_buffer_size;
@@ -123,6 +125,7 @@ struct {
     int igmp_last_member_query_time;
     int allow_peer_talk_without_ssl;
     int max_peers;
+    char *flow_profile;
 } options;
 
 // bind addresses
@@ -143,6 +146,17 @@ struct bind_addr bind_addrs[MAX_BIND_ADDRS];
 // TCP listeners
 PasswordListener listeners[MAX_BIND_ADDRS];
 
+#ifndef BADVPN_USE_WINAPI
+// shared UDP sockets for binding, one per bind address, and the port offset
+// each is bound to (-1 if binding failed)
+DatagramSharedSocket bind_shared_sockets[MAX_BIND_ADDRS];
+int bind_shared_ports[MAX_BIND_ADDRS];
+
+// shared UDP sockets for connecting, per address family, created when first needed
+DatagramSharedSocket connect_shared_sockets[2];
+int connect_shared_sockets_inited[2];
+#endif
+
 // SPProto parameters (UDP only)
 struct spproto_security_params sp_params;
 
@@ -158,6 +172,9 @@ BReactor ss;
 // thread work dispatcher
 BThreadWorkDispatcher twd;
 
+// flow profile dumper, if options.flow_profile
+FlowProfileDumper flow_profile_dumper;
+
 // client certificate if using SSL
 CERTCertificate *client_cert;
 
@@ -300,6 +317,14 @@ static void peer_udp_pio_handler_seed_ready (struct peer_data *peer);
 // handler from DatagramPeerIO when an error occurs on the connection
 static void peer_udp_pio_handler_error (struct peer_data *peer);
 
+#ifndef BADVPN_USE_WINAPI
+// handler from DatagramSharedSocket when the socket fails
+static void shared_socket_handler_error (void *unused);
+
+// returns the shared socket for connecting to addresses of a family, creating it if needed
+static DatagramSharedSocket * get_connect_shared_socket (int family);
+#endif
+
 // handler from StreamPeerIO when an error occurs on the connection
 static void peer_tcp_pio_handler_error (struct peer_data *peer);
 
@@ -487,6 +512,13 @@ int main (int argc, char *argv[])
         goto fail2;
     }
     
+    // init flow profile dumper, before any threads are started so that
+    // they don't receive the signal
+    if (options.flow_profile && !FlowProfileDumper_Init(&flow_profile_dumper, &ss, options.flow_profile)) {
+        BLog(BLOG_ERROR, "FlowProfileDumper_Init failed");
+        goto fail2a;
+    }
+    
     // init thread work dispatcher
     if (!BThreadWorkDispatcher_Init(&twd, &ss, options.threads)) {
         BLog(BLOG_ERROR, "BThreadWorkDispatcher_Init failed");
@@ -501,6 +533,12 @@ int main (int argc, char *argv[])
         }
     }
     
+#ifndef BADVPN_USE_WINAPI
+    int num_shared_sockets = 0;
+    connect_shared_sockets_inited[0] = 0;
+    connect_shared_sockets_inited[1] = 0;
+#endif
+    
     // init listeners
     int num_listeners = 0;
     if (options.transport_mode == TRANSPORT_MODE_TCP) {
@@ -514,6 +552,36 @@ int main (int argc, char *argv[])
         }
     }
     
+#ifndef BADVPN_USE_WINAPI
+    // init shared UDP sockets
+    if (options.udp_shared_socket) {
+        while (num_shared_sockets < num_bind_addrs) {
+            struct bind_addr *addr = &bind_addrs[num_shared_sockets];
+            if (!DatagramSharedSocket_Init(&bind_shared_sockets[num_shared_sockets], addr->addr.type, CLIENT_UDP_MTU, &ss, NULL, shared_socket_handler_error)) {
+                BLog(BLOG_ERROR, "DatagramSharedSocket_Init failed");
+                goto fail8;
+            }
+            
+            // bind to the first port in the range which works
+            int port_add;
+            for (port_add = 0; port_add < addr->num_ports; port_add++) {
+                BAddr tryaddr = addr->addr;
+                BAddr_SetPort(&tryaddr, hton16(ntoh16(BAddr_GetPort(&tryaddr)) + port_add));
+                if (DatagramSharedSocket_Bind(&bind_shared_sockets[num_shared_sockets], tryaddr)) {
+                    break;
+                }
+            }
+            if (port_add == addr->num_ports) {
+                BLog(BLOG_WARNING, "shared socket for bind address number %d failed to bind to any port", num_shared_sockets);
+                port_add = -1;
+            }
+            bind_shared_ports[num_shared_sockets] = port_add;
+            
+            num_shared_sockets++;
+        }
+    }
+#endif
+    
     // init device
     if (!BTap_Init(&device, &ss, options.tapdev, device_error_handler, NULL, 0)) {
         BLog(BLOG_ERROR, "BTap_Init failed");
@@ -607,6 +675,16 @@ fail10:
 fail9:
     BTap_Free(&device);
 fail8:
+#ifndef BADVPN_USE_WINAPI
+    for (int j = 0; j < 2; j++) {
+        if (connect_shared_sockets_inited[j]) {
+            DatagramSharedSocket_Free(&connect_shared_sockets[j]);
+        }
+    }
+    while (num_shared_sockets-- > 0) {
+        DatagramSharedSocket_Free(&bind_shared_sockets[num_shared_sockets]);
+    }
+#endif
     if (options.transport_mode == TRANSPORT_MODE_TCP) {
         while (num_listeners-- > 0) {
             PasswordListener_Free(&listeners[num_listeners]);
@@ -619,6 +697,10 @@ fail4:
     // NOTE: BThreadWorkDispatcher must be freed before NSPR and stuff
     BThreadWorkDispatcher_Free(&twd);
 fail3:
+    if (options.flow_profile) {
+        FlowProfileDumper_Free(&flow_profile_dumper);
+    }
+fail2a:
     BSignal_Finish();
 fail2:
     BReactor_Free(&ss);
@@ -686,6 +768,9 @@ void print_help (const char *name)
         "            --hash-mode <md5/sha1/none>\n"
         "            [--otp <blowfish/aes> <num> <num-warn>]\n"
         "            [--fragmentation-latency <milliseconds>]\n"
+        #ifndef BADVPN_USE_WINAPI
+        "            [--udp-shared-socket]\n"
+        #endif
         "        )\n"
         "        (transport-mode=tcp?\n"
         "            (ssl? [--peer-ssl])\n"
@@ -699,6 +784,7 @@ void print_help (const char *name)
         "        [--igmp-last-member-query-time <ms>]\n"
         "        [--allow-peer-talk-without-ssl]\n"
         "        [--max-peers <number>]\n"
+        "        [--flow-profile <file>]\n"
         "Address format is a.b.c.d:port (IPv4) or [addr]:port (IPv6).\n",
         name
     );
@@ -742,6 +828,7 @@ int parse_arguments (int argc, char *argv[])
     options.hash_mode = -1;
     options.otp_mode = SPPROTO_OTP_MODE_NONE;
     options.fragmentation_latency = PEER_DEFAULT_UDP_FRAGMENTATION_LATENCY;
+    options.udp_shared_socket = 0;
     options.peer_ssl = 0;
     options.peer_tcp_socket_sndbuf = -1;
     options.send_buffer_size = PEER_DEFAULT_SEND_BUFFER_SIZE;
@@ -752,6 +839,7 @@ int parse_arguments (int argc, char *argv[])
     options.igmp_last_member_query_time = DEFAULT_IGMP_LAST_MEMBER_QUERY_TIME;
     options.allow_peer_talk_without_ssl = 0;
     options.max_peers = DEFAULT_MAX_PEERS;
+    options.flow_profile = NULL;
     
     int have_fragmentation_latency = 0;
     
@@ -1051,6 +1139,11 @@ int parse_arguments (int argc, char *argv[])
             have_fragmentation_latency = 1;
             i++;
         }
+        #ifndef BADVPN_USE_WINAPI
+        else if (!strcmp(arg, "--udp-shared-socket")) {
+            options.udp_shared_socket = 1;
+        }
+        #endif
         else if (!strcmp(arg, "--peer-ssl")) {
             options.peer_ssl = 1;
         }
@@ -1142,6 +1235,14 @@ int parse_arguments (int argc, char *argv[])
             }
             i++;
         }
+        else if (!strcmp(arg, "--flow-profile")) {
+            if (1 >= argc - i) {
+                fprintf(stderr, "%s: requires an argument\n", arg);
+                return 0;
+            }
+            options.flow_profile = argv[i + 1];
+            i++;
+        }
         else if (!strcmp(arg, "--allow-peer-talk-without-ssl")) {
             options.allow_peer_talk_without_ssl = 1;
         }
@@ -1195,6 +1296,17 @@ int parse_arguments (int argc, char *argv[])
         return 0;
     }
     
+    if (!(!options.udp_shared_socket || (options.transport_mode == TRANSPORT_MODE_UDP))) {
+        fprintf(stderr, "False: --udp-shared-socket => UDP\n");
+        return 0;
+    }
+    
+    // with a shared socket, only decoding tells apart peers connecting from new addresses
+    if (!(!options.udp_shared_socket || (options.encryption_mode > 0 && options.hash_mode > 0) || options.otp_mode != SPPROTO_OTP_MODE_NONE)) {
+        fprintf(stderr, "False: --udp-shared-socket => ((--encryption-mode != none && --hash-mode != none) || --otp)\n");
+        return 0;
+    }
+    
     if (!(!options.peer_ssl || (options.ssl && options.transport_mode == TRANSPORT_MODE_TCP))) {
         fprintf(stderr, "False: --peer-ssl => (--ssl && TCP)\n");
         return 0;
@@ -2269,6 +2381,39 @@ void peer_udp_pio_handler_error (struct peer_data *peer)
     return;
 }
 
+#ifndef BADVPN_USE_WINAPI
+
+void shared_socket_handler_error (void *unused)
+{
+    ASSERT(options.udp_shared_socket)
+    
+    BLog(BLOG_ERROR, "shared UDP socket failed");
+    
+    terminate();
+    return;
+}
+
+DatagramSharedSocket * get_connect_shared_socket (int family)
+{
+    ASSERT(options.udp_shared_socket)
+    
+    int index = (family == BADDR_TYPE_IPV6);
+    
+    if (!connect_shared_sockets_inited[index]) {
+        if (!BDatagram_AddressFamilySupported(family) ||
+            !DatagramSharedSocket_Init(&connect_shared_sockets[index], family, CLIENT_UDP_MTU, &ss, NULL, shared_socket_handler_error)
+        ) {
+            BLog(BLOG_WARNING, "cannot create shared socket for connecting, using own socket");
+            return NULL;
+        }
+        connect_shared_sockets_inited[index] = 1;
+    }
+    
+    return &connect_shared_sockets[index];
+}
+
+#endif
+
 void peer_tcp_pio_handler_error (struct peer_data *peer)
 {
     ASSERT(options.transport_mode == TRANSPORT_MODE_TCP)
@@ -2358,19 +2503,31 @@ void peer_bind_one_address (struct peer_data *peer, int addr_index, int *cont)
         // get addr
         struct bind_addr *addr = &bind_addrs[addr_index];
         
-        // try binding to all ports in the range
         int port_add;
-        for (port_add = 0; port_add < addr->num_ports; port_add++) {
-            BAddr tryaddr = addr->addr;
-            BAddr_SetPort(&tryaddr, hton16(ntoh16(BAddr_GetPort(&tryaddr)) + port_add));
-            if (DatagramPeerIO_Bind(&peer->pio.udp.pio, tryaddr)) {
-                break;
+        if (options.udp_shared_socket) {
+#ifndef BADVPN_USE_WINAPI
+            // use the shared socket of the address
+            if ((port_add = bind_shared_ports[addr_index]) < 0) {
+                BLog(BLOG_NOTICE, "shared socket is not bound");
+                *cont = 1;
+                return;
+            }
+            DatagramPeerIO_BindShared(&peer->pio.udp.pio, &bind_shared_sockets[addr_index]);
+#endif
+        } else {
+            // try binding to all ports in the range
+            for (port_add = 0; port_add < addr->num_ports; port_add++) {
+                BAddr tryaddr = addr->addr;
+                BAddr_SetPort(&tryaddr, hton16(ntoh16(BAddr_GetPort(&tryaddr)) + port_add));
+                if (DatagramPeerIO_Bind(&peer->pio.udp.pio, tryaddr)) {
+                    break;
+                }
+            }
+            if (port_add == addr->num_ports) {
+                BLog(BLOG_NOTICE, "failed to bind to any port");
+                *cont = 1;
+                return;
             }
-        }
-        if (port_add == addr->num_ports) {
-            BLog(BLOG_NOTICE, "failed to bind to any port");
-            *cont = 1;
-            return;
         }
         
         uint8_t key[BENCRYPTION_MAX_KEY_SIZE];
@@ -2414,7 +2571,18 @@ void peer_connect (struct peer_data *peer, BAddr addr, uint8_t* encryption_key,
     
     if (options.transport_mode == TRANSPORT_MODE_UDP) {
         // order DatagramPeerIO to connect
-        if (!DatagramPeerIO_Connect(&peer->pio.udp.pio, addr)) {
+        int res;
+#ifndef BADVPN_USE_WINAPI
+        DatagramSharedSocket *shared_socket = (options.udp_shared_socket ? get_connect_shared_socket(addr.type) : NULL);
+        if (shared_socket) {
+            res = DatagramPeerIO_ConnectShared(&peer->pio.udp.pio, shared_socket, addr);
+        } else {
+            res = DatagramPeerIO_Connect(&peer->pio.udp.pio, addr);
+        }
+#else
+        res = DatagramPeerIO_Connect(&peer->pio.udp.pio, addr);
+#endif
+        if (!res) {
             peer_log(peer, BLOG_NOTICE, "DatagramPeerIO_Connect failed");
             peer_reset(peer);
             return;
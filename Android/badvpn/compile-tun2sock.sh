@@ -65,6 +65,8 @@ flow/PacketProtoFlow.c
 flow/PacketPassFairQueue.c
 flow/PacketProtoEncoder.c
 flow/PacketProtoDecoder.c
+flow/PacketChunk.c
+flow/FlowProfile.c
 socksclient/BSocksClient.c
 tuntap/BTap.c
 lwip/src/core/timers.c
@@ -95,8 +97,11 @@ base/DebugObject.c
 base/BLog.c
 base/BPending.c
 flowextra/PacketPassInactivityMonitor.c
+flowextra/PacketStreamCoalescer.c
+flowextra/FlowProfileDumper.c
 tun2socks/SocksUdpGwClient.c
 udpgw_client/UdpGwClient.c
+random/BRandom2.c
 "
 
 set -e
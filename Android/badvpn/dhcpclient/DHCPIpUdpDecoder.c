@@ -117,6 +117,7 @@ void DHCPIpUdpDecoder_Init (DHCPIpUdpDecoder *o, PacketPassInterface *output, BP
     
     // init input
     PacketPassInterface_Init(&o->input, IPUDP_HEADER_SIZE + PacketPassInterface_GetMTU(o->output), (PacketPassInterface_handler_send)input_handler_send, o, pg);
+    PacketPassInterface_SetName(&o->input, "DHCPIpUdpDecoder");
     
     DebugObject_Init(&o->d_obj);
 }
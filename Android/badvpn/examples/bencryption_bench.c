@@ -32,30 +32,64 @@
 #include <string.h>
 #include <stdint.h>
 #include <limits.h>
+#include <time.h>
+
+#if defined(__i386__) || defined(__x86_64__)
+#include <x86intrin.h>
+#define HAVE_RDTSC 1
+#endif
 
 #include <misc/balloc.h>
 #include <security/BRandom.h>
 #include <security/BEncryption.h>
 #include <base/DebugObject.h>
 
+// number of packets passed to each BEncryption_DecryptMany call
+#define BATCH_PACKETS 64
+
 static void usage (char *name)
 {
     printf(
-        "Usage: %s <enc/dec> <ciper> <num_blocks> <num_ops>\n"
-        "    <cipher> is one of (blowfish, aes).\n",
-        name
+        "Usage: %s <enc/dec/decmany> <ciper> <num_blocks> <num_ops> [<backend>]\n"
+        "    <cipher> is one of (blowfish, aes).\n"
+        "    <backend> is one of (auto, evp, legacy).\n"
+        "    With decmany, each op is a packet of <num_blocks> blocks, decrypted\n"
+        "    in batches of %d packets.\n",
+        name, BATCH_PACKETS
     );
     
     exit(1);
 }
 
+// returns CPU cycles where available, nanoseconds otherwise
+static uint64_t get_ticks (void)
+{
+#ifdef HAVE_RDTSC
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+static const char * backend_name (int backend)
+{
+    switch (backend) {
+        case BENCRYPTION_BACKEND_LEGACY: return "legacy";
+        case BENCRYPTION_BACKEND_EVP: return "evp";
+        case BENCRYPTION_BACKEND_CRYPTODEV: return "cryptodev";
+        default: return "?";
+    }
+}
+
 int main (int argc, char **argv)
 {
     if (argc <= 0) {
         return 1;
     }
     
-    if (argc != 5) {
+    if (argc != 5 && argc != 6) {
         usage(argv[0]);
     }
     
@@ -63,6 +97,7 @@ int main (int argc, char **argv)
     char *cipher_str = argv[2];
     
     int mode;
+    int many = 0;
     int cipher = 0; // silence warning
     int num_blocks = atoi(argv[3]);
     int num_ops = atoi(argv[4]);
@@ -73,6 +108,10 @@ int main (int argc, char **argv)
     else if (!strcmp(mode_str, "dec")) {
         mode = BENCRYPTION_MODE_DECRYPT;
     }
+    else if (!strcmp(mode_str, "decmany")) {
+        mode = BENCRYPTION_MODE_DECRYPT;
+        many = 1;
+    }
     else {
         usage(argv[0]);
     }
@@ -87,6 +126,21 @@ int main (int argc, char **argv)
         usage(argv[0]);
     }
     
+    if (argc == 6) {
+        if (!strcmp(argv[5], "auto")) {
+            BEncryption_GlobalSetBackend(BENCRYPTION_BACKEND_AUTO);
+        }
+        else if (!strcmp(argv[5], "evp")) {
+            BEncryption_GlobalSetBackend(BENCRYPTION_BACKEND_EVP);
+        }
+        else if (!strcmp(argv[5], "legacy")) {
+            BEncryption_GlobalSetBackend(BENCRYPTION_BACKEND_LEGACY);
+        }
+        else {
+            usage(argv[0]);
+        }
+    }
+    
     if (num_blocks < 0 || num_ops < 0) {
         usage(argv[0]);
     }
@@ -97,10 +151,7 @@ int main (int argc, char **argv)
     uint8_t key[BENCRYPTION_MAX_KEY_SIZE];
     BRandom_randomize(key, key_size);
     
-    uint8_t iv[BENCRYPTION_MAX_BLOCK_SIZE];
-    BRandom_randomize(iv, block_size);
-    
-    if (num_blocks > INT_MAX / block_size) {
+    if (num_blocks > INT_MAX / block_size / BATCH_PACKETS) {
         printf("too much");
         goto fail0;
     }
@@ -108,13 +159,16 @@ int main (int argc, char **argv)
     
     printf("unit size %d\n", unit_size);
     
-    uint8_t *buf1 = (uint8_t *)BAlloc(unit_size);
+    // in decmany mode, hold a whole batch of packets
+    int buf_size = (many ? BATCH_PACKETS * unit_size : unit_size);
+    
+    uint8_t *buf1 = (uint8_t *)BAlloc(buf_size);
     if (!buf1) {
         printf("BAlloc failed");
         goto fail0;
     }
     
-    uint8_t *buf2 = (uint8_t *)BAlloc(unit_size);
+    uint8_t *buf2 = (uint8_t *)BAlloc(buf_size);
     if (!buf2) {
         printf("BAlloc failed");
         goto fail1;
@@ -123,18 +177,78 @@ int main (int argc, char **argv)
     BEncryption enc;
     BEncryption_Init(&enc, mode, cipher, key);
     
+    printf("backend %s\n", backend_name(BEncryption_GetBackend(&enc)));
+    
     uint8_t *in = buf1;
     uint8_t *out = buf2;
-    BRandom_randomize(in, unit_size);
+    BRandom_randomize(in, buf_size);
     
-    for (int i = 0; i < num_ops; i++) {
-        BEncryption_Encrypt(&enc, in, out, unit_size, iv);
+    uint8_t ivs[BATCH_PACKETS][BENCRYPTION_MAX_BLOCK_SIZE];
+    BRandom_randomize((uint8_t *)ivs, sizeof(ivs));
+    
+    struct BEncryption_packet packets[BATCH_PACKETS];
+    for (int j = 0; j < BATCH_PACKETS; j++) {
+        packets[j].in = in + (many ? j * unit_size : 0);
+        packets[j].out = out + (many ? j * unit_size : 0);
+        packets[j].len = unit_size;
+        packets[j].iv = ivs[j];
+    }
+    
+    if (many) {
+        // check batching against one by one decryption
+        uint8_t *ref = (uint8_t *)BAlloc(buf_size);
+        if (!ref) {
+            printf("BAlloc failed");
+            goto fail2;
+        }
+        
+        uint8_t ref_ivs[BATCH_PACKETS][BENCRYPTION_MAX_BLOCK_SIZE];
+        memcpy(ref_ivs, ivs, sizeof(ivs));
+        for (int j = 0; j < BATCH_PACKETS; j++) {
+            BEncryption_Decrypt(&enc, packets[j].in, ref + j * unit_size, unit_size, ref_ivs[j]);
+        }
+        
+        BEncryption_DecryptMany(&enc, packets, BATCH_PACKETS);
         
-        uint8_t *t = in;
-        in = out;
-        out = t;
+        ASSERT_FORCE(!memcmp(out, ref, buf_size))
+        for (int j = 0; j < BATCH_PACKETS; j++) {
+            ASSERT_FORCE(!memcmp(ivs[j], ref_ivs[j], block_size))
+        }
+        
+        BFree(ref);
+    }
+    
+    uint64_t start = get_ticks();
+    
+    if (many) {
+        for (int i = 0; i < num_ops; i += BATCH_PACKETS) {
+            int n = (num_ops - i < BATCH_PACKETS ? num_ops - i : BATCH_PACKETS);
+            BEncryption_DecryptMany(&enc, packets, n);
+        }
+    } else {
+        for (int i = 0; i < num_ops; i++) {
+            if (mode == BENCRYPTION_MODE_ENCRYPT) {
+                BEncryption_Encrypt(&enc, in, out, unit_size, packets[0].iv);
+            } else {
+                BEncryption_Decrypt(&enc, in, out, unit_size, packets[0].iv);
+            }
+            
+            uint8_t *t = in;
+            in = out;
+            out = t;
+        }
     }
     
+    uint64_t ticks = get_ticks() - start;
+    double bytes = (double)unit_size * num_ops;
+    
+#ifdef HAVE_RDTSC
+    printf("%.3f cycles/byte\n", (bytes > 0 ? ticks / bytes : 0.0));
+#else
+    printf("%.3f ns/byte\n", (bytes > 0 ? ticks / bytes : 0.0));
+#endif
+    
+fail2:
     BEncryption_Free(&enc);
     BFree(buf2);
 fail1:
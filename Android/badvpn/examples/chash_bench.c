@@ -0,0 +1,265 @@
+/**
+ * @file chash_bench.c
+ * @author Psiphon Inc.
+ * 
+ * @section LICENSE
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ * @section DESCRIPTION
+ * 
+ * Compares the chained and the open addressing variants of CHash with BAVL,
+ * for 1000 up to max_entries entries with 64-bit random keys. For each size,
+ * measures the time per insertion (growing the tables from a small size), per
+ * successful and unsuccessful lookup, and per removal of half the entries.
+ * The structures are verified after inserting and after removing.
+ * 
+ * Usage: chash_bench <max_entries> <num_lookups>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <misc/balloc.h>
+#include <misc/compare.h>
+#include <misc/debug.h>
+#include <misc/offset.h>
+#include <structure/CHash.h>
+#include <structure/BAVL.h>
+
+#define INITIAL_BUCKETS 16
+
+struct entry {
+    uint64_t key;
+    int hash_next;
+    BAVLNode avl_node;
+};
+
+#define CHASH_PARAM_NAME ChainedHash
+#include "chash_bench_hash.h"
+#include <structure/CHash_decl.h>
+
+#define CHASH_PARAM_NAME ChainedHash
+#include "chash_bench_hash.h"
+#include <structure/CHash_impl.h>
+
+#define CHASH_PARAM_NAME OpenHash
+#define CHASH_PARAM_OPEN_ADDRESSING 1
+#include "chash_bench_hash.h"
+#include <structure/CHash_decl.h>
+
+#define CHASH_PARAM_NAME OpenHash
+#define CHASH_PARAM_OPEN_ADDRESSING 1
+#include "chash_bench_hash.h"
+#include <structure/CHash_impl.h>
+
+enum {TYPE_CHAINED, TYPE_OPEN, TYPE_BAVL};
+
+static const char *type_names[] = {"CHash", "CHash/OA", "BAVL"};
+
+static struct entry *entries;
+static ChainedHash chained;
+static OpenHash open;
+static BAVL avl;
+static uint64_t *hit_keys;
+static uint64_t *miss_keys;
+static uint64_t rng_state = 88172645463325252ULL;
+
+static uint64_t rng_next (void)
+{
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * UINT64_C(2685821657736338717);
+}
+
+static double now_sec (void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int key_comparator (void *user, uint64_t *val1, uint64_t *val2)
+{
+    return B_COMPARE(*val1, *val2);
+}
+
+static void run (int type, int num, int num_lookups)
+{
+    switch (type) {
+        case TYPE_CHAINED:
+            ASSERT_FORCE(ChainedHash_Init(&chained, INITIAL_BUCKETS))
+            break;
+        case TYPE_OPEN:
+            ASSERT_FORCE(OpenHash_Init(&open, INITIAL_BUCKETS))
+            break;
+        case TYPE_BAVL:
+            BAVL_Init(&avl, OFFSET_DIFF(struct entry, key, avl_node), (BAVL_comparator)key_comparator, NULL);
+            break;
+    }
+    
+    // insert, growing the chained hash table the way NCDStringIndex does
+    double start = now_sec();
+    size_t num_buckets = INITIAL_BUCKETS;
+    for (int i = 0; i < num; i++) {
+        int res;
+        switch (type) {
+            case TYPE_CHAINED: {
+                if (i == num_buckets) {
+                    ASSERT_FORCE(ChainedHash_MultiplyBuckets(&chained, entries, 1))
+                    num_buckets *= 2;
+                }
+                ChainedHashRef ref = {&entries[i], i};
+                res = ChainedHash_Insert(&chained, entries, ref, NULL);
+            } break;
+            case TYPE_OPEN: {
+                OpenHashRef ref = {&entries[i], i};
+                res = OpenHash_Insert(&open, entries, ref, NULL);
+            } break;
+            case TYPE_BAVL:
+                res = BAVL_Insert(&avl, &entries[i].avl_node, NULL);
+                break;
+        }
+        ASSERT_FORCE(res)
+    }
+    double insert_time = now_sec() - start;
+    
+    switch (type) {
+        case TYPE_CHAINED: ChainedHash_Verify(&chained, entries); break;
+        case TYPE_OPEN: OpenHash_Verify(&open, entries); break;
+        case TYPE_BAVL: BAVL_Verify(&avl); break;
+    }
+    
+    // look up existing and missing keys
+    double lookup_time[2];
+    for (int miss = 0; miss < 2; miss++) {
+        uint64_t *keys = (miss ? miss_keys : hit_keys);
+        int found = 0;
+        start = now_sec();
+        for (int i = 0; i < num_lookups; i++) {
+            uint64_t key = keys[i];
+            switch (type) {
+                case TYPE_CHAINED:
+                    found += !ChainedHashIsNullRef(ChainedHash_Lookup(&chained, entries, key));
+                    break;
+                case TYPE_OPEN:
+                    found += !OpenHashIsNullRef(OpenHash_Lookup(&open, entries, key));
+                    break;
+                case TYPE_BAVL:
+                    found += !!BAVL_LookupExact(&avl, &key);
+                    break;
+            }
+        }
+        lookup_time[miss] = now_sec() - start;
+        ASSERT_FORCE(found == (miss ? 0 : num_lookups))
+    }
+    
+    // remove every other entry
+    start = now_sec();
+    for (int i = 0; i < num; i += 2) {
+        switch (type) {
+            case TYPE_CHAINED: {
+                ChainedHashRef ref = {&entries[i], i};
+                ChainedHash_Remove(&chained, entries, ref);
+            } break;
+            case TYPE_OPEN: {
+                OpenHashRef ref = {&entries[i], i};
+                OpenHash_Remove(&open, entries, ref);
+            } break;
+            case TYPE_BAVL:
+                BAVL_Remove(&avl, &entries[i].avl_node);
+                break;
+        }
+    }
+    double remove_time = now_sec() - start;
+    
+    switch (type) {
+        case TYPE_CHAINED:
+            ChainedHash_Verify(&chained, entries);
+            ASSERT_FORCE(ChainedHashIsNullRef(ChainedHash_Lookup(&chained, entries, entries[0].key)))
+            ChainedHash_Free(&chained);
+            break;
+        case TYPE_OPEN:
+            OpenHash_Verify(&open, entries);
+            ASSERT_FORCE(OpenHashIsNullRef(OpenHash_Lookup(&open, entries, entries[0].key)))
+            OpenHash_Free(&open);
+            break;
+        case TYPE_BAVL:
+            BAVL_Verify(&avl);
+            ASSERT_FORCE(!BAVL_LookupExact(&avl, &entries[0].key))
+            break;
+    }
+    
+    printf("%-8s %8d: insert %7.1f ns, hit %7.1f ns, miss %7.1f ns, remove %7.1f ns\n",
+           type_names[type], num, insert_time * 1e9 / num, lookup_time[0] * 1e9 / num_lookups,
+           lookup_time[1] * 1e9 / num_lookups, remove_time * 1e9 / ((num + 1) / 2));
+}
+
+int main (int argc, char **argv)
+{
+    int max_entries;
+    int num_lookups;
+    
+    if (argc != 3 || (max_entries = atoi(argv[1])) < 1000 || (num_lookups = atoi(argv[2])) <= 0) {
+        fprintf(stderr, "Usage: %s <max_entries> <num_lookups>\n", (argc > 0 ? argv[0] : NULL));
+        return 1;
+    }
+    
+    entries = (struct entry *)BAllocArray(max_entries, sizeof(entries[0]));
+    hit_keys = (uint64_t *)BAllocArray(num_lookups, sizeof(hit_keys[0]));
+    miss_keys = (uint64_t *)BAllocArray(num_lookups, sizeof(miss_keys[0]));
+    ASSERT_FORCE(entries)
+    ASSERT_FORCE(hit_keys)
+    ASSERT_FORCE(miss_keys)
+    
+    // keys with the highest bit set are never inserted
+    for (int i = 0; i < max_entries; i++) {
+        entries[i].key = rng_next() >> 1;
+    }
+    for (int i = 0; i < num_lookups; i++) {
+        miss_keys[i] = rng_next() | (UINT64_C(1) << 63);
+    }
+    
+    for (int num = 1000; num <= max_entries; num *= 10) {
+        for (int i = 0; i < num_lookups; i++) {
+            hit_keys[i] = entries[rng_next() % num].key;
+        }
+        
+        for (int type = TYPE_CHAINED; type <= TYPE_BAVL; type++) {
+            run(type, num, num_lookups);
+        }
+        
+        if (num > max_entries / 10) {
+            break;
+        }
+    }
+    
+    BFree(miss_keys);
+    BFree(hit_keys);
+    BFree(entries);
+    
+    return 0;
+}
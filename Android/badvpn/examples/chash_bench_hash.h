@@ -0,0 +1,12 @@
+#define CHASH_PARAM_ENTRY struct entry
+#define CHASH_PARAM_LINK int
+#define CHASH_PARAM_KEY uint64_t
+#define CHASH_PARAM_ARG struct entry *
+#define CHASH_PARAM_NULL ((int)-1)
+#define CHASH_PARAM_DEREF(arg, link) (&(arg)[(link)])
+#define CHASH_PARAM_ENTRYHASH(arg, entry) ((size_t)(entry).ptr->key)
+#define CHASH_PARAM_KEYHASH(arg, key) ((size_t)(key))
+#define CHASH_PARAM_ENTRYHASH_IS_CHEAP 1
+#define CHASH_PARAM_COMPARE_ENTRIES(arg, entry1, entry2) ((entry1).ptr->key == (entry2).ptr->key)
+#define CHASH_PARAM_COMPARE_KEY_ENTRY(arg, key1, entry2) ((key1) == (entry2).ptr->key)
+#define CHASH_PARAM_ENTRY_NEXT hash_next
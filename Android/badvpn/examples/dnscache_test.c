@@ -0,0 +1,328 @@
+/**
+ * @file dnscache_test.c
+ * @author Psiphon Inc.
+ * 
+ * @section LICENSE
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include <misc/debug.h>
+#include <misc/byteorder.h>
+#include <misc/read_write_int.h>
+#include <misc/dns_proto.h>
+#include <base/BLog.h>
+#include <system/BReactor.h>
+#include <system/BNetwork.h>
+#include <system/BDatagram.h>
+#include <system/BTime.h>
+#include <udpgw/DnsCache.h>
+
+#define NUM_WAITERS 10
+#define STUB_TTL 300
+#define FORGED_TTL 7
+#define TEST_TIMEOUT 5000
+
+BReactor reactor;
+DnsCache cache;
+BAddr stub_addr;
+BDatagram stub_dgram;
+PacketPassInterface *stub_send_if;
+PacketRecvInterface *stub_recv_if;
+uint8_t stub_recv_buf[1500];
+uint8_t stub_send_buf[1500];
+int stub_send_len;
+int stub_forged;
+int stub_queries;
+BPending start_job;
+BTimer timeout_timer;
+uint16_t waiter_ids[NUM_WAITERS + 1];
+const char *waiter_names[NUM_WAITERS + 1];
+int waiter_replies[NUM_WAITERS + 1];
+int cancelled_waiter;
+int num_replies;
+int result;
+
+static int build_query (uint8_t *buf, uint16_t id, const char *name, int qdcount)
+{
+    struct dns_header header;
+    header.id = hton16(id);
+    header.flags = hton16(1 << 8);
+    header.qdcount = hton16(qdcount);
+    header.ancount = hton16(0);
+    header.nscount = hton16(0);
+    header.arcount = hton16(0);
+    memcpy(buf, &header, sizeof(header));
+    int pos = sizeof(header);
+    
+    while (*name) {
+        const char *dot = strchr(name, '.');
+        int len = dot ? dot - name : strlen(name);
+        buf[pos++] = len;
+        memcpy(buf + pos, name, len);
+        pos += len;
+        name += len + !!dot;
+    }
+    buf[pos++] = 0;
+    
+    badvpn_write_be16(DNS_TYPE_A, (char *)buf + pos);
+    badvpn_write_be16(DNS_CLASS_IN, (char *)buf + pos + 2);
+    pos += 4;
+    
+    return pos;
+}
+
+static uint32_t answer_ttl (const uint8_t *data, int data_len)
+{
+    // answer immediately follows the single question
+    int pos = sizeof(struct dns_header);
+    ASSERT_FORCE(dns_skip_name(data, data_len, &pos))
+    pos += 4;
+    ASSERT_FORCE(dns_skip_name(data, data_len, &pos))
+    ASSERT_FORCE(data_len - pos >= sizeof(struct dns_rr_fixed) + 4)
+    ASSERT_FORCE(badvpn_read_be16((const char *)data + pos) == DNS_TYPE_A)
+    return badvpn_read_be32((const char *)data + pos + 4);
+}
+
+static int question_matches (const uint8_t *data, int data_len, const char *name)
+{
+    uint8_t query[DNSCACHE_MAX_QUERY_LEN];
+    int query_len = build_query(query, 0, name, 1);
+    
+    return data_len >= query_len && !memcmp(data + sizeof(struct dns_header), query + sizeof(struct dns_header), query_len - sizeof(struct dns_header));
+}
+
+static void finish (int res)
+{
+    result = res;
+    BReactor_Quit(&reactor, 0);
+}
+
+static void stub_dgram_handler (void *unused, int event)
+{
+    fprintf(stderr, "stub socket error\n");
+    finish(1);
+}
+
+static void stub_send_if_handler_done (void *unused)
+{
+    // after the forged reply, send the real one
+    if (stub_forged) {
+        stub_forged = 0;
+        PacketPassInterface_Sender_Send(stub_send_if, stub_send_buf, stub_send_len);
+    }
+}
+
+static void stub_recv_if_handler_done (void *unused, int data_len)
+{
+    PacketRecvInterface_Receiver_Recv(stub_recv_if, stub_recv_buf);
+    
+    ASSERT_FORCE(data_len >= sizeof(struct dns_header))
+    ASSERT_FORCE(data_len + 16 <= sizeof(stub_send_buf))
+    
+    stub_queries++;
+    
+    // the query goes upstream as the first client asked it, but not with its ID
+    ASSERT_FORCE(question_matches(stub_recv_buf, data_len, waiter_names[0]))
+    ASSERT_FORCE(badvpn_read_be16((const char *)stub_recv_buf) != waiter_ids[0])
+    
+    // reply to whoever asked
+    BAddr remote_addr;
+    BIPAddr local_addr;
+    ASSERT_FORCE(BDatagram_GetLastReceiveAddrs(&stub_dgram, &remote_addr, &local_addr))
+    BIPAddr_InitInvalid(&local_addr);
+    BDatagram_SetSendAddrs(&stub_dgram, remote_addr, local_addr);
+    
+    // echo the question, with one A record in the answer
+    memcpy(stub_send_buf, stub_recv_buf, data_len);
+    badvpn_write_be16(0x8180, (char *)stub_send_buf + 2);
+    badvpn_write_be16(1, (char *)stub_send_buf + 6);
+    
+    uint8_t answer[] = {0xC0, 0x0C, 0, DNS_TYPE_A, 0, DNS_CLASS_IN, 0, 0, STUB_TTL >> 8, STUB_TTL & 0xFF, 0, 4, 192, 0, 2, 1};
+    memcpy(stub_send_buf + data_len, answer, sizeof(answer));
+    stub_send_len = data_len + sizeof(answer);
+    
+    // first send a forged answer with the ID the client chose, as an attacker
+    // knowing that ID would; it must not be accepted
+    static uint8_t forged_buf[sizeof(stub_send_buf)];
+    memcpy(forged_buf, stub_send_buf, stub_send_len);
+    badvpn_write_be16(waiter_ids[0], (char *)forged_buf);
+    badvpn_write_be32(FORGED_TTL, (char *)forged_buf + data_len + 6);
+    stub_forged = 1;
+    
+    PacketPassInterface_Sender_Send(stub_send_if, forged_buf, stub_send_len);
+}
+
+static void cache_handler_reply (void *unused, void *waiter, const uint8_t *data, int data_len)
+{
+    int i = (int *)waiter - waiter_replies;
+    ASSERT_FORCE(i >= 0 && i <= NUM_WAITERS)
+    ASSERT_FORCE(i != cancelled_waiter)
+    ASSERT_FORCE(waiter_replies[i] == 0)
+    ASSERT_FORCE(badvpn_read_be16((const char *)data) == waiter_ids[i])
+    ASSERT_FORCE(question_matches(data, data_len, waiter_names[i]))
+    ASSERT_FORCE(answer_ttl(data, data_len) == STUB_TTL)
+    
+    waiter_replies[i]++;
+    num_replies++;
+    
+    if (num_replies < NUM_WAITERS) {
+        return;
+    }
+    
+    // everyone got an answer from a single upstream query
+    ASSERT_FORCE(stub_queries == 1)
+    
+    uint8_t query[DNSCACHE_MAX_QUERY_LEN];
+    const uint8_t *reply;
+    int reply_len;
+    
+    // same question again comes from the cache, with our ID and case
+    int query_len = build_query(query, 4242, "WWW.EXAMPLE.COM", 1);
+    ASSERT_FORCE(DnsCache_Query(&cache, stub_addr, NULL, query, query_len, &reply, &reply_len) == DNSCACHE_RESULT_HIT)
+    ASSERT_FORCE(badvpn_read_be16((const char *)reply) == 4242)
+    ASSERT_FORCE(question_matches(reply, reply_len, "WWW.EXAMPLE.COM"))
+    ASSERT_FORCE(answer_ttl(reply, reply_len) <= STUB_TTL)
+    
+    // multiple questions are not cacheable
+    query_len = build_query(query, 4243, "www.example.com", 2);
+    ASSERT_FORCE(DnsCache_Query(&cache, stub_addr, NULL, query, query_len, &reply, &reply_len) == DNSCACHE_RESULT_PASS)
+    
+    struct DnsCache_stats stats;
+    DnsCache_GetStats(&cache, &stats);
+    printf("queries=%d hits=%d coalesced=%d forwarded=%d answered=%d passed=%d cached=%d pending=%d\n",
+           (int)stats.queries, (int)stats.hits, (int)stats.coalesced, (int)stats.forwarded, (int)stats.answered,
+           (int)stats.passed, stats.num_cached, stats.num_pending);
+    
+    ASSERT_FORCE(stats.forwarded == 1)
+    ASSERT_FORCE(stats.coalesced == NUM_WAITERS)
+    ASSERT_FORCE(stats.hits == 1)
+    ASSERT_FORCE(stats.passed == 1)
+    ASSERT_FORCE(stats.num_cached == 1)
+    ASSERT_FORCE(stats.num_pending == 0)
+    
+    finish(0);
+}
+
+static void start_job_handler (void *unused)
+{
+    uint8_t query[DNSCACHE_MAX_QUERY_LEN];
+    const uint8_t *reply;
+    int reply_len;
+    
+    // ask the same question many times, with differing case and IDs
+    for (int i = 0; i <= NUM_WAITERS; i++) {
+        waiter_ids[i] = 1000 + i;
+        waiter_names[i] = (i % 2) ? "www.example.com" : "WWW.Example.com";
+        int query_len = build_query(query, waiter_ids[i], waiter_names[i], 1);
+        ASSERT_FORCE(DnsCache_Query(&cache, stub_addr, &waiter_replies[i], query, query_len, &reply, &reply_len) == DNSCACHE_RESULT_WAIT)
+    }
+    
+    // one client goes away before the answer arrives
+    cancelled_waiter = NUM_WAITERS / 2;
+    DnsCache_CancelWaiter(&cache, &waiter_replies[cancelled_waiter]);
+}
+
+static void timeout_timer_handler (void *unused)
+{
+    fprintf(stderr, "timed out\n");
+    finish(1);
+}
+
+int main ()
+{
+    BLog_InitStdout();
+    BTime_Init();
+    
+    result = 1;
+    
+    if (!BNetwork_GlobalInit()) {
+        DEBUG("BNetwork_GlobalInit failed");
+        goto fail0;
+    }
+    
+    if (!BReactor_Init(&reactor)) {
+        DEBUG("BReactor_Init failed");
+        goto fail0;
+    }
+    
+    // init stub resolver on an ephemeral loopback port
+    if (!BDatagram_Init(&stub_dgram, BADDR_TYPE_IPV4, &reactor, NULL, stub_dgram_handler)) {
+        DEBUG("BDatagram_Init failed");
+        goto fail1;
+    }
+    BAddr_InitIPv4(&stub_addr, hton32(0x7f000001), 0);
+    if (!BDatagram_Bind(&stub_dgram, stub_addr)) {
+        DEBUG("BDatagram_Bind failed");
+        goto fail2;
+    }
+    struct sockaddr_in sin;
+    socklen_t sin_len = sizeof(sin);
+    if (getsockname(BDatagram_GetFd(&stub_dgram), (struct sockaddr *)&sin, &sin_len) < 0) {
+        DEBUG("getsockname failed");
+        goto fail2;
+    }
+    BAddr_InitIPv4(&stub_addr, hton32(0x7f000001), sin.sin_port);
+    
+    BDatagram_SendAsync_Init(&stub_dgram, sizeof(stub_send_buf));
+    stub_send_if = BDatagram_SendAsync_GetIf(&stub_dgram);
+    PacketPassInterface_Sender_Init(stub_send_if, stub_send_if_handler_done, NULL);
+    BDatagram_RecvAsync_Init(&stub_dgram, sizeof(stub_recv_buf));
+    stub_recv_if = BDatagram_RecvAsync_GetIf(&stub_dgram);
+    PacketRecvInterface_Receiver_Init(stub_recv_if, stub_recv_if_handler_done, NULL);
+    PacketRecvInterface_Receiver_Recv(stub_recv_if, stub_recv_buf);
+    
+    if (!DnsCache_Init(&cache, &reactor, 16, 1500, 60, NULL, cache_handler_reply)) {
+        DEBUG("DnsCache_Init failed");
+        goto fail3;
+    }
+    
+    BPending_Init(&start_job, BReactor_PendingGroup(&reactor), start_job_handler, NULL);
+    BPending_Set(&start_job);
+    
+    BTimer_Init(&timeout_timer, TEST_TIMEOUT, timeout_timer_handler, NULL);
+    BReactor_SetTimer(&reactor, &timeout_timer);
+    
+    BReactor_Exec(&reactor);
+    
+    BReactor_RemoveTimer(&reactor, &timeout_timer);
+    BPending_Free(&start_job);
+    DnsCache_Free(&cache);
+fail3:
+    BDatagram_RecvAsync_Free(&stub_dgram);
+    BDatagram_SendAsync_Free(&stub_dgram);
+fail2:
+    BDatagram_Free(&stub_dgram);
+fail1:
+    BReactor_Free(&reactor);
+fail0:
+    BLog_Free();
+    DebugObjectGlobal_Finish();
+    
+    return result;
+}
@@ -0,0 +1,240 @@
+/**
+ * @file fpa_bench.c
+ * @author Psiphon Inc.
+ * 
+ * @section LICENSE
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ * @section DESCRIPTION
+ * 
+ * Measures the reassembly rate of FragmentProtoAssembler. Frames are split
+ * into a fixed number of chunks, one chunk per input packet. Packets can be
+ * reordered within a window and dropped at random, to model a lossy link.
+ * Prints the number of frames completed and the input packet rate.
+ * 
+ * Usage: fpa_bench <num_frames> <chunks_per_frame> <reorder_window> <loss_permille> <num_packets>
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <misc/balloc.h>
+#include <misc/byteorder.h>
+#include <protocol/fragmentproto.h>
+#include <base/BLog.h>
+#include <system/BReactor.h>
+#include <system/BTime.h>
+#include <flow/PacketPassInterface.h>
+#include <client/FragmentProtoAssembler.h>
+
+#define CHUNK_PAYLOAD 512
+
+struct chunk_desc {
+    fragmentproto_frameid frame_id;
+    uint16_t chunk_start;
+    uint8_t is_last;
+};
+
+static BReactor reactor;
+static FragmentProtoAssembler assembler;
+static PacketPassInterface output;
+static PacketPassInterface *input;
+static struct chunk_desc *descs;
+static int num_descs;
+static int pos;
+static int frames_completed;
+static uint8_t packet[sizeof(struct fragmentproto_chunk_header) + CHUNK_PAYLOAD];
+static uint8_t payload[CHUNK_PAYLOAD];
+static uint32_t rand_state = 1;
+
+static void usage (char *name)
+{
+    printf("Usage: %s <num_frames> <chunks_per_frame> <reorder_window> <loss_permille> <num_packets>\n", name);
+    
+    exit(1);
+}
+
+static double now_sec (void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint32_t next_rand (void)
+{
+    rand_state = rand_state * 1103515245 + 12345;
+    return (rand_state >> 8);
+}
+
+static void logfunc (void *user)
+{
+}
+
+static void send_next (void)
+{
+    if (pos == num_descs) {
+        BReactor_Quit(&reactor, 0);
+        return;
+    }
+    
+    struct chunk_desc *d = &descs[pos++];
+    
+    struct fragmentproto_chunk_header header;
+    header.frame_id = htol16(d->frame_id);
+    header.chunk_start = htol16(d->chunk_start);
+    header.chunk_len = htol16(CHUNK_PAYLOAD);
+    header.is_last = htol8(d->is_last);
+    memcpy(packet, &header, sizeof(header));
+    memcpy(packet + sizeof(header), payload, CHUNK_PAYLOAD);
+    
+    PacketPassInterface_Sender_Send(input, packet, sizeof(packet));
+}
+
+static void input_handler_done (void *user)
+{
+    send_next();
+}
+
+static void output_handler_send (void *user, uint8_t *data, int data_len)
+{
+    frames_completed++;
+    PacketPassInterface_Done(&output);
+}
+
+int main (int argc, char **argv)
+{
+    if (argc <= 0) {
+        return 1;
+    }
+    
+    if (argc != 6) {
+        usage(argv[0]);
+    }
+    
+    int num_frames = atoi(argv[1]);
+    int chunks_per_frame = atoi(argv[2]);
+    int reorder_window = atoi(argv[3]);
+    int loss_permille = atoi(argv[4]);
+    int num_packets = atoi(argv[5]);
+    
+    if (num_frames <= 0 || chunks_per_frame <= 0 || chunks_per_frame > UINT16_MAX / CHUNK_PAYLOAD ||
+        reorder_window <= 0 || loss_permille < 0 || loss_permille > 1000 || num_packets <= 0
+    ) {
+        usage(argv[0]);
+    }
+    
+    BLog_InitStdout();
+    BLog_SetChannelLoglevel(BLOG_CHANNEL_FragmentProtoAssembler, BLOG_NOTICE);
+    BTime_Init();
+    
+    if (!BReactor_Init(&reactor)) {
+        printf("BReactor_Init failed\n");
+        goto fail0;
+    }
+    
+    if (!(descs = (struct chunk_desc *)BAllocArray(num_packets, sizeof(descs[0])))) {
+        printf("BAllocArray failed\n");
+        goto fail1;
+    }
+    
+    // generate chunks in order, dropping some, then shuffle each
+    // consecutive group of reorder_window chunks
+    uint32_t chunk_seq = 0;
+    num_descs = 0;
+    int frames_sent = 0;
+    int frames_lost = 0;
+    int frame_lost = 0;
+    while (num_descs < num_packets) {
+        uint32_t chunk_index = chunk_seq % chunks_per_frame;
+        if (chunk_index == 0) {
+            frame_lost = 0;
+        }
+        struct chunk_desc d;
+        d.frame_id = chunk_seq / chunks_per_frame;
+        d.chunk_start = chunk_index * CHUNK_PAYLOAD;
+        d.is_last = (chunk_index == chunks_per_frame - 1);
+        chunk_seq++;
+        
+        if (next_rand() % 1000 < loss_permille) {
+            frame_lost = 1;
+        } else {
+            descs[num_descs++] = d;
+        }
+        if (d.is_last) {
+            frames_sent++;
+            frames_lost += frame_lost;
+        }
+    }
+    for (int base = 0; base < num_descs; base += reorder_window) {
+        int n = (num_descs - base < reorder_window ? num_descs - base : reorder_window);
+        for (int i = n - 1; i > 0; i--) {
+            int j = next_rand() % (i + 1);
+            struct chunk_desc t = descs[base + i];
+            descs[base + i] = descs[base + j];
+            descs[base + j] = t;
+        }
+    }
+    
+    memset(payload, 0xab, sizeof(payload));
+    
+    PacketPassInterface_Init(&output, chunks_per_frame * CHUNK_PAYLOAD, output_handler_send, NULL, BReactor_PendingGroup(&reactor));
+    
+    if (!FragmentProtoAssembler_Init(&assembler, sizeof(packet), &output, num_frames, chunks_per_frame + 1, BReactor_PendingGroup(&reactor), NULL, logfunc)) {
+        printf("FragmentProtoAssembler_Init failed\n");
+        goto fail2;
+    }
+    input = FragmentProtoAssembler_GetInput(&assembler);
+    PacketPassInterface_Sender_Init(input, input_handler_done, NULL);
+    
+    double start = now_sec();
+    pos = 0;
+    send_next();
+    BReactor_Exec(&reactor);
+    double elapsed = now_sec() - start;
+    
+    printf("frames: %d sent, %d without loss, %d completed\n", frames_sent, frames_sent - frames_lost, frames_completed);
+    printf("packets: %d in %.3f s = %.2f M/s\n", num_descs, elapsed, num_descs / elapsed / 1e6);
+    
+    FragmentProtoAssembler_Free(&assembler);
+    PacketPassInterface_Free(&output);
+    BFree(descs);
+    BReactor_Free(&reactor);
+    BLog_Free();
+    
+    return 0;
+    
+fail2:
+    PacketPassInterface_Free(&output);
+    BFree(descs);
+fail1:
+    BReactor_Free(&reactor);
+fail0:
+    BLog_Free();
+    return 1;
+}
@@ -0,0 +1,172 @@
+/**
+ * @file inet_checksum_bench.c
+ * @author Psiphon Inc.
+ * 
+ * @section LICENSE
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <misc/debug.h>
+#include <misc/byteorder.h>
+#include <misc/read_write_int.h>
+#include <misc/inet_checksum.h>
+
+#define BUF_SIZE 65536
+
+static uint8_t buf[BUF_SIZE + 64];
+
+typedef uint64_t (*sum_func) (uint64_t acc, const uint8_t *p, size_t len);
+
+// the word at a time summation we used before
+static uint64_t reference_add (uint64_t acc, const uint8_t *p, size_t len)
+{
+    uint32_t t = 0;
+    
+    for (size_t i = 0; i + 1 < len; i += 2) {
+        t += badvpn_read_be16((const char *)p + i);
+        if (t >> 16) {
+            t = (t & 0xFFFF) + (t >> 16);
+        }
+    }
+    
+    if (len % 2) {
+        t += (uint16_t)p[len - 1] << 8;
+    }
+    
+    return acc + hton16(inet_checksum_fold(t));
+}
+
+static uint64_t dispatch_add (uint64_t acc, const uint8_t *p, size_t len)
+{
+    return inet_checksum_add(acc, p, len);
+}
+
+static struct {
+    const char *name;
+    sum_func func;
+} impls[] = {
+    {"reference", reference_add},
+    {"portable", inet_checksum__add_portable},
+#ifdef BADVPN_INET_CHECKSUM_SSE2
+    {"sse2", inet_checksum__add_sse2},
+#endif
+#ifdef BADVPN_INET_CHECKSUM_AVX2
+    {"avx2", inet_checksum__add_avx2},
+#endif
+#ifdef BADVPN_INET_CHECKSUM_NEON
+    {"neon", inet_checksum__add_neon},
+#endif
+    {"dispatch", dispatch_add},
+};
+
+static const size_t sizes[] = {20, 40, 64, 128, 576, 1280, 1500, 9000, 65535};
+
+#define NUM_IMPLS (sizeof(impls) / sizeof(impls[0]))
+#define NUM_SIZES (sizeof(sizes) / sizeof(sizes[0]))
+
+static double now_sec (void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main (int argc, char **argv)
+{
+    if (argc <= 0) {
+        return 1;
+    }
+    
+    size_t bytes_per_run = 256 * 1024 * 1024;
+    if (argc > 1) {
+        bytes_per_run = (size_t)atoi(argv[1]) * 1024 * 1024;
+    }
+    
+    srand(1);
+    for (size_t i = 0; i < sizeof(buf); i++) {
+        buf[i] = rand();
+    }
+    
+    // all implementations must agree, at any offset and length
+    for (int i = 0; i < 100000; i++) {
+        size_t off = rand() % 64;
+        size_t len = (i < 1000) ? (size_t)i : (size_t)(rand() % BUF_SIZE);
+        uint16_t expected = inet_checksum_fold(reference_add(0, buf + off, len));
+        for (int j = 0; j < NUM_IMPLS; j++) {
+            uint16_t sum = inet_checksum_fold(impls[j].func(0, buf + off, len));
+            if (sum != expected) {
+                fprintf(stderr, "%s: mismatch at offset %zu length %zu\n", impls[j].name, off, len);
+                return 1;
+            }
+        }
+    }
+    
+    // incremental update must match recomputing
+    for (int i = 0; i < 10000; i++) {
+        uint8_t pkt[20];
+        memcpy(pkt, buf + (rand() % 1024), sizeof(pkt));
+        uint16_t check = inet_checksum(pkt, sizeof(pkt));
+        uint32_t old_val;
+        uint32_t new_val = rand();
+        int off = 2 * (rand() % 9);
+        memcpy(&old_val, pkt + off, 4);
+        memcpy(pkt + off, &new_val, 4);
+        ASSERT_FORCE(inet_checksum_update32(check, old_val, new_val) == inet_checksum(pkt, sizeof(pkt)))
+    }
+    
+    printf("%8s", "size");
+    for (int j = 0; j < NUM_IMPLS; j++) {
+        printf(" %14s", impls[j].name);
+    }
+    printf("   (ns/packet, GB/s)\n");
+    
+    uint64_t sink = 0;
+    
+    for (int k = 0; k < NUM_SIZES; k++) {
+        size_t len = sizes[k];
+        size_t iters = bytes_per_run / len;
+        
+        printf("%8zu", len);
+        
+        for (int j = 0; j < NUM_IMPLS; j++) {
+            double start = now_sec();
+            for (size_t i = 0; i < iters; i++) {
+                sink += impls[j].func(sink & 1, buf + (i & 1), len);
+            }
+            double elapsed = now_sec() - start;
+            
+            printf(" %7.1f/%6.2f", elapsed * 1e9 / iters, (double)iters * len / elapsed / 1e9);
+        }
+        
+        printf("\n");
+    }
+    
+    return (sink == 1);
+}
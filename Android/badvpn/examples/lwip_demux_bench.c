@@ -0,0 +1,240 @@
+/**
+ * @file lwip_demux_bench.c
+ * @author Psiphon Inc.
+ * 
+ * @section LICENSE
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ * @section DESCRIPTION
+ * 
+ * Measures how the cost of demultiplexing incoming TCP segments in the
+ * bundled lwIP grows with the number of open connections. Connections are
+ * opened by feeding SYN and ACK segments through netif.input, then pure ACKs
+ * for randomly chosen connections are fed and timed.
+ * 
+ * Usage: lwip_demux_bench [<segments per step>] [<max connections>]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <misc/debug.h>
+#include <misc/byteorder.h>
+#include <misc/inet_checksum.h>
+#include <misc/ipv4_proto.h>
+#include <system/BTime.h>
+
+#include <lwip/init.h>
+#include <lwip/tcp_impl.h>
+#include <lwip/netif.h>
+#include <lwip/tcp.h>
+
+#define LOCAL_ADDR 0x0a000001
+#define REMOTE_ADDR 0x0a000002
+#define LOCAL_PORT 80
+#define REMOTE_PORT_BASE 10000
+#define CLIENT_ISS 1000
+#define SEGMENT_LEN (sizeof(struct ipv4_header) + sizeof(struct tcp_hdr))
+
+struct conn {
+    uint32_t server_iss;
+    int have_server_iss;
+    uint8_t ack[SEGMENT_LEN];
+};
+
+static struct netif netif;
+static struct conn *conns;
+static int num_accepted;
+
+static double now_sec (void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void build_segment (uint8_t *out, uint16_t remote_port, uint32_t seqno, uint32_t ackno, uint16_t flags)
+{
+    struct ipv4_header ip;
+    ip.version4_ihl4 = IPV4_MAKE_VERSION_IHL(sizeof(ip));
+    ip.ds = 0;
+    ip.total_length = hton16(SEGMENT_LEN);
+    ip.identification = 0;
+    ip.flags3_fragmentoffset13 = 0;
+    ip.ttl = 64;
+    ip.protocol = IP_PROTO_TCP;
+    ip.checksum = 0;
+    ip.source_address = hton32(REMOTE_ADDR);
+    ip.destination_address = hton32(LOCAL_ADDR);
+    ip.checksum = ipv4_checksum(&ip, NULL, 0);
+    
+    struct tcp_hdr tcp;
+    tcp.src = hton16(remote_port);
+    tcp.dest = hton16(LOCAL_PORT);
+    tcp.seqno = hton32(seqno);
+    tcp.ackno = hton32(ackno);
+    TCPH_HDRLEN_FLAGS_SET(&tcp, 5, flags);
+    tcp.wnd = hton16(65535);
+    tcp.chksum = 0;
+    tcp.urgp = 0;
+    
+    // pseudo header
+    uint64_t t = inet_checksum_add(0, &ip.source_address, 8);
+    uint16_t proto_len[2] = {hton16(IP_PROTO_TCP), hton16(sizeof(tcp))};
+    t = inet_checksum_add(t, proto_len, sizeof(proto_len));
+    t = inet_checksum_add(t, &tcp, sizeof(tcp));
+    tcp.chksum = ~inet_checksum_fold(t);
+    
+    memcpy(out, &ip, sizeof(ip));
+    memcpy(out + sizeof(ip), &tcp, sizeof(tcp));
+}
+
+static void input_segment (const uint8_t *data, int len)
+{
+    struct pbuf *p = pbuf_alloc(PBUF_RAW, len, PBUF_POOL);
+    ASSERT_FORCE(p)
+    ASSERT_FORCE(pbuf_take(p, data, len) == ERR_OK)
+    
+    if (netif.input(p, &netif) != ERR_OK) {
+        pbuf_free(p);
+    }
+}
+
+static err_t netif_output_func (struct netif *nif, struct pbuf *p, ip_addr_t *ipaddr)
+{
+    // remember the initial sequence number from the SYN-ACK
+    uint8_t hdrs[SEGMENT_LEN];
+    if (pbuf_copy_partial(p, hdrs, sizeof(hdrs), 0) != sizeof(hdrs)) {
+        return ERR_OK;
+    }
+    struct tcp_hdr tcp;
+    memcpy(&tcp, hdrs + sizeof(struct ipv4_header), sizeof(tcp));
+    
+    int i = ntoh16(tcp.dest) - REMOTE_PORT_BASE;
+    if ((TCPH_FLAGS(&tcp) & (TCP_SYN | TCP_ACK)) == (TCP_SYN | TCP_ACK) && i >= 0 && conns && !conns[i].have_server_iss) {
+        conns[i].server_iss = ntoh32(tcp.seqno);
+        conns[i].have_server_iss = 1;
+    }
+    
+    return ERR_OK;
+}
+
+static err_t netif_init_func (struct netif *nif)
+{
+    nif->name[0] = 'b';
+    nif->name[1] = 'm';
+    nif->mtu = 1500;
+    nif->output = netif_output_func;
+    
+    return ERR_OK;
+}
+
+static err_t accept_func (void *arg, struct tcp_pcb *pcb, err_t err)
+{
+    tcp_accepted((struct tcp_pcb *)arg);
+    num_accepted++;
+    
+    return ERR_OK;
+}
+
+static void open_connection (int i)
+{
+    uint8_t seg[SEGMENT_LEN];
+    
+    build_segment(seg, REMOTE_PORT_BASE + i, CLIENT_ISS, 0, TCP_SYN);
+    input_segment(seg, sizeof(seg));
+    ASSERT_FORCE(conns[i].have_server_iss)
+    
+    build_segment(conns[i].ack, REMOTE_PORT_BASE + i, CLIENT_ISS + 1, conns[i].server_iss + 1, TCP_ACK);
+    input_segment(conns[i].ack, sizeof(conns[i].ack));
+}
+
+int main (int argc, char **argv)
+{
+    if (argc <= 0) {
+        return 1;
+    }
+    
+    int segments = (argc > 1 ? atoi(argv[1]) : 2000000);
+    int max_conns = (argc > 2 ? atoi(argv[2]) : MEMP_NUM_TCP_PCB);
+    if (segments <= 0 || max_conns <= 0 || max_conns > MEMP_NUM_TCP_PCB) {
+        fprintf(stderr, "bad arguments\n");
+        return 1;
+    }
+    
+    conns = calloc(max_conns, sizeof(conns[0]));
+    ASSERT_FORCE(conns)
+    
+    BTime_Init();
+    lwip_init();
+    
+    ip_addr_t addr, netmask, gw;
+    ip4_addr_set_u32(&addr, hton32(LOCAL_ADDR));
+    IP4_ADDR(&netmask, 255, 255, 255, 0);
+    ip_addr_set_any(&gw);
+    ASSERT_FORCE(netif_add(&netif, &addr, &netmask, &gw, NULL, netif_init_func, ip_input))
+    netif_set_up(&netif);
+    netif_set_default(&netif);
+    
+    struct tcp_pcb *l = tcp_new();
+    ASSERT_FORCE(l)
+    ASSERT_FORCE(tcp_bind(l, IP_ADDR_ANY, LOCAL_PORT) == ERR_OK)
+    struct tcp_pcb *listener = tcp_listen(l);
+    ASSERT_FORCE(listener)
+    tcp_arg(listener, listener);
+    tcp_accept(listener, accept_func);
+    
+    printf("pcb hash: %s\n", (LWIP_TCP_PCB_HASH ? "on" : "off"));
+    printf("%12s %12s\n", "connections", "ns/segment");
+    
+    uint32_t rnd = 1;
+    int open = 0;
+    
+    for (int n = 1; n <= max_conns; n *= 4) {
+        while (open < n) {
+            open_connection(open++);
+        }
+        ASSERT_FORCE(num_accepted == open)
+        
+        double start = now_sec();
+        for (int k = 0; k < segments; k++) {
+            // xorshift32
+            rnd ^= rnd << 13;
+            rnd ^= rnd >> 17;
+            rnd ^= rnd << 5;
+            struct conn *c = &conns[rnd % n];
+            input_segment(c->ack, sizeof(c->ack));
+        }
+        double elapsed = now_sec() - start;
+        
+        printf("%12d %12.1f\n", n, elapsed * 1e9 / segments);
+    }
+    
+    free(conns);
+    
+    return 0;
+}
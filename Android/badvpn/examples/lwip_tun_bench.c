@@ -0,0 +1,473 @@
+/**
+ * @file lwip_tun_bench.c
+ * @author Psiphon Inc.
+ * 
+ * @section LICENSE
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ * @section DESCRIPTION
+ * 
+ * Single-stream TCP throughput benchmark for the bundled lwIP, driven by the
+ * kernel TCP stack through a TUN device. Packets in both directions pass
+ * through a delay line (with optional loss in the data direction), standing in
+ * for a high-RTT tunnel. With "offload" as the last argument, the device is
+ * opened in BTap's offload mode (TSO super-packets in both directions). The CPU
+ * time reported includes the kernel's work, which runs in this process.
+ * 
+ * The TUN device must exist and be configured beforehand, e.g.:
+ *   ip tuntap add dev bt0 mode tun
+ *   ip addr add 10.9.0.1/24 dev bt0
+ *   ip link set bt0 up
+ *   lwip_tun_bench bt0 10.9.0.2 50 0 up 64
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <sys/resource.h>
+
+#include <misc/debug.h>
+#include <misc/offset.h>
+#include <misc/minmax.h>
+#include <misc/ipaddr.h>
+#include <structure/LinkedList1.h>
+#include <base/BLog.h>
+#include <system/BReactor.h>
+#include <system/BNetwork.h>
+#include <system/BConnection.h>
+#include <system/BTime.h>
+#include <flow/SinglePacketBuffer.h>
+#include <tuntap/BTap.h>
+
+#include <lwip/init.h>
+#include <lwip/tcp_impl.h>
+#include <lwip/netif.h>
+#include <lwip/tcp.h>
+
+#define BENCH_PORT 5001
+#define CHUNK_SIZE 65535
+#define LOSS_MIN_PACKET_LEN 200
+
+struct packet {
+    LinkedList1Node list_node;
+    btime_t release_time;
+    int len;
+    uint8_t data[];
+};
+
+struct delay_line {
+    LinkedList1 packets;
+    BTimer timer;
+    int loss_permille;
+    void (*deliver) (uint8_t *data, int len);
+};
+
+static int delay;
+static int direction_up;
+static uint64_t total_bytes;
+static uint64_t transferred;
+static btime_t start_time;
+static double start_cpu;
+static int finished;
+
+static BReactor reactor;
+static BTap device;
+static PacketPassInterface device_read_interface;
+static SinglePacketBuffer device_read_buffer;
+static struct delay_line to_lwip;
+static struct delay_line to_kernel;
+static struct netif netif;
+static BTimer tcp_timer;
+static BConnector connector;
+static BConnection connection;
+static int have_connection;
+static uint8_t chunk[CHUNK_SIZE];
+
+static double cpu_time (void)
+{
+    struct rusage usage;
+    ASSERT_FORCE(getrusage(RUSAGE_SELF, &usage) == 0)
+    
+    return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 + usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+}
+
+static void finish (void)
+{
+    if (finished) {
+        return;
+    }
+    finished = 1;
+    
+    btime_t elapsed = btime_gettime() - start_time;
+    if (elapsed <= 0) {
+        elapsed = 1;
+    }
+    
+    // the kernel side runs in our process too, so this covers both stacks
+    double cpu = cpu_time() - start_cpu;
+    
+    printf("%s bytes=%"PRIu64" time=%"PRIi64"ms throughput=%.2f Mbit/s cpu=%.2fs (%.2fs/GB)\n",
+           (direction_up ? "up" : "down"), transferred, (int64_t)elapsed, (double)transferred * 8 / 1000 / elapsed,
+           cpu, cpu / ((double)transferred / 1e9));
+    
+    fflush(stdout);
+    
+    BReactor_Quit(&reactor, 0);
+}
+
+static void delay_line_handler (struct delay_line *o)
+{
+    btime_t now = btime_gettime();
+    
+    LinkedList1Node *node;
+    while ((node = LinkedList1_GetFirst(&o->packets))) {
+        struct packet *pk = UPPER_OBJECT(node, struct packet, list_node);
+        if (pk->release_time > now) {
+            BReactor_SetTimerAbsolute(&reactor, &o->timer, pk->release_time);
+            return;
+        }
+        LinkedList1_Remove(&o->packets, &pk->list_node);
+        o->deliver(pk->data, pk->len);
+        free(pk);
+    }
+}
+
+static void delay_line_init (struct delay_line *o, int loss_permille, void (*deliver) (uint8_t *, int))
+{
+    LinkedList1_Init(&o->packets);
+    BTimer_Init(&o->timer, 0, (BTimer_handler)delay_line_handler, o);
+    o->loss_permille = loss_permille;
+    o->deliver = deliver;
+}
+
+static void delay_line_free (struct delay_line *o)
+{
+    LinkedList1Node *node;
+    while ((node = LinkedList1_GetFirst(&o->packets))) {
+        LinkedList1_Remove(&o->packets, node);
+        free(UPPER_OBJECT(node, struct packet, list_node));
+    }
+    BReactor_RemoveTimer(&reactor, &o->timer);
+}
+
+static struct packet * delay_line_alloc (struct delay_line *o, int len)
+{
+    // drop data packets at random; ACKs and handshakes always pass
+    if (len >= LOSS_MIN_PACKET_LEN && rand() % 1000 < o->loss_permille) {
+        return NULL;
+    }
+    
+    struct packet *pk = malloc(sizeof(*pk) + len);
+    if (!pk) {
+        return NULL;
+    }
+    pk->release_time = btime_gettime() + delay;
+    pk->len = len;
+    
+    return pk;
+}
+
+static void delay_line_submit (struct delay_line *o, struct packet *pk)
+{
+    if (!LinkedList1_GetFirst(&o->packets)) {
+        BReactor_SetTimerAbsolute(&reactor, &o->timer, pk->release_time);
+    }
+    LinkedList1_Append(&o->packets, &pk->list_node);
+}
+
+static void deliver_to_lwip (uint8_t *data, int len)
+{
+    struct pbuf *p = pbuf_alloc(PBUF_RAW, len, PBUF_POOL);
+    if (!p) {
+        return;
+    }
+    ASSERT_FORCE(pbuf_take(p, data, len) == ERR_OK)
+    
+    if (netif.input(p, &netif) != ERR_OK) {
+        pbuf_free(p);
+    }
+}
+
+static void deliver_to_kernel (uint8_t *data, int len)
+{
+    BTap_Send(&device, data, len);
+}
+
+static void device_read_handler_send (void *unused, uint8_t *data, int data_len)
+{
+    struct packet *pk = delay_line_alloc(&to_lwip, data_len);
+    if (pk) {
+        memcpy(pk->data, data, data_len);
+        delay_line_submit(&to_lwip, pk);
+    }
+    
+    PacketPassInterface_Done(&device_read_interface);
+}
+
+static void device_error_handler (void *unused)
+{
+    fprintf(stderr, "device error\n");
+    BReactor_Quit(&reactor, 1);
+}
+
+static err_t netif_output_func (struct netif *nif, struct pbuf *p, ip_addr_t *ipaddr)
+{
+    struct packet *pk = delay_line_alloc(&to_kernel, p->tot_len);
+    if (pk) {
+        pbuf_copy_partial(p, pk->data, p->tot_len, 0);
+        delay_line_submit(&to_kernel, pk);
+    }
+    
+    return ERR_OK;
+}
+
+static err_t netif_init_func (struct netif *nif)
+{
+    nif->name[0] = 'b';
+    nif->name[1] = 't';
+    nif->mtu = BTap_GetMTU(&device);
+    nif->output = netif_output_func;
+    
+    return ERR_OK;
+}
+
+static void tcp_timer_handler (void *unused)
+{
+    tcp_tmr();
+    BReactor_SetTimer(&reactor, &tcp_timer);
+}
+
+static void lwip_send_more (struct tcp_pcb *pcb)
+{
+    while (transferred < total_bytes) {
+        int len = bmin_int(tcp_sndbuf(pcb), CHUNK_SIZE);
+        if (total_bytes - transferred < (uint64_t)len) {
+            len = total_bytes - transferred;
+        }
+        if (len == 0 || tcp_write(pcb, chunk, len, 0) != ERR_OK) {
+            break;
+        }
+        transferred += len;
+    }
+    
+    tcp_output(pcb);
+}
+
+static err_t lwip_sent_func (void *arg, struct tcp_pcb *pcb, u16_t len)
+{
+    lwip_send_more(pcb);
+    return ERR_OK;
+}
+
+static err_t lwip_recv_func (void *arg, struct tcp_pcb *pcb, struct pbuf *p, err_t err)
+{
+    if (!p) {
+        tcp_close(pcb);
+        return ERR_OK;
+    }
+    
+    transferred += p->tot_len;
+    tcp_recved(pcb, p->tot_len);
+    pbuf_free(p);
+    
+    if (transferred >= total_bytes) {
+        finish();
+    }
+    
+    return ERR_OK;
+}
+
+static err_t lwip_accept_func (void *arg, struct tcp_pcb *pcb, err_t err)
+{
+    tcp_accepted((struct tcp_pcb *)arg);
+    
+    printf("accepted: wnd_scale=%d sack=%d rcv_wnd_max=%"PRIu32"\n",
+           !!(pcb->flags & TF_WND_SCALE), !!(pcb->flags & TF_SACK), (uint32_t)TCP_WND_MAX(pcb));
+    
+    start_time = btime_gettime();
+    start_cpu = cpu_time();
+    
+    if (direction_up) {
+        tcp_recv(pcb, lwip_recv_func);
+    } else {
+        tcp_sent(pcb, lwip_sent_func);
+        lwip_send_more(pcb);
+    }
+    
+    return ERR_OK;
+}
+
+static void connection_handler (void *unused, int event)
+{
+    if (event == BCONNECTION_EVENT_RECVCLOSED && !direction_up) {
+        return;
+    }
+    fprintf(stderr, "connection error\n");
+    BReactor_Quit(&reactor, 1);
+}
+
+static void connection_send_handler_done (void *unused, int data_len)
+{
+    StreamPassInterface_Sender_Send(BConnection_SendAsync_GetIf(&connection), chunk, CHUNK_SIZE);
+}
+
+static void connection_recv_handler_done (void *unused, int data_len)
+{
+    if (direction_up) {
+        return;
+    }
+    
+    // the data itself is counted on the lwIP side when sending, here we only detect the end
+    static uint64_t received;
+    received += data_len;
+    if (received >= total_bytes) {
+        finish();
+        return;
+    }
+    
+    StreamRecvInterface_Receiver_Recv(BConnection_RecvAsync_GetIf(&connection), chunk, CHUNK_SIZE);
+}
+
+static void connector_handler (void *unused, int is_error)
+{
+    if (is_error || !BConnection_Init(&connection, BConnection_source_connector(&connector), &reactor, NULL, connection_handler)) {
+        fprintf(stderr, "connect failed\n");
+        BReactor_Quit(&reactor, 1);
+        return;
+    }
+    have_connection = 1;
+    
+    BConnection_SendAsync_Init(&connection);
+    BConnection_RecvAsync_Init(&connection);
+    
+    if (direction_up) {
+        StreamPassInterface_Sender_Init(BConnection_SendAsync_GetIf(&connection), connection_send_handler_done, NULL);
+        StreamPassInterface_Sender_Send(BConnection_SendAsync_GetIf(&connection), chunk, CHUNK_SIZE);
+    } else {
+        StreamRecvInterface_Receiver_Init(BConnection_RecvAsync_GetIf(&connection), connection_recv_handler_done, NULL);
+        StreamRecvInterface_Receiver_Recv(BConnection_RecvAsync_GetIf(&connection), chunk, CHUNK_SIZE);
+    }
+}
+
+int main (int argc, char *argv[])
+{
+    int offload = (argc > 1 && !strcmp(argv[argc - 1], "offload"));
+    if (offload) {
+        argc--;
+    }
+    
+    if (argc != 7 && argc != 9) {
+        printf("Usage: %s <tundev> <lwip_addr> <delay_ms> <loss_permille> <up/down> <megabytes> [<tcp_wnd> <tcp_snd_buf>] [offload]\n", (argc > 0 ? argv[0] : ""));
+        return 1;
+    }
+    
+    char *tundev = argv[1];
+    uint32_t lwip_addr;
+    delay = atoi(argv[3]);
+    int loss = atoi(argv[4]);
+    direction_up = !strcmp(argv[5], "up");
+    total_bytes = (uint64_t)atoi(argv[6]) * 1000000;
+    int tcp_wnd = (argc == 9 ? atoi(argv[7]) : TCP_WND);
+    int tcp_snd_buf = (argc == 9 ? atoi(argv[8]) : TCP_SND_BUF);
+    
+    if (!ipaddr_parse_ipv4_addr(argv[2], &lwip_addr) || delay < 0 || loss < 0 ||
+        (!direction_up && strcmp(argv[5], "down")) || total_bytes == 0 ||
+        tcp_wnd < TCP_MSS || tcp_wnd > TCP_WND_LIMIT || tcp_snd_buf < 2 * TCP_MSS) {
+        fprintf(stderr, "bad arguments\n");
+        return 1;
+    }
+    
+    srand(1);
+    memset(chunk, 'x', sizeof(chunk));
+    
+    BLog_InitStdout();
+    BTime_Init();
+    ASSERT_FORCE(BNetwork_GlobalInit())
+    ASSERT_FORCE(BReactor_Init(&reactor))
+    
+    struct BTap_init_data init_data;
+    init_data.dev_type = BTAP_DEV_TUN;
+    init_data.init_type = BTAP_INIT_STRING;
+    init_data.init.string = tundev;
+    init_data.offload = offload;
+    if (!BTap_Init2(&device, &reactor, init_data, device_error_handler, NULL)) {
+        fprintf(stderr, "BTap_Init2 failed\n");
+        return 1;
+    }
+    
+    PacketPassInterface_Init(&device_read_interface, PacketRecvInterface_GetMTU(BTap_GetOutput(&device)), device_read_handler_send, NULL, BReactor_PendingGroup(&reactor));
+    ASSERT_FORCE(SinglePacketBuffer_Init(&device_read_buffer, BTap_GetOutput(&device), &device_read_interface, BReactor_PendingGroup(&reactor)))
+    
+    // data loss only applies in the direction of the transfer
+    delay_line_init(&to_lwip, (direction_up ? loss : 0), deliver_to_lwip);
+    delay_line_init(&to_kernel, (direction_up ? 0 : loss), deliver_to_kernel);
+    
+    lwip_init();
+    
+    ip_addr_t addr, netmask, gw;
+    addr.addr = lwip_addr;
+    IP4_ADDR(&netmask, 255, 255, 255, 0);
+    ip_addr_set_any(&gw);
+    ASSERT_FORCE(netif_add(&netif, &addr, &netmask, &gw, NULL, netif_init_func, ip_input))
+    netif_set_up(&netif);
+    netif_set_default(&netif);
+    
+    struct tcp_pcb *l = tcp_new();
+    ASSERT_FORCE(l)
+    tcp_set_wnd(l, tcp_wnd, tcp_snd_buf);
+    ASSERT_FORCE(tcp_bind(l, IP_ADDR_ANY, BENCH_PORT) == ERR_OK)
+    struct tcp_pcb *listener = tcp_listen(l);
+    ASSERT_FORCE(listener)
+    tcp_arg(listener, listener);
+    tcp_accept(listener, lwip_accept_func);
+    
+    BTimer_Init(&tcp_timer, TCP_TMR_INTERVAL, tcp_timer_handler, NULL);
+    BReactor_SetTimer(&reactor, &tcp_timer);
+    
+    BAddr dest;
+    BAddr_InitIPv4(&dest, lwip_addr, hton16(BENCH_PORT));
+    ASSERT_FORCE(BConnector_Init(&connector, dest, &reactor, NULL, connector_handler))
+    
+    printf("%s: delay=%dms loss=%d/1000 tcp_wnd=%d tcp_snd_buf=%d offload=%d\n", (direction_up ? "up" : "down"), delay, loss, tcp_wnd, tcp_snd_buf, offload);
+    
+    int ret = BReactor_Exec(&reactor);
+    
+    if (have_connection) {
+        BConnection_RecvAsync_Free(&connection);
+        BConnection_SendAsync_Free(&connection);
+        BConnection_Free(&connection);
+    }
+    BConnector_Free(&connector);
+    BReactor_RemoveTimer(&reactor, &tcp_timer);
+    delay_line_free(&to_kernel);
+    delay_line_free(&to_lwip);
+    SinglePacketBuffer_Free(&device_read_buffer);
+    PacketPassInterface_Free(&device_read_interface);
+    BTap_Free(&device);
+    BReactor_Free(&reactor);
+    BLog_Free();
+    
+    return ret;
+}
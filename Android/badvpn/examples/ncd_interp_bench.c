@@ -0,0 +1,256 @@
+/**
+ * @file ncd_interp_bench.c
+ * @author Psiphon Inc.
+ * 
+ * @section LICENSE
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ * @section DESCRIPTION
+ * 
+ * Measures how fast the NCD interpreter re-initializes statements. A program
+ * with a chain of var() statements, each referring to the previous one, is
+ * generated and run, and a backtrack point makes the whole chain be torn down
+ * and initialized again for the given number of iterations. Statement names
+ * are reused round-robin from a set of the given size; fewer names mean more
+ * shadowed statements with the same name.
+ * 
+ * Usage: ncd_interp_bench <num_statements> <num_names> <iterations>
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <misc/debug.h>
+#include <misc/expstring.h>
+#include <base/BLog.h>
+#include <system/BReactor.h>
+#include <system/BTime.h>
+#ifndef BADVPN_NO_PROCESS
+#include <system/BProcess.h>
+#endif
+#ifndef BADVPN_NO_UDEV
+#include <udevmonitor/NCDUdevManager.h>
+#endif
+#ifndef BADVPN_NO_RANDOM
+#include <random/BRandom2.h>
+#endif
+#include <ncd/NCDConfigParser.h>
+#include <ncd/NCDInterpreter.h>
+
+static BReactor reactor;
+static int exit_code;
+
+static void usage (char *name)
+{
+    printf("Usage: %s <num_statements> <num_names> <iterations>\n", name);
+    
+    exit(1);
+}
+
+static double now_sec (void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int generate_program (ExpString *str, int num_statements, int num_names, int iterations)
+{
+    char buf[256];
+    
+    sprintf(buf, "process main {\n    var(\"0\") i;\n    backtrack_point() point;\n    var(\"x\") n0;\n");
+    if (!ExpString_Append(str, buf)) {
+        return 0;
+    }
+    
+    for (int k = 1; k < num_statements; k++) {
+        sprintf(buf, "    var(n%d) n%d;\n", (k - 1) % num_names, k % num_names);
+        if (!ExpString_Append(str, buf)) {
+            return 0;
+        }
+    }
+    
+    sprintf(buf, "    num_lesser(i, \"%d\") more;\n    If (more) {\n        num_add(i, \"1\") new_i;\n        i->set(new_i);\n        point->go();\n    };\n    exit(\"0\");\n}\n", iterations);
+    if (!ExpString_Append(str, buf)) {
+        return 0;
+    }
+    
+    return 1;
+}
+
+static void interpreter_handler_finished (void *user, int code)
+{
+    exit_code = code;
+    BReactor_Quit(&reactor, 0);
+}
+
+int main (int argc, char **argv)
+{
+    if (argc <= 0) {
+        return 1;
+    }
+    
+    if (argc != 4) {
+        usage(argv[0]);
+    }
+    
+    int num_statements = atoi(argv[1]);
+    int num_names = atoi(argv[2]);
+    int iterations = atoi(argv[3]);
+    
+    if (num_statements <= 0 || num_names <= 0 || iterations <= 0) {
+        usage(argv[0]);
+    }
+    
+    BLog_InitStdout();
+    for (int i = 0; i < BLOG_NUM_CHANNELS; i++) {
+        BLog_SetChannelLoglevel(i, BLOG_ERROR);
+    }
+    
+    BTime_Init();
+    
+    if (!BReactor_Init(&reactor)) {
+        printf("BReactor_Init failed\n");
+        goto fail0;
+    }
+    
+#ifndef BADVPN_NO_PROCESS
+    BProcessManager manager;
+    if (!BProcessManager_Init(&manager, &reactor)) {
+        printf("BProcessManager_Init failed\n");
+        goto fail1;
+    }
+#endif
+    
+#ifndef BADVPN_NO_UDEV
+    NCDUdevManager umanager;
+    NCDUdevManager_Init(&umanager, 1, &reactor, &manager);
+#endif
+    
+#ifndef BADVPN_NO_RANDOM
+    BRandom2 random2;
+    if (!BRandom2_Init(&random2, BRANDOM2_INIT_LAZY)) {
+        printf("BRandom2_Init failed\n");
+        goto fail2;
+    }
+#endif
+    
+    ExpString str;
+    if (!ExpString_Init(&str)) {
+        printf("ExpString_Init failed\n");
+        goto fail3;
+    }
+    
+    if (!generate_program(&str, num_statements, num_names, iterations)) {
+        printf("generate_program failed\n");
+        goto fail4;
+    }
+    
+    NCDProgram program;
+    if (!NCDConfigParser_Parse((char *)ExpString_Get(&str), ExpString_Length(&str), &program)) {
+        printf("NCDConfigParser_Parse failed\n");
+        goto fail4;
+    }
+    
+    struct NCDInterpreter_params params;
+    params.handler_finished = interpreter_handler_finished;
+    params.user = NULL;
+    params.retry_time = 1000;
+    params.extra_args = NULL;
+    params.num_extra_args = 0;
+    params.reactor = &reactor;
+#ifndef BADVPN_NO_PROCESS
+    params.manager = &manager;
+#endif
+#ifndef BADVPN_NO_UDEV
+    params.umanager = &umanager;
+#endif
+#ifndef BADVPN_NO_RANDOM
+    params.random2 = &random2;
+#endif
+    
+    double start = now_sec();
+    
+    NCDInterpreter interpreter;
+    if (!NCDInterpreter_Init(&interpreter, program, params)) {
+        printf("NCDInterpreter_Init failed\n");
+        goto fail4;
+    }
+    
+    double load_time = now_sec() - start;
+    
+    exit_code = 1;
+    start = now_sec();
+    BReactor_Exec(&reactor);
+    double run_time = now_sec() - start;
+    
+    NCDInterpreter_Free(&interpreter);
+    
+    if (exit_code != 0) {
+        printf("program failed\n");
+        goto fail4;
+    }
+    
+    printf("load:       %10.1f ms\n", load_time * 1e3);
+    printf("run:        %10.1f ms\n", run_time * 1e3);
+    printf("statements: %10.1f k/s\n", (double)num_statements * iterations / run_time / 1e3);
+    
+    ExpString_Free(&str);
+#ifndef BADVPN_NO_RANDOM
+    BRandom2_Free(&random2);
+#endif
+#ifndef BADVPN_NO_UDEV
+    NCDUdevManager_Free(&umanager);
+#endif
+#ifndef BADVPN_NO_PROCESS
+    BProcessManager_Free(&manager);
+#endif
+    BReactor_Free(&reactor);
+    BLog_Free();
+    DebugObjectGlobal_Finish();
+    return 0;
+    
+fail4:
+    ExpString_Free(&str);
+fail3:
+#ifndef BADVPN_NO_RANDOM
+    BRandom2_Free(&random2);
+fail2:
+#endif
+#ifndef BADVPN_NO_UDEV
+    NCDUdevManager_Free(&umanager);
+#endif
+#ifndef BADVPN_NO_PROCESS
+    BProcessManager_Free(&manager);
+fail1:
+#endif
+    BReactor_Free(&reactor);
+fail0:
+    BLog_Free();
+    DebugObjectGlobal_Finish();
+    return 1;
+}
@@ -25,9 +25,21 @@
  * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
  * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
  * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ * @section DESCRIPTION
+ * 
+ * Tests NCDVal. If a number of iterations is given, also measures copying
+ * statement argument templates the way the interpreter does when statements
+ * are initialized: plain copies, copies into preallocated memory, and
+ * arguments without variables which are shared instead of copied.
+ * 
+ * Usage: ncdval_test [<bench_iterations>]
  */
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
 #include <ncd/NCDVal.h>
 #include <ncd/NCDStringIndex.h>
@@ -36,6 +48,7 @@
 #include <misc/debug.h>
 #include <misc/balloc.h>
 #include <misc/offset.h>
+#include <misc/maxalign.h>
 
 #define FORCE(cmd) if (!(cmd)) { fprintf(stderr, "failed\n"); exit(1); }
 
@@ -209,10 +222,179 @@ static void print_value (NCDValRef val, unsigned int indent)
     }
 }
 
-int main ()
+static int replace_func (void *arg, int plid, NCDValMem *mem, NCDValRef *out)
+{
+    *out = NCDVal_NewString(mem, "value of a variable, e.g. an interface name");
+    return 1;
+}
+
+// Builds a value like the arguments of a typical statement, with num_vars
+// placeholders (up to 3).
+static NCDValRef build_args_template (NCDValMem *mem, NCDStringIndex *string_index, int num_vars)
+{
+    const char *strs[] = {"192.168.111.1", "24", "some_option", "some_value"};
+    NCDValRef elems[4];
+    for (int i = 0; i < 4; i++) {
+        NCD_string_id_t id = NCDStringIndex_Get(string_index, strs[i]);
+        FORCE( id >= 0 )
+        elems[i] = NCDVal_NewIdString(mem, id, string_index);
+        FORCE( !NCDVal_IsInvalid(elems[i]) )
+    }
+    
+    NCDValRef list = NCDVal_NewList(mem, 5);
+    FORCE( !NCDVal_IsInvalid(list) )
+    NCDValRef opts = NCDVal_NewMap(mem, 1);
+    FORCE( !NCDVal_IsInvalid(opts) )
+    
+    int res;
+    FORCE( NCDVal_ListAppend(list, (num_vars > 0 ? NCDVal_NewPlaceholder(mem, 0) : elems[0])) )
+    FORCE( NCDVal_ListAppend(list, elems[0]) )
+    FORCE( NCDVal_ListAppend(list, (num_vars > 1 ? NCDVal_NewPlaceholder(mem, 1) : elems[1])) )
+    FORCE( NCDVal_MapInsert(opts, elems[2], (num_vars > 2 ? NCDVal_NewPlaceholder(mem, 2) : elems[3]), &res) && res )
+    FORCE( NCDVal_ListAppend(list, opts) )
+    
+    return list;
+}
+
+static void test_prealloc (NCDStringIndex *string_index)
+{
+    union {
+        bmax_align_t align;
+        char data[512];
+    } prealloc;
+    
+    NCDValMem tmem;
+    NCDValMem_Init(&tmem);
+    NCDValRef tval = build_args_template(&tmem, string_index, 3);
+    NCDValReplaceProg prog;
+    FORCE( NCDValReplaceProg_Init(&prog, tval) )
+    FORCE( NCDValMem_Used(&tmem) > NCDVAL_FASTBUF_SIZE )
+    
+    // reference result, using a plain copy
+    NCDValMem mem1;
+    FORCE( NCDValMem_InitCopy(&mem1, &tmem) )
+    FORCE( NCDValReplaceProg_Execute(prog, &mem1, replace_func, NULL) )
+    NCDValRef val1 = NCDVal_FromSafe(&mem1, NCDVal_ToSafe(tval));
+    
+    // copy into a buffer which fits the result
+    NCDValMem mem2;
+    FORCE( NCDValMem_InitCopyPrealloc(&mem2, &tmem, prealloc.data, sizeof(prealloc.data)) )
+    FORCE( NCDValReplaceProg_Execute(prog, &mem2, replace_func, NULL) )
+    NCDValRef val2 = NCDVal_FromSafe(&mem2, NCDVal_ToSafe(tval));
+    FORCE( NCDVal_Compare(val1, val2) == 0 )
+    print_value(val2, 0);
+    
+    // copy into a buffer which only fits the template; replacement must move
+    // the values out of it
+    size_t tsize = NCDValMem_Used(&tmem);
+    NCDValMem mem3;
+    FORCE( NCDValMem_InitCopyPrealloc(&mem3, &tmem, prealloc.data, tsize) )
+    FORCE( NCDValReplaceProg_Execute(prog, &mem3, replace_func, NULL) )
+    FORCE( NCDValMem_Used(&mem3) > tsize )
+    memset(prealloc.data, 0, sizeof(prealloc.data));
+    NCDValRef val3 = NCDVal_FromSafe(&mem3, NCDVal_ToSafe(tval));
+    FORCE( NCDVal_Compare(val1, val3) == 0 )
+    
+    // a copy of a memory object using a preallocated buffer
+    NCDValMem mem4;
+    FORCE( NCDValMem_InitCopy(&mem4, &mem3) )
+    FORCE( NCDVal_Compare(val1, NCDVal_Moved(&mem4, val3)) == 0 )
+    
+    // a buffer which is too small is not used
+    NCDValMem mem5;
+    FORCE( NCDValMem_InitCopyPrealloc(&mem5, &tmem, prealloc.data, tsize - 1) )
+    FORCE( NCDValReplaceProg_Execute(prog, &mem5, replace_func, NULL) )
+    FORCE( NCDVal_Compare(val1, NCDVal_Moved(&mem5, tval)) == 0 )
+    
+    NCDValMem_Free(&mem5);
+    NCDValMem_Free(&mem4);
+    NCDValMem_Free(&mem3);
+    NCDValMem_Free(&mem2);
+    NCDValMem_Free(&mem1);
+    NCDValReplaceProg_Free(&prog);
+    NCDValMem_Free(&tmem);
+}
+
+static double now_sec (void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void bench_copy (const char *name, NCDStringIndex *string_index, int num_vars, int mode, int iterations)
+{
+    union {
+        bmax_align_t align;
+        char data[1024];
+    } prealloc;
+    size_t prealloc_size = 0;
+    
+    NCDValMem tmem;
+    NCDValMem_Init(&tmem);
+    NCDValRef tval = build_args_template(&tmem, string_index, num_vars);
+    NCDValReplaceProg prog;
+    FORCE( NCDValReplaceProg_Init(&prog, tval) )
+    
+    // number of instantiations which needed allocated memory
+    long heap = 0;
+    
+    double start = now_sec();
+    
+    for (int i = 0; i < iterations; i++) {
+        NCDValMem mem;
+        NCDValRef val;
+        size_t avail;
+        
+        switch (mode) {
+            case 0: { // plain copy
+                FORCE( NCDValMem_InitCopy(&mem, &tmem) )
+                avail = NCDVAL_FASTBUF_SIZE;
+            } break;
+            case 1: { // copy into preallocated memory, learning the size
+                FORCE( NCDValMem_InitCopyPrealloc(&mem, &tmem, prealloc.data, prealloc_size) )
+                avail = (prealloc_size > NCDVAL_FASTBUF_SIZE ? prealloc_size : NCDVAL_FASTBUF_SIZE);
+            } break;
+            default: { // shared
+                val = tval;
+                FORCE( !NCDVal_IsInvalid(val) )
+                continue;
+            } break;
+        }
+        
+        FORCE( NCDValReplaceProg_Execute(prog, &mem, replace_func, NULL) )
+        val = NCDVal_FromSafe(&mem, NCDVal_ToSafe(tval));
+        FORCE( !NCDVal_IsInvalid(val) )
+        
+        size_t used = NCDValMem_Used(&mem);
+        if (used > avail || NCDValMem_Used(&tmem) > avail) {
+            heap++;
+        }
+        if (mode == 1 && used > prealloc_size && used <= sizeof(prealloc.data)) {
+            prealloc_size = used;
+        }
+        
+        NCDValMem_Free(&mem);
+    }
+    
+    double elapsed = now_sec() - start;
+    
+    printf("%-32s %8.1f ns/statement, %ld of %d needed allocated memory\n", name, elapsed / iterations * 1e9, heap, iterations);
+    
+    NCDValReplaceProg_Free(&prog);
+    NCDValMem_Free(&tmem);
+}
+
+int main (int argc, char *argv[])
 {
     int res;
     
+    int bench_iterations = 0;
+    if (argc > 2 || (argc == 2 && (bench_iterations = atoi(argv[1])) <= 0)) {
+        fprintf(stderr, "Usage: %s [<bench_iterations>]\n", (argc > 0 ? argv[0] : ""));
+        return 1;
+    }
+    
     BLog_InitStdout();
     
     NCDStringIndex string_index;
@@ -374,6 +556,17 @@ int main ()
     
     NCDValMem_Free(&mem);
     
+    // Copies of argument templates into preallocated memory.
+    
+    test_prealloc(&string_index);
+    
+    if (bench_iterations > 0) {
+        bench_copy("with variables, plain copy", &string_index, 3, 0, bench_iterations);
+        bench_copy("with variables, preallocated", &string_index, 3, 1, bench_iterations);
+        bench_copy("no variables, plain copy", &string_index, 0, 0, bench_iterations);
+        bench_copy("no variables, shared", &string_index, 0, 2, bench_iterations);
+    }
+    
     NCDStringIndex_Free(&string_index);
     
     return 0;
@@ -0,0 +1,245 @@
+/**
+ * @file otp_bench.c
+ * @author Psiphon Inc.
+ * 
+ * @section LICENSE
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ * @section DESCRIPTION
+ * 
+ * Measures how long it takes to compute OTPs from a seed, both for sending
+ * (OTPGenerator, with shuffling) and for checking (OTPChecker, building its
+ * lookup table), and how many OTPs OTPChecker can check per second.
+ * Seeds are computed in the event loop, without additional threads.
+ * 
+ * Usage: otp_bench <cipher> <num_otps> <num_seeds> <num_checks>
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <misc/balloc.h>
+#include <base/BLog.h>
+#include <system/BReactor.h>
+#include <system/BTime.h>
+#include <threadwork/BThreadWork.h>
+#include <security/BRandom.h>
+#include <security/BEncryption.h>
+#include <security/OTPCalculator.h>
+#include <security/OTPChecker.h>
+
+static BReactor reactor;
+static OTPCalculator calc;
+static OTPChecker checker;
+static otp_t *check_otps;
+static int num_otps;
+static int num_seeds;
+static int num_checks;
+static uint8_t key[BENCRYPTION_MAX_KEY_SIZE];
+static uint8_t iv[BENCRYPTION_MAX_BLOCK_SIZE];
+static int seeds_done;
+static int checks_done;
+static int checks_valid;
+static double start;
+static double elapsed;
+static int failed;
+
+static void usage (char *name)
+{
+    printf(
+        "Usage: %s <cipher> <num_otps> <num_seeds> <num_checks>\n"
+        "    <cipher> is one of (blowfish, aes).\n",
+        name
+    );
+    
+    exit(1);
+}
+
+static double now_sec (void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void check_invalid (void)
+{
+    // check random OTPs, which are almost always invalid
+    BRandom_randomize((uint8_t *)check_otps, num_otps * sizeof(otp_t));
+    int accepted = 0;
+    start = now_sec();
+    for (int i = 0; i < num_checks; i++) {
+        accepted += OTPChecker_CheckOTP(&checker, 0, check_otps[i % num_otps]);
+    }
+    elapsed = now_sec() - start;
+    printf("invalid checks:  %10.1f M/s (%d accepted)\n", num_checks / elapsed / 1e6, accepted);
+}
+
+static void checker_handler (void *user)
+{
+    // generating seeds for checking
+    if (seeds_done < num_seeds) {
+        if (++seeds_done < num_seeds) {
+            iv[0] = seeds_done;
+            OTPChecker_AddSeed(&checker, 0, key, iv);
+            return;
+        }
+        
+        printf("checker seed:    %10.1f us\n", (now_sec() - start) * 1e6 / num_seeds);
+        
+        // compute the OTPs of the last seed in the order they would be sent
+        memcpy(check_otps, OTPCalculator_Generate(&calc, key, iv, 1), num_otps * sizeof(otp_t));
+        elapsed = 0.0;
+    }
+    
+    // check valid OTPs; each can only be used once, so we start over with
+    // the seed whenever all have been used
+    int n = (num_checks - checks_done < num_otps ? num_checks - checks_done : num_otps);
+    start = now_sec();
+    for (int i = 0; i < n; i++) {
+        checks_valid += OTPChecker_CheckOTP(&checker, 0, check_otps[i]);
+    }
+    elapsed += now_sec() - start;
+    checks_done += n;
+    
+    if (checks_done < num_checks) {
+        OTPChecker_AddSeed(&checker, 0, key, iv);
+        return;
+    }
+    
+    if (checks_valid != num_checks) {
+        printf("valid OTPs rejected: %d of %d\n", num_checks - checks_valid, num_checks);
+        failed = 1;
+    } else {
+        printf("valid checks:    %10.1f M/s\n", num_checks / elapsed / 1e6);
+        check_invalid();
+    }
+    
+    BReactor_Quit(&reactor, 0);
+}
+
+int main (int argc, char **argv)
+{
+    if (argc <= 0) {
+        return 1;
+    }
+    
+    if (argc != 5) {
+        usage(argv[0]);
+    }
+    
+    int cipher;
+    if (!strcmp(argv[1], "blowfish")) {
+        cipher = BENCRYPTION_CIPHER_BLOWFISH;
+    }
+    else if (!strcmp(argv[1], "aes")) {
+        cipher = BENCRYPTION_CIPHER_AES;
+    }
+    else {
+        usage(argv[0]);
+    }
+    
+    num_otps = atoi(argv[2]);
+    num_seeds = atoi(argv[3]);
+    num_checks = atoi(argv[4]);
+    
+    if (num_otps <= 0 || num_seeds <= 0 || num_checks <= 0) {
+        usage(argv[0]);
+    }
+    
+    BRandom_randomize(key, BEncryption_cipher_key_size(cipher));
+    BRandom_randomize(iv, BEncryption_cipher_block_size(cipher));
+    
+    BLog_InitStdout();
+    BTime_Init();
+    
+    if (!BReactor_Init(&reactor)) {
+        printf("BReactor_Init failed\n");
+        goto fail0;
+    }
+    
+    // compute in the event loop, so that only the computation is timed
+    BThreadWorkDispatcher twd;
+    if (!BThreadWorkDispatcher_Init(&twd, &reactor, 0)) {
+        printf("BThreadWorkDispatcher_Init failed\n");
+        goto fail1;
+    }
+    
+    if (!OTPCalculator_Init(&calc, num_otps, cipher)) {
+        printf("OTPCalculator_Init failed\n");
+        goto fail2;
+    }
+    
+    if (!OTPChecker_Init(&checker, num_otps, cipher, 2, &twd)) {
+        printf("OTPChecker_Init failed\n");
+        goto fail3;
+    }
+    OTPChecker_SetHandlers(&checker, checker_handler, NULL);
+    
+    if (!(check_otps = (otp_t *)BAllocArray(num_otps, sizeof(otp_t)))) {
+        printf("BAllocArray failed\n");
+        goto fail4;
+    }
+    
+    printf("%d OTPs per seed\n", num_otps);
+    
+    // generate seeds for sending
+    start = now_sec();
+    for (int i = 0; i < num_seeds; i++) {
+        iv[0] = i;
+        OTPCalculator_Generate(&calc, key, iv, 1);
+    }
+    printf("generator seed:  %10.1f us\n", (now_sec() - start) * 1e6 / num_seeds);
+    
+    // generate seeds for checking, then check; continues in checker_handler
+    start = now_sec();
+    iv[0] = 0;
+    OTPChecker_AddSeed(&checker, 0, key, iv);
+    BReactor_Exec(&reactor);
+    
+    BFree(check_otps);
+    OTPChecker_Free(&checker);
+    OTPCalculator_Free(&calc);
+    BThreadWorkDispatcher_Free(&twd);
+    BReactor_Free(&reactor);
+    BLog_Free();
+    
+    return failed;
+    
+fail4:
+    OTPChecker_Free(&checker);
+fail3:
+    OTPCalculator_Free(&calc);
+fail2:
+    BThreadWorkDispatcher_Free(&twd);
+fail1:
+    BReactor_Free(&reactor);
+fail0:
+    BLog_Free();
+    return 1;
+}
@@ -0,0 +1,333 @@
+/**
+ * @file server_relay_bench.c
+ * @author Psiphon Inc.
+ * 
+ * @section LICENSE
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ * @section DESCRIPTION
+ * 
+ * Measures the throughput of messages relayed by a running badvpn-server.
+ * Two plain (non-SSL) clients connect to the server over TCP and accept
+ * each other; the first then sends messages to the second, which returns
+ * a small acknowledgement message through the server every few messages.
+ * The number of unacknowledged messages is bounded so that the server's
+ * per-peer buffers never overflow, which would reset the pair; the window
+ * must therefore not exceed CLIENT_PEER_FLOW_BUFFER_MIN_PACKETS. The clients
+ * acknowledge TCP data immediately where possible, so that the server's
+ * Nagle algorithm does not stall on delayed acknowledgements.
+ * 
+ * Usage: server_relay_bench <server addr> [<messages>] [<payload size>] [<window>]
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include <misc/byteorder.h>
+#include <protocol/packetproto.h>
+#include <protocol/scproto.h>
+
+#define ACK_EVERY 4
+#define MAX_PACKET PACKETPROTO_ENCLEN(SC_MAX_ENC)
+
+struct client {
+    int fd;
+    peerid_t id;
+    peerid_t peer_id;
+    uint8_t buf[MAX_PACKET];
+};
+
+static struct client clients[2];
+static long long num_messages;
+static int payload_size;
+
+static double now_sec (void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void fatal (const char *msg)
+{
+    fprintf(stderr, "%s\n", msg);
+    exit(1);
+}
+
+static void write_all (int fd, const uint8_t *data, size_t len)
+{
+    while (len > 0) {
+        ssize_t res = write(fd, data, len);
+        if (res < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fatal("write failed");
+        }
+        data += res;
+        len -= res;
+    }
+}
+
+static void read_all (int fd, uint8_t *data, size_t len)
+{
+    while (len > 0) {
+#ifdef TCP_QUICKACK
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_QUICKACK, &one, sizeof(one));
+#endif
+        ssize_t res = read(fd, data, len);
+        if (res < 0 && errno == EINTR) {
+            continue;
+        }
+        if (res <= 0) {
+            fatal("connection to server lost");
+        }
+        data += res;
+        len -= res;
+    }
+}
+
+// sends a packet; the payload must have been written to c->buf after the headers
+static void send_packet (struct client *c, uint8_t type, int payload_len)
+{
+    struct packetproto_header pp;
+    pp.len = htol16(sizeof(struct sc_header) + payload_len);
+    struct sc_header sc;
+    sc.type = htol8(type);
+    
+    memcpy(c->buf, &pp, sizeof(pp));
+    memcpy(c->buf + sizeof(pp), &sc, sizeof(sc));
+    
+    write_all(c->fd, c->buf, sizeof(pp) + sizeof(sc) + payload_len);
+}
+
+static uint8_t * payload_ptr (struct client *c)
+{
+    return c->buf + sizeof(struct packetproto_header) + sizeof(struct sc_header);
+}
+
+// receives a packet into c->buf, returning its type and payload length
+static uint8_t recv_packet (struct client *c, int *out_payload_len)
+{
+    struct packetproto_header pp;
+    read_all(c->fd, (uint8_t *)&pp, sizeof(pp));
+    int len = ltoh16(pp.len);
+    if (len < sizeof(struct sc_header) || len > SC_MAX_ENC) {
+        fatal("bad packet from server");
+    }
+    
+    read_all(c->fd, c->buf + sizeof(pp), len);
+    
+    struct sc_header sc;
+    memcpy(&sc, c->buf + sizeof(pp), sizeof(sc));
+    *out_payload_len = len - sizeof(sc);
+    
+    return ltoh8(sc.type);
+}
+
+// receives a packet, skipping keep-alives
+static uint8_t recv_nonkeepalive (struct client *c, int *out_payload_len)
+{
+    uint8_t type;
+    while ((type = recv_packet(c, out_payload_len)) == SCID_KEEPALIVE);
+    return type;
+}
+
+static void client_connect (struct client *c, struct sockaddr_in *addr)
+{
+    if ((c->fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+        fatal("socket failed");
+    }
+    if (connect(c->fd, (struct sockaddr *)addr, sizeof(*addr)) < 0) {
+        fatal("connect failed");
+    }
+    int one = 1;
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    
+    // send hello
+    struct sc_client_hello hello;
+    hello.version = htol16(SC_VERSION);
+    memcpy(payload_ptr(c), &hello, sizeof(hello));
+    send_packet(c, SCID_CLIENTHELLO, sizeof(hello));
+    
+    // receive our ID
+    int len;
+    if (recv_nonkeepalive(c, &len) != SCID_SERVERHELLO || len != sizeof(struct sc_server_hello)) {
+        fatal("expected serverhello");
+    }
+    struct sc_server_hello shello;
+    memcpy(&shello, payload_ptr(c), sizeof(shello));
+    c->id = ltoh16(shello.id);
+}
+
+static void client_accept_peer (struct client *c)
+{
+    // wait for the other client to be announced
+    int len;
+    if (recv_nonkeepalive(c, &len) != SCID_NEWCLIENT || len < sizeof(struct sc_server_newclient)) {
+        fatal("expected newclient");
+    }
+    struct sc_server_newclient nc;
+    memcpy(&nc, payload_ptr(c), sizeof(nc));
+    c->peer_id = ltoh16(nc.id);
+    
+    // accept it
+    struct sc_client_acceptpeer acc;
+    acc.clientid = htol16(c->peer_id);
+    memcpy(payload_ptr(c), &acc, sizeof(acc));
+    send_packet(c, SCID_ACCEPTPEER, sizeof(acc));
+}
+
+// receiving client; acknowledges every ACK_EVERY messages
+static void * receiver_thread (void *arg)
+{
+    struct client *c = &clients[1];
+    uint8_t ack_buf[PACKETPROTO_ENCLEN(sizeof(struct sc_header) + sizeof(struct sc_client_outmsg) + 8)];
+    
+    for (long long received = 1; received <= num_messages; received++) {
+        int len;
+        uint8_t type = recv_nonkeepalive(c, &len);
+        if (type != SCID_INMSG) {
+            fatal("unexpected packet while relaying (pair was reset?)");
+        }
+        if (len != sizeof(struct sc_server_inmsg) + payload_size) {
+            fatal("relayed message has wrong size");
+        }
+        
+        if (received % ACK_EVERY == 0 || received == num_messages) {
+            struct packetproto_header pp;
+            pp.len = htol16(sizeof(ack_buf) - sizeof(pp));
+            struct sc_header sc;
+            sc.type = htol8(SCID_OUTMSG);
+            struct sc_client_outmsg om;
+            om.clientid = htol16(c->peer_id);
+            uint64_t count = htol64(received);
+            
+            uint8_t *p = ack_buf;
+            memcpy(p, &pp, sizeof(pp)); p += sizeof(pp);
+            memcpy(p, &sc, sizeof(sc)); p += sizeof(sc);
+            memcpy(p, &om, sizeof(om)); p += sizeof(om);
+            memcpy(p, &count, sizeof(count));
+            
+            write_all(c->fd, ack_buf, sizeof(ack_buf));
+        }
+    }
+    
+    return NULL;
+}
+
+int main (int argc, char **argv)
+{
+    if (argc < 2 || argc > 5) {
+        fprintf(stderr, "Usage: %s <server addr> [<messages>] [<payload size>] [<window>]\n", (argc > 0 ? argv[0] : "server_relay_bench"));
+        return 1;
+    }
+    
+    num_messages = (argc > 2 ? atoll(argv[2]) : 200000);
+    payload_size = (argc > 3 ? atoi(argv[3]) : 1400);
+    int window = (argc > 4 ? atoi(argv[4]) : 8);
+    
+    if (num_messages <= 0 || payload_size < 0 || payload_size > SC_MAX_MSGLEN || window < ACK_EVERY) {
+        fprintf(stderr, "bad arguments\n");
+        return 1;
+    }
+    
+    // parse server address
+    char host[64];
+    int port;
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    if (sscanf(argv[1], "%63[^:]:%d", host, &port) != 2 || inet_pton(AF_INET, host, &addr.sin_addr) != 1) {
+        fprintf(stderr, "bad server address, expected a.b.c.d:port\n");
+        return 1;
+    }
+    addr.sin_port = htons(port);
+    
+    // connect clients and let them accept each other
+    client_connect(&clients[0], &addr);
+    client_connect(&clients[1], &addr);
+    client_accept_peer(&clients[0]);
+    client_accept_peer(&clients[1]);
+    if (clients[0].peer_id != clients[1].id || clients[1].peer_id != clients[0].id) {
+        fatal("clients were not paired, is the server empty?");
+    }
+    
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, receiver_thread, NULL) != 0) {
+        fatal("pthread_create failed");
+    }
+    
+    struct client *c = &clients[0];
+    struct sc_client_outmsg om;
+    om.clientid = htol16(c->peer_id);
+    
+    double start = now_sec();
+    
+    long long sent = 0;
+    long long acked = 0;
+    
+    while (acked < num_messages) {
+        // send as much as the window allows
+        while (sent < num_messages && sent - acked < window) {
+            uint8_t *p = payload_ptr(c);
+            memcpy(p, &om, sizeof(om));
+            send_packet(c, SCID_OUTMSG, sizeof(om) + payload_size);
+            sent++;
+        }
+        
+        // wait for an acknowledgement
+        int len;
+        if (recv_nonkeepalive(c, &len) != SCID_INMSG || len != sizeof(struct sc_server_inmsg) + 8) {
+            fatal("unexpected packet while relaying (pair was reset?)");
+        }
+        uint64_t count;
+        memcpy(&count, payload_ptr(c) + sizeof(struct sc_server_inmsg), sizeof(count));
+        acked = ltoh64(count);
+    }
+    
+    double elapsed = now_sec() - start;
+    
+    pthread_join(thread, NULL);
+    
+    printf("%lld messages of %d bytes, window %d\n", num_messages, payload_size, window);
+    printf("%.0f messages/s, %.1f MB/s\n", num_messages / elapsed, num_messages * (double)payload_size / elapsed / 1e6);
+    
+    close(clients[1].fd);
+    close(clients[0].fd);
+    
+    return 0;
+}
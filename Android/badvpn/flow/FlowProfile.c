@@ -0,0 +1,293 @@
+/**
+ * @file FlowProfile.c
+ * @author Psiphon Inc.
+ * 
+ * @section LICENSE
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef BADVPN_FLOW_PROFILE
+
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#ifdef BADVPN_USE_WINAPI
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+#if BADVPN_THREAD_SAFE
+#include <pthread.h>
+#endif
+
+#include <misc/balloc.h>
+#include <misc/compare.h>
+#include <misc/offset.h>
+
+#include <flow/FlowProfile.h>
+
+struct snapshot {
+    const char *type;
+    const char *name;
+    const void *owner;
+    const void *sender;
+    uint64_t age;
+    uint64_t num_ops;
+    uint64_t num_bytes;
+    uint64_t busy_time;
+    uint64_t max_busy_time;
+    int busy;
+};
+
+static LinkedList1 flowprofile_list;
+static size_t flowprofile_count;
+#if BADVPN_THREAD_SAFE
+static pthread_mutex_t flowprofile_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static void lock (void)
+{
+    #if BADVPN_THREAD_SAFE
+    ASSERT_FORCE(pthread_mutex_lock(&flowprofile_mutex) == 0)
+    #endif
+}
+
+static void unlock (void)
+{
+    #if BADVPN_THREAD_SAFE
+    ASSERT_FORCE(pthread_mutex_unlock(&flowprofile_mutex) == 0)
+    #endif
+}
+
+static const struct snapshot *sort_nodes;
+
+static int compare_sender (const void *v1, const void *v2)
+{
+    const struct snapshot *s1 = &sort_nodes[*(const size_t *)v1];
+    const struct snapshot *s2 = &sort_nodes[*(const size_t *)v2];
+    
+    return B_COMPARE((uintptr_t)s1->sender, (uintptr_t)s2->sender);
+}
+
+static void write_string (FILE *f, const char *str)
+{
+    for (const char *c = str; *c; c++) {
+        if (*c == '"' || *c == '\\') {
+            fputc('\\', f);
+        }
+        fputc(*c, f);
+    }
+}
+
+static double average_depth (const struct snapshot *s)
+{
+    return (s->age > 0) ? (double)s->busy_time / s->age : 0.0;
+}
+
+static void write_node (FILE *f, int format, size_t id, const struct snapshot *s)
+{
+    uint64_t avg_ns = (s->num_ops > 0) ? s->busy_time / s->num_ops : 0;
+    
+    if (format == FLOWPROFILE_FORMAT_DOT) {
+        fprintf(f, "    n%zu [label=\"", id);
+        write_string(f, s->name);
+        fprintf(f, "\\n%p\\nops %"PRIu64" bytes %"PRIu64"\\navg %"PRIu64"us max %"PRIu64"us\\ndepth %.3f%s\"];\n",
+                s->owner, s->num_ops, s->num_bytes, avg_ns / 1000, s->max_busy_time / 1000, average_depth(s), (s->busy ? " busy" : ""));
+    } else {
+        fprintf(f, "%s\n    {\"id\": %zu, \"type\": \"", (id > 0 ? "," : ""), id);
+        write_string(f, s->type);
+        fprintf(f, "\", \"name\": \"");
+        write_string(f, s->name);
+        fprintf(f, "\", \"owner\": \"%p\", \"sender\": \"%p\", \"ops\": %"PRIu64", \"bytes\": %"PRIu64", "
+                "\"busy_ns\": %"PRIu64", \"max_busy_ns\": %"PRIu64", \"age_ns\": %"PRIu64", \"depth\": %.6f, \"busy\": %s}",
+                s->owner, s->sender, s->num_ops, s->num_bytes, s->busy_time, s->max_busy_time, s->age, average_depth(s), (s->busy ? "true" : "false"));
+    }
+}
+
+static void write_edge (FILE *f, int format, size_t from, size_t to, int first)
+{
+    if (format == FLOWPROFILE_FORMAT_DOT) {
+        fprintf(f, "    n%zu -> n%zu;\n", from, to);
+    } else {
+        fprintf(f, "%s\n    [%zu, %zu]", (first ? "" : ","), from, to);
+    }
+}
+
+void FlowProfileNode_Init (FlowProfileNode *o, const char *type, const void *owner)
+{
+    ASSERT(type)
+    
+    o->type = type;
+    o->name = type;
+    o->owner = owner;
+    o->sender = NULL;
+    o->init_time = FlowProfile_Now();
+    o->num_ops = 0;
+    o->num_bytes = 0;
+    o->busy_time = 0;
+    o->max_busy_time = 0;
+    o->busy = 0;
+    
+    lock();
+    LinkedList1_Append(&flowprofile_list, &o->list_node);
+    flowprofile_count++;
+    unlock();
+}
+
+void FlowProfileNode_Free (FlowProfileNode *o)
+{
+    lock();
+    LinkedList1_Remove(&flowprofile_list, &o->list_node);
+    flowprofile_count--;
+    unlock();
+}
+
+uint64_t FlowProfile_Now (void)
+{
+    #ifdef BADVPN_USE_WINAPI
+    
+    LARGE_INTEGER count;
+    LARGE_INTEGER freq;
+    QueryPerformanceCounter(&count);
+    QueryPerformanceFrequency(&freq);
+    
+    return (uint64_t)((double)count.QuadPart * 1000000000.0 / freq.QuadPart);
+    
+    #else
+    
+    struct timespec ts;
+    ASSERT_FORCE(clock_gettime(CLOCK_MONOTONIC, &ts) == 0)
+    
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    
+    #endif
+}
+
+int FlowProfile_Dump (FILE *f, int format)
+{
+    ASSERT(format == FLOWPROFILE_FORMAT_DOT || format == FLOWPROFILE_FORMAT_JSON)
+    
+    // take a snapshot of the nodes, so that the lock is not held while writing
+    lock();
+    
+    size_t count = flowprofile_count;
+    struct snapshot *nodes = (count > 0) ? (struct snapshot *)BAllocArray(count, sizeof(nodes[0])) : NULL;
+    if (count > 0 && !nodes) {
+        unlock();
+        goto fail0;
+    }
+    
+    uint64_t now = FlowProfile_Now();
+    size_t i = 0;
+    
+    for (LinkedList1Node *ln = LinkedList1_GetFirst(&flowprofile_list); ln; ln = LinkedList1Node_Next(ln)) {
+        FlowProfileNode *o = UPPER_OBJECT(ln, FlowProfileNode, list_node);
+        struct snapshot *s = &nodes[i++];
+        s->type = o->type;
+        s->name = o->name;
+        s->owner = o->owner;
+        s->sender = o->sender;
+        s->age = now - o->init_time;
+        s->num_ops = o->num_ops;
+        s->num_bytes = o->num_bytes;
+        s->busy_time = o->busy_time;
+        s->max_busy_time = o->max_busy_time;
+        s->busy = o->busy;
+        
+        // count the operation in progress
+        if (o->busy) {
+            s->busy_time += now - o->start_time;
+        }
+    }
+    
+    unlock();
+    
+    ASSERT(i == count)
+    
+    // sort node indices by sender, for finding edges
+    size_t *by_sender = (count > 0) ? (size_t *)BAllocArray(count, sizeof(by_sender[0])) : NULL;
+    if (count > 0 && !by_sender) {
+        goto fail1;
+    }
+    for (size_t j = 0; j < count; j++) {
+        by_sender[j] = j;
+    }
+    sort_nodes = nodes;
+    if (count > 0) {
+        qsort(by_sender, count, sizeof(by_sender[0]), compare_sender);
+    }
+    
+    // write nodes
+    fprintf(f, (format == FLOWPROFILE_FORMAT_DOT) ? "digraph flow {\n    rankdir=LR;\n    node [shape=box];\n" : "{\"nodes\": [");
+    
+    for (size_t j = 0; j < count; j++) {
+        write_node(f, format, j, &nodes[j]);
+    }
+    
+    if (format == FLOWPROFILE_FORMAT_JSON) {
+        fprintf(f, "\n], \"edges\": [");
+    }
+    
+    // write an edge from each interface to the interfaces its owner sends into
+    int first = 1;
+    for (size_t j = 0; j < count; j++) {
+        const void *owner = nodes[j].owner;
+        if (!owner) {
+            continue;
+        }
+        
+        // find first node sent into by the owner
+        size_t lo = 0;
+        size_t hi = count;
+        while (lo < hi) {
+            size_t mid = lo + (hi - lo) / 2;
+            if ((uintptr_t)nodes[by_sender[mid]].sender < (uintptr_t)owner) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        
+        for (size_t k = lo; k < count && nodes[by_sender[k]].sender == owner; k++) {
+            write_edge(f, format, j, by_sender[k], first);
+            first = 0;
+        }
+    }
+    
+    fprintf(f, (format == FLOWPROFILE_FORMAT_DOT) ? "}\n" : "\n]}\n");
+    
+    BFree(by_sender);
+    BFree(nodes);
+    
+    return !ferror(f);
+    
+fail1:
+    BFree(nodes);
+fail0:
+    return 0;
+}
+
+#endif
@@ -0,0 +1,210 @@
+/**
+ * @file FlowProfile.h
+ * @author Psiphon Inc.
+ * 
+ * @section LICENSE
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ * @section DESCRIPTION
+ * 
+ * Opt-in profiling of {@link PacketPassInterface} and {@link StreamPassInterface}
+ * instances, compiled in when BADVPN_FLOW_PROFILE is defined (the FLOW_PROFILE
+ * CMake option); otherwise this header declares nothing.
+ * 
+ * Each interface registers a {@link FlowProfileNode} which counts operations and
+ * bytes, and accumulates the time from Sender_Send until the sender is notified
+ * that the operation is done. Dividing that time by the age of the interface gives
+ * the average number of operations in flight, i.e. the queue depth at the
+ * interface.
+ * 
+ * The registered nodes can be dumped as a graph. There is an edge from interface A
+ * to interface B if the owner of A (the object providing it) is the sender of B.
+ * Statistics are updated without locking by the thread the interface lives in, so
+ * values in a dump taken from another thread may be slightly stale.
+ */
+
+#ifndef BADVPN_FLOW_FLOWPROFILE_H
+#define BADVPN_FLOW_FLOWPROFILE_H
+
+#ifdef BADVPN_FLOW_PROFILE
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <misc/debug.h>
+#include <structure/LinkedList1.h>
+
+#define FLOWPROFILE_FORMAT_DOT 1
+#define FLOWPROFILE_FORMAT_JSON 2
+
+/**
+ * Profiling data of one interface.
+ */
+typedef struct {
+    const char *type;
+    const char *name;
+    const void *owner;
+    const void *sender;
+    uint64_t init_time;
+    uint64_t start_time;
+    uint64_t num_ops;
+    uint64_t num_bytes;
+    uint64_t busy_time;
+    uint64_t max_busy_time;
+    int busy;
+    LinkedList1Node list_node;
+} FlowProfileNode;
+
+/**
+ * Initializes the node and registers it.
+ * 
+ * @param o the node
+ * @param type type of the interface, used as the name until one is set
+ * @param owner object providing the interface
+ */
+void FlowProfileNode_Init (FlowProfileNode *o, const char *type, const void *owner);
+
+/**
+ * Unregisters and frees the node.
+ * 
+ * @param o the node
+ */
+void FlowProfileNode_Free (FlowProfileNode *o);
+
+/**
+ * Sets the name of the interface.
+ * 
+ * @param o the node
+ * @param name name, which must remain valid as long as the node
+ */
+static void FlowProfileNode_SetName (FlowProfileNode *o, const char *name);
+
+/**
+ * Sets the object providing the interface, for when it is not the object
+ * passed as the provider's user pointer.
+ * 
+ * @param o the node
+ * @param owner object providing the interface
+ */
+static void FlowProfileNode_SetOwner (FlowProfileNode *o, const void *owner);
+
+/**
+ * Sets the object sending into the interface.
+ * 
+ * @param o the node
+ * @param sender object sending into the interface
+ */
+static void FlowProfileNode_SetSender (FlowProfileNode *o, const void *sender);
+
+/**
+ * Records the start of an operation.
+ * 
+ * @param o the node
+ * @param bytes number of bytes in the operation, if known now
+ */
+static void FlowProfileNode_Begin (FlowProfileNode *o, int bytes);
+
+/**
+ * Adds bytes to the current operation, for interfaces where the amount
+ * is only known when it is done.
+ * 
+ * @param o the node
+ * @param bytes number of bytes
+ */
+static void FlowProfileNode_AddBytes (FlowProfileNode *o, int bytes);
+
+/**
+ * Records the end of the current operation.
+ * 
+ * @param o the node
+ */
+static void FlowProfileNode_End (FlowProfileNode *o);
+
+/**
+ * Returns the current time for profiling, in nanoseconds.
+ * 
+ * @return monotonic time in nanoseconds
+ */
+uint64_t FlowProfile_Now (void);
+
+/**
+ * Writes the graph of all registered interfaces.
+ * 
+ * @param f file to write to
+ * @param format FLOWPROFILE_FORMAT_DOT or FLOWPROFILE_FORMAT_JSON
+ * @return 1 on success, 0 on failure
+ */
+int FlowProfile_Dump (FILE *f, int format);
+
+void FlowProfileNode_SetName (FlowProfileNode *o, const char *name)
+{
+    ASSERT(name)
+    
+    o->name = name;
+}
+
+void FlowProfileNode_SetOwner (FlowProfileNode *o, const void *owner)
+{
+    o->owner = owner;
+}
+
+void FlowProfileNode_SetSender (FlowProfileNode *o, const void *sender)
+{
+    o->sender = sender;
+}
+
+void FlowProfileNode_Begin (FlowProfileNode *o, int bytes)
+{
+    ASSERT(!o->busy)
+    ASSERT(bytes >= 0)
+    
+    o->num_ops++;
+    o->num_bytes += bytes;
+    o->start_time = FlowProfile_Now();
+    o->busy = 1;
+}
+
+void FlowProfileNode_AddBytes (FlowProfileNode *o, int bytes)
+{
+    ASSERT(o->busy)
+    ASSERT(bytes >= 0)
+    
+    o->num_bytes += bytes;
+}
+
+void FlowProfileNode_End (FlowProfileNode *o)
+{
+    ASSERT(o->busy)
+    
+    uint64_t t = FlowProfile_Now() - o->start_time;
+    o->busy_time += t;
+    if (t > o->max_busy_time) {
+        o->max_busy_time = t;
+    }
+    o->busy = 0;
+}
+
+#endif
+
+#endif
@@ -0,0 +1,129 @@
+/**
+ * @file PacketChunk.h
+ * @author Psiphon Inc.
+ * 
+ * @section LICENSE
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ * @section DESCRIPTION
+ * 
+ * Reference-counted block of memory holding packets, allowing a packet to be
+ * passed on to other objects without copying it while the buffer it was
+ * received into is still being reused for further data.
+ */
+
+
+#ifndef BADVPN_FLOW_PACKETCHUNK_H
+#define BADVPN_FLOW_PACKETCHUNK_H
+
+#include <stdint.h>
+
+#include <misc/debug.h>
+#include <misc/BRefTarget.h>
+
+/**
+ * Reference-counted block of memory holding packets.
+ * The data immediately follows the structure.
+ */
+typedef struct {
+    BRefTarget ref_target;
+    int size;
+} PacketChunk;
+
+/**
+ * Allocates a chunk with a reference count of one.
+ *
+ * @param size size of the data area. Must be >=0.
+ * @return new chunk, or NULL on allocation failure
+ */
+PacketChunk * PacketChunk_New (int size);
+
+/**
+ * Returns a pointer to the data area of the chunk.
+ *
+ * @param o the chunk
+ * @return data area, {@link PacketChunk_Size} bytes long
+ */
+static uint8_t * PacketChunk_Data (PacketChunk *o);
+
+/**
+ * Returns the size of the data area of the chunk.
+ *
+ * @param o the chunk
+ * @return size of the data area
+ */
+static int PacketChunk_Size (PacketChunk *o);
+
+/**
+ * Adds a reference to the chunk.
+ *
+ * @param o the chunk
+ * @return 1 on success, 0 if the reference count would overflow
+ */
+static int PacketChunk_Ref (PacketChunk *o) WARN_UNUSED;
+
+/**
+ * Removes a reference to the chunk, freeing it when none are left.
+ *
+ * @param o the chunk
+ */
+static void PacketChunk_Deref (PacketChunk *o);
+
+/**
+ * Determines if anyone other than the caller holds a reference to the chunk.
+ * If not, the caller may reuse the whole data area.
+ *
+ * @param o the chunk
+ * @return 1 if the reference count is more than one, 0 if not
+ */
+static int PacketChunk_IsShared (PacketChunk *o);
+
+static uint8_t * PacketChunk_Data (PacketChunk *o)
+{
+    return (uint8_t *)(o + 1);
+}
+
+static int PacketChunk_Size (PacketChunk *o)
+{
+    return o->size;
+}
+
+static int PacketChunk_Ref (PacketChunk *o)
+{
+    return BRefTarget_Ref(&o->ref_target);
+}
+
+static void PacketChunk_Deref (PacketChunk *o)
+{
+    BRefTarget_Deref(&o->ref_target);
+}
+
+static int PacketChunk_IsShared (PacketChunk *o)
+{
+    ASSERT(o->ref_target.refcnt > 0)
+    
+    return (o->ref_target.refcnt > 1);
+}
+
+#endif
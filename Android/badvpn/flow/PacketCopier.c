@@ -96,6 +96,7 @@ void PacketCopier_Init (PacketCopier *o, int mtu, BPendingGroup *pg)
     
     // init input
     PacketPassInterface_Init(&o->input, mtu, (PacketPassInterface_handler_send)input_handler_send, o, pg);
+    PacketPassInterface_SetName(&o->input, "PacketCopier");
     PacketPassInterface_EnableCancel(&o->input, (PacketPassInterface_handler_requestcancel)input_handler_requestcancel);
     
     // init output
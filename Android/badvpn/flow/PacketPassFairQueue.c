@@ -306,6 +306,8 @@ void PacketPassFairQueueFlow_Init (PacketPassFairQueueFlow *flow, PacketPassFair
     
     // init input
     PacketPassInterface_Init(&flow->input, PacketPassInterface_GetMTU(flow->m->output), (PacketPassInterface_handler_send)input_handler_send, flow, m->pg);
+    PacketPassInterface_SetName(&flow->input, "PacketPassFairQueueFlow");
+    PacketPassInterface_SetOwner(&flow->input, m);
     
     // set time
     flow->time = 0;
@@ -171,6 +171,8 @@ void PacketPassFifoQueueFlow_Init (PacketPassFifoQueueFlow *o, PacketPassFifoQue
     
     // init input
     PacketPassInterface_Init(&o->input, PacketPassInterface_GetMTU(queue->output), (PacketPassInterface_handler_send)input_handler_send, o, queue->pg);
+    PacketPassInterface_SetName(&o->input, "PacketPassFifoQueueFlow");
+    PacketPassInterface_SetOwner(&o->input, queue);
     
     // set not waiting
     o->is_waiting = 0;
@@ -62,6 +62,10 @@ void _PacketPassInterface_job_done (PacketPassInterface *i)
     // set state
     i->state = PPI_STATE_NONE;
     
+    #ifdef BADVPN_FLOW_PROFILE
+    FlowProfileNode_End(&i->prof);
+    #endif
+    
     // call handler
     i->handler_done(i->user_user);
     return;
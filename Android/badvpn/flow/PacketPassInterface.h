@@ -40,6 +40,7 @@
 #include <misc/debug.h>
 #include <base/DebugObject.h>
 #include <base/BPending.h>
+#include <flow/FlowProfile.h>
 
 #define PPI_STATE_NONE 1
 #define PPI_STATE_OPERATION_PENDING 2
@@ -78,6 +79,10 @@ typedef struct {
     int state;
     int cancel_requested;
     
+    #ifdef BADVPN_FLOW_PROFILE
+    FlowProfileNode prof;
+    #endif
+    
     DebugObject d_obj;
 } PacketPassInterface;
 
@@ -91,6 +96,10 @@ static void PacketPassInterface_Done (PacketPassInterface *i);
 
 static int PacketPassInterface_GetMTU (PacketPassInterface *i);
 
+static void PacketPassInterface_SetName (PacketPassInterface *i, const char *name);
+
+static void PacketPassInterface_SetOwner (PacketPassInterface *i, const void *owner);
+
 static void PacketPassInterface_Sender_Init (PacketPassInterface *i, PacketPassInterface_handler_done handler_done, void *user);
 
 static void PacketPassInterface_Sender_Send (PacketPassInterface *i, uint8_t *data, int data_len);
@@ -124,6 +133,10 @@ void PacketPassInterface_Init (PacketPassInterface *i, int mtu, PacketPassInterf
     // set state
     i->state = PPI_STATE_NONE;
     
+    #ifdef BADVPN_FLOW_PROFILE
+    FlowProfileNode_Init(&i->prof, "PacketPassInterface", user);
+    #endif
+    
     DebugObject_Init(&i->d_obj);
 }
 
@@ -131,6 +144,10 @@ void PacketPassInterface_Free (PacketPassInterface *i)
 {
     DebugObject_Free(&i->d_obj);
     
+    #ifdef BADVPN_FLOW_PROFILE
+    FlowProfileNode_Free(&i->prof);
+    #endif
+    
     // free jobs
     BPending_Free(&i->job_done);
     BPending_Free(&i->job_requestcancel);
@@ -168,6 +185,25 @@ int PacketPassInterface_GetMTU (PacketPassInterface *i)
     return i->mtu;
 }
 
+void PacketPassInterface_SetName (PacketPassInterface *i, const char *name)
+{
+    ASSERT(name)
+    DebugObject_Access(&i->d_obj);
+    
+    #ifdef BADVPN_FLOW_PROFILE
+    FlowProfileNode_SetName(&i->prof, name);
+    #endif
+}
+
+void PacketPassInterface_SetOwner (PacketPassInterface *i, const void *owner)
+{
+    DebugObject_Access(&i->d_obj);
+    
+    #ifdef BADVPN_FLOW_PROFILE
+    FlowProfileNode_SetOwner(&i->prof, owner);
+    #endif
+}
+
 void PacketPassInterface_Sender_Init (PacketPassInterface *i, PacketPassInterface_handler_done handler_done, void *user)
 {
     ASSERT(handler_done)
@@ -176,6 +212,10 @@ void PacketPassInterface_Sender_Init (PacketPassInterface *i, PacketPassInterfac
     
     i->handler_done = handler_done;
     i->user_user = user;
+    
+    #ifdef BADVPN_FLOW_PROFILE
+    FlowProfileNode_SetSender(&i->prof, user);
+    #endif
 }
 
 void PacketPassInterface_Sender_Send (PacketPassInterface *i, uint8_t *data, int data_len)
@@ -195,6 +235,10 @@ void PacketPassInterface_Sender_Send (PacketPassInterface *i, uint8_t *data, int
     // set state
     i->state = PPI_STATE_OPERATION_PENDING;
     i->cancel_requested = 0;
+    
+    #ifdef BADVPN_FLOW_PROFILE
+    FlowProfileNode_Begin(&i->prof, data_len);
+    #endif
 }
 
 void PacketPassInterface_Sender_RequestCancel (PacketPassInterface *i)
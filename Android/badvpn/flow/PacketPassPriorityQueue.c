@@ -198,6 +198,8 @@ void PacketPassPriorityQueueFlow_Init (PacketPassPriorityQueueFlow *flow, Packet
     
     // init input
     PacketPassInterface_Init(&flow->input, PacketPassInterface_GetMTU(flow->m->output), (PacketPassInterface_handler_send)input_handler_send, flow, m->pg);
+    PacketPassInterface_SetName(&flow->input, "PacketPassPriorityQueueFlow");
+    PacketPassInterface_SetOwner(&flow->input, m);
     
     // is not queued
     flow->is_queued = 0;
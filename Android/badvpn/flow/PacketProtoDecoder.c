@@ -29,6 +29,7 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
 
 #include <misc/debug.h>
 #include <misc/byteorder.h>
@@ -39,10 +40,36 @@
 
 #include <generated/blog_channel_PacketProtoDecoder.h>
 
+static int init_common (PacketProtoDecoder *enc, StreamRecvInterface *input, PacketPassInterface *output, int chunk_packets, BPendingGroup *pg, void *user, PacketProtoDecoder_handler_error handler_error);
+static int move_to_front (PacketProtoDecoder *enc);
 static void process_data (PacketProtoDecoder *enc);
 static void input_handler_done (PacketProtoDecoder *enc, int data_len);
 static void output_handler_done (PacketProtoDecoder *enc);
 
+int move_to_front (PacketProtoDecoder *enc)
+{
+    ASSERT(enc->buf_start > 0)
+    
+    if (enc->chunk && PacketChunk_IsShared(enc->chunk)) {
+        // someone still references packets in the chunk, continue in a new one
+        PacketChunk *chunk = PacketChunk_New(enc->buf_size);
+        if (!chunk) {
+            BLog(BLOG_ERROR, "failed to allocate chunk");
+            return 0;
+        }
+        memcpy(PacketChunk_Data(chunk), enc->buf + enc->buf_start, enc->buf_used);
+        PacketChunk_Deref(enc->chunk);
+        enc->chunk = chunk;
+        enc->buf = PacketChunk_Data(chunk);
+    } else {
+        memmove(enc->buf, enc->buf + enc->buf_start, enc->buf_used);
+    }
+    
+    enc->buf_start = 0;
+    
+    return 1;
+}
+
 void process_data (PacketProtoDecoder *enc)
 {
     int was_error = 0;
@@ -83,17 +110,22 @@ void process_data (PacketProtoDecoder *enc)
     } while (0);
     
     if (was_error) {
-        // reset buffer
-        enc->buf_start = 0;
+        // reset buffer, but don't overwrite packets in a chunk someone else references
         enc->buf_used = 0;
-    } else {
-        // if we reached the end of the buffer, wrap around to allow more data to be received
-        if (enc->buf_start + enc->buf_used == enc->buf_size) {
-            memmove(enc->buf, enc->buf + enc->buf_start, enc->buf_used);
+        if (!enc->chunk || !PacketChunk_IsShared(enc->chunk)) {
             enc->buf_start = 0;
         }
     }
     
+    // if we reached the end of the buffer, wrap around to allow more data to be received
+    if (enc->buf_start + enc->buf_used == enc->buf_size) {
+        if (!move_to_front(enc)) {
+            // stop receiving, we must be freed
+            enc->handler_error(enc->user);
+            return;
+        }
+    }
+    
     // receive data
     StreamRecvInterface_Receiver_Recv(enc->input, enc->buf + (enc->buf_start + enc->buf_used), enc->buf_size - (enc->buf_start + enc->buf_used));
     
@@ -127,7 +159,7 @@ void output_handler_done (PacketProtoDecoder *enc)
     return;
 }
 
-int PacketProtoDecoder_Init (PacketProtoDecoder *enc, StreamRecvInterface *input, PacketPassInterface *output, BPendingGroup *pg, void *user, PacketProtoDecoder_handler_error handler_error)
+int init_common (PacketProtoDecoder *enc, StreamRecvInterface *input, PacketPassInterface *output, int chunk_packets, BPendingGroup *pg, void *user, PacketProtoDecoder_handler_error handler_error)
 {
     // init arguments
     enc->input = input;
@@ -150,8 +182,20 @@ int PacketProtoDecoder_Init (PacketProtoDecoder *enc, StreamRecvInterface *input
     enc->buf_used = 0;
     
     // allocate buffer
-    if (!(enc->buf = (uint8_t *)malloc(enc->buf_size))) {
-        goto fail0;
+    if (chunk_packets > 0) {
+        if (enc->buf_size > INT_MAX / chunk_packets) {
+            goto fail0;
+        }
+        enc->buf_size *= chunk_packets;
+        if (!(enc->chunk = PacketChunk_New(enc->buf_size))) {
+            goto fail0;
+        }
+        enc->buf = PacketChunk_Data(enc->chunk);
+    } else {
+        enc->chunk = NULL;
+        if (!(enc->buf = (uint8_t *)malloc(enc->buf_size))) {
+            goto fail0;
+        }
     }
     
     // start receiving
@@ -165,12 +209,28 @@ fail0:
     return 0;
 }
 
+int PacketProtoDecoder_Init (PacketProtoDecoder *enc, StreamRecvInterface *input, PacketPassInterface *output, BPendingGroup *pg, void *user, PacketProtoDecoder_handler_error handler_error)
+{
+    return init_common(enc, input, output, 0, pg, user, handler_error);
+}
+
+int PacketProtoDecoder_InitChunked (PacketProtoDecoder *enc, StreamRecvInterface *input, PacketPassInterface *output, int chunk_packets, BPendingGroup *pg, void *user, PacketProtoDecoder_handler_error handler_error)
+{
+    ASSERT(chunk_packets > 0)
+    
+    return init_common(enc, input, output, chunk_packets, pg, user, handler_error);
+}
+
 void PacketProtoDecoder_Free (PacketProtoDecoder *enc)
 {
     DebugObject_Free(&enc->d_obj);
     
     // free buffer
-    free(enc->buf);
+    if (enc->chunk) {
+        PacketChunk_Deref(enc->chunk);
+    } else {
+        free(enc->buf);
+    }
 }
 
 void PacketProtoDecoder_Reset (PacketProtoDecoder *enc)
@@ -180,3 +240,11 @@ void PacketProtoDecoder_Reset (PacketProtoDecoder *enc)
     enc->buf_start += enc->buf_used;
     enc->buf_used = 0;
 }
+
+PacketChunk * PacketProtoDecoder_GetChunk (PacketProtoDecoder *enc)
+{
+    ASSERT(enc->chunk)
+    DebugObject_Access(&enc->d_obj);
+    
+    return enc->chunk;
+}
@@ -29,6 +29,10 @@
  * @section DESCRIPTION
  * 
  * Object which decodes a stream according to PacketProto.
+ * 
+ * Optionally, data can be received into reference-counted {@link PacketChunk}s,
+ * which allows the receiver of the output to keep a reference to packets
+ * after it has accepted them, without copying them.
  */
 
 #ifndef BADVPN_FLOW_PACKETPROTODECODER_H
@@ -41,10 +45,13 @@
 #include <base/DebugObject.h>
 #include <flow/StreamRecvInterface.h>
 #include <flow/PacketPassInterface.h>
+#include <flow/PacketChunk.h>
 
 /**
  * Handler called when a protocol error occurs.
  * When an error occurs, the decoder is reset to the initial state.
+ * In chunked mode, this is also called when a new chunk cannot be allocated;
+ * the decoder then stops receiving and must be freed.
  * 
  * @param user as in {@link PacketProtoDecoder_Init}
  */
@@ -60,6 +67,7 @@ typedef struct {
     int buf_start;
     int buf_used;
     uint8_t *buf;
+    PacketChunk *chunk;
     DebugObject d_obj;
 } PacketProtoDecoder;
 
@@ -77,6 +85,25 @@ typedef struct {
  */
 int PacketProtoDecoder_Init (PacketProtoDecoder *enc, StreamRecvInterface *input, PacketPassInterface *output, BPendingGroup *pg, void *user, PacketProtoDecoder_handler_error handler_error) WARN_UNUSED;
 
+/**
+ * Initializes the object in chunked mode.
+ * Data is received into {@link PacketChunk}s large enough for the given number of
+ * packets of maximum size. When the end of a chunk is reached and someone else still
+ * holds a reference to it, a new chunk is allocated, so that referenced packets are
+ * never overwritten.
+ *
+ * @param enc the object
+ * @param input input interface. The decoder will accept packets with payload size up to its MTU
+ *              (but the payload can never be more than PACKETPROTO_MAXPAYLOAD).
+ * @param output output interface
+ * @param chunk_packets number of maximum size encoded packets fitting in a chunk. Must be >0.
+ * @param pg pending group
+ * @param user argument to handlers
+ * @param handler_error error handler
+ * @return 1 on success, 0 on failure
+ */
+int PacketProtoDecoder_InitChunked (PacketProtoDecoder *enc, StreamRecvInterface *input, PacketPassInterface *output, int chunk_packets, BPendingGroup *pg, void *user, PacketProtoDecoder_handler_error handler_error) WARN_UNUSED;
+
 /**
  * Frees the object.
  *
@@ -93,4 +120,18 @@ void PacketProtoDecoder_Free (PacketProtoDecoder *enc);
  */
 void PacketProtoDecoder_Reset (PacketProtoDecoder *enc);
 
+/**
+ * Returns the chunk holding the packet being passed to the output.
+ * The decoder must have been initialized with {@link PacketProtoDecoder_InitChunked},
+ * and a packet must be being passed to the output, i.e. this can be called from
+ * within the output's send handler.
+ * The packet data, including the PacketProto header preceding it, lies within the
+ * chunk. The caller may take a reference to the chunk to keep the packet, and
+ * may modify the packet and its header in place.
+ *
+ * @param enc the object
+ * @return chunk holding the current packet
+ */
+PacketChunk * PacketProtoDecoder_GetChunk (PacketProtoDecoder *enc);
+
 #endif
@@ -41,6 +41,7 @@ int PacketProtoFlow_Init (PacketProtoFlow *o, int input_mtu, int num_packets, Pa
     
     // init async input
     BufferWriter_Init(&o->ainput, input_mtu, pg);
+    o->have_ainput = 1;
     
     // init encoder
     PacketProtoEncoder_Init(&o->encoder, BufferWriter_GetOutput(&o->ainput), pg);
@@ -60,6 +61,32 @@ fail0:
     return 0;
 }
 
+int PacketProtoFlow_InitRecv (PacketProtoFlow *o, PacketRecvInterface *input, int num_packets, PacketPassInterface *output, BPendingGroup *pg)
+{
+    ASSERT(PacketRecvInterface_GetMTU(input) <= PACKETPROTO_MAXPAYLOAD)
+    ASSERT(num_packets > 0)
+    ASSERT(PacketPassInterface_GetMTU(output) >= PACKETPROTO_ENCLEN(PacketRecvInterface_GetMTU(input)))
+    
+    // set no async input
+    o->have_ainput = 0;
+    
+    // init encoder
+    PacketProtoEncoder_Init(&o->encoder, input, pg);
+    
+    // init buffer
+    if (!PacketBuffer_Init(&o->buffer, PacketProtoEncoder_GetOutput(&o->encoder), output, num_packets, pg)) {
+        goto fail0;
+    }
+    
+    DebugObject_Init(&o->d_obj);
+    
+    return 1;
+    
+fail0:
+    PacketProtoEncoder_Free(&o->encoder);
+    return 0;
+}
+
 void PacketProtoFlow_Free (PacketProtoFlow *o)
 {
     DebugObject_Free(&o->d_obj);
@@ -71,11 +98,14 @@ void PacketProtoFlow_Free (PacketProtoFlow *o)
     PacketProtoEncoder_Free(&o->encoder);
     
     // free async input
-    BufferWriter_Free(&o->ainput);
+    if (o->have_ainput) {
+        BufferWriter_Free(&o->ainput);
+    }
 }
 
 BufferWriter * PacketProtoFlow_GetInput (PacketProtoFlow *o)
 {
+    ASSERT(o->have_ainput)
     DebugObject_Access(&o->d_obj);
     
     return &o->ainput;
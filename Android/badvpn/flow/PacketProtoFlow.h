@@ -30,6 +30,8 @@
  * 
  * Buffer which encodes packets with PacketProto, with {@link BufferWriter}
  * input and {@link PacketPassInterface} output.
+ * Alternatively, the input can be a {@link PacketRecvInterface}, which receives
+ * packets directly into the buffer.
  */
 
 #ifndef BADVPN_FLOW_PACKETPROTOFLOW_H
@@ -48,6 +50,7 @@
  */
 typedef struct {
     BufferWriter ainput;
+    int have_ainput;
     PacketProtoEncoder encoder;
     PacketBuffer buffer;
     DebugObject d_obj;
@@ -65,6 +68,23 @@ typedef struct {
  */
 int PacketProtoFlow_Init (PacketProtoFlow *o, int input_mtu, int num_packets, PacketPassInterface *output, BPendingGroup *pg) WARN_UNUSED;
 
+/**
+ * Initializes the object with a {@link PacketRecvInterface} input instead of
+ * a {@link BufferWriter}.
+ * The input receives packets directly into the buffer, after the space reserved
+ * for the PacketProto header, so they are not copied. The input is also free to
+ * write its own headers in front of the payload, within the packet it returns.
+ * {@link PacketProtoFlow_GetInput} must not be called.
+ * 
+ * @param o the object
+ * @param input input interface. Its MTU must be <=PACKETPROTO_MAXPAYLOAD.
+ * @param num_packets minimum number of packets the buffer should hold. Must be >0.
+ * @param output output interface. Its MTU must be >=PACKETPROTO_ENCLEN(input MTU).
+ * @param pg pending group
+ * @return 1 on success, 0 on failure
+ */
+int PacketProtoFlow_InitRecv (PacketProtoFlow *o, PacketRecvInterface *input, int num_packets, PacketPassInterface *output, BPendingGroup *pg) WARN_UNUSED;
+
 /**
  * Frees the object.
  * 
@@ -74,6 +94,7 @@ void PacketProtoFlow_Free (PacketProtoFlow *o);
 
 /**
  * Returns the input interface.
+ * The object must have been initialized with {@link PacketProtoFlow_Init}.
  * 
  * @param o the object
  * @return input interface
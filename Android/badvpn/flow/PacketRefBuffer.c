@@ -0,0 +1,122 @@
+/**
+ * @file PacketRefBuffer.c
+ * @author Psiphon Inc.
+ * 
+ * @section LICENSE
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ */
+
+
+#include <stdlib.h>
+
+#include <misc/debug.h>
+#include <misc/balloc.h>
+
+#include <flow/PacketRefBuffer.h>
+
+static void output_handler_done (PacketRefBuffer *o)
+{
+    ASSERT(o->used > 0)
+    DebugObject_Access(&o->d_obj);
+    
+    // release the sent packet
+    PacketChunk_Deref(o->entries[o->start].chunk);
+    o->start = (o->start + 1) % o->num_packets;
+    o->used--;
+    
+    // send the next packet
+    if (o->used > 0) {
+        struct PacketRefBuffer_entry *e = &o->entries[o->start];
+        PacketPassInterface_Sender_Send(o->output, e->data, e->len);
+    }
+}
+
+int PacketRefBuffer_Init (PacketRefBuffer *o, PacketPassInterface *output, int num_packets)
+{
+    ASSERT(num_packets > 0)
+    
+    // init arguments
+    o->output = output;
+    o->num_packets = num_packets;
+    
+    // allocate entries
+    if (!(o->entries = (struct PacketRefBuffer_entry *)BAllocArray(num_packets, sizeof(o->entries[0])))) {
+        return 0;
+    }
+    
+    // init output
+    PacketPassInterface_Sender_Init(o->output, (PacketPassInterface_handler_done)output_handler_done, o);
+    
+    // set no packets
+    o->start = 0;
+    o->used = 0;
+    
+    DebugObject_Init(&o->d_obj);
+    
+    return 1;
+}
+
+void PacketRefBuffer_Free (PacketRefBuffer *o)
+{
+    DebugObject_Free(&o->d_obj);
+    
+    // release packets
+    for (int i = 0; i < o->used; i++) {
+        PacketChunk_Deref(o->entries[(o->start + i) % o->num_packets].chunk);
+    }
+    
+    // free entries
+    BFree(o->entries);
+}
+
+int PacketRefBuffer_Push (PacketRefBuffer *o, PacketChunk *chunk, uint8_t *data, int len)
+{
+    ASSERT(data >= PacketChunk_Data(chunk))
+    ASSERT(len >= 0)
+    ASSERT(len <= PacketChunk_Size(chunk) - (data - PacketChunk_Data(chunk)))
+    ASSERT(len <= PacketPassInterface_GetMTU(o->output))
+    DebugObject_Access(&o->d_obj);
+    
+    if (o->used == o->num_packets) {
+        return 0;
+    }
+    
+    if (!PacketChunk_Ref(chunk)) {
+        return 0;
+    }
+    
+    struct PacketRefBuffer_entry *e = &o->entries[(o->start + o->used) % o->num_packets];
+    e->chunk = chunk;
+    e->data = data;
+    e->len = len;
+    o->used++;
+    
+    // start sending if we were idle
+    if (o->used == 1) {
+        PacketPassInterface_Sender_Send(o->output, e->data, e->len);
+    }
+    
+    return 1;
+}
@@ -0,0 +1,99 @@
+/**
+ * @file PacketRefBuffer.h
+ * @author Psiphon Inc.
+ * 
+ * @section LICENSE
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ * @section DESCRIPTION
+ * 
+ * Packet buffer with {@link PacketPassInterface} output which stores references
+ * to packets residing in {@link PacketChunk}s instead of copies of them.
+ */
+
+
+#ifndef BADVPN_FLOW_PACKETREFBUFFER_H
+#define BADVPN_FLOW_PACKETREFBUFFER_H
+
+#include <stdint.h>
+
+#include <misc/debug.h>
+#include <base/DebugObject.h>
+#include <flow/PacketPassInterface.h>
+#include <flow/PacketChunk.h>
+
+struct PacketRefBuffer_entry {
+    PacketChunk *chunk;
+    uint8_t *data;
+    int len;
+};
+
+/**
+ * Packet buffer with {@link PacketPassInterface} output which stores references
+ * to packets residing in {@link PacketChunk}s instead of copies of them.
+ * Packets are passed to the output directly from their chunks, and the references
+ * are released once the output has accepted them.
+ */
+typedef struct {
+    PacketPassInterface *output;
+    int num_packets;
+    struct PacketRefBuffer_entry *entries;
+    int start;
+    int used;
+    DebugObject d_obj;
+} PacketRefBuffer;
+
+/**
+ * Initializes the object.
+ *
+ * @param o the object
+ * @param output output interface
+ * @param num_packets maximum number of packets the buffer can hold. Must be >0.
+ * @return 1 on success, 0 on failure
+ */
+int PacketRefBuffer_Init (PacketRefBuffer *o, PacketPassInterface *output, int num_packets) WARN_UNUSED;
+
+/**
+ * Frees the object, releasing references to all buffered packets.
+ * The output must not be using the current packet any more, i.e. it must not be
+ * in the middle of sending, unless it is being freed as well.
+ *
+ * @param o the object
+ */
+void PacketRefBuffer_Free (PacketRefBuffer *o);
+
+/**
+ * Appends a packet to the buffer, taking a reference to its chunk.
+ * The packet must not be modified until it has been sent, i.e. until the
+ * chunk is no longer referenced by the buffer.
+ *
+ * @param o the object
+ * @param chunk chunk holding the packet
+ * @param data packet data, lying within the chunk's data area
+ * @param len packet length. Must be >=0 and <= output MTU.
+ * @return 1 on success, 0 if the buffer is full or a reference could not be taken
+ */
+int PacketRefBuffer_Push (PacketRefBuffer *o, PacketChunk *chunk, uint8_t *data, int len) WARN_UNUSED;
+
+#endif
@@ -38,7 +38,11 @@ void _StreamPassInterface_job_operation (StreamPassInterface *i)
     i->state = SPI_STATE_BUSY;
     
     // call handler
-    i->handler_operation(i->user_provider, i->job_operation_data, i->job_operation_len);
+    if (i->job_operation_bufs) {
+        i->handler_operation_vec(i->user_provider, i->job_operation_bufs, i->job_operation_num_bufs);
+    } else {
+        i->handler_operation(i->user_provider, i->job_operation_data, i->job_operation_len);
+    }
     return;
 }
 
@@ -50,6 +54,11 @@ void _StreamPassInterface_job_done (StreamPassInterface *i)
     // set state
     i->state = SPI_STATE_NONE;
     
+    #ifdef BADVPN_FLOW_PROFILE
+    FlowProfileNode_AddBytes(&i->prof, i->job_done_len);
+    FlowProfileNode_End(&i->prof);
+    #endif
+    
     // call handler
     i->handler_done(i->user_user, i->job_done_len);
     return;
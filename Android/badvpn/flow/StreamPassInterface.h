@@ -33,7 +33,8 @@
  * Note that this interface behaves exactly the same and has the same code as
  * {@link StreamRecvInterface} if names and its external semantics are disregarded.
  * If you modify this file, you should probably modify {@link StreamRecvInterface}
- * too.
+ * too. The exception is the optional scatter-gather operation, which only exists
+ * here.
  */
 
 #ifndef BADVPN_FLOW_STREAMPASSINTERFACE_H
@@ -41,23 +42,36 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include <limits.h>
 
 #include <misc/debug.h>
 #include <base/DebugObject.h>
 #include <base/BPending.h>
+#include <flow/FlowProfile.h>
 
 #define SPI_STATE_NONE 1
 #define SPI_STATE_OPERATION_PENDING 2
 #define SPI_STATE_BUSY 3
 #define SPI_STATE_DONE_PENDING 4
 
+// maximum number of buffers in a scatter-gather operation
+#define SPI_MAX_BUFS 8
+
+struct StreamPassInterface_buf {
+    uint8_t *data;
+    int len;
+};
+
 typedef void (*StreamPassInterface_handler_send) (void *user, uint8_t *data, int data_len);
 
+typedef void (*StreamPassInterface_handler_send_vec) (void *user, const struct StreamPassInterface_buf *bufs, int num_bufs);
+
 typedef void (*StreamPassInterface_handler_done) (void *user, int data_len);
 
 typedef struct {
     // provider data
     StreamPassInterface_handler_send handler_operation;
+    StreamPassInterface_handler_send_vec handler_operation_vec;
     void *user_provider;
     
     // user data
@@ -68,6 +82,8 @@ typedef struct {
     BPending job_operation;
     uint8_t *job_operation_data;
     int job_operation_len;
+    const struct StreamPassInterface_buf *job_operation_bufs;
+    int job_operation_num_bufs;
     
     // done job
     BPending job_done;
@@ -76,6 +92,10 @@ typedef struct {
     // state
     int state;
     
+    #ifdef BADVPN_FLOW_PROFILE
+    FlowProfileNode prof;
+    #endif
+    
     DebugObject d_obj;
 } StreamPassInterface;
 
@@ -83,12 +103,20 @@ static void StreamPassInterface_Init (StreamPassInterface *i, StreamPassInterfac
 
 static void StreamPassInterface_Free (StreamPassInterface *i);
 
+static void StreamPassInterface_EnableVec (StreamPassInterface *i, StreamPassInterface_handler_send_vec handler_operation_vec);
+
+static int StreamPassInterface_HasVec (StreamPassInterface *i);
+
+static void StreamPassInterface_SetName (StreamPassInterface *i, const char *name);
+
 static void StreamPassInterface_Done (StreamPassInterface *i, int data_len);
 
 static void StreamPassInterface_Sender_Init (StreamPassInterface *i, StreamPassInterface_handler_done handler_done, void *user);
 
 static void StreamPassInterface_Sender_Send (StreamPassInterface *i, uint8_t *data, int data_len);
 
+static void StreamPassInterface_Sender_SendVec (StreamPassInterface *i, const struct StreamPassInterface_buf *bufs, int num_bufs);
+
 void _StreamPassInterface_job_operation (StreamPassInterface *i);
 void _StreamPassInterface_job_done (StreamPassInterface *i);
 
@@ -98,6 +126,9 @@ void StreamPassInterface_Init (StreamPassInterface *i, StreamPassInterface_handl
     i->handler_operation = handler_operation;
     i->user_provider = user;
     
+    // set no scatter-gather support
+    i->handler_operation_vec = NULL;
+    
     // set no user
     i->handler_done = NULL;
     
@@ -108,6 +139,10 @@ void StreamPassInterface_Init (StreamPassInterface *i, StreamPassInterface_handl
     // set state
     i->state = SPI_STATE_NONE;
     
+    #ifdef BADVPN_FLOW_PROFILE
+    FlowProfileNode_Init(&i->prof, "StreamPassInterface", user);
+    #endif
+    
     DebugObject_Init(&i->d_obj);
 }
 
@@ -115,11 +150,42 @@ void StreamPassInterface_Free (StreamPassInterface *i)
 {
     DebugObject_Free(&i->d_obj);
     
+    #ifdef BADVPN_FLOW_PROFILE
+    FlowProfileNode_Free(&i->prof);
+    #endif
+    
     // free jobs
     BPending_Free(&i->job_done);
     BPending_Free(&i->job_operation);
 }
 
+void StreamPassInterface_EnableVec (StreamPassInterface *i, StreamPassInterface_handler_send_vec handler_operation_vec)
+{
+    ASSERT(handler_operation_vec)
+    ASSERT(!i->handler_operation_vec)
+    ASSERT(!i->handler_done)
+    DebugObject_Access(&i->d_obj);
+    
+    i->handler_operation_vec = handler_operation_vec;
+}
+
+int StreamPassInterface_HasVec (StreamPassInterface *i)
+{
+    DebugObject_Access(&i->d_obj);
+    
+    return !!i->handler_operation_vec;
+}
+
+void StreamPassInterface_SetName (StreamPassInterface *i, const char *name)
+{
+    ASSERT(name)
+    DebugObject_Access(&i->d_obj);
+    
+    #ifdef BADVPN_FLOW_PROFILE
+    FlowProfileNode_SetName(&i->prof, name);
+    #endif
+}
+
 void StreamPassInterface_Done (StreamPassInterface *i, int data_len)
 {
     ASSERT(i->state == SPI_STATE_BUSY)
@@ -143,6 +209,10 @@ void StreamPassInterface_Sender_Init (StreamPassInterface *i, StreamPassInterfac
     
     i->handler_done = handler_done;
     i->user_user = user;
+    
+    #ifdef BADVPN_FLOW_PROFILE
+    FlowProfileNode_SetSender(&i->prof, user);
+    #endif
 }
 
 void StreamPassInterface_Sender_Send (StreamPassInterface *i, uint8_t *data, int data_len)
@@ -156,10 +226,48 @@ void StreamPassInterface_Sender_Send (StreamPassInterface *i, uint8_t *data, int
     // schedule operation
     i->job_operation_data = data;
     i->job_operation_len = data_len;
+    i->job_operation_bufs = NULL;
     BPending_Set(&i->job_operation);
     
     // set state
     i->state = SPI_STATE_OPERATION_PENDING;
+    
+    #ifdef BADVPN_FLOW_PROFILE
+    FlowProfileNode_Begin(&i->prof, 0);
+    #endif
+}
+
+void StreamPassInterface_Sender_SendVec (StreamPassInterface *i, const struct StreamPassInterface_buf *bufs, int num_bufs)
+{
+    ASSERT(i->handler_operation_vec)
+    ASSERT(bufs)
+    ASSERT(num_bufs > 0)
+    ASSERT(num_bufs <= SPI_MAX_BUFS)
+    ASSERT(i->state == SPI_STATE_NONE)
+    ASSERT(i->handler_done)
+    DebugObject_Access(&i->d_obj);
+    
+    // compute total length
+    int total = 0;
+    for (int j = 0; j < num_bufs; j++) {
+        ASSERT(bufs[j].data)
+        ASSERT(bufs[j].len > 0)
+        ASSERT(bufs[j].len <= INT_MAX - total)
+        total += bufs[j].len;
+    }
+    
+    // schedule operation
+    i->job_operation_len = total;
+    i->job_operation_bufs = bufs;
+    i->job_operation_num_bufs = num_bufs;
+    BPending_Set(&i->job_operation);
+    
+    // set state
+    i->state = SPI_STATE_OPERATION_PENDING;
+    
+    #ifdef BADVPN_FLOW_PROFILE
+    FlowProfileNode_Begin(&i->prof, 0);
+    #endif
 }
 
 #endif
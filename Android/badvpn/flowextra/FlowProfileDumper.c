@@ -0,0 +1,139 @@
+/**
+ * @file FlowProfileDumper.c
+ * @author Psiphon Inc.
+ * 
+ * @section LICENSE
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <misc/debug.h>
+#include <misc/concat_strings.h>
+#include <base/BLog.h>
+#include <flow/FlowProfile.h>
+
+#include <flowextra/FlowProfileDumper.h>
+
+#include <generated/blog_channel_FlowProfileDumper.h>
+
+#if defined(BADVPN_FLOW_PROFILE) && !defined(BADVPN_USE_WINAPI)
+
+static int ends_with (const char *str, const char *suffix)
+{
+    size_t str_len = strlen(str);
+    size_t suffix_len = strlen(suffix);
+    
+    return (str_len >= suffix_len && !strcmp(str + str_len - suffix_len, suffix));
+}
+
+static void dump (FlowProfileDumper *o)
+{
+    char *tmp_path = concat_strings(2, o->path, ".tmp");
+    if (!tmp_path) {
+        BLog(BLOG_ERROR, "concat_strings failed");
+        goto fail0;
+    }
+    
+    FILE *f = fopen(tmp_path, "w");
+    if (!f) {
+        BLog(BLOG_ERROR, "failed to open %s", tmp_path);
+        goto fail1;
+    }
+    
+    int res = FlowProfile_Dump(f, o->format);
+    
+    if (fclose(f) != 0 || !res) {
+        BLog(BLOG_ERROR, "failed to write %s", tmp_path);
+        remove(tmp_path);
+        goto fail1;
+    }
+    
+    if (rename(tmp_path, o->path) != 0) {
+        BLog(BLOG_ERROR, "failed to rename %s to %s", tmp_path, o->path);
+        remove(tmp_path);
+        goto fail1;
+    }
+    
+    BLog(BLOG_NOTICE, "flow profile written to %s", o->path);
+    
+fail1:
+    free(tmp_path);
+fail0:
+    return;
+}
+
+static void signal_handler (FlowProfileDumper *o, int signo)
+{
+    DebugObject_Access(&o->d_obj);
+    ASSERT(signo == SIGUSR1)
+    
+    dump(o);
+}
+
+#endif
+
+int FlowProfileDumper_Init (FlowProfileDumper *o, BReactor *reactor, const char *path)
+{
+    ASSERT(path)
+    
+#ifndef BADVPN_FLOW_PROFILE
+    BLog(BLOG_ERROR, "not built with flow profiling (FLOW_PROFILE)");
+    return 0;
+#elif defined(BADVPN_USE_WINAPI)
+    BLog(BLOG_ERROR, "flow profile dumping is not supported on this platform");
+    return 0;
+#else
+    // init arguments
+    o->path = path;
+    
+    // choose format
+    o->format = ends_with(path, ".json") ? FLOWPROFILE_FORMAT_JSON : FLOWPROFILE_FORMAT_DOT;
+    
+    // handle SIGUSR1
+    sigset_t sset;
+    sigemptyset(&sset);
+    sigaddset(&sset, SIGUSR1);
+    if (!BUnixSignal_Init(&o->signal, reactor, sset, (BUnixSignal_handler)signal_handler, o)) {
+        BLog(BLOG_ERROR, "BUnixSignal_Init failed");
+        return 0;
+    }
+    
+    DebugObject_Init(&o->d_obj);
+    
+    return 1;
+#endif
+}
+
+void FlowProfileDumper_Free (FlowProfileDumper *o)
+{
+    DebugObject_Free(&o->d_obj);
+    
+#if defined(BADVPN_FLOW_PROFILE) && !defined(BADVPN_USE_WINAPI)
+    // free signal
+    BUnixSignal_Free(&o->signal, 0);
+#endif
+}
@@ -0,0 +1,82 @@
+/**
+ * @file FlowProfileDumper.h
+ * @author Psiphon Inc.
+ * 
+ * @section LICENSE
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ * @section DESCRIPTION
+ * 
+ * Object which writes the flow interface graph (see {@link FlowProfile.h}) to
+ * a file whenever SIGUSR1 is received.
+ */
+
+#ifndef BADVPN_FLOWPROFILEDUMPER_H
+#define BADVPN_FLOWPROFILEDUMPER_H
+
+#include <misc/debug.h>
+#include <base/DebugObject.h>
+#include <system/BReactor.h>
+
+#ifndef BADVPN_USE_WINAPI
+#include <system/BUnixSignal.h>
+#endif
+
+/**
+ * Object which writes the flow interface graph to a file whenever SIGUSR1
+ * is received.
+ * The graph is written in JSON if the file name ends with ".json", and in
+ * Graphviz DOT format otherwise. It is written to a temporary file first,
+ * which is then renamed over the target.
+ */
+typedef struct {
+    const char *path;
+    int format;
+    #ifndef BADVPN_USE_WINAPI
+    BUnixSignal signal;
+    #endif
+    DebugObject d_obj;
+} FlowProfileDumper;
+
+/**
+ * Initializes the object.
+ * Fails if the program was not built with the FLOW_PROFILE option, or if
+ * signals are not supported on this platform.
+ * {@link BLog_Init} must have been done.
+ * 
+ * @param o the object
+ * @param reactor reactor we live in
+ * @param path file to write the graph to. Must remain valid as long as the object.
+ * @return 1 on success, 0 on failure
+ */
+int FlowProfileDumper_Init (FlowProfileDumper *o, BReactor *reactor, const char *path) WARN_UNUSED;
+
+/**
+ * Frees the object.
+ * 
+ * @param o the object
+ */
+void FlowProfileDumper_Free (FlowProfileDumper *o);
+
+#endif
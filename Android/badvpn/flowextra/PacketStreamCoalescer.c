@@ -0,0 +1,248 @@
+/**
+ * @file PacketStreamCoalescer.c
+ * @author Psiphon Inc.
+ * 
+ * @section LICENSE
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <string.h>
+
+#include <misc/debug.h>
+#include <misc/balloc.h>
+#include <misc/minmax.h>
+
+#include <flowextra/PacketStreamCoalescer.h>
+
+static void start_sending (PacketStreamCoalescer *o)
+{
+    ASSERT(!o->sending)
+    
+    int n = 0;
+    
+    // buffered data goes first
+    o->sending_buf_len = o->buf_end - o->buf_start;
+    if (o->sending_buf_len > 0) {
+        o->bufs[n].data = o->buf + o->buf_start;
+        o->bufs[n].len = o->sending_buf_len;
+        n++;
+    }
+    
+    // then the held packet, together if possible
+    if (o->held && (n == 0 || StreamPassInterface_HasVec(o->output))) {
+        ASSERT(o->held_used < o->held_len)
+        o->bufs[n].data = o->held + o->held_used;
+        o->bufs[n].len = o->held_len - o->held_used;
+        n++;
+    }
+    
+    if (n == 0) {
+        return;
+    }
+    
+    // everything is being sent, no need to flush
+    BPending_Unset(&o->flush_job);
+    BReactor_RemoveTimer(o->reactor, &o->flush_timer);
+    
+    o->sending = 1;
+    
+    if (n == 1) {
+        StreamPassInterface_Sender_Send(o->output, o->bufs[0].data, o->bufs[0].len);
+    } else {
+        StreamPassInterface_Sender_SendVec(o->output, o->bufs, n);
+    }
+}
+
+static void schedule_flush (PacketStreamCoalescer *o)
+{
+    ASSERT(!o->sending)
+    ASSERT(o->buf_end > o->buf_start)
+    
+    if (o->max_delay > 0) {
+        if (!BTimer_IsRunning(&o->flush_timer)) {
+            BReactor_SetTimerAfter(o->reactor, &o->flush_timer, o->max_delay);
+        }
+    } else {
+        // Jobs execute in LIFO order, so any jobs set as a result of accepting
+        // the input packet, including the input providing another one, run
+        // before this one.
+        if (!BPending_IsSet(&o->flush_job)) {
+            BPending_Set(&o->flush_job);
+        }
+    }
+}
+
+static void input_handler_send (PacketStreamCoalescer *o, uint8_t *data, int data_len)
+{
+    ASSERT(!o->held)
+    ASSERT(data_len >= 0)
+    DebugObject_Access(&o->d_obj);
+    
+    if (data_len == 0) {
+        PacketPassInterface_Done(&o->input);
+        return;
+    }
+    
+    // make the whole buffer available if we're not sending from it
+    if (!o->sending && o->buf_start > 0) {
+        memmove(o->buf, o->buf + o->buf_start, o->buf_end - o->buf_start);
+        o->buf_end -= o->buf_start;
+        o->buf_start = 0;
+    }
+    
+    if (data_len <= o->buf_size - o->buf_end) {
+        // copy to buffer and accept the packet
+        memcpy(o->buf + o->buf_end, data, data_len);
+        o->buf_end += data_len;
+        PacketPassInterface_Done(&o->input);
+        
+        // if sending, the rest will go out when it's done
+        if (!o->sending) {
+            if (o->buf_end == o->buf_size) {
+                start_sending(o);
+            } else {
+                schedule_flush(o);
+            }
+        }
+        return;
+    }
+    
+    // hold the packet until it has been written out directly
+    o->held = data;
+    o->held_len = data_len;
+    o->held_used = 0;
+    
+    if (!o->sending) {
+        start_sending(o);
+    }
+}
+
+static void output_handler_done (PacketStreamCoalescer *o, int data_len)
+{
+    ASSERT(o->sending)
+    ASSERT(data_len > 0)
+    DebugObject_Access(&o->d_obj);
+    
+    // consume from the buffer first, then from the held packet
+    int from_buf = bmin_int(data_len, o->sending_buf_len);
+    o->buf_start += from_buf;
+    data_len -= from_buf;
+    if (data_len > 0) {
+        ASSERT(o->held)
+        ASSERT(data_len <= o->held_len - o->held_used)
+        o->held_used += data_len;
+    }
+    
+    if (o->buf_start == o->buf_end) {
+        o->buf_start = 0;
+        o->buf_end = 0;
+    }
+    
+    o->sending = 0;
+    
+    // release the held packet if it has been written
+    int accept = 0;
+    if (o->held && o->held_used == o->held_len) {
+        o->held = NULL;
+        accept = 1;
+    }
+    
+    // send anything remaining or buffered meanwhile
+    start_sending(o);
+    
+    if (accept) {
+        PacketPassInterface_Done(&o->input);
+    }
+}
+
+static void flush_handler (PacketStreamCoalescer *o)
+{
+    DebugObject_Access(&o->d_obj);
+    ASSERT(!o->sending)
+    
+    start_sending(o);
+}
+
+int PacketStreamCoalescer_Init (PacketStreamCoalescer *o, StreamPassInterface *output, int mtu, int buf_size, btime_t max_delay, BReactor *reactor)
+{
+    ASSERT(mtu >= 0)
+    ASSERT(buf_size > 0)
+    ASSERT(max_delay >= 0)
+    
+    // init arguments
+    o->output = output;
+    o->reactor = reactor;
+    o->buf_size = buf_size;
+    o->max_delay = max_delay;
+    
+    // allocate buffer
+    if (!(o->buf = (uint8_t *)BAlloc(o->buf_size))) {
+        goto fail0;
+    }
+    o->buf_start = 0;
+    o->buf_end = 0;
+    
+    // init input
+    PacketPassInterface_Init(&o->input, mtu, (PacketPassInterface_handler_send)input_handler_send, o, BReactor_PendingGroup(o->reactor));
+    PacketPassInterface_SetName(&o->input, "PacketStreamCoalescer");
+    
+    // init output
+    StreamPassInterface_Sender_Init(o->output, (StreamPassInterface_handler_done)output_handler_done, o);
+    
+    // init flush job and timer
+    BPending_Init(&o->flush_job, BReactor_PendingGroup(o->reactor), (BPending_handler)flush_handler, o);
+    BTimer_Init(&o->flush_timer, 0, (BTimer_handler)flush_handler, o);
+    
+    // have no held packet, not sending
+    o->held = NULL;
+    o->sending = 0;
+    
+    DebugObject_Init(&o->d_obj);
+    return 1;
+    
+fail0:
+    return 0;
+}
+
+void PacketStreamCoalescer_Free (PacketStreamCoalescer *o)
+{
+    DebugObject_Free(&o->d_obj);
+    
+    // free flush job and timer
+    BReactor_RemoveTimer(o->reactor, &o->flush_timer);
+    BPending_Free(&o->flush_job);
+    
+    // free input
+    PacketPassInterface_Free(&o->input);
+    
+    // free buffer
+    BFree(o->buf);
+}
+
+PacketPassInterface * PacketStreamCoalescer_GetInput (PacketStreamCoalescer *o)
+{
+    DebugObject_Access(&o->d_obj);
+    
+    return &o->input;
+}
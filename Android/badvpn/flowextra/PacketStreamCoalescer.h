@@ -0,0 +1,111 @@
+/**
+ * @file PacketStreamCoalescer.h
+ * @author Psiphon Inc.
+ * 
+ * @section LICENSE
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ * @section DESCRIPTION
+ * 
+ * Object which forwards packets obtained with {@link PacketPassInterface}
+ * as a stream with {@link StreamPassInterface}, coalescing them into fewer
+ * writes.
+ */
+
+#ifndef BADVPN_PACKETSTREAMCOALESCER_H
+#define BADVPN_PACKETSTREAMCOALESCER_H
+
+#include <stdint.h>
+
+#include <base/DebugObject.h>
+#include <base/BPending.h>
+#include <system/BReactor.h>
+#include <flow/PacketPassInterface.h>
+#include <flow/StreamPassInterface.h>
+
+/**
+ * Object which forwards packets obtained with {@link PacketPassInterface}
+ * as a stream with {@link StreamPassInterface}, like {@link PacketStreamSender},
+ * but with fewer output operations.
+ * 
+ * Input packets are copied into a buffer and accepted immediately, so the
+ * sender (typically a queue) can provide the next packet right away. The
+ * buffer is written out when it fills up, when the output finishes a previous
+ * write, or when the flush delay expires; a delay of zero flushes once there
+ * are no more pending jobs which could provide more packets, adding no latency.
+ * A packet which doesn't fit into the buffer is not copied, but written
+ * directly after the buffered data, in the same operation if the output
+ * supports scatter-gather (see {@link StreamPassInterface_EnableVec}).
+ */
+typedef struct {
+    DebugObject d_obj;
+    StreamPassInterface *output;
+    BReactor *reactor;
+    int buf_size;
+    btime_t max_delay;
+    PacketPassInterface input;
+    uint8_t *buf;
+    int buf_start;
+    int buf_end;
+    uint8_t *held;
+    int held_len;
+    int held_used;
+    int sending;
+    int sending_buf_len;
+    struct StreamPassInterface_buf bufs[2];
+    BPending flush_job;
+    BTimer flush_timer;
+} PacketStreamCoalescer;
+
+/**
+ * Initializes the object.
+ *
+ * @param o the object
+ * @param output output interface
+ * @param mtu input MTU. Must be >=0.
+ * @param buf_size size of the coalescing buffer in bytes. Must be >0.
+ * @param max_delay maximum time in milliseconds data may wait in the buffer
+ *                  for more data. Must be >=0.
+ * @param reactor reactor we live in
+ * @return 1 on success, 0 on failure
+ */
+int PacketStreamCoalescer_Init (PacketStreamCoalescer *o, StreamPassInterface *output, int mtu, int buf_size, btime_t max_delay, BReactor *reactor) WARN_UNUSED;
+
+/**
+ * Frees the object.
+ *
+ * @param o the object
+ */
+void PacketStreamCoalescer_Free (PacketStreamCoalescer *o);
+
+/**
+ * Returns the input interface.
+ * Its MTU will be as in {@link PacketStreamCoalescer_Init}.
+ *
+ * @param o the object
+ * @return input interface
+ */
+PacketPassInterface * PacketStreamCoalescer_GetInput (PacketStreamCoalescer *o);
+
+#endif
@@ -143,3 +143,7 @@
 {"BThreadSignal", 4},
 {"BLockReactor", 4},
 {"ncd_load_module", 4},
+{"DnsCache", 4},
+{"DatagramSharedSocket", 4},
+{"NCDProgramCache", 4},
+{"FlowProfileDumper", 4},
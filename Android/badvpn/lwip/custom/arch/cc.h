@@ -40,6 +40,7 @@
 #include <misc/packed.h>
 #include <misc/print_macros.h>
 #include <misc/byteorder.h>
+#include <misc/inet_checksum.h>
 #include <base/BLog.h>
 
 #define u8_t uint8_t
@@ -69,6 +70,14 @@
 #define LWIP_PLATFORM_HTONS(x) hton16(x)
 #define LWIP_PLATFORM_HTONL(x) hton32(x)
 
+// use our vectorized checksum; lwip expects the non-inverted sum in network byte order
+#define LWIP_CHKSUM badvpn_lwip_chksum
+
+static u16_t badvpn_lwip_chksum (void *dataptr, int len)
+{
+    return inet_checksum_fold(inet_checksum_add(0, dataptr, len));
+}
+
 #define LWIP_RAND() ( \
     (((uint32_t)(rand() & 0xFF)) << 24) | \
     (((uint32_t)(rand() & 0xFF)) << 16) | \
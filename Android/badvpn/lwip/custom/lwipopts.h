@@ -60,9 +60,18 @@
 
 #define MEMP_NUM_TCP_PCB_LISTEN 16
 #define MEMP_NUM_TCP_PCB 1024
+#define LWIP_TCP_PCB_HASH 1
+#define TCP_PCB_HASH_SIZE 1024
 #define TCP_MSS 1460
+#define LWIP_WND_SCALE 1
+#define TCP_RCV_SCALE 5
+#define LWIP_TCP_SACK_OUT 1
+// default per-pcb sizes; tun2socks allocates a full receive window for every
+// connection, so larger windows are opted into with tcp_set_wnd() (--tcp-wnd)
+#define TCP_WND (4 * TCP_MSS)
 #define TCP_SND_BUF 16384
-#define TCP_SND_QUEUELEN (4 * (TCP_SND_BUF)/(TCP_MSS))
+// leave room for the larger per-pcb send buffers set with tcp_set_wnd()
+#define TCP_SND_QUEUELEN 0x4000
 
 #define MEM_LIBC_MALLOC 1
 #define MEMP_MEM_MALLOC 1
@@ -115,8 +115,20 @@
   #error "MEMP_NUM_REASSDATA > IP_REASS_MAX_PBUFS doesn't make sense since each struct ip_reassdata must hold 2 pbufs at least!"
 #endif
 #endif /* !MEMP_MEM_MALLOC */
-#if (LWIP_TCP && (TCP_WND > 0xffff))
-  #error "If you want to use TCP, TCP_WND must fit in an u16_t, so, you have to reduce it in your lwipopts.h"
+#if (LWIP_TCP && !LWIP_WND_SCALE && (TCP_WND > 0xffff))
+  #error "If you want to use TCP, TCP_WND must fit in an u16_t, so, you have to reduce it in your lwipopts.h (or enable LWIP_WND_SCALE)"
+#endif
+#if (LWIP_TCP && LWIP_WND_SCALE && ((TCP_RCV_SCALE > 14) || ((TCP_WND >> TCP_RCV_SCALE) > 0xffff)))
+  #error "If you want to use TCP with window scaling, TCP_RCV_SCALE must be at most 14 and TCP_WND >> TCP_RCV_SCALE must fit in an u16_t"
+#endif
+#if (LWIP_TCP && !LWIP_WND_SCALE && (TCP_SND_BUF > 0xffff))
+  #error "If you want to use TCP, TCP_SND_BUF must fit in an u16_t, so, you have to reduce it in your lwipopts.h (or enable LWIP_WND_SCALE)"
+#endif
+#if (LWIP_TCP && LWIP_TCP_SACK_OUT && (!TCP_QUEUE_OOSEQ || (LWIP_TCP_MAX_SACK_NUM < 1)))
+  #error "LWIP_TCP_SACK_OUT requires TCP_QUEUE_OOSEQ and LWIP_TCP_MAX_SACK_NUM >= 1"
+#endif
+#if (LWIP_TCP && LWIP_TCP_PCB_HASH && ((TCP_PCB_HASH_SIZE < 1) || ((TCP_PCB_HASH_SIZE & (TCP_PCB_HASH_SIZE - 1)) != 0)))
+  #error "TCP_PCB_HASH_SIZE must be a power of two"
 #endif
 #if (LWIP_TCP && (TCP_SND_QUEUELEN > 0xffff))
   #error "If you want to use TCP, TCP_SND_QUEUELEN must fit in an u16_t, so, you have to reduce it in your lwipopts.h"
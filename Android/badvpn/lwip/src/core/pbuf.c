@@ -766,6 +766,53 @@ pbuf_cat(struct pbuf *h, struct pbuf *t)
    */
 }
 
+#if TCP_QUEUE_OOSEQ && LWIP_WND_SCALE
+/**
+ * Split a pbuf chain whose total length may have overflowed tot_len into
+ * a first part of less than 64K and the rest.
+ *
+ * With window scaling, the segments reassembled from the ooseq queue can
+ * add up to more than fits into tot_len; tot_len of every pbuf is then
+ * only correct modulo 64K, which is enough to split it up again.
+ *
+ * @param p the pbuf chain to split, shortened in place
+ * @param rest set to the remainder of the chain, or NULL if p fits
+ */
+void
+pbuf_split_64k(struct pbuf *p, struct pbuf **rest)
+{
+  *rest = NULL;
+  if ((p != NULL) && (p->next != NULL)) {
+    u16_t tot_len_front = p->len;
+    struct pbuf *i = p;
+    struct pbuf *r = p->next;
+
+    /* continue until the total length (summed up as u16_t) overflows */
+    while ((r != NULL) && ((u16_t)(tot_len_front + r->len) > tot_len_front)) {
+      tot_len_front += r->len;
+      i = r;
+      r = r->next;
+    }
+    /* i now points to the last pbuf of the first part */
+    i->next = NULL;
+
+    if (r != NULL) {
+      /* remove the rest from the totals of the first part */
+      for (i = p; i != NULL; i = i->next) {
+        i->tot_len -= r->tot_len;
+        LWIP_ASSERT("tot_len/len mismatch in last pbuf",
+                    (i->next != NULL) || (i->tot_len == i->len));
+      }
+      if (p->flags & PBUF_FLAG_TCP_FIN) {
+        r->flags |= PBUF_FLAG_TCP_FIN;
+      }
+      /* the rest keeps its tot_len fields and the caller's reference */
+      *rest = r;
+    }
+  }
+}
+#endif /* TCP_QUEUE_OOSEQ && LWIP_WND_SCALE */
+
 /**
  * Chain two pbufs (or pbuf chains) together.
  * 
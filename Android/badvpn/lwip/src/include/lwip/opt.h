@@ -923,6 +923,55 @@
 #define TCP_WND                         (4 * TCP_MSS)
 #endif 
 
+/**
+ * LWIP_WND_SCALE and TCP_RCV_SCALE:
+ * Set LWIP_WND_SCALE to 1 to enable window scaling (RFC 7323).
+ * Set TCP_RCV_SCALE to the desired scaling factor (shift count in the
+ * range of [0..14]).
+ * With window scaling, TCP_WND (and the per-pcb windows set with
+ * tcp_set_wnd()) may be up to (0xffff << TCP_RCV_SCALE); windows larger
+ * than 0xffff are only used with peers that also support scaling.
+ */
+#ifndef LWIP_WND_SCALE
+#define LWIP_WND_SCALE                  0
+#define TCP_RCV_SCALE                   0
+#endif
+
+/**
+ * LWIP_TCP_SACK_OUT==1: TCP will negotiate SACK (RFC 2018) and report
+ * segments held on the ooseq queue in SACK blocks of the ACKs it sends.
+ * Requires TCP_QUEUE_OOSEQ.
+ */
+#ifndef LWIP_TCP_SACK_OUT
+#define LWIP_TCP_SACK_OUT               0
+#endif
+
+/**
+ * LWIP_TCP_MAX_SACK_NUM: The maximum number of SACK blocks to include in
+ * an ACK. Only used if LWIP_TCP_SACK_OUT is enabled. At most 4 blocks fit
+ * into the option space (3 with timestamps).
+ */
+#ifndef LWIP_TCP_MAX_SACK_NUM
+#define LWIP_TCP_MAX_SACK_NUM           4
+#endif
+
+/**
+ * LWIP_TCP_PCB_HASH==1: Find the pcb of an incoming segment in a hash table
+ * keyed by the connection's addresses and ports, instead of walking the
+ * lists of active and TIME-WAIT pcbs. Worth it with many open connections.
+ */
+#ifndef LWIP_TCP_PCB_HASH
+#define LWIP_TCP_PCB_HASH               0
+#endif
+
+/**
+ * TCP_PCB_HASH_SIZE: Number of buckets in the pcb hash table, must be a
+ * power of two. Only used if LWIP_TCP_PCB_HASH is enabled.
+ */
+#ifndef TCP_PCB_HASH_SIZE
+#define TCP_PCB_HASH_SIZE               256
+#endif
+
 /**
  * TCP_MAXRTX: Maximum number of retransmissions of data segments.
  */
@@ -1065,7 +1114,7 @@
  * explicit window update
  */
 #ifndef TCP_WND_UPDATE_THRESHOLD
-#define TCP_WND_UPDATE_THRESHOLD   (TCP_WND / 4)
+#define TCP_WND_UPDATE_THRESHOLD   LWIP_MIN((TCP_WND / 4), (TCP_MSS * 4))
 #endif
 
 /**
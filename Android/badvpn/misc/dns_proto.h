@@ -0,0 +1,125 @@
+/**
+ * @file dns_proto.h
+ * @author Psiphon Inc.
+ * 
+ * @section LICENSE
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ * @section DESCRIPTION
+ * 
+ * Definitions for the DNS protocol.
+ */
+
+#ifndef BADVPN_MISC_DNS_PROTO_H
+#define BADVPN_MISC_DNS_PROTO_H
+
+#include <stdint.h>
+
+#include <misc/debug.h>
+#include <misc/packed.h>
+
+#define DNS_FLAG_QR (1 << 15)
+#define DNS_FLAG_TC (1 << 9)
+#define DNS_OPCODE_MASK (0xF << 11)
+#define DNS_RCODE_MASK 0xF
+
+#define DNS_RCODE_NOERROR 0
+#define DNS_RCODE_NXDOMAIN 3
+
+#define DNS_TYPE_A 1
+#define DNS_TYPE_SOA 6
+#define DNS_TYPE_OPT 41
+
+#define DNS_CLASS_IN 1
+
+#define DNS_MAX_LABEL_LEN 63
+
+B_START_PACKED
+struct dns_header {
+    uint16_t id;
+    uint16_t flags;
+    uint16_t qdcount;
+    uint16_t ancount;
+    uint16_t nscount;
+    uint16_t arcount;
+} B_PACKED;
+B_END_PACKED
+
+B_START_PACKED
+struct dns_rr_fixed {
+    uint16_t type;
+    uint16_t rr_class;
+    uint32_t ttl;
+    uint16_t rdlength;
+} B_PACKED;
+B_END_PACKED
+
+/**
+ * Skips a possibly compressed domain name.
+ * Compression pointers are not followed, since a pointer always
+ * terminates the name at the current position.
+ * 
+ * @param data message
+ * @param data_len length of message
+ * @param pos position of the name; on success, set to the position after it
+ * @return 1 on success, 0 if the name is malformed or truncated
+ */
+static int dns_skip_name (const uint8_t *data, int data_len, int *pos)
+{
+    ASSERT(data_len >= 0)
+    ASSERT(*pos >= 0)
+    
+    int p = *pos;
+    
+    while (1) {
+        if (p >= data_len) {
+            return 0;
+        }
+        uint8_t len = data[p];
+        
+        if (len == 0) {
+            p++;
+            break;
+        }
+        
+        if ((len & 0xC0) == 0xC0) {
+            if (p + 2 > data_len) {
+                return 0;
+            }
+            p += 2;
+            break;
+        }
+        
+        if (len > DNS_MAX_LABEL_LEN || len >= data_len - p) {
+            return 0;
+        }
+        
+        p += 1 + len;
+    }
+    
+    *pos = p;
+    return 1;
+}
+
+#endif
@@ -0,0 +1,273 @@
+/**
+ * @file flow_stats.h
+ * @author Psiphon Inc.
+ * 
+ * @section LICENSE
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ * @section DESCRIPTION
+ * 
+ * Per-flow traffic counters aggregated into log2 histograms.
+ * 
+ * Flows are updated from the event loop thread only, but the aggregate
+ * counters may be read from another thread with flow_stats_snapshot();
+ * each counter is updated atomically so a snapshot never sees torn
+ * values, though different counters may be from slightly different
+ * points in time.
+ */
+
+#ifndef BADVPN_FLOW_STATS_H
+#define BADVPN_FLOW_STATS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#include <misc/debug.h>
+
+// number of histogram buckets; bucket 0 counts zero values,
+// bucket i counts values in [2^(i-1), 2^i), the last one everything above
+#define FLOW_STATS_HIST_BUCKETS 32
+
+// number of values written by flow_stats_export
+#define FLOW_STATS_HIST_EXPORT_LEN (2 + FLOW_STATS_HIST_BUCKETS)
+#define FLOW_STATS_CLASS_EXPORT_LEN (6 + 5 * FLOW_STATS_HIST_EXPORT_LEN)
+#define FLOW_STATS_EXPORT_LEN (2 * FLOW_STATS_CLASS_EXPORT_LEN)
+
+struct flow_stats_hist {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t buckets[FLOW_STATS_HIST_BUCKETS];
+};
+
+struct flow_stats_class {
+    uint64_t active;
+    uint64_t opened;
+    uint64_t closed;
+    uint64_t bytes_up;
+    uint64_t bytes_down;
+    uint64_t stalls;
+    struct flow_stats_hist setup_ms;
+    struct flow_stats_hist lifetime_ms;
+    struct flow_stats_hist flow_bytes_up;
+    struct flow_stats_hist flow_bytes_down;
+    struct flow_stats_hist flow_stalls;
+};
+
+struct flow_stats {
+    struct flow_stats_class tcp;
+    struct flow_stats_class udp;
+};
+
+struct flow_stats_flow {
+    uint64_t start_time;
+    int setup_done;
+    uint64_t bytes_up;
+    uint64_t bytes_down;
+    uint64_t stalls;
+};
+
+static void flow_stats__add (uint64_t *p, uint64_t v)
+{
+#ifdef __GNUC__
+    __atomic_fetch_add(p, v, __ATOMIC_RELAXED);
+#else
+    *p += v;
+#endif
+}
+
+static void flow_stats__sub (uint64_t *p, uint64_t v)
+{
+#ifdef __GNUC__
+    __atomic_fetch_sub(p, v, __ATOMIC_RELAXED);
+#else
+    *p -= v;
+#endif
+}
+
+static uint64_t flow_stats__load (const uint64_t *p)
+{
+#ifdef __GNUC__
+    return __atomic_load_n(p, __ATOMIC_RELAXED);
+#else
+    return *p;
+#endif
+}
+
+static int flow_stats_hist_bucket (uint64_t v)
+{
+    int i = 0;
+    while (v > 0 && i < FLOW_STATS_HIST_BUCKETS - 1) {
+        v >>= 1;
+        i++;
+    }
+    return i;
+}
+
+// returns the upper bound of the bucket containing the given percentile
+static uint64_t flow_stats_hist_percentile (const struct flow_stats_hist *h, int percent)
+{
+    ASSERT(percent >= 0)
+    ASSERT(percent <= 100)
+    
+    uint64_t count = 0;
+    for (int i = 0; i < FLOW_STATS_HIST_BUCKETS; i++) {
+        count += h->buckets[i];
+    }
+    if (count == 0) {
+        return 0;
+    }
+    
+    uint64_t target = (count * percent + 99) / 100;
+    uint64_t seen = 0;
+    int i;
+    for (i = 0; i < FLOW_STATS_HIST_BUCKETS - 1; i++) {
+        seen += h->buckets[i];
+        if (seen >= target) {
+            break;
+        }
+    }
+    
+    return (i == 0) ? 0 : ((uint64_t)1 << i) - 1;
+}
+
+static void flow_stats_hist_add (struct flow_stats_hist *h, uint64_t v)
+{
+    flow_stats__add(&h->count, 1);
+    flow_stats__add(&h->sum, v);
+    flow_stats__add(&h->buckets[flow_stats_hist_bucket(v)], 1);
+}
+
+static void flow_stats_init (struct flow_stats *s)
+{
+    memset(s, 0, sizeof(*s));
+}
+
+static void flow_stats_flow_start (struct flow_stats_class *c, struct flow_stats_flow *f, uint64_t now_ms)
+{
+    f->start_time = now_ms;
+    f->setup_done = 0;
+    f->bytes_up = 0;
+    f->bytes_down = 0;
+    f->stalls = 0;
+    
+    flow_stats__add(&c->active, 1);
+    flow_stats__add(&c->opened, 1);
+}
+
+// records the time from flow_stats_flow_start to the first time this is called
+static void flow_stats_flow_setup (struct flow_stats_class *c, struct flow_stats_flow *f, uint64_t now_ms)
+{
+    if (f->setup_done) {
+        return;
+    }
+    f->setup_done = 1;
+    
+    flow_stats_hist_add(&c->setup_ms, now_ms - f->start_time);
+}
+
+static void flow_stats_flow_up (struct flow_stats_class *c, struct flow_stats_flow *f, uint64_t bytes)
+{
+    f->bytes_up += bytes;
+    flow_stats__add(&c->bytes_up, bytes);
+}
+
+static void flow_stats_flow_down (struct flow_stats_class *c, struct flow_stats_flow *f, uint64_t bytes)
+{
+    f->bytes_down += bytes;
+    flow_stats__add(&c->bytes_down, bytes);
+}
+
+static void flow_stats_flow_stall (struct flow_stats_class *c, struct flow_stats_flow *f)
+{
+    f->stalls++;
+    flow_stats__add(&c->stalls, 1);
+}
+
+static void flow_stats_flow_end (struct flow_stats_class *c, struct flow_stats_flow *f, uint64_t now_ms)
+{
+    flow_stats_hist_add(&c->lifetime_ms, now_ms - f->start_time);
+    flow_stats_hist_add(&c->flow_bytes_up, f->bytes_up);
+    flow_stats_hist_add(&c->flow_bytes_down, f->bytes_down);
+    flow_stats_hist_add(&c->flow_stalls, f->stalls);
+    
+    flow_stats__sub(&c->active, 1);
+    flow_stats__add(&c->closed, 1);
+}
+
+static void flow_stats_snapshot (const struct flow_stats *s, struct flow_stats *out)
+{
+    const uint64_t *src = (const uint64_t *)s;
+    uint64_t *dst = (uint64_t *)out;
+    
+    for (size_t i = 0; i < sizeof(*s) / sizeof(uint64_t); i++) {
+        dst[i] = flow_stats__load(&src[i]);
+    }
+}
+
+static size_t flow_stats__export_hist (const struct flow_stats_hist *h, uint64_t *out)
+{
+    size_t n = 0;
+    out[n++] = h->count;
+    out[n++] = h->sum;
+    for (int i = 0; i < FLOW_STATS_HIST_BUCKETS; i++) {
+        out[n++] = h->buckets[i];
+    }
+    return n;
+}
+
+static size_t flow_stats__export_class (const struct flow_stats_class *c, uint64_t *out)
+{
+    size_t n = 0;
+    out[n++] = c->active;
+    out[n++] = c->opened;
+    out[n++] = c->closed;
+    out[n++] = c->bytes_up;
+    out[n++] = c->bytes_down;
+    out[n++] = c->stalls;
+    n += flow_stats__export_hist(&c->setup_ms, out + n);
+    n += flow_stats__export_hist(&c->lifetime_ms, out + n);
+    n += flow_stats__export_hist(&c->flow_bytes_up, out + n);
+    n += flow_stats__export_hist(&c->flow_bytes_down, out + n);
+    n += flow_stats__export_hist(&c->flow_stalls, out + n);
+    return n;
+}
+
+/**
+ * Flattens a snapshot into FLOW_STATS_EXPORT_LEN values: the TCP class
+ * followed by the UDP class. Each class is active, opened, closed,
+ * bytes_up, bytes_down, stalls, then the histograms setup_ms, lifetime_ms,
+ * flow_bytes_up, flow_bytes_down and flow_stalls, each as count, sum and
+ * FLOW_STATS_HIST_BUCKETS buckets.
+ */
+static void flow_stats_export (const struct flow_stats *snapshot, uint64_t *out)
+{
+    size_t n = 0;
+    n += flow_stats__export_class(&snapshot->tcp, out + n);
+    n += flow_stats__export_class(&snapshot->udp, out + n);
+    ASSERT(n == FLOW_STATS_EXPORT_LEN)
+    B_USE(n)
+}
+
+#endif
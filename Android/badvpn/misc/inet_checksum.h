@@ -0,0 +1,283 @@
+/**
+ * @file inet_checksum.h
+ * @author Psiphon Inc.
+ * 
+ * @section LICENSE
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ * @section DESCRIPTION
+ * 
+ * Internet (one's complement) checksum, as used by IPv4, UDP, TCP and ICMP.
+ * 
+ * Sums are computed in memory byte order, so results can be stored into packets
+ * directly (RFC 1071 byte order independence). The bulk of the data is summed
+ * with SSE2, AVX2 or NEON where available; AVX2 is selected at runtime, the
+ * others at compile time. Define BADVPN_INET_CHECKSUM_NO_SIMD to force the
+ * portable implementation.
+ */
+
+#ifndef BADVPN_MISC_INET_CHECKSUM_H
+#define BADVPN_MISC_INET_CHECKSUM_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#if !defined(BADVPN_INET_CHECKSUM_NO_SIMD)
+    #if (defined(__x86_64__) || defined(__i386__)) && defined(__SSE2__)
+        #define BADVPN_INET_CHECKSUM_SSE2
+        #include <emmintrin.h>
+        #if defined(__GNUC__) && (defined(__clang__) || __GNUC__ >= 5)
+            #define BADVPN_INET_CHECKSUM_AVX2
+            #include <immintrin.h>
+        #endif
+    #elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+        #define BADVPN_INET_CHECKSUM_NEON
+        #include <arm_neon.h>
+    #endif
+#endif
+
+/**
+ * Adds data to a running checksum accumulator.
+ * The accumulator starts at 0. When summing a message in pieces,
+ * all but the last piece must have even length.
+ * 
+ * @param acc accumulator
+ * @param data data to sum
+ * @param len length of data
+ * @return new accumulator
+ */
+static uint64_t inet_checksum_add (uint64_t acc, const void *data, size_t len);
+
+/**
+ * Folds an accumulator into a 16-bit one's complement sum (not inverted),
+ * in network byte order.
+ */
+static uint16_t inet_checksum_fold (uint64_t acc);
+
+/**
+ * Computes the Internet checksum of data, in network byte order.
+ */
+static uint16_t inet_checksum (const void *data, size_t len);
+
+/**
+ * Updates a checksum after a 16-bit field has changed (RFC 1624).
+ * All values are in network byte order.
+ */
+static uint16_t inet_checksum_update16 (uint16_t checksum, uint16_t old_val, uint16_t new_val);
+
+/**
+ * Updates a checksum after a 32-bit field has changed (RFC 1624).
+ * All values are in network byte order.
+ */
+static uint16_t inet_checksum_update32 (uint16_t checksum, uint32_t old_val, uint32_t new_val);
+
+static uint64_t inet_checksum__add_portable (uint64_t acc, const uint8_t *p, size_t len)
+{
+    // 32-bit words are summed into 64 bits, which is equivalent modulo 0xFFFF
+    while (len >= 16) {
+        uint64_t w1;
+        uint64_t w2;
+        memcpy(&w1, p, 8);
+        memcpy(&w2, p + 8, 8);
+        acc += (w1 & UINT32_MAX) + (w1 >> 32) + (w2 & UINT32_MAX) + (w2 >> 32);
+        p += 16;
+        len -= 16;
+    }
+    
+    while (len >= 4) {
+        uint32_t w;
+        memcpy(&w, p, 4);
+        acc += w;
+        p += 4;
+        len -= 4;
+    }
+    
+    if (len >= 2) {
+        uint16_t w;
+        memcpy(&w, p, 2);
+        acc += w;
+        p += 2;
+        len -= 2;
+    }
+    
+    // odd byte is padded with zero
+    if (len > 0) {
+        uint8_t last[2] = {p[0], 0};
+        uint16_t w;
+        memcpy(&w, last, 2);
+        acc += w;
+    }
+    
+    return acc;
+}
+
+#ifdef BADVPN_INET_CHECKSUM_SSE2
+
+static uint64_t inet_checksum__add_sse2 (uint64_t acc, const uint8_t *p, size_t len)
+{
+    __m128i zero = _mm_setzero_si128();
+    __m128i acc1 = zero;
+    __m128i acc2 = zero;
+    
+    while (len >= 32) {
+        __m128i v1 = _mm_loadu_si128((const __m128i *)p);
+        __m128i v2 = _mm_loadu_si128((const __m128i *)(p + 16));
+        acc1 = _mm_add_epi64(acc1, _mm_unpacklo_epi32(v1, zero));
+        acc2 = _mm_add_epi64(acc2, _mm_unpackhi_epi32(v1, zero));
+        acc1 = _mm_add_epi64(acc1, _mm_unpacklo_epi32(v2, zero));
+        acc2 = _mm_add_epi64(acc2, _mm_unpackhi_epi32(v2, zero));
+        p += 32;
+        len -= 32;
+    }
+    
+    uint64_t lanes[2];
+    _mm_storeu_si128((__m128i *)lanes, _mm_add_epi64(acc1, acc2));
+    acc += lanes[0];
+    acc += lanes[1];
+    
+    return inet_checksum__add_portable(acc, p, len);
+}
+
+#endif
+
+#ifdef BADVPN_INET_CHECKSUM_AVX2
+
+__attribute__((target("avx2")))
+static uint64_t inet_checksum__add_avx2 (uint64_t acc, const uint8_t *p, size_t len)
+{
+    __m256i zero = _mm256_setzero_si256();
+    __m256i acc1 = zero;
+    __m256i acc2 = zero;
+    
+    while (len >= 64) {
+        __m256i v1 = _mm256_loadu_si256((const __m256i *)p);
+        __m256i v2 = _mm256_loadu_si256((const __m256i *)(p + 32));
+        acc1 = _mm256_add_epi64(acc1, _mm256_unpacklo_epi32(v1, zero));
+        acc2 = _mm256_add_epi64(acc2, _mm256_unpackhi_epi32(v1, zero));
+        acc1 = _mm256_add_epi64(acc1, _mm256_unpacklo_epi32(v2, zero));
+        acc2 = _mm256_add_epi64(acc2, _mm256_unpackhi_epi32(v2, zero));
+        p += 64;
+        len -= 64;
+    }
+    
+    uint64_t lanes[4];
+    _mm256_storeu_si256((__m256i *)lanes, _mm256_add_epi64(acc1, acc2));
+    acc += lanes[0];
+    acc += lanes[1];
+    acc += lanes[2];
+    acc += lanes[3];
+    
+    return inet_checksum__add_sse2(acc, p, len);
+}
+
+static int inet_checksum__have_avx2 (void)
+{
+    static int have = -1;
+    if (have < 0) {
+        have = !!__builtin_cpu_supports("avx2");
+    }
+    return have;
+}
+
+#endif
+
+#ifdef BADVPN_INET_CHECKSUM_NEON
+
+static uint64_t inet_checksum__add_neon (uint64_t acc, const uint8_t *p, size_t len)
+{
+    uint64x2_t acc1 = vdupq_n_u64(0);
+    uint64x2_t acc2 = vdupq_n_u64(0);
+    
+    while (len >= 32) {
+        acc1 = vpadalq_u32(acc1, vreinterpretq_u32_u8(vld1q_u8(p)));
+        acc2 = vpadalq_u32(acc2, vreinterpretq_u32_u8(vld1q_u8(p + 16)));
+        p += 32;
+        len -= 32;
+    }
+    
+    uint64x2_t sum = vaddq_u64(acc1, acc2);
+    acc += vgetq_lane_u64(sum, 0);
+    acc += vgetq_lane_u64(sum, 1);
+    
+    return inet_checksum__add_portable(acc, p, len);
+}
+
+#endif
+
+uint64_t inet_checksum_add (uint64_t acc, const void *data, size_t len)
+{
+    const uint8_t *p = (const uint8_t *)data;
+    
+    // keep the accumulator within 33 bits so the SIMD lanes cannot overflow it
+    acc = (acc & UINT32_MAX) + (acc >> 32);
+    
+#if defined(BADVPN_INET_CHECKSUM_AVX2)
+    if (len >= 64 && inet_checksum__have_avx2()) {
+        return inet_checksum__add_avx2(acc, p, len);
+    }
+#endif
+#if defined(BADVPN_INET_CHECKSUM_SSE2)
+    return inet_checksum__add_sse2(acc, p, len);
+#elif defined(BADVPN_INET_CHECKSUM_NEON)
+    return inet_checksum__add_neon(acc, p, len);
+#else
+    return inet_checksum__add_portable(acc, p, len);
+#endif
+}
+
+uint16_t inet_checksum_fold (uint64_t acc)
+{
+    acc = (acc & UINT32_MAX) + (acc >> 32);
+    acc = (acc & UINT32_MAX) + (acc >> 32);
+    
+    uint32_t t = acc;
+    t = (t & UINT16_MAX) + (t >> 16);
+    t = (t & UINT16_MAX) + (t >> 16);
+    
+    return t;
+}
+
+uint16_t inet_checksum (const void *data, size_t len)
+{
+    return ~inet_checksum_fold(inet_checksum_add(0, data, len));
+}
+
+uint16_t inet_checksum_update16 (uint16_t checksum, uint16_t old_val, uint16_t new_val)
+{
+    // HC' = ~(~HC + ~m + m')
+    uint32_t t = (uint16_t)~checksum;
+    t += (uint16_t)~old_val;
+    t += new_val;
+    
+    return ~inet_checksum_fold(t);
+}
+
+uint16_t inet_checksum_update32 (uint16_t checksum, uint32_t old_val, uint32_t new_val)
+{
+    checksum = inet_checksum_update16(checksum, old_val >> 16, new_val >> 16);
+    return inet_checksum_update16(checksum, old_val & UINT16_MAX, new_val & UINT16_MAX);
+}
+
+#endif
@@ -38,6 +38,7 @@
 #include <misc/packed.h>
 
 #define IPV6_NEXT_IGMP 2
+#define IPV6_NEXT_TCP 6
 #define IPV6_NEXT_UDP 17
 
 B_START_PACKED
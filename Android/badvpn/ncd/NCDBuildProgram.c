@@ -52,6 +52,8 @@ struct guard {
 
 struct build_state {
     struct guard *top_guard;
+    NCDBuildProgram_file_handler file_handler;
+    void *user;
 };
 
 static int add_guard (struct guard **first, const char *id_data, size_t id_length)
@@ -194,6 +196,11 @@ static int process_file (struct build_state *st, int depth, const char *file_pat
         goto fail0;
     }
     
+    if (st->file_handler && !st->file_handler(st->user, file_path)) {
+        BLog(BLOG_ERROR, "file '%s': file handler failed", file_path);
+        goto fail1;
+    }
+    
     uint8_t *data;
     size_t len;
     if (!read_file(file_path, &data, &len)) {
@@ -297,13 +304,15 @@ fail0:
     return ret_val;
 }
 
-int NCDBuildProgram_Build (const char *file_path, NCDProgram *out_program)
+int NCDBuildProgram_Build (const char *file_path, NCDProgram *out_program, NCDBuildProgram_file_handler file_handler, void *user)
 {
     ASSERT(file_path)
     ASSERT(out_program)
     
     struct build_state st;
     st.top_guard = NULL;
+    st.file_handler = file_handler;
+    st.user = user;
     
     int guarded;
     int res = process_file(&st, 0, file_path, out_program, &guarded);
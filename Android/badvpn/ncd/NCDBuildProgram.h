@@ -33,6 +33,15 @@
 #include <misc/debug.h>
 #include <ncd/NCDAst.h>
 
+/**
+ * Handler called for each file read by {@link NCDBuildProgram_Build}.
+ * 
+ * @param user as in {@link NCDBuildProgram_Build}
+ * @param file_path path of the file, as it will be opened
+ * @return 1 to continue, 0 to fail the build
+ */
+typedef int (*NCDBuildProgram_file_handler) (void *user, const char *file_path);
+
 /**
  * Builds an NCD program in AST form suitable for passing to {@link NCDInterpreter},
  * by opening and parsing it, as well as recursively processing any included files.
@@ -42,8 +51,13 @@
  * @param file_path path to the main file of the program
  * @param out_program on success, *out_program will contain the resulting program.
  *                    On failure, *out_program will be unchanged.
+ * @param file_handler if not NULL, called with the path of every file just before
+ *                     it is read (the main file and all included files, including
+ *                     ones skipped due to include guards). If the handler returns 0,
+ *                     building fails.
+ * @param user argument to file_handler
  * @return 1 on success, 0 on failure
  */
-int NCDBuildProgram_Build (const char *file_path, NCDProgram *out_program) WARN_UNUSED;
+int NCDBuildProgram_Build (const char *file_path, NCDProgram *out_program, NCDBuildProgram_file_handler file_handler, void *user) WARN_UNUSED;
 
 #endif
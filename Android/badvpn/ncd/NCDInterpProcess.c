@@ -56,6 +56,16 @@ static int compute_prealloc (NCDInterpProcess *o)
         
         o->stmts[i].prealloc_offset = size + align_size;
         size += align_size + o->stmts[i].alloc_size;
+        
+        mod = size % BMAX_ALIGN;
+        align_size = (mod == 0 ? 0 : BMAX_ALIGN - mod);
+        
+        if (align_size + o->stmts[i].arg_size > INT_MAX - size) {
+            return 0;
+        }
+        
+        o->stmts[i].arg_prealloc_offset = size + align_size;
+        size += align_size + o->stmts[i].arg_size;
     }
     
     ASSERT(size >= 0)
@@ -65,7 +75,82 @@ static int compute_prealloc (NCDInterpProcess *o)
     return 1;
 }
 
-static int convert_value_recurser (NCDPlaceholderDb *pdb, NCDStringIndex *string_index, NCDValue *value, NCDValMem *mem, NCDValRef *out)
+static int find_statement (NCDInterpProcess *o, int from_index, NCD_string_id_t name)
+{
+    ASSERT(from_index >= 0)
+    ASSERT(from_index <= o->num_stmts)
+    
+    size_t bucket_idx = name % o->num_hash_buckets;
+    int stmt_idx = o->hash_buckets[bucket_idx];
+    ASSERT(stmt_idx >= -1)
+    ASSERT(stmt_idx < o->num_stmts)
+    
+    while (stmt_idx >= 0) {
+        if (stmt_idx < from_index && o->stmts[stmt_idx].name == name) {
+            return stmt_idx;
+        }
+        
+        stmt_idx = o->stmts[stmt_idx].hash_next;
+        ASSERT(stmt_idx >= -1)
+        ASSERT(stmt_idx < o->num_stmts)
+    }
+    
+    return -1;
+}
+
+static size_t count_vars_recurser (NCDValue *value)
+{
+    switch (NCDValue_Type(value)) {
+        case NCDVALUE_LIST: {
+            size_t count = 0;
+            for (NCDValue *e = NCDValue_ListFirst(value); e; e = NCDValue_ListNext(value, e)) {
+                count += count_vars_recurser(e);
+            }
+            return count;
+        } break;
+        
+        case NCDVALUE_MAP: {
+            size_t count = 0;
+            for (NCDValue *ekey = NCDValue_MapFirstKey(value); ekey; ekey = NCDValue_MapNextKey(value, ekey)) {
+                count += count_vars_recurser(ekey);
+                count += count_vars_recurser(NCDValue_MapKeyValue(value, ekey));
+            }
+            return count;
+        } break;
+        
+        case NCDVALUE_VAR:
+            return 1;
+        
+        default:
+            return 0;
+    }
+}
+
+static int bind_var (NCDInterpProcess *o, NCDPlaceholderDb *pdb, int plid)
+{
+    // placeholders of a process are allocated consecutively, while the
+    // process is being built
+    if (o->num_vars == 0) {
+        o->first_plid = plid;
+    }
+    if (plid != o->first_plid + o->num_vars) {
+        BLog(BLOG_ERROR, "placeholder IDs are not consecutive");
+        return 0;
+    }
+    
+    const NCD_string_id_t *varnames;
+    size_t num_names;
+    NCDPlaceholderDb_GetVariable(pdb, plid, &varnames, &num_names);
+    ASSERT(num_names > 0)
+    
+    // statements are added in order, so the current one is the last one
+    o->var_bindings[o->num_vars] = find_statement(o, o->num_stmts, varnames[0]);
+    o->num_vars++;
+    
+    return 1;
+}
+
+static int convert_value_recurser (NCDInterpProcess *o, NCDPlaceholderDb *pdb, NCDStringIndex *string_index, NCDValue *value, NCDValMem *mem, NCDValRef *out)
 {
     ASSERT(pdb)
     ASSERT(string_index)
@@ -98,7 +183,7 @@ static int convert_value_recurser (NCDPlaceholderDb *pdb, NCDStringIndex *string
             
             for (NCDValue *e = NCDValue_ListFirst(value); e; e = NCDValue_ListNext(value, e)) {
                 NCDValRef vval;
-                if (!convert_value_recurser(pdb, string_index, e, mem, &vval)) {
+                if (!convert_value_recurser(o, pdb, string_index, e, mem, &vval)) {
                     goto fail;
                 }
                 
@@ -120,8 +205,8 @@ static int convert_value_recurser (NCDPlaceholderDb *pdb, NCDStringIndex *string
                 
                 NCDValRef vkey;
                 NCDValRef vval;
-                if (!convert_value_recurser(pdb, string_index, ekey, mem, &vkey) ||
-                    !convert_value_recurser(pdb, string_index, eval, mem, &vval)
+                if (!convert_value_recurser(o, pdb, string_index, ekey, mem, &vkey) ||
+                    !convert_value_recurser(o, pdb, string_index, eval, mem, &vval)
                 ) {
                     goto fail;
                 }
@@ -148,6 +233,10 @@ static int convert_value_recurser (NCDPlaceholderDb *pdb, NCDStringIndex *string
                 goto fail;
             }
             
+            if (!bind_var(o, pdb, plid)) {
+                goto fail;
+            }
+            
             *out = NCDVal_NewPlaceholder(mem, plid);
         } break;
         
@@ -192,9 +281,27 @@ int NCDInterpProcess_Init (NCDInterpProcess *o, NCDProcess *process, NCDStringIn
         o->hash_buckets[i] = -1;
     }
     
+    size_t num_vars = 0;
+    for (NCDStatement *s = NCDBlock_FirstStatement(block); s; s = NCDBlock_NextStatement(block, s)) {
+        num_vars += count_vars_recurser(NCDStatement_RegArgs(s));
+    }
+    
+    if (num_vars > INT_MAX) {
+        BLog(BLOG_ERROR, "too many variables");
+        goto fail2;
+    }
+    
+    if (!(o->var_bindings = BAllocArray(num_vars > 0 ? num_vars : 1, sizeof(o->var_bindings[0])))) {
+        BLog(BLOG_ERROR, "BAllocArray failed");
+        goto fail2;
+    }
+    
+    o->first_plid = 0;
+    o->num_vars = 0;
+    
     if (!(o->name = b_strdup(NCDProcess_Name(process)))) {
         BLog(BLOG_ERROR, "b_strdup failed");
-        goto fail2;
+        goto fail2a;
     }
     
     o->num_stmts = 0;
@@ -209,6 +316,7 @@ int NCDInterpProcess_Init (NCDInterpProcess *o, NCDProcess *process, NCDStringIn
         e->name = -1;
         e->objnames = NULL;
         e->num_objnames = 0;
+        e->objnames_binding = -1;
         e->alloc_size = 0;
         
         if (NCDStatement_Name(s)) {
@@ -227,14 +335,23 @@ int NCDInterpProcess_Init (NCDInterpProcess *o, NCDProcess *process, NCDStringIn
         
         NCDValMem_Init(&e->arg_mem);
         
+        int stmt_first_var = o->num_vars;
+        
         NCDValRef val;
-        if (!convert_value_recurser(pdb, string_index, NCDStatement_RegArgs(s), &e->arg_mem, &val)) {
+        if (!convert_value_recurser(o, pdb, string_index, NCDStatement_RegArgs(s), &e->arg_mem, &val)) {
             BLog(BLOG_ERROR, "convert_value_recurser failed");
             goto loop_fail1;
         }
         
         e->arg_ref = NCDVal_ToSafe(val);
         
+        // arguments without variables never change, so instances can share them
+        e->arg_shared = (o->num_vars == stmt_first_var);
+        e->arg_size = 0;
+        if (!e->arg_shared && NCDValMem_Used(&e->arg_mem) > NCDVAL_FASTBUF_SIZE) {
+            e->arg_size = NCDValMem_Used(&e->arg_mem);
+        }
+        
         if (!NCDValReplaceProg_Init(&e->arg_prog, val)) {
             BLog(BLOG_ERROR, "NCDValReplaceProg_Init failed");
             goto loop_fail1;
@@ -246,6 +363,8 @@ int NCDInterpProcess_Init (NCDInterpProcess *o, NCDProcess *process, NCDStringIn
                 goto loop_fail2;
             }
             
+            e->objnames_binding = find_statement(o, o->num_stmts, e->objnames[0]);
+            
             e->binding.method_name_id = NCDModuleIndex_GetMethodNameId(module_index, NCDStatement_RegCmdName(s));
             if (e->binding.method_name_id == -1) {
                 BLog(BLOG_ERROR, "NCDModuleIndex_GetMethodNameId failed");
@@ -253,6 +372,12 @@ int NCDInterpProcess_Init (NCDInterpProcess *o, NCDProcess *process, NCDStringIn
             }
         } else {
             e->binding.simple_module = NCDModuleIndex_FindModule(module_index, NCDStatement_RegCmdName(s));
+            
+            // seed the preallocation size from the module, so that the first
+            // instance does not need a separate allocation
+            if (e->binding.simple_module && e->binding.simple_module->module.alloc_size > 0) {
+                e->alloc_size = e->binding.simple_module->module.alloc_size;
+            }
         }
         
         if (e->name >= 0) {
@@ -275,6 +400,7 @@ int NCDInterpProcess_Init (NCDInterpProcess *o, NCDProcess *process, NCDStringIn
     }
     
     ASSERT(o->num_stmts == num_stmts)
+    ASSERT(o->num_vars == num_vars)
     
     DebugObject_Init(&o->d_obj);
     return 1;
@@ -287,6 +413,8 @@ fail3:
         NCDValMem_Free(&e->arg_mem);
     }
     free(o->name);
+fail2a:
+    BFree(o->var_bindings);
 fail2:
     BFree(o->hash_buckets);
 fail1:
@@ -307,6 +435,7 @@ void NCDInterpProcess_Free (NCDInterpProcess *o)
     }
     
     free(o->name);
+    BFree(o->var_bindings);
     BFree(o->hash_buckets);
     BFree(o->stmts);
 }
@@ -317,22 +446,7 @@ int NCDInterpProcess_FindStatement (NCDInterpProcess *o, int from_index, NCD_str
     ASSERT(from_index >= 0)
     ASSERT(from_index <= o->num_stmts)
     
-    size_t bucket_idx = name % o->num_hash_buckets;
-    int stmt_idx = o->hash_buckets[bucket_idx];
-    ASSERT(stmt_idx >= -1)
-    ASSERT(stmt_idx < o->num_stmts)
-    
-    while (stmt_idx >= 0) {
-        if (stmt_idx < from_index && o->stmts[stmt_idx].name == name) {
-            return stmt_idx;
-        }
-        
-        stmt_idx = o->stmts[stmt_idx].hash_next;
-        ASSERT(stmt_idx >= -1)
-        ASSERT(stmt_idx < o->num_stmts)
-    }
-    
-    return -1;
+    return find_statement(o, from_index, name);
 }
 
 const char * NCDInterpProcess_StatementCmdName (NCDInterpProcess *o, int i, NCDStringIndex *string_index)
@@ -357,6 +471,25 @@ void NCDInterpProcess_StatementObjNames (NCDInterpProcess *o, int i, const NCD_s
     *out_num_objnames = o->stmts[i].num_objnames;
 }
 
+int NCDInterpProcess_StatementObjBinding (NCDInterpProcess *o, int i)
+{
+    DebugObject_Access(&o->d_obj);
+    ASSERT(i >= 0)
+    ASSERT(i < o->num_stmts)
+    ASSERT(o->stmts[i].objnames)
+    
+    return o->stmts[i].objnames_binding;
+}
+
+int NCDInterpProcess_PlaceholderBinding (NCDInterpProcess *o, int plid)
+{
+    DebugObject_Access(&o->d_obj);
+    ASSERT(plid >= o->first_plid)
+    ASSERT(plid - o->first_plid < o->num_vars)
+    
+    return o->var_bindings[plid - o->first_plid];
+}
+
 const struct NCDInterpModule * NCDInterpProcess_StatementGetSimpleModule (NCDInterpProcess *o, int i, NCDStringIndex *string_index, NCDModuleIndex *module_index)
 {
     DebugObject_Access(&o->d_obj);
@@ -386,18 +519,41 @@ const struct NCDInterpModule * NCDInterpProcess_StatementGetMethodModule (NCDInt
     return NCDModuleIndex_GetMethodModule(module_index, obj_type, o->stmts[i].binding.method_name_id);
 }
 
-int NCDInterpProcess_CopyStatementArgs (NCDInterpProcess *o, int i, NCDValMem *out_valmem, NCDValRef *out_val, NCDValReplaceProg *out_prog)
+int NCDInterpProcess_StatementArgsShared (NCDInterpProcess *o, int i)
+{
+    DebugObject_Access(&o->d_obj);
+    ASSERT(i >= 0)
+    ASSERT(i < o->num_stmts)
+    
+    return o->stmts[i].arg_shared;
+}
+
+NCDValRef NCDInterpProcess_StatementSharedArgs (NCDInterpProcess *o, int i)
+{
+    DebugObject_Access(&o->d_obj);
+    ASSERT(i >= 0)
+    ASSERT(i < o->num_stmts)
+    ASSERT(o->stmts[i].arg_shared)
+    
+    struct NCDInterpProcess__stmt *e = &o->stmts[i];
+    
+    return NCDVal_FromSafe(&e->arg_mem, e->arg_ref);
+}
+
+int NCDInterpProcess_CopyStatementArgs (NCDInterpProcess *o, int i, NCDValMem *out_valmem, char *prealloc_mem, int prealloc_size, NCDValRef *out_val, NCDValReplaceProg *out_prog)
 {
     DebugObject_Access(&o->d_obj);
     ASSERT(i >= 0)
     ASSERT(i < o->num_stmts)
     ASSERT(out_valmem)
+    ASSERT(prealloc_mem || prealloc_size == 0)
+    ASSERT(prealloc_size >= 0)
     ASSERT(out_val)
     ASSERT(out_prog)
     
     struct NCDInterpProcess__stmt *e = &o->stmts[i];
     
-    if (!NCDValMem_InitCopy(out_valmem, &e->arg_mem)) {
+    if (!NCDValMem_InitCopyPrealloc(out_valmem, &e->arg_mem, prealloc_mem, prealloc_size)) {
         return 0;
     }
     
@@ -419,6 +575,24 @@ void NCDInterpProcess_StatementBumpAllocSize (NCDInterpProcess *o, int i, int al
     }
 }
 
+void NCDInterpProcess_StatementBumpArgsSize (NCDInterpProcess *o, int i, size_t args_size)
+{
+    DebugObject_Access(&o->d_obj);
+    ASSERT(i >= 0)
+    ASSERT(i < o->num_stmts)
+    ASSERT(!o->stmts[i].arg_shared)
+    
+    // small arguments fit into the built-in buffer of NCDValMem
+    if (args_size <= NCDVAL_FASTBUF_SIZE || args_size > INT_MAX) {
+        return;
+    }
+    
+    if ((int)args_size > o->stmts[i].arg_size) {
+        o->stmts[i].arg_size = args_size;
+        o->prealloc_size = -1;
+    }
+}
+
 int NCDInterpProcess_PreallocSize (NCDInterpProcess *o)
 {
     DebugObject_Access(&o->d_obj);
@@ -451,6 +625,26 @@ int NCDInterpProcess_StatementPreallocOffset (NCDInterpProcess *o, int i)
     return o->stmts[i].prealloc_offset;
 }
 
+int NCDInterpProcess_StatementArgsPreallocSize (NCDInterpProcess *o, int i)
+{
+    DebugObject_Access(&o->d_obj);
+    ASSERT(i >= 0)
+    ASSERT(i < o->num_stmts)
+    ASSERT(o->prealloc_size >= 0)
+    
+    return o->stmts[i].arg_size;
+}
+
+int NCDInterpProcess_StatementArgsPreallocOffset (NCDInterpProcess *o, int i)
+{
+    DebugObject_Access(&o->d_obj);
+    ASSERT(i >= 0)
+    ASSERT(i < o->num_stmts)
+    ASSERT(o->prealloc_size >= 0)
+    
+    return o->stmts[i].arg_prealloc_offset;
+}
+
 const char * NCDInterpProcess_Name (NCDInterpProcess *o)
 {
     DebugObject_Access(&o->d_obj);
@@ -46,6 +46,7 @@ struct NCDInterpProcess__stmt {
     NCD_string_id_t cmdname;
     NCD_string_id_t *objnames;
     size_t num_objnames;
+    int objnames_binding;
     union {
         const struct NCDInterpModule *simple_module;
         int method_name_id;
@@ -53,6 +54,9 @@ struct NCDInterpProcess__stmt {
     NCDValMem arg_mem;
     NCDValSafeRef arg_ref;
     NCDValReplaceProg arg_prog;
+    int arg_shared;
+    int arg_size;
+    int arg_prealloc_offset;
     int alloc_size;
     int prealloc_offset;
     int hash_next;
@@ -66,6 +70,13 @@ struct NCDInterpProcess__stmt {
  * the program is loaded Inn case of template processes, the same
  * NCDInterpProcess is shared by all processes created from the same
  * template.
+ * The first names of variables and method objects are bound to the
+ * statements they refer to here, so that (re)initializing a statement
+ * does not need to look up statements by name.
+ * Statement arguments without variables are shared by all instances of
+ * the statement instead of being copied. For other statements, the size
+ * of the arguments after variable replacement is learned, and memory for
+ * them is preallocated together with the process, like module memory.
  */
 typedef struct {
     struct NCDInterpProcess__stmt *stmts;
@@ -75,6 +86,9 @@ typedef struct {
     int is_template;
     int *hash_buckets;
     size_t num_hash_buckets;
+    int *var_bindings;
+    int first_plid;
+    int num_vars;
     void *cache;
     DebugObject d_obj;
 } NCDInterpProcess;
@@ -84,13 +98,20 @@ void NCDInterpProcess_Free (NCDInterpProcess *o);
 int NCDInterpProcess_FindStatement (NCDInterpProcess *o, int from_index, NCD_string_id_t name);
 const char * NCDInterpProcess_StatementCmdName (NCDInterpProcess *o, int i, NCDStringIndex *string_index);
 void NCDInterpProcess_StatementObjNames (NCDInterpProcess *o, int i, const NCD_string_id_t **out_objnames, size_t *out_num_objnames);
+int NCDInterpProcess_StatementObjBinding (NCDInterpProcess *o, int i);
+int NCDInterpProcess_PlaceholderBinding (NCDInterpProcess *o, int plid);
 const struct NCDInterpModule * NCDInterpProcess_StatementGetSimpleModule (NCDInterpProcess *o, int i, NCDStringIndex *string_index, NCDModuleIndex *module_index);
 const struct NCDInterpModule * NCDInterpProcess_StatementGetMethodModule (NCDInterpProcess *o, int i, NCD_string_id_t obj_type, NCDModuleIndex *module_index);
-int NCDInterpProcess_CopyStatementArgs (NCDInterpProcess *o, int i, NCDValMem *out_valmem, NCDValRef *out_val, NCDValReplaceProg *out_prog) WARN_UNUSED;
+int NCDInterpProcess_StatementArgsShared (NCDInterpProcess *o, int i);
+NCDValRef NCDInterpProcess_StatementSharedArgs (NCDInterpProcess *o, int i);
+int NCDInterpProcess_CopyStatementArgs (NCDInterpProcess *o, int i, NCDValMem *out_valmem, char *prealloc_mem, int prealloc_size, NCDValRef *out_val, NCDValReplaceProg *out_prog) WARN_UNUSED;
 void NCDInterpProcess_StatementBumpAllocSize (NCDInterpProcess *o, int i, int alloc_size);
+void NCDInterpProcess_StatementBumpArgsSize (NCDInterpProcess *o, int i, size_t args_size);
 int NCDInterpProcess_PreallocSize (NCDInterpProcess *o);
 int NCDInterpProcess_StatementPreallocSize (NCDInterpProcess *o, int i);
 int NCDInterpProcess_StatementPreallocOffset (NCDInterpProcess *o, int i);
+int NCDInterpProcess_StatementArgsPreallocSize (NCDInterpProcess *o, int i);
+int NCDInterpProcess_StatementArgsPreallocOffset (NCDInterpProcess *o, int i);
 const char * NCDInterpProcess_Name (NCDInterpProcess *o);
 int NCDInterpProcess_IsTemplate (NCDInterpProcess *o);
 int NCDInterpProcess_NumStatements (NCDInterpProcess *o);
@@ -57,6 +57,8 @@
 struct statement {
     NCDModuleInst inst;
     NCDValMem args_mem;
+    char *args_prealloc;
+    int args_prealloc_size;
     int mem_size;
     int i;
 };
@@ -101,9 +103,10 @@ static void process_work_job_handler_terminating (struct process *p);
 static int replace_placeholders_callback (void *arg, int plid, NCDValMem *mem, NCDValRef *out);
 static void process_advance (struct process *p);
 static void process_wait_timer_handler (BSmallTimer *timer);
+static int process_get_object (struct process *p, int stmt_idx, NCD_string_id_t name, NCDObject *out_object);
 static int process_find_object (struct process *p, int pos, NCD_string_id_t name, NCDObject *out_object);
-static int process_resolve_object_expr (struct process *p, int pos, const NCD_string_id_t *names, size_t num_names, NCDObject *out_object);
-static int process_resolve_variable_expr (struct process *p, int pos, const NCD_string_id_t *names, size_t num_names, NCDValMem *mem, NCDValRef *out_value);
+static int process_resolve_object_expr (struct process *p, int stmt_idx, const NCD_string_id_t *names, size_t num_names, NCDObject *out_object);
+static int process_resolve_variable_expr (struct process *p, int stmt_idx, const NCD_string_id_t *names, size_t num_names, NCDValMem *mem, NCDValRef *out_value);
 static void statement_logfunc (struct statement *ps);
 static void statement_log (struct statement *ps, int level, const char *fmt, ...);
 static struct process * statement_process (struct statement *ps);
@@ -453,6 +456,8 @@ struct process * process_allocate (NCDInterpreter *interp, NCDInterpProcess *ipr
         ps->inst.istate = SSTATE_FORGOTTEN;
         ps->mem_size = NCDInterpProcess_StatementPreallocSize(iprocess, i);
         ps->inst.mem = mem + NCDInterpProcess_StatementPreallocOffset(iprocess, i);
+        ps->args_prealloc_size = NCDInterpProcess_StatementArgsPreallocSize(iprocess, i);
+        ps->args_prealloc = mem + NCDInterpProcess_StatementArgsPreallocOffset(iprocess, i);
     }
     
     // init timer
@@ -823,7 +828,11 @@ int replace_placeholders_callback (void *arg, int plid, NCDValMem *mem, NCDValRe
     size_t num_names;
     NCDPlaceholderDb_GetVariable(&p->interp->placeholder_db, plid, &varnames, &num_names);
     
-    return process_resolve_variable_expr(p, p->ap, varnames, num_names, mem, out);
+    // the statement the variable refers to was found when the program was loaded
+    int stmt_idx = NCDInterpProcess_PlaceholderBinding(p->iprocess, plid);
+    ASSERT(stmt_idx == NCDInterpProcess_FindStatement(p->iprocess, p->ap, varnames[0]))
+    
+    return process_resolve_variable_expr(p, stmt_idx, varnames, num_names, mem, out);
 }
 
 void process_advance (struct process *p)
@@ -862,8 +871,12 @@ void process_advance (struct process *p)
         }
     } else {
         // get object
+        // get statement the object refers to, found when the program was loaded
+        int stmt_idx = NCDInterpProcess_StatementObjBinding(p->iprocess, p->ap);
+        ASSERT(stmt_idx == NCDInterpProcess_FindStatement(p->iprocess, p->ap, objnames[0]))
+        
         NCDObject object;
-        if (!process_resolve_object_expr(p, p->ap, objnames, num_objnames, &object)) {
+        if (!process_resolve_object_expr(p, stmt_idx, objnames, num_objnames, &object)) {
             goto fail0;
         }
         
@@ -888,26 +901,40 @@ void process_advance (struct process *p)
         }
     }
     
-    // copy arguments
     NCDValRef args;
-    NCDValReplaceProg prog;
-    if (!NCDInterpProcess_CopyStatementArgs(p->iprocess, ps->i, &ps->args_mem, &args, &prog)) {
-        STATEMENT_LOG(ps, BLOG_ERROR, "NCDInterpProcess_CopyStatementArgs failed");
-        goto fail0;
-    }
-    
-    // replace placeholders with values of variables
-    if (!NCDValReplaceProg_Execute(prog, &ps->args_mem, replace_placeholders_callback, p)) {
-        STATEMENT_LOG(ps, BLOG_ERROR, "failed to replace variables in arguments with values");
-        goto fail1;
-    }
     
-    // convert non-continuous strings unless the module can handle them
-    if (!(module->module.flags & NCDMODULE_FLAG_ACCEPT_NON_CONTINUOUS_STRINGS)) {
-        if (!NCDValMem_ConvertNonContinuousStrings(&ps->args_mem, &args)) {
-            STATEMENT_LOG(ps, BLOG_ERROR, "NCDValMem_ConvertNonContinuousStrings failed");
+    if (NCDInterpProcess_StatementArgsShared(p->iprocess, ps->i)) {
+        // arguments have no variables, use them without copying
+        NCDValMem_Init(&ps->args_mem);
+        args = NCDInterpProcess_StatementSharedArgs(p->iprocess, ps->i);
+    } else {
+        // copy arguments, into preallocated memory if possible
+        NCDValReplaceProg prog;
+        if (!NCDInterpProcess_CopyStatementArgs(p->iprocess, ps->i, &ps->args_mem, ps->args_prealloc, ps->args_prealloc_size, &args, &prog)) {
+            STATEMENT_LOG(ps, BLOG_ERROR, "NCDInterpProcess_CopyStatementArgs failed");
+            goto fail0;
+        }
+        
+        // replace placeholders with values of variables
+        if (!NCDValReplaceProg_Execute(prog, &ps->args_mem, replace_placeholders_callback, p)) {
+            STATEMENT_LOG(ps, BLOG_ERROR, "failed to replace variables in arguments with values");
             goto fail1;
         }
+        
+        // convert non-continuous strings unless the module can handle them
+        if (!(module->module.flags & NCDMODULE_FLAG_ACCEPT_NON_CONTINUOUS_STRINGS)) {
+            if (!NCDValMem_ConvertNonContinuousStrings(&ps->args_mem, &args)) {
+                STATEMENT_LOG(ps, BLOG_ERROR, "NCDValMem_ConvertNonContinuousStrings failed");
+                goto fail1;
+            }
+        }
+        
+        // register arguments size for future preallocations, unless they
+        // fit into preallocated memory or the built-in buffer of NCDValMem
+        size_t args_size = NCDValMem_Used(&ps->args_mem);
+        if (args_size > (size_t)ps->args_prealloc_size && args_size > NCDVAL_FASTBUF_SIZE) {
+            NCDInterpProcess_StatementBumpArgsSize(p->iprocess, ps->i, args_size);
+        }
     }
     
     // allocate memory
@@ -959,13 +986,13 @@ void process_wait_timer_handler (BSmallTimer *timer)
     process_advance(p);
 }
 
-int process_find_object (struct process *p, int pos, NCD_string_id_t name, NCDObject *out_object)
+int process_get_object (struct process *p, int stmt_idx, NCD_string_id_t name, NCDObject *out_object)
 {
-    ASSERT(pos >= 0)
-    ASSERT(pos <= p->num_statements)
+    ASSERT(stmt_idx >= -1)
+    ASSERT(stmt_idx < p->num_statements)
     ASSERT(out_object)
     
-    int i = NCDInterpProcess_FindStatement(p->iprocess, pos, name);
+    int i = stmt_idx;
     if (i >= 0) {
         struct statement *ps = &p->statements[i];
         ASSERT(i < p->num_statements)
@@ -986,16 +1013,27 @@ int process_find_object (struct process *p, int pos, NCD_string_id_t name, NCDOb
     return 0;
 }
 
-int process_resolve_object_expr (struct process *p, int pos, const NCD_string_id_t *names, size_t num_names, NCDObject *out_object)
+int process_find_object (struct process *p, int pos, NCD_string_id_t name, NCDObject *out_object)
 {
     ASSERT(pos >= 0)
     ASSERT(pos <= p->num_statements)
+    ASSERT(out_object)
+    
+    int stmt_idx = NCDInterpProcess_FindStatement(p->iprocess, pos, name);
+    
+    return process_get_object(p, stmt_idx, name, out_object);
+}
+
+int process_resolve_object_expr (struct process *p, int stmt_idx, const NCD_string_id_t *names, size_t num_names, NCDObject *out_object)
+{
+    ASSERT(stmt_idx >= -1)
+    ASSERT(stmt_idx < p->ap)
     ASSERT(names)
     ASSERT(num_names > 0)
     ASSERT(out_object)
     
     NCDObject object;
-    if (!process_find_object(p, pos, names[0], &object)) {
+    if (!process_get_object(p, stmt_idx, names[0], &object)) {
         goto fail;
     }
     
@@ -1007,22 +1045,22 @@ int process_resolve_object_expr (struct process *p, int pos, const NCD_string_id
     
 fail:;
     char *name = implode_id_strings(p->interp, names, num_names, '.');
-    process_log(p, BLOG_ERROR, "failed to resolve object (%s) from position %zu", (name ? name : ""), pos);
+    process_log(p, BLOG_ERROR, "failed to resolve object (%s) from position %d", (name ? name : ""), p->ap);
     free(name);
     return 0;
 }
 
-int process_resolve_variable_expr (struct process *p, int pos, const NCD_string_id_t *names, size_t num_names, NCDValMem *mem, NCDValRef *out_value)
+int process_resolve_variable_expr (struct process *p, int stmt_idx, const NCD_string_id_t *names, size_t num_names, NCDValMem *mem, NCDValRef *out_value)
 {
-    ASSERT(pos >= 0)
-    ASSERT(pos <= p->num_statements)
+    ASSERT(stmt_idx >= -1)
+    ASSERT(stmt_idx < p->ap)
     ASSERT(names)
     ASSERT(num_names > 0)
     ASSERT(mem)
     ASSERT(out_value)
     
     NCDObject object;
-    if (!process_find_object(p, pos, names[0], &object)) {
+    if (!process_get_object(p, stmt_idx, names[0], &object)) {
         goto fail;
     }
     
@@ -1034,7 +1072,7 @@ int process_resolve_variable_expr (struct process *p, int pos, const NCD_string_
     
 fail:;
     char *name = implode_id_strings(p->interp, names, num_names, '.');
-    process_log(p, BLOG_ERROR, "failed to resolve variable (%s) from position %zu", (name ? name : ""), pos);
+    process_log(p, BLOG_ERROR, "failed to resolve variable (%s) from position %d", (name ? name : ""), p->ap);
     free(name);
     return 0;
 }
@@ -0,0 +1,892 @@
+/**
+ * @file NCDProgramCache.c
+ * @author Psiphon Inc.
+ * 
+ * @section LICENSE
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include <misc/debug.h>
+#include <misc/balloc.h>
+#include <misc/byteorder.h>
+#include <misc/expstring.h>
+#include <misc/strdup.h>
+#include <misc/concat_strings.h>
+#include <misc/write_file.h>
+#include <base/BLog.h>
+#include <ncd/NCDStringIndex.h>
+
+#include "NCDProgramCache.h"
+
+#include <generated/blog_channel_NCDProgramCache.h>
+
+#define CACHE_MAGIC UINT32_C(0x434e4350)
+#define CACHE_VERSION 1
+#define CACHE_NONE UINT32_C(0xFFFFFFFF)
+#define MAX_VALUE_DEPTH 256
+
+/*
+ * Cache file format. All integers are little endian.
+ * 
+ * header:
+ *   u32 magic, u32 version, u32 num_strings, u32 num_sources, u32 num_processes
+ * string table, num_strings times:
+ *   u32 length, length bytes of data, one zero byte
+ * sources, num_sources times (the first one is the main file):
+ *   u32 path (string index), u64 size, u64 inode, u64 mtime_sec, u32 mtime_nsec
+ * processes, num_processes times, in reverse program order:
+ *   u8 is_template, u32 name (string index), u32 num_statements,
+ *   statements, in reverse block order:
+ *     u32 name, u32 objname (string index or NONE), u32 cmdname (string index),
+ *     value (arguments)
+ * value:
+ *   u8 type, followed by:
+ *     STRING, VAR: u32 string index
+ *     LIST: u32 count, count values in order
+ *     MAP: u32 count, count key-value pairs in reverse order
+ * 
+ * Elements whose AST containers only support prepending are stored in reverse,
+ * so that the loader can build the AST in a single forward pass.
+ */
+
+struct write_state {
+    NCDStringIndex string_index;
+    int32_t *string_map;
+    size_t string_map_size;
+    uint32_t num_strings;
+    ExpString strtab;
+    ExpString body;
+};
+
+struct cache_string {
+    const char *data;
+    size_t length;
+};
+
+struct load_state {
+    const uint8_t *data;
+    size_t len;
+    size_t pos;
+    struct cache_string *strings;
+    uint32_t num_strings;
+};
+
+static int append_u8 (ExpString *s, uint8_t x)
+{
+    return ExpString_AppendByte(s, x);
+}
+
+static int append_u32 (ExpString *s, uint32_t x)
+{
+    x = htol32(x);
+    return ExpString_AppendBinary(s, (uint8_t *)&x, sizeof(x));
+}
+
+static int append_u64 (ExpString *s, uint64_t x)
+{
+    x = htol64(x);
+    return ExpString_AppendBinary(s, (uint8_t *)&x, sizeof(x));
+}
+
+static int intern_string (struct write_state *ws, const char *data, size_t length, uint32_t *out_idx)
+{
+    if (length > UINT32_MAX) {
+        return 0;
+    }
+    
+    NCD_string_id_t id = NCDStringIndex_GetBin(&ws->string_index, data, length);
+    if (id < 0) {
+        return 0;
+    }
+    
+    if ((size_t)id >= ws->string_map_size) {
+        size_t new_size = ws->string_map_size * 2;
+        if (new_size <= (size_t)id) {
+            new_size = (size_t)id + 1;
+        }
+        
+        int32_t *new_map = BReallocArray(ws->string_map, new_size, sizeof(ws->string_map[0]));
+        if (!new_map) {
+            return 0;
+        }
+        
+        for (size_t i = ws->string_map_size; i < new_size; i++) {
+            new_map[i] = -1;
+        }
+        
+        ws->string_map = new_map;
+        ws->string_map_size = new_size;
+    }
+    
+    if (ws->string_map[id] < 0) {
+        if (ws->num_strings == INT32_MAX) {
+            return 0;
+        }
+        
+        if (!append_u32(&ws->strtab, length) ||
+            !ExpString_AppendBinary(&ws->strtab, (const uint8_t *)data, length) ||
+            !append_u8(&ws->strtab, 0)
+        ) {
+            return 0;
+        }
+        
+        ws->string_map[id] = ws->num_strings++;
+    }
+    
+    *out_idx = ws->string_map[id];
+    return 1;
+}
+
+static int write_string_ref (struct write_state *ws, const char *str)
+{
+    uint32_t idx = CACHE_NONE;
+    
+    if (str && !intern_string(ws, str, strlen(str), &idx)) {
+        return 0;
+    }
+    
+    return append_u32(&ws->body, idx);
+}
+
+static int write_value (struct write_state *ws, NCDValue *v, int depth)
+{
+    if (depth > MAX_VALUE_DEPTH) {
+        BLog(BLOG_ERROR, "maximum value depth exceeded");
+        return 0;
+    }
+    
+    if (!append_u8(&ws->body, NCDValue_Type(v))) {
+        return 0;
+    }
+    
+    switch (NCDValue_Type(v)) {
+        case NCDVALUE_STRING: {
+            uint32_t idx;
+            if (!intern_string(ws, NCDValue_StringValue(v), NCDValue_StringLength(v), &idx) ||
+                !append_u32(&ws->body, idx)
+            ) {
+                return 0;
+            }
+        } break;
+        
+        case NCDVALUE_VAR: {
+            if (!write_string_ref(ws, NCDValue_VarName(v))) {
+                return 0;
+            }
+        } break;
+        
+        case NCDVALUE_LIST: {
+            if (NCDValue_ListCount(v) > UINT32_MAX || !append_u32(&ws->body, NCDValue_ListCount(v))) {
+                return 0;
+            }
+            
+            for (NCDValue *e = NCDValue_ListFirst(v); e; e = NCDValue_ListNext(v, e)) {
+                if (!write_value(ws, e, depth + 1)) {
+                    return 0;
+                }
+            }
+        } break;
+        
+        case NCDVALUE_MAP: {
+            size_t count = NCDValue_MapCount(v);
+            if (count > UINT32_MAX || !append_u32(&ws->body, count)) {
+                return 0;
+            }
+            
+            NCDValue **keys = BAllocArray(count > 0 ? count : 1, sizeof(keys[0]));
+            if (!keys) {
+                return 0;
+            }
+            
+            size_t i = 0;
+            for (NCDValue *ek = NCDValue_MapFirstKey(v); ek; ek = NCDValue_MapNextKey(v, ek)) {
+                keys[i++] = ek;
+            }
+            ASSERT(i == count)
+            
+            while (i-- > 0) {
+                if (!write_value(ws, keys[i], depth + 1) ||
+                    !write_value(ws, NCDValue_MapKeyValue(v, keys[i]), depth + 1)
+                ) {
+                    BFree(keys);
+                    return 0;
+                }
+            }
+            
+            BFree(keys);
+        } break;
+        
+        default:
+            ASSERT(0);
+    }
+    
+    return 1;
+}
+
+static int write_statement (struct write_state *ws, NCDStatement *s)
+{
+    if (NCDStatement_Type(s) != NCDSTATEMENT_REG) {
+        BLog(BLOG_ERROR, "program contains non-regular statements");
+        return 0;
+    }
+    
+    return write_string_ref(ws, NCDStatement_Name(s)) &&
+           write_string_ref(ws, NCDStatement_RegObjName(s)) &&
+           write_string_ref(ws, NCDStatement_RegCmdName(s)) &&
+           write_value(ws, NCDStatement_RegArgs(s), 0);
+}
+
+static int write_process (struct write_state *ws, NCDProcess *proc)
+{
+    NCDBlock *block = NCDProcess_Block(proc);
+    size_t count = NCDBlock_NumStatements(block);
+    
+    if (count > UINT32_MAX ||
+        !append_u8(&ws->body, NCDProcess_IsTemplate(proc)) ||
+        !write_string_ref(ws, NCDProcess_Name(proc)) ||
+        !append_u32(&ws->body, count)
+    ) {
+        return 0;
+    }
+    
+    NCDStatement **stmts = BAllocArray(count > 0 ? count : 1, sizeof(stmts[0]));
+    if (!stmts) {
+        return 0;
+    }
+    
+    size_t i = 0;
+    for (NCDStatement *s = NCDBlock_FirstStatement(block); s; s = NCDBlock_NextStatement(block, s)) {
+        stmts[i++] = s;
+    }
+    ASSERT(i == count)
+    
+    while (i-- > 0) {
+        if (!write_statement(ws, stmts[i])) {
+            BFree(stmts);
+            return 0;
+        }
+    }
+    
+    BFree(stmts);
+    return 1;
+}
+
+static int write_program (struct write_state *ws, NCDProgram *prog)
+{
+    size_t count = NCDProgram_NumElems(prog);
+    
+    NCDProgramElem **elems = BAllocArray(count > 0 ? count : 1, sizeof(elems[0]));
+    if (!elems) {
+        return 0;
+    }
+    
+    size_t i = 0;
+    for (NCDProgramElem *e = NCDProgram_FirstElem(prog); e; e = NCDProgram_NextElem(prog, e)) {
+        elems[i++] = e;
+    }
+    ASSERT(i == count)
+    
+    while (i-- > 0) {
+        if (NCDProgramElem_Type(elems[i]) != NCDPROGRAMELEM_PROCESS) {
+            BLog(BLOG_ERROR, "program contains non-process elements");
+            goto fail;
+        }
+        
+        if (!write_process(ws, NCDProgramElem_Process(elems[i]))) {
+            goto fail;
+        }
+    }
+    
+    BFree(elems);
+    return 1;
+    
+fail:
+    BFree(elems);
+    return 0;
+}
+
+static int stat_source (const char *path, struct NCDProgramCache__source *out)
+{
+    struct stat st;
+    if (stat(path, &st) < 0) {
+        return 0;
+    }
+    
+    out->size = st.st_size;
+    out->ino = st.st_ino;
+    out->mtime_sec = st.st_mtim.tv_sec;
+    out->mtime_nsec = st.st_mtim.tv_nsec;
+    return 1;
+}
+
+void NCDProgramCacheWriter_Init (NCDProgramCacheWriter *o)
+{
+    o->sources = NULL;
+    o->num_sources = 0;
+    
+    DebugObject_Init(&o->d_obj);
+}
+
+void NCDProgramCacheWriter_Free (NCDProgramCacheWriter *o)
+{
+    DebugObject_Free(&o->d_obj);
+    
+    for (size_t i = 0; i < o->num_sources; i++) {
+        free(o->sources[i].path);
+    }
+    
+    BFree(o->sources);
+}
+
+int NCDProgramCacheWriter_AddSource (void *vo, const char *file_path)
+{
+    NCDProgramCacheWriter *o = vo;
+    DebugObject_Access(&o->d_obj);
+    ASSERT(file_path)
+    
+    struct NCDProgramCache__source src;
+    if (!stat_source(file_path, &src)) {
+        BLog(BLOG_ERROR, "failed to stat '%s'", file_path);
+        goto fail0;
+    }
+    
+    if (!(src.path = b_strdup(file_path))) {
+        BLog(BLOG_ERROR, "b_strdup failed");
+        goto fail0;
+    }
+    
+    struct NCDProgramCache__source *new_sources = BReallocArray(o->sources, o->num_sources + 1, sizeof(o->sources[0]));
+    if (!new_sources) {
+        BLog(BLOG_ERROR, "BReallocArray failed");
+        goto fail1;
+    }
+    
+    o->sources = new_sources;
+    o->sources[o->num_sources++] = src;
+    
+    return 1;
+    
+fail1:
+    free(src.path);
+fail0:
+    return 0;
+}
+
+int NCDProgramCacheWriter_Write (NCDProgramCacheWriter *o, NCDProgram *prog, const char *cache_path)
+{
+    DebugObject_Access(&o->d_obj);
+    ASSERT(o->num_sources > 0)
+    ASSERT(prog)
+    ASSERT(cache_path)
+    
+    int ret_val = 0;
+    
+    struct write_state ws;
+    ws.string_map = NULL;
+    ws.string_map_size = 0;
+    ws.num_strings = 0;
+    
+    if (!NCDStringIndex_Init(&ws.string_index)) {
+        BLog(BLOG_ERROR, "NCDStringIndex_Init failed");
+        goto fail0;
+    }
+    
+    if (!ExpString_Init(&ws.strtab)) {
+        BLog(BLOG_ERROR, "ExpString_Init failed");
+        goto fail1;
+    }
+    
+    if (!ExpString_Init(&ws.body)) {
+        BLog(BLOG_ERROR, "ExpString_Init failed");
+        goto fail2;
+    }
+    
+    if (o->num_sources > UINT32_MAX || NCDProgram_NumElems(prog) > UINT32_MAX) {
+        BLog(BLOG_ERROR, "too many sources or processes");
+        goto fail3;
+    }
+    
+    for (size_t i = 0; i < o->num_sources; i++) {
+        struct NCDProgramCache__source *src = &o->sources[i];
+        uint32_t path_idx;
+        if (!intern_string(&ws, src->path, strlen(src->path), &path_idx) ||
+            !append_u32(&ws.body, path_idx) ||
+            !append_u64(&ws.body, src->size) ||
+            !append_u64(&ws.body, src->ino) ||
+            !append_u64(&ws.body, src->mtime_sec) ||
+            !append_u32(&ws.body, src->mtime_nsec)
+        ) {
+            BLog(BLOG_ERROR, "failed to write sources");
+            goto fail3;
+        }
+    }
+    
+    if (!write_program(&ws, prog)) {
+        BLog(BLOG_ERROR, "failed to write program");
+        goto fail3;
+    }
+    
+    ExpString out;
+    if (!ExpString_Init(&out)) {
+        BLog(BLOG_ERROR, "ExpString_Init failed");
+        goto fail3;
+    }
+    
+    if (!append_u32(&out, CACHE_MAGIC) ||
+        !append_u32(&out, CACHE_VERSION) ||
+        !append_u32(&out, ws.num_strings) ||
+        !append_u32(&out, o->num_sources) ||
+        !append_u32(&out, NCDProgram_NumElems(prog)) ||
+        !ExpString_AppendBinary(&out, (const uint8_t *)ExpString_Get(&ws.strtab), ExpString_Length(&ws.strtab)) ||
+        !ExpString_AppendBinary(&out, (const uint8_t *)ExpString_Get(&ws.body), ExpString_Length(&ws.body))
+    ) {
+        BLog(BLOG_ERROR, "failed to assemble cache");
+        goto fail4;
+    }
+    
+    char *tmp_path = concat_strings(2, cache_path, ".tmp");
+    if (!tmp_path) {
+        BLog(BLOG_ERROR, "concat_strings failed");
+        goto fail4;
+    }
+    
+    if (!write_file(tmp_path, (const uint8_t *)ExpString_Get(&out), ExpString_Length(&out))) {
+        BLog(BLOG_ERROR, "failed to write '%s'", tmp_path);
+        unlink(tmp_path);
+        goto fail5;
+    }
+    
+    if (rename(tmp_path, cache_path) < 0) {
+        BLog(BLOG_ERROR, "failed to rename '%s' to '%s'", tmp_path, cache_path);
+        unlink(tmp_path);
+        goto fail5;
+    }
+    
+    BLog(BLOG_INFO, "wrote program cache '%s' (%zu bytes, %"PRIu32" strings)", cache_path, ExpString_Length(&out), ws.num_strings);
+    
+    ret_val = 1;
+    
+fail5:
+    free(tmp_path);
+fail4:
+    ExpString_Free(&out);
+fail3:
+    ExpString_Free(&ws.body);
+fail2:
+    ExpString_Free(&ws.strtab);
+fail1:
+    BFree(ws.string_map);
+    NCDStringIndex_Free(&ws.string_index);
+fail0:
+    return ret_val;
+}
+
+static int read_bytes (struct load_state *ls, size_t n, const uint8_t **out)
+{
+    if (n > ls->len - ls->pos) {
+        return 0;
+    }
+    
+    *out = ls->data + ls->pos;
+    ls->pos += n;
+    return 1;
+}
+
+static int read_u8 (struct load_state *ls, uint8_t *out)
+{
+    const uint8_t *p;
+    if (!read_bytes(ls, 1, &p)) {
+        return 0;
+    }
+    
+    *out = *p;
+    return 1;
+}
+
+static int read_u32 (struct load_state *ls, uint32_t *out)
+{
+    const uint8_t *p;
+    if (!read_bytes(ls, sizeof(*out), &p)) {
+        return 0;
+    }
+    
+    memcpy(out, p, sizeof(*out));
+    *out = ltoh32(*out);
+    return 1;
+}
+
+static int read_u64 (struct load_state *ls, uint64_t *out)
+{
+    const uint8_t *p;
+    if (!read_bytes(ls, sizeof(*out), &p)) {
+        return 0;
+    }
+    
+    memcpy(out, p, sizeof(*out));
+    *out = ltoh64(*out);
+    return 1;
+}
+
+static int read_string (struct load_state *ls, struct cache_string **out)
+{
+    uint32_t idx;
+    if (!read_u32(ls, &idx) || idx >= ls->num_strings) {
+        return 0;
+    }
+    
+    *out = &ls->strings[idx];
+    return 1;
+}
+
+// reads a string reference to be used as a C string; if allow_none,
+// CACHE_NONE is accepted and results in NULL
+static int read_cstring (struct load_state *ls, int allow_none, const char **out)
+{
+    uint32_t idx;
+    if (!read_u32(ls, &idx)) {
+        return 0;
+    }
+    
+    if (idx == CACHE_NONE && allow_none) {
+        *out = NULL;
+        return 1;
+    }
+    
+    if (idx >= ls->num_strings) {
+        return 0;
+    }
+    
+    struct cache_string *str = &ls->strings[idx];
+    if (memchr(str->data, '\0', str->length)) {
+        return 0;
+    }
+    
+    *out = str->data;
+    return 1;
+}
+
+static int load_value (struct load_state *ls, int depth, NCDValue *out)
+{
+    uint8_t type;
+    if (depth > MAX_VALUE_DEPTH || !read_u8(ls, &type)) {
+        return 0;
+    }
+    
+    switch (type) {
+        case NCDVALUE_STRING: {
+            struct cache_string *str;
+            if (!read_string(ls, &str)) {
+                return 0;
+            }
+            return NCDValue_InitStringBin(out, (const uint8_t *)str->data, str->length);
+        } break;
+        
+        case NCDVALUE_VAR: {
+            const char *name;
+            if (!read_cstring(ls, 0, &name)) {
+                return 0;
+            }
+            return NCDValue_InitVar(out, name);
+        } break;
+        
+        case NCDVALUE_LIST: {
+            uint32_t count;
+            if (!read_u32(ls, &count)) {
+                return 0;
+            }
+            
+            NCDValue_InitList(out);
+            
+            for (uint32_t i = 0; i < count; i++) {
+                NCDValue v;
+                if (!load_value(ls, depth + 1, &v)) {
+                    goto list_fail;
+                }
+                if (!NCDValue_ListAppend(out, v)) {
+                    NCDValue_Free(&v);
+                    goto list_fail;
+                }
+            }
+            
+            return 1;
+            
+        list_fail:
+            NCDValue_Free(out);
+            return 0;
+        } break;
+        
+        case NCDVALUE_MAP: {
+            uint32_t count;
+            if (!read_u32(ls, &count)) {
+                return 0;
+            }
+            
+            NCDValue_InitMap(out);
+            
+            for (uint32_t i = 0; i < count; i++) {
+                NCDValue key;
+                if (!load_value(ls, depth + 1, &key)) {
+                    goto map_fail;
+                }
+                NCDValue val;
+                if (!load_value(ls, depth + 1, &val)) {
+                    NCDValue_Free(&key);
+                    goto map_fail;
+                }
+                if (!NCDValue_MapPrepend(out, key, val)) {
+                    NCDValue_Free(&val);
+                    NCDValue_Free(&key);
+                    goto map_fail;
+                }
+            }
+            
+            return 1;
+            
+        map_fail:
+            NCDValue_Free(out);
+            return 0;
+        } break;
+        
+        default:
+            return 0;
+    }
+}
+
+static int load_statement (struct load_state *ls, NCDStatement *out)
+{
+    const char *name;
+    const char *objname;
+    const char *cmdname;
+    if (!read_cstring(ls, 1, &name) || !read_cstring(ls, 1, &objname) || !read_cstring(ls, 0, &cmdname)) {
+        return 0;
+    }
+    
+    NCDValue args;
+    if (!load_value(ls, 0, &args)) {
+        return 0;
+    }
+    
+    if (NCDValue_Type(&args) != NCDVALUE_LIST || !NCDStatement_InitReg(out, name, objname, cmdname, args)) {
+        NCDValue_Free(&args);
+        return 0;
+    }
+    
+    return 1;
+}
+
+static int load_process (struct load_state *ls, NCDProcess *out)
+{
+    uint8_t is_template;
+    const char *name;
+    uint32_t num_statements;
+    if (!read_u8(ls, &is_template) || is_template > 1 || !read_cstring(ls, 0, &name) || !read_u32(ls, &num_statements)) {
+        return 0;
+    }
+    
+    NCDBlock block;
+    NCDBlock_Init(&block);
+    
+    for (uint32_t i = 0; i < num_statements; i++) {
+        NCDStatement s;
+        if (!load_statement(ls, &s)) {
+            goto fail;
+        }
+        if (!NCDBlock_PrependStatement(&block, s)) {
+            NCDStatement_Free(&s);
+            goto fail;
+        }
+    }
+    
+    if (!NCDProcess_Init(out, is_template, name, block)) {
+        goto fail;
+    }
+    
+    return 1;
+    
+fail:
+    NCDBlock_Free(&block);
+    return 0;
+}
+
+static int check_sources (struct load_state *ls, uint32_t num_sources, const char *main_file)
+{
+    for (uint32_t i = 0; i < num_sources; i++) {
+        const char *path;
+        struct NCDProgramCache__source rec;
+        uint64_t mtime_sec;
+        if (!read_cstring(ls, 0, &path) ||
+            !read_u64(ls, &rec.size) ||
+            !read_u64(ls, &rec.ino) ||
+            !read_u64(ls, &mtime_sec) ||
+            !read_u32(ls, &rec.mtime_nsec)
+        ) {
+            BLog(BLOG_WARNING, "cache is corrupt");
+            return 0;
+        }
+        rec.mtime_sec = mtime_sec;
+        
+        if (i == 0 && strcmp(path, main_file)) {
+            BLog(BLOG_INFO, "cache was written for a different program");
+            return 0;
+        }
+        
+        struct NCDProgramCache__source cur;
+        if (!stat_source(path, &cur) || cur.size != rec.size || cur.ino != rec.ino ||
+            cur.mtime_sec != rec.mtime_sec || cur.mtime_nsec != rec.mtime_nsec
+        ) {
+            BLog(BLOG_INFO, "cache is stale: '%s' changed", path);
+            return 0;
+        }
+    }
+    
+    return 1;
+}
+
+int NCDProgramCache_Load (const char *cache_path, const char *main_file, NCDProgram *out_program)
+{
+    ASSERT(cache_path)
+    ASSERT(main_file)
+    ASSERT(out_program)
+    
+    int fd = open(cache_path, O_RDONLY);
+    if (fd < 0) {
+        BLog(BLOG_INFO, "cache '%s' not available", cache_path);
+        goto fail0;
+    }
+    
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size <= 0 || (uint64_t)st.st_size > SIZE_MAX) {
+        BLog(BLOG_WARNING, "cache '%s' has bad size", cache_path);
+        goto fail1;
+    }
+    
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+        BLog(BLOG_ERROR, "mmap failed");
+        goto fail1;
+    }
+    
+    struct load_state ls;
+    ls.data = map;
+    ls.len = st.st_size;
+    ls.pos = 0;
+    ls.strings = NULL;
+    
+    uint32_t magic;
+    uint32_t version;
+    uint32_t num_sources;
+    uint32_t num_processes;
+    if (!read_u32(&ls, &magic) || magic != CACHE_MAGIC ||
+        !read_u32(&ls, &version) || version != CACHE_VERSION ||
+        !read_u32(&ls, &ls.num_strings) ||
+        !read_u32(&ls, &num_sources) || num_sources == 0 ||
+        !read_u32(&ls, &num_processes)
+    ) {
+        BLog(BLOG_WARNING, "cache '%s' has bad header or version", cache_path);
+        goto fail2;
+    }
+    
+    // each string takes at least 5 bytes
+    if (ls.num_strings > (ls.len - ls.pos) / 5) {
+        BLog(BLOG_WARNING, "cache '%s' is corrupt", cache_path);
+        goto fail2;
+    }
+    
+    if (!(ls.strings = BAllocArray(ls.num_strings > 0 ? ls.num_strings : 1, sizeof(ls.strings[0])))) {
+        BLog(BLOG_ERROR, "BAllocArray failed");
+        goto fail2;
+    }
+    
+    for (uint32_t i = 0; i < ls.num_strings; i++) {
+        uint32_t length;
+        const uint8_t *p;
+        if (!read_u32(&ls, &length) || length == UINT32_MAX || !read_bytes(&ls, (size_t)length + 1, &p) || p[length] != 0) {
+            BLog(BLOG_WARNING, "cache '%s' is corrupt", cache_path);
+            goto fail3;
+        }
+        ls.strings[i].data = (const char *)p;
+        ls.strings[i].length = length;
+    }
+    
+    if (!check_sources(&ls, num_sources, main_file)) {
+        goto fail3;
+    }
+    
+    NCDProgram prog;
+    NCDProgram_Init(&prog);
+    
+    for (uint32_t i = 0; i < num_processes; i++) {
+        NCDProcess proc;
+        if (!load_process(&ls, &proc)) {
+            BLog(BLOG_WARNING, "cache '%s' is corrupt or out of memory", cache_path);
+            goto fail4;
+        }
+        
+        NCDProgramElem elem;
+        NCDProgramElem_InitProcess(&elem, proc);
+        
+        if (!NCDProgram_PrependElem(&prog, elem)) {
+            BLog(BLOG_ERROR, "NCDProgram_PrependElem failed");
+            NCDProgramElem_Free(&elem);
+            goto fail4;
+        }
+    }
+    
+    if (ls.pos != ls.len) {
+        BLog(BLOG_WARNING, "cache '%s' has trailing data", cache_path);
+        goto fail4;
+    }
+    
+    BFree(ls.strings);
+    munmap(map, st.st_size);
+    close(fd);
+    
+    BLog(BLOG_INFO, "loaded program from cache '%s'", cache_path);
+    
+    *out_program = prog;
+    return 1;
+    
+fail4:
+    NCDProgram_Free(&prog);
+fail3:
+    BFree(ls.strings);
+fail2:
+    munmap(map, st.st_size);
+fail1:
+    close(fd);
+fail0:
+    return 0;
+}
@@ -0,0 +1,113 @@
+/**
+ * @file NCDProgramCache.h
+ * @author Psiphon Inc.
+ * 
+ * @section LICENSE
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef BADVPN_NCDPROGRAMCACHE_H
+#define BADVPN_NCDPROGRAMCACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <misc/debug.h>
+#include <base/DebugObject.h>
+#include <ncd/NCDAst.h>
+
+struct NCDProgramCache__source {
+    char *path;
+    uint64_t size;
+    uint64_t ino;
+    int64_t mtime_sec;
+    uint32_t mtime_nsec;
+};
+
+/**
+ * Writes compiled program cache files which can later be loaded using
+ * {@link NCDProgramCache_Load}.
+ * 
+ * A cache file holds a program (as built by {@link NCDBuildProgram_Build} and
+ * desugared by {@link NCDSugar_Desugar}), with all the strings it uses in an
+ * interned string table, as well as the identity of each source file the program
+ * was built from. The cache is considered fresh only while all these source files
+ * remain unchanged.
+ */
+typedef struct {
+    struct NCDProgramCache__source *sources;
+    size_t num_sources;
+    DebugObject d_obj;
+} NCDProgramCacheWriter;
+
+/**
+ * Initializes the cache writer, with no sources.
+ */
+void NCDProgramCacheWriter_Init (NCDProgramCacheWriter *o);
+
+/**
+ * Frees the cache writer.
+ */
+void NCDProgramCacheWriter_Free (NCDProgramCacheWriter *o);
+
+/**
+ * Records a source file of the program. The file is stat'd immediately, so this
+ * should be called before the file is read. The first source added must be the
+ * main file of the program.
+ * This has the signature of {@link NCDBuildProgram_file_handler}.
+ * 
+ * @param vo pointer to the NCDProgramCacheWriter
+ * @param file_path path of the source file
+ * @return 1 on success, 0 on failure
+ */
+int NCDProgramCacheWriter_AddSource (void *vo, const char *file_path) WARN_UNUSED;
+
+/**
+ * Writes a program to a cache file. The file is written under a temporary
+ * name and then renamed into place.
+ * 
+ * @param o the object. At least one source must have been added.
+ * @param prog program to write. It must contain only process elements with
+ *             regular statements, i.e. it must have been built and desugared.
+ * @param cache_path path of the cache file
+ * @return 1 on success, 0 on failure
+ */
+int NCDProgramCacheWriter_Write (NCDProgramCacheWriter *o, NCDProgram *prog, const char *cache_path) WARN_UNUSED;
+
+/**
+ * Loads a program from a cache file, if the cache is fresh.
+ * The cache is used only if it was written for the same main file, by a compatible
+ * version, and all its source files still have the size, inode and modification
+ * time they had when the cache was written.
+ * The cache file is mapped into memory and parsed in place.
+ * 
+ * @param cache_path path of the cache file
+ * @param main_file path of the main file of the program
+ * @param out_program on success, *out_program will contain the program, already
+ *                    desugared. On failure, *out_program will be unchanged.
+ * @return 1 if the program was loaded, 0 if the cache is missing, stale or invalid
+ */
+int NCDProgramCache_Load (const char *cache_path, const char *main_file, NCDProgram *out_program) WARN_UNUSED;
+
+#endif
@@ -100,6 +100,30 @@ static void * NCDValMem__BufAt (NCDValMem *o, NCDVal__idx idx)
     return (o->buf ? o->buf : o->fastbuf) + idx;
 }
 
+static int NCDValMem__RefTargets (NCDValMem *o)
+{
+    NCDVal__idx refidx = o->first_ref;
+    while (refidx != -1) {
+        struct NCDVal__ref *ref = NCDValMem__BufAt(o, refidx);
+        ASSERT(ref->target)
+        if (!BRefTarget_Ref(ref->target)) {
+            goto fail;
+        }
+        refidx = ref->next;
+    }
+    
+    return 1;
+    
+fail:;
+    NCDVal__idx undo_refidx = o->first_ref;
+    while (undo_refidx != refidx) {
+        struct NCDVal__ref *ref = NCDValMem__BufAt(o, undo_refidx);
+        BRefTarget_Deref(ref->target);
+        undo_refidx = ref->next;
+    }
+    return 0;
+}
+
 static NCDVal__idx NCDValMem__Alloc (NCDValMem *o, NCDVal__idx alloc_size, NCDVal__idx align)
 {
     NCDVal__idx mod = o->used % align;
@@ -111,7 +135,7 @@ static NCDVal__idx NCDValMem__Alloc (NCDValMem *o, NCDVal__idx alloc_size, NCDVa
     NCDVal__idx aligned_alloc_size = align_extra + alloc_size;
     
     if (aligned_alloc_size > o->size - o->used) {
-        NCDVal__idx newsize = (o->buf ? o->size : NCDVAL_FIRST_SIZE);
+        NCDVal__idx newsize = ((o->buf && !o->buf_external) ? o->size : NCDVAL_FIRST_SIZE);
         while (aligned_alloc_size > newsize - o->used) {
             if (newsize > NCDVAL_MAXIDX / 2) {
                 return -1;
@@ -121,12 +145,12 @@ static NCDVal__idx NCDValMem__Alloc (NCDValMem *o, NCDVal__idx alloc_size, NCDVa
         
         char *newbuf;
         
-        if (!o->buf) {
+        if (!o->buf || o->buf_external) {
             newbuf = malloc(newsize);
             if (!newbuf) {
                 return -1;
             }
-            memcpy(newbuf, o->fastbuf, o->used);
+            memcpy(newbuf, (o->buf ? o->buf : o->fastbuf), o->used);
         } else {
             newbuf = realloc(o->buf, newsize);
             if (!newbuf) {
@@ -136,6 +160,7 @@ static NCDVal__idx NCDValMem__Alloc (NCDValMem *o, NCDVal__idx alloc_size, NCDVa
         
         o->buf = newbuf;
         o->size = newsize;
+        o->buf_external = 0;
     }
     
     NCDVal__idx idx = o->used + align_extra;
@@ -159,7 +184,8 @@ static void NCDVal__AssertMem (NCDValMem *mem)
     ASSERT(mem->used >= 0)
     ASSERT(mem->used <= mem->size)
     ASSERT(mem->buf || mem->size == NCDVAL_FASTBUF_SIZE)
-    ASSERT(!mem->buf || mem->size >= NCDVAL_FIRST_SIZE)
+    ASSERT(mem->buf || !mem->buf_external)
+    ASSERT(!mem->buf || mem->size >= (mem->buf_external ? NCDVAL_FASTBUF_SIZE : NCDVAL_FIRST_SIZE))
 }
 
 static void NCDVal_AssertExternal (NCDValMem *mem, const void *e_buf, size_t e_len)
@@ -382,6 +408,7 @@ void NCDValMem_Init (NCDValMem *o)
     o->used = 0;
     o->first_ref = -1;
     o->first_cms_link = -1;
+    o->buf_external = 0;
 }
 
 void NCDValMem_Free (NCDValMem *o)
@@ -396,7 +423,7 @@ void NCDValMem_Free (NCDValMem *o)
         refidx = ref->next;
     }
     
-    if (o->buf) {
+    if (o->buf && !o->buf_external) {
         BFree(o->buf);
     }
 }
@@ -405,41 +432,32 @@ int NCDValMem_InitCopy (NCDValMem *o, NCDValMem *other)
 {
     NCDVal__AssertMem(other);
     
-    o->size = other->size;
     o->used = other->used;
     o->first_ref = other->first_ref;
     o->first_cms_link = other->first_cms_link;
+    o->buf_external = 0;
     
     if (!other->buf) {
         o->buf = NULL;
+        o->size = NCDVAL_FASTBUF_SIZE;
         memcpy(o->fastbuf, other->fastbuf, other->used);
     } else {
-        o->buf = BAlloc(other->size);
+        // the other memory object may be using a smaller external buffer
+        o->size = (other->size < NCDVAL_FIRST_SIZE ? NCDVAL_FIRST_SIZE : other->size);
+        o->buf = BAlloc(o->size);
         if (!o->buf) {
             goto fail0;
         }
         memcpy(o->buf, other->buf, other->used);
     }
     
-    NCDVal__idx refidx = o->first_ref;
-    while (refidx != -1) {
-        struct NCDVal__ref *ref = NCDValMem__BufAt(o, refidx);
-        ASSERT(ref->target)
-        if (!BRefTarget_Ref(ref->target)) {
-            goto fail1;
-        }
-        refidx = ref->next;
+    if (!NCDValMem__RefTargets(o)) {
+        goto fail1;
     }
     
     return 1;
     
-fail1:;
-    NCDVal__idx undo_refidx = o->first_ref;
-    while (undo_refidx != refidx) {
-        struct NCDVal__ref *ref = NCDValMem__BufAt(o, undo_refidx);
-        BRefTarget_Deref(ref->target);
-        undo_refidx = ref->next;
-    }
+fail1:
     if (o->buf) {
         BFree(o->buf);
     }
@@ -447,6 +465,34 @@ fail0:
     return 0;
 }
 
+int NCDValMem_InitCopyPrealloc (NCDValMem *o, NCDValMem *other, char *buf, size_t buf_size)
+{
+    NCDVal__AssertMem(other);
+    ASSERT(buf || buf_size == 0)
+    
+    if (buf_size <= NCDVAL_FASTBUF_SIZE || buf_size > NCDVAL_MAXIDX || other->used > buf_size) {
+        return NCDValMem_InitCopy(o, other);
+    }
+    
+    o->buf = buf;
+    o->size = buf_size;
+    o->used = other->used;
+    o->first_ref = other->first_ref;
+    o->first_cms_link = other->first_cms_link;
+    o->buf_external = 1;
+    
+    memcpy(o->buf, (other->buf ? other->buf : other->fastbuf), other->used);
+    
+    return NCDValMem__RefTargets(o);
+}
+
+size_t NCDValMem_Used (NCDValMem *o)
+{
+    NCDVal__AssertMem(o);
+    
+    return o->used;
+}
+
 int NCDValMem_ConvertNonContinuousStrings (NCDValMem *o, NCDValRef *root_val)
 {
     NCDVal__AssertMem(o);
@@ -1821,6 +1867,7 @@ NCDValRef NCDVal_MapGetValue (NCDValRef map, const char *key_str)
     mem.size = NCDVAL_FASTBUF_SIZE;
     mem.used = sizeof(struct NCDVal__externalstring);
     mem.first_ref = -1;
+    mem.buf_external = 0;
     
     struct NCDVal__externalstring *exs_e = (void *)mem.fastbuf;
     exs_e->type = make_type(EXTERNALSTRING_TYPE, 0);
@@ -109,6 +109,7 @@ typedef struct {
     NCDVal__idx used;
     NCDVal__idx first_ref;
     NCDVal__idx first_cms_link;
+    int buf_external;
     union {
         char fastbuf[NCDVAL_FASTBUF_SIZE];
         struct NCDVal__ref align_ref;
@@ -232,6 +233,26 @@ void NCDValMem_Free (NCDValMem *o);
  */
 int NCDValMem_InitCopy (NCDValMem *o, NCDValMem *other) WARN_UNUSED;
 
+/**
+ * Like {@link NCDValMem_InitCopy}, but places the copy into the given buffer
+ * instead of allocating memory, if the buffer is large enough.
+ * The buffer remains owned by the caller; if more memory is needed later, the
+ * values are moved to allocated memory and the buffer is no longer used.
+ * The buffer must be aligned to BMAX_ALIGN and must remain available until
+ * the memory object is freed.
+ * If the buffer is too small (or not larger than the built-in buffer of
+ * memory objects), this behaves as {@link NCDValMem_InitCopy}.
+ * Returns 1 on success and 0 on failure.
+ */
+int NCDValMem_InitCopyPrealloc (NCDValMem *o, NCDValMem *other, char *buf, size_t buf_size) WARN_UNUSED;
+
+/**
+ * Returns the number of bytes of the memory object which are in use.
+ * A buffer of this size passed to {@link NCDValMem_InitCopyPrealloc} is
+ * sufficient to hold a copy of the memory object.
+ */
+size_t NCDValMem_Used (NCDValMem *o);
+
 /**
  * For each internal link (e.g. list element) to a ComposedString in the memory
  * object, copies the ComposedString to some kind ContinuousString, and updates
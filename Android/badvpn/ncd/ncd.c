@@ -44,6 +44,8 @@
 #include <random/BRandom2.h>
 #include <ncd/NCDInterpreter.h>
 #include <ncd/NCDBuildProgram.h>
+#include <ncd/NCDSugar.h>
+#include <ncd/NCDProgramCache.h>
 
 #ifdef BADVPN_USE_SYSLOG
 #include <base/BLog_syslog.h>
@@ -69,6 +71,7 @@ static struct {
     int loglevel;
     int loglevels[BLOG_NUM_CHANNELS];
     char *config_file;
+    char *program_cache;
     int syntax_only;
     int retry_time;
     int no_udev;
@@ -95,6 +98,7 @@ static NCDInterpreter interpreter;
 static void print_help (const char *name);
 static void print_version (void);
 static int parse_arguments (int argc, char *argv[]);
+static int build_program (NCDProgram *out_program);
 static void signal_handler (void *unused);
 static void interpreter_handler_finished (void *user, int exit_code);
 
@@ -199,7 +203,7 @@ int main (int argc, char **argv)
     
     // build program
     NCDProgram program;
-    if (!NCDBuildProgram_Build(options.config_file, &program)) {
+    if (!build_program(&program)) {
         BLog(BLOG_ERROR, "failed to build program");
         goto fail5;
     }
@@ -278,6 +282,7 @@ void print_help (const char *name)
         "        [--retry-time <ms>]\n"
         "        [--no-udev]\n"
         "        [--config-file <ncd_program_file>]\n"
+        "        [--program-cache <cache_file>]\n"
         "        [--syntax-only]\n"
         "        [-- program_args...]\n"
         "        [<ncd_program_file> program_args...]\n" ,
@@ -308,6 +313,7 @@ int parse_arguments (int argc, char *argv[])
         options.loglevels[i] = -1;
     }
     options.config_file = NULL;
+    options.program_cache = NULL;
     options.syntax_only = 0;
     options.retry_time = DEFAULT_RETRY_TIME;
     options.no_udev = 0;
@@ -400,6 +406,14 @@ int parse_arguments (int argc, char *argv[])
             options.config_file = argv[i + 1];
             i++;
         }
+        else if (!strcmp(arg, "--program-cache")) {
+            if (1 >= argc - i) {
+                fprintf(stderr, "%s: requires an argument\n", arg);
+                return 0;
+            }
+            options.program_cache = argv[i + 1];
+            i++;
+        }
         else if (!strcmp(arg, "--syntax-only")) {
             options.syntax_only = 1;
         }
@@ -450,6 +464,48 @@ int parse_arguments (int argc, char *argv[])
     return 1;
 }
 
+int build_program (NCDProgram *out_program)
+{
+    if (!options.program_cache) {
+        return NCDBuildProgram_Build(options.config_file, out_program, NULL, NULL);
+    }
+    
+    // use the cached program if it is fresh
+    if (NCDProgramCache_Load(options.program_cache, options.config_file, out_program)) {
+        return 1;
+    }
+    
+    NCDProgramCacheWriter writer;
+    NCDProgramCacheWriter_Init(&writer);
+    
+    NCDProgram program;
+    if (!NCDBuildProgram_Build(options.config_file, &program, NCDProgramCacheWriter_AddSource, &writer)) {
+        goto fail0;
+    }
+    
+    // desugar here so that the cache holds the desugared program;
+    // the interpreter will then have nothing left to desugar
+    if (!NCDSugar_Desugar(&program)) {
+        BLog(BLOG_ERROR, "NCDSugar_Desugar failed");
+        goto fail1;
+    }
+    
+    if (!NCDProgramCacheWriter_Write(&writer, &program, options.program_cache)) {
+        BLog(BLOG_WARNING, "failed to write program cache, continuing without it");
+    }
+    
+    NCDProgramCacheWriter_Free(&writer);
+    
+    *out_program = program;
+    return 1;
+    
+fail1:
+    NCDProgram_Free(&program);
+fail0:
+    NCDProgramCacheWriter_Free(&writer);
+    return 0;
+}
+
 void signal_handler (void *unused)
 {
     BLog(BLOG_NOTICE, "termination requested");
@@ -444,6 +444,7 @@ static void connection_init_up (BSSLConnection *o)
     
     // init send interface
     StreamPassInterface_Init(&o->send_if, (StreamPassInterface_handler_send)connection_send_if_handler_send, o, o->pg);
+    StreamPassInterface_SetName(&o->send_if, "BSSLConnection");
     
     // init recv interface
     StreamRecvInterface_Init(&o->recv_if, (StreamRecvInterface_handler_recv)connection_recv_if_handler_recv, o, o->pg);
@@ -38,6 +38,9 @@
 #define UDPGW_CLIENT_FLAG_REBIND (1 << 1)
 #define UDPGW_CLIENT_FLAG_DNS (1 << 2)
 #define UDPGW_CLIENT_FLAG_IPV6 (1 << 3)
+#define UDPGW_CLIENT_FLAG_SESSION (1 << 4)
+
+#define UDPGW_SESSION_ID_LEN 16
 
 B_START_PACKED
 struct udpgw_header {
@@ -46,6 +49,19 @@ struct udpgw_header {
 } B_PACKED;
 B_END_PACKED
 
+/**
+ * Payload of a session packet, which a client sends with both
+ * UDPGW_CLIENT_FLAG_KEEPALIVE and UDPGW_CLIENT_FLAG_SESSION set (conid is ignored).
+ * All server connections on which the same session ID is received share one
+ * set of connections, so a connection's packets may arrive on any of them.
+ * Servers which don't support sessions ignore this as a keepalive.
+ */
+B_START_PACKED
+struct udpgw_session {
+    uint8_t id[UDPGW_SESSION_ID_LEN];
+} B_PACKED;
+B_END_PACKED
+
 B_START_PACKED
 struct udpgw_addr_ipv4 {
     uint32_t addr_ip;
@@ -33,6 +33,18 @@
 
 #include <generated/blog_channel_BEncryption.h>
 
+static int default_backend = BENCRYPTION_BACKEND_AUTO;
+
+#ifdef BADVPN_USE_CRYPTODEV
+static int init_cryptodev (BEncryption *enc, uint8_t *key);
+#endif
+static int init_evp (BEncryption *enc, uint8_t *key);
+static void init_legacy (BEncryption *enc, uint8_t *key);
+static const EVP_CIPHER * evp_cipher (int cipher, int ecb);
+static EVP_CIPHER_CTX * evp_new_ctx (const EVP_CIPHER *type, uint8_t *key, int encrypt);
+static void evp_cbc (BEncryption *enc, EVP_CIPHER_CTX *ctx, int encrypt, uint8_t *in, uint8_t *out, int len, uint8_t *iv);
+static void xor_bytes (uint8_t *dst, const uint8_t *src, int len);
+
 int BEncryption_cipher_valid (int cipher)
 {
     switch (cipher) {
@@ -70,32 +82,26 @@ int BEncryption_cipher_key_size (int cipher)
     }
 }
 
-void BEncryption_Init (BEncryption *enc, int mode, int cipher, uint8_t *key)
+#ifdef BADVPN_USE_CRYPTODEV
+
+static int init_cryptodev (BEncryption *enc, uint8_t *key)
 {
-    ASSERT(!(mode&~(BENCRYPTION_MODE_ENCRYPT|BENCRYPTION_MODE_DECRYPT)))
-    ASSERT((mode&BENCRYPTION_MODE_ENCRYPT) || (mode&BENCRYPTION_MODE_DECRYPT))
-    
-    enc->mode = mode;
-    enc->cipher = cipher;
-    
-    #ifdef BADVPN_USE_CRYPTODEV
-    
     switch (enc->cipher) {
         case BENCRYPTION_CIPHER_AES:
             enc->cryptodev.cipher = CRYPTO_AES_CBC;
             break;
         default:
-            goto fail1;
+            goto fail0;
     }
     
     if ((enc->cryptodev.fd = open("/dev/crypto", O_RDWR, 0)) < 0) {
         BLog(BLOG_ERROR, "failed to open /dev/crypto");
-        goto fail1;
+        goto fail0;
     }
     
     if (ioctl(enc->cryptodev.fd, CRIOGET, &enc->cryptodev.cfd)) {
         BLog(BLOG_ERROR, "failed ioctl(CRIOGET)");
-        goto fail2;
+        goto fail1;
     }
     
     struct session_op sess;
@@ -105,24 +111,94 @@ void BEncryption_Init (BEncryption *enc, int mode, int cipher, uint8_t *key)
     sess.key = key;
     if (ioctl(enc->cryptodev.cfd, CIOCGSESSION, &sess)) {
         BLog(BLOG_ERROR, "failed ioctl(CIOCGSESSION)");
-        goto fail3;
+        goto fail2;
     }
     
     enc->cryptodev.ses = sess.ses;
-    enc->use_cryptodev = 1;
     
-    goto success;
+    return 1;
     
-fail3:
-    ASSERT_FORCE(close(enc->cryptodev.cfd) == 0)
 fail2:
+    ASSERT_FORCE(close(enc->cryptodev.cfd) == 0)
+fail1:
     ASSERT_FORCE(close(enc->cryptodev.fd) == 0)
+fail0:
+    return 0;
+}
+
+#endif
+
+static const EVP_CIPHER * evp_cipher (int cipher, int ecb)
+{
+    switch (cipher) {
+        case BENCRYPTION_CIPHER_BLOWFISH:
+            return (ecb ? EVP_bf_ecb() : EVP_bf_cbc());
+        case BENCRYPTION_CIPHER_AES:
+            return (ecb ? EVP_aes_128_ecb() : EVP_aes_128_cbc());
+        default:
+            ASSERT(0)
+            return NULL;
+    }
+}
+
+static EVP_CIPHER_CTX * evp_new_ctx (const EVP_CIPHER *type, uint8_t *key, int encrypt)
+{
+    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+    if (!ctx) {
+        goto fail0;
+    }
+    
+    // this fails if the cipher is not provided, e.g. Blowfish without
+    // the legacy provider in OpenSSL 3
+    if (EVP_CipherInit_ex(ctx, type, NULL, key, NULL, encrypt) != 1) {
+        goto fail1;
+    }
+    
+    if (EVP_CIPHER_CTX_set_padding(ctx, 0) != 1) {
+        goto fail1;
+    }
+    
+    return ctx;
+    
 fail1:
+    EVP_CIPHER_CTX_free(ctx);
+fail0:
+    return NULL;
+}
+
+static int init_evp (BEncryption *enc, uint8_t *key)
+{
+    enc->evp.encrypt = NULL;
+    enc->evp.decrypt = NULL;
+    enc->evp.ecb_decrypt = NULL;
     
-    enc->use_cryptodev = 0;
+    if (enc->mode&BENCRYPTION_MODE_ENCRYPT) {
+        if (!(enc->evp.encrypt = evp_new_ctx(evp_cipher(enc->cipher, 0), key, 1))) {
+            goto fail0;
+        }
+    }
     
-    #endif
+    if (enc->mode&BENCRYPTION_MODE_DECRYPT) {
+        if (!(enc->evp.decrypt = evp_new_ctx(evp_cipher(enc->cipher, 0), key, 0))) {
+            goto fail1;
+        }
+        
+        // only needed for batching; BEncryption_DecryptMany copes without it
+        enc->evp.ecb_decrypt = evp_new_ctx(evp_cipher(enc->cipher, 1), key, 0);
+    }
     
+    return 1;
+    
+fail1:
+    if (enc->evp.encrypt) {
+        EVP_CIPHER_CTX_free(enc->evp.encrypt);
+    }
+fail0:
+    return 0;
+}
+
+static void init_legacy (BEncryption *enc, uint8_t *key)
+{
     int res;
     
     switch (enc->cipher) {
@@ -143,10 +219,90 @@ fail1:
             ASSERT(0)
             ;
     }
+}
+
+static void evp_cbc (BEncryption *enc, EVP_CIPHER_CTX *ctx, int encrypt, uint8_t *in, uint8_t *out, int len, uint8_t *iv)
+{
+    int block_size = BEncryption_cipher_block_size(enc->cipher);
+    
+    if (len == 0) {
+        return;
+    }
+    
+    // when decrypting, the next IV is the last ciphertext block, which
+    // may be overwritten if decrypting in place
+    uint8_t next_iv[BENCRYPTION_MAX_BLOCK_SIZE];
+    if (!encrypt) {
+        memcpy(next_iv, in + len - block_size, block_size);
+    }
+    
+    // restart the chain with the given IV, keeping the key schedule
+    ASSERT_FORCE(EVP_CipherInit_ex(ctx, NULL, NULL, NULL, iv, -1) == 1)
+    
+    int out_len;
+    ASSERT_FORCE(EVP_CipherUpdate(ctx, out, &out_len, in, len) == 1)
+    ASSERT(out_len == len)
+    
+    memcpy(iv, (encrypt ? out + len - block_size : next_iv), block_size);
+}
+
+static void xor_bytes (uint8_t *dst, const uint8_t *src, int len)
+{
+    int i = 0;
+    
+    for (; len - i >= 8; i += 8) {
+        uint64_t a;
+        uint64_t b;
+        memcpy(&a, dst + i, 8);
+        memcpy(&b, src + i, 8);
+        a ^= b;
+        memcpy(dst + i, &a, 8);
+    }
+    
+    for (; i < len; i++) {
+        dst[i] ^= src[i];
+    }
+}
+
+void BEncryption_GlobalSetBackend (int backend)
+{
+    ASSERT(backend == BENCRYPTION_BACKEND_AUTO || backend == BENCRYPTION_BACKEND_LEGACY ||
+           backend == BENCRYPTION_BACKEND_EVP || backend == BENCRYPTION_BACKEND_CRYPTODEV)
+    
+    default_backend = backend;
+}
+
+int BEncryption_GetBackend (BEncryption *enc)
+{
+    DebugObject_Access(&enc->d_obj);
+    
+    return enc->backend;
+}
+
+void BEncryption_Init (BEncryption *enc, int mode, int cipher, uint8_t *key)
+{
+    ASSERT(!(mode&~(BENCRYPTION_MODE_ENCRYPT|BENCRYPTION_MODE_DECRYPT)))
+    ASSERT((mode&BENCRYPTION_MODE_ENCRYPT) || (mode&BENCRYPTION_MODE_DECRYPT))
+    
+    enc->mode = mode;
+    enc->cipher = cipher;
     
     #ifdef BADVPN_USE_CRYPTODEV
-success:
+    if ((default_backend == BENCRYPTION_BACKEND_AUTO || default_backend == BENCRYPTION_BACKEND_CRYPTODEV) && init_cryptodev(enc, key)) {
+        enc->backend = BENCRYPTION_BACKEND_CRYPTODEV;
+        goto success;
+    }
     #endif
+    
+    if (default_backend != BENCRYPTION_BACKEND_LEGACY && init_evp(enc, key)) {
+        enc->backend = BENCRYPTION_BACKEND_EVP;
+        goto success;
+    }
+    
+    init_legacy(enc, key);
+    enc->backend = BENCRYPTION_BACKEND_LEGACY;
+    
+success:
     // init debug object
     DebugObject_Init(&enc->d_obj);
 }
@@ -156,15 +312,27 @@ void BEncryption_Free (BEncryption *enc)
     // free debug object
     DebugObject_Free(&enc->d_obj);
     
-    #ifdef BADVPN_USE_CRYPTODEV
-    
-    if (enc->use_cryptodev) {
-        ASSERT_FORCE(ioctl(enc->cryptodev.cfd, CIOCFSESSION, &enc->cryptodev.ses) == 0)
-        ASSERT_FORCE(close(enc->cryptodev.cfd) == 0)
-        ASSERT_FORCE(close(enc->cryptodev.fd) == 0)
+    switch (enc->backend) {
+        #ifdef BADVPN_USE_CRYPTODEV
+        case BENCRYPTION_BACKEND_CRYPTODEV: {
+            ASSERT_FORCE(ioctl(enc->cryptodev.cfd, CIOCFSESSION, &enc->cryptodev.ses) == 0)
+            ASSERT_FORCE(close(enc->cryptodev.cfd) == 0)
+            ASSERT_FORCE(close(enc->cryptodev.fd) == 0)
+        } break;
+        #endif
+        
+        case BENCRYPTION_BACKEND_EVP: {
+            if (enc->evp.ecb_decrypt) {
+                EVP_CIPHER_CTX_free(enc->evp.ecb_decrypt);
+            }
+            if (enc->evp.decrypt) {
+                EVP_CIPHER_CTX_free(enc->evp.decrypt);
+            }
+            if (enc->evp.encrypt) {
+                EVP_CIPHER_CTX_free(enc->evp.encrypt);
+            }
+        } break;
     }
-    
-    #endif
 }
 
 void BEncryption_Encrypt (BEncryption *enc, uint8_t *in, uint8_t *out, int len, uint8_t *iv)
@@ -175,7 +343,7 @@ void BEncryption_Encrypt (BEncryption *enc, uint8_t *in, uint8_t *out, int len,
     
     #ifdef BADVPN_USE_CRYPTODEV
     
-    if (enc->use_cryptodev) {
+    if (enc->backend == BENCRYPTION_BACKEND_CRYPTODEV) {
         struct crypt_op cryp;
         memset(&cryp, 0, sizeof(cryp));
         cryp.ses = enc->cryptodev.ses;
@@ -191,6 +359,11 @@ void BEncryption_Encrypt (BEncryption *enc, uint8_t *in, uint8_t *out, int len,
     
     #endif
     
+    if (enc->backend == BENCRYPTION_BACKEND_EVP) {
+        evp_cbc(enc, enc->evp.encrypt, 1, in, out, len, iv);
+        return;
+    }
+    
     switch (enc->cipher) {
         case BENCRYPTION_CIPHER_BLOWFISH:
             BF_cbc_encrypt(in, out, len, &enc->blowfish, iv, BF_ENCRYPT);
@@ -211,7 +384,7 @@ void BEncryption_Decrypt (BEncryption *enc, uint8_t *in, uint8_t *out, int len,
     
     #ifdef BADVPN_USE_CRYPTODEV
     
-    if (enc->use_cryptodev) {
+    if (enc->backend == BENCRYPTION_BACKEND_CRYPTODEV) {
         struct crypt_op cryp;
         memset(&cryp, 0, sizeof(cryp));
         cryp.ses = enc->cryptodev.ses;
@@ -227,6 +400,11 @@ void BEncryption_Decrypt (BEncryption *enc, uint8_t *in, uint8_t *out, int len,
     
     #endif
     
+    if (enc->backend == BENCRYPTION_BACKEND_EVP) {
+        evp_cbc(enc, enc->evp.decrypt, 0, in, out, len, iv);
+        return;
+    }
+    
     switch (enc->cipher) {
         case BENCRYPTION_CIPHER_BLOWFISH:
             BF_cbc_encrypt(in, out, len, &enc->blowfish, iv, BF_DECRYPT);
@@ -238,3 +416,68 @@ void BEncryption_Decrypt (BEncryption *enc, uint8_t *in, uint8_t *out, int len,
             ASSERT(0);
     }
 }
+
+void BEncryption_DecryptMany (BEncryption *enc, struct BEncryption_packet *packets, int num_packets)
+{
+    ASSERT(enc->mode&BENCRYPTION_MODE_DECRYPT)
+    ASSERT(num_packets >= 0)
+    
+    // without an ECB context there is nothing to gain, decrypt one by one
+    if (enc->backend != BENCRYPTION_BACKEND_EVP || !enc->evp.ecb_decrypt) {
+        for (int i = 0; i < num_packets; i++) {
+            BEncryption_Decrypt(enc, packets[i].in, packets[i].out, packets[i].len, packets[i].iv);
+        }
+        return;
+    }
+    
+    int block_size = BEncryption_cipher_block_size(enc->cipher);
+    uint8_t buf[BENCRYPTION_BATCH_SIZE];
+    
+    int i = 0;
+    while (i < num_packets) {
+        // gather as many ciphertexts as fit into the buffer
+        int end = i;
+        int total = 0;
+        while (end < num_packets && packets[end].len <= BENCRYPTION_BATCH_SIZE - total) {
+            ASSERT(packets[end].len >= 0)
+            ASSERT(packets[end].len % block_size == 0)
+            memcpy(buf + total, packets[end].in, packets[end].len);
+            total += packets[end].len;
+            end++;
+        }
+        
+        // a packet which doesn't share the buffer is fast enough on its own
+        if (end - i <= 1) {
+            BEncryption_Decrypt(enc, packets[i].in, packets[i].out, packets[i].len, packets[i].iv);
+            i++;
+            continue;
+        }
+        
+        // decrypt all blocks at once; CBC decryption is ECB decryption
+        // followed by XOR with the previous ciphertext block
+        if (total > 0) {
+            int out_len;
+            ASSERT_FORCE(EVP_CipherUpdate(enc->evp.ecb_decrypt, buf, &out_len, buf, total) == 1)
+            ASSERT(out_len == total)
+        }
+        
+        // chain the blocks in the buffer, then copy them out
+        int pos = 0;
+        for (; i < end; i++) {
+            struct BEncryption_packet *p = &packets[i];
+            if (p->len == 0) {
+                continue;
+            }
+            
+            xor_bytes(buf + pos, p->iv, block_size);
+            xor_bytes(buf + pos + block_size, p->in, p->len - block_size);
+            
+            // next IV is the last ciphertext block; take it before
+            // the output may overwrite it
+            memcpy(p->iv, p->in + p->len - block_size, block_size);
+            memcpy(p->out, buf + pos, p->len);
+            
+            pos += p->len;
+        }
+    }
+}
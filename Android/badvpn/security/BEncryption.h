@@ -50,6 +50,7 @@
 
 #include <openssl/blowfish.h>
 #include <openssl/aes.h>
+#include <openssl/evp.h>
 
 #include <misc/debug.h>
 #include <base/DebugObject.h>
@@ -70,6 +71,14 @@
 
 // NOTE: update the maximums above when adding a cipher!
 
+#define BENCRYPTION_BACKEND_AUTO 0
+#define BENCRYPTION_BACKEND_LEGACY 1
+#define BENCRYPTION_BACKEND_EVP 2
+#define BENCRYPTION_BACKEND_CRYPTODEV 3
+
+// size of the buffer BEncryption_DecryptMany gathers small packets into
+#define BENCRYPTION_BATCH_SIZE 4096
+
 /**
  * Block cipher encryption abstraction.
  */
@@ -77,15 +86,18 @@ typedef struct {
     DebugObject d_obj;
     int mode;
     int cipher;
-    #ifdef BADVPN_USE_CRYPTODEV
-    int use_cryptodev;
-    #endif
+    int backend;
     union {
         BF_KEY blowfish;
         struct {
             AES_KEY encrypt;
             AES_KEY decrypt;
         } aes;
+        struct {
+            EVP_CIPHER_CTX *encrypt;
+            EVP_CIPHER_CTX *decrypt;
+            EVP_CIPHER_CTX *ecb_decrypt;
+        } evp;
         #ifdef BADVPN_USE_CRYPTODEV
         struct {
             int fd;
@@ -97,6 +109,16 @@ typedef struct {
     };
 } BEncryption;
 
+/**
+ * A packet for {@link BEncryption_DecryptMany}.
+ */
+struct BEncryption_packet {
+    uint8_t *in;
+    uint8_t *out;
+    int len;
+    uint8_t *iv;
+};
+
 /**
  * Checks if the given cipher number is valid.
  * 
@@ -121,6 +143,27 @@ int BEncryption_cipher_block_size (int cipher);
  */
 int BEncryption_cipher_key_size (int cipher);
 
+/**
+ * Chooses the implementation used by objects initialized from now on.
+ * With BENCRYPTION_BACKEND_AUTO (the default), cryptodev is used if available,
+ * then OpenSSL EVP, which selects AES-NI or ARMv8 instructions at runtime, and
+ * finally the low-level OpenSSL cipher functions.
+ * A requested backend which cannot handle a cipher falls back the same way.
+ * Not thread-safe; intended to be called once at startup.
+ * 
+ * @param backend one of BENCRYPTION_BACKEND_*
+ */
+void BEncryption_GlobalSetBackend (int backend);
+
+/**
+ * Returns the backend an object ended up using.
+ * 
+ * @param enc the object
+ * @return one of BENCRYPTION_BACKEND_LEGACY, BENCRYPTION_BACKEND_EVP and
+ *         BENCRYPTION_BACKEND_CRYPTODEV
+ */
+int BEncryption_GetBackend (BEncryption *enc);
+
 /**
  * Initializes the object.
  * {@link BSecurity_GlobalInitThreadSafe} must have been done if this object
@@ -172,4 +215,18 @@ void BEncryption_Encrypt (BEncryption *enc, uint8_t *in, uint8_t *out, int len,
  */
 void BEncryption_Decrypt (BEncryption *enc, uint8_t *in, uint8_t *out, int len, uint8_t *iv);
 
+/**
+ * Decrypts several independent packets.
+ * Equivalent to calling {@link BEncryption_Decrypt} for each packet in order,
+ * but packets smaller than BENCRYPTION_BATCH_SIZE are decrypted together in a
+ * single pass, which keeps the cipher pipeline full when packets are small.
+ * A packet's input and output may be the same buffer, but must not otherwise
+ * overlap with each other or with those of other packets.
+ * 
+ * @param enc the object
+ * @param packets packets to decrypt; their IVs are updated as by {@link BEncryption_Decrypt}
+ * @param num_packets number of packets. Must be >=0.
+ */
+void BEncryption_DecryptMany (BEncryption *enc, struct BEncryption_packet *packets, int num_packets);
+
 #endif
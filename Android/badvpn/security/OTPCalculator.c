@@ -30,6 +30,7 @@
 #include <limits.h>
 
 #include <misc/balloc.h>
+#include <misc/minmax.h>
 
 #include <security/OTPCalculator.h>
 
@@ -82,17 +83,18 @@ otp_t * OTPCalculator_Generate (OTPCalculator *calc, uint8_t *key, uint8_t *iv,
     uint8_t iv_work[BENCRYPTION_MAX_BLOCK_SIZE];
     memcpy(iv_work, iv, calc->block_size);
     
-    // create zero block
-    uint8_t zero[BENCRYPTION_MAX_BLOCK_SIZE];
-    memset(zero, 0, calc->block_size);
-    
     // init encryptor
     BEncryption encryptor;
     BEncryption_Init(&encryptor, BENCRYPTION_MODE_ENCRYPT, calc->cipher, key);
     
-    // encrypt zero blocks
-    for (size_t i = 0; i < calc->num_blocks; i++) {
-        BEncryption_Encrypt(&encryptor, zero, (uint8_t *)calc->data + i * calc->block_size, calc->block_size, iv_work);
+    // Encrypt zero blocks in place, a batch at a time. Each block depends on the
+    // previous one through the IV, but passing many blocks to a single call lets
+    // the cipher implementation process them without per-block overhead.
+    for (size_t i = 0; i < calc->num_blocks; i += OTPCALCULATOR_BATCH_BLOCKS) {
+        size_t n = bmin_size(calc->num_blocks - i, OTPCALCULATOR_BATCH_BLOCKS);
+        uint8_t *out = (uint8_t *)calc->data + i * calc->block_size;
+        memset(out, 0, n * calc->block_size);
+        BEncryption_Encrypt(&encryptor, out, out, n * calc->block_size, iv_work);
     }
     
     // free encryptor
@@ -43,6 +43,9 @@
 #include <security/BEncryption.h>
 #include <base/DebugObject.h>
 
+// number of blocks encrypted with a single BEncryption_Encrypt call
+#define OTPCALCULATOR_BATCH_BLOCKS 4096
+
 /**
  * Type for an OTP.
  */
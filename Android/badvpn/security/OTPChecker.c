@@ -40,20 +40,20 @@ static int OTPChecker_Table_CheckOTP (OTPChecker *mc, struct OTPChecker_table *t
 
 void OTPChecker_Table_Empty (OTPChecker *mc, struct OTPChecker_table *t)
 {
-    for (int i = 0; i < mc->num_entries; i++) {
-        t->entries[i].avail = -1;
-    }
+    // all bits set makes avail -1
+    memset(t->entries, 0xff, (size_t)mc->num_entries * sizeof(t->entries[0]));
 }
 
 void OTPChecker_Table_AddOTP (OTPChecker *mc, struct OTPChecker_table *t, otp_t otp)
 {
-    // calculate starting index
-    int start_index = otp % mc->num_entries;
+    // OTPs are cipher output, so the low bits are as good as any hash
+    otp_t mask = mc->num_entries - 1;
+    otp_t index = otp & mask;
     
     // try indexes starting with the base position
     for (int i = 0; i < mc->num_entries; i++) {
-        int index = bmodadd_int(start_index, i, mc->num_entries);
         struct OTPChecker_entry *entry = &t->entries[index];
+        index = (index + 1) & mask;
         
         // if we find a free index, use it
         if (entry->avail < 0) {
@@ -90,13 +90,13 @@ void OTPChecker_Table_Generate (OTPChecker *mc, struct OTPChecker_table *t, OTPC
 
 int OTPChecker_Table_CheckOTP (OTPChecker *mc, struct OTPChecker_table *t, otp_t otp)
 {
-    // calculate starting index
-    int start_index = otp % mc->num_entries;
+    otp_t mask = mc->num_entries - 1;
+    otp_t index = otp & mask;
     
     // try indexes starting with the base position
     for (int i = 0; i < mc->num_entries; i++) {
-        int index = bmodadd_int(start_index, i, mc->num_entries);
         struct OTPChecker_entry *entry = &t->entries[index];
+        index = (index + 1) & mask;
         
         // if we find an empty entry, there is no such mac
         if (entry->avail < 0) {
@@ -163,11 +163,14 @@ int OTPChecker_Init (OTPChecker *mc, int num_otps, int cipher, int num_tables, B
     // set no handlers
     mc->handler = NULL;
     
-    // set number of entries
-    if (mc->num_otps > INT_MAX / 2) {
+    // set number of entries, a power of two at least twice the number of OTPs
+    if (mc->num_otps > INT_MAX / 4) {
         goto fail0;
     }
-    mc->num_entries = 2 * mc->num_otps;
+    mc->num_entries = 1;
+    while (mc->num_entries < 2 * mc->num_otps) {
+        mc->num_entries *= 2;
+    }
     
     // set no tables used
     mc->tables_used = 0;
@@ -43,6 +43,9 @@
 #include <base/DebugObject.h>
 #include <threadwork/BThreadWork.h>
 
+// Entry in an open-addressed table of OTPs. The table size is a power of two
+// at least twice the number of OTPs, and collisions are resolved by linear probing.
+// Empty entries have avail=-1.
 struct OTPChecker_entry {
     otp_t otp;
     int avail;
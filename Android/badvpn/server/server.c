@@ -55,6 +55,7 @@
 #include <misc/open_standard_streams.h>
 #include <misc/compare.h>
 #include <misc/bsize.h>
+#include <misc/balloc.h>
 #include <predicate/BPredicate.h>
 #include <base/DebugObject.h>
 #include <base/BLog.h>
@@ -64,8 +65,10 @@
 #include <security/BRandom.h>
 #include <nspr_support/DummyPRFileDesc.h>
 #include <threadwork/BThreadWork.h>
+#include <flowextra/FlowProfileDumper.h>
 
 #ifndef BADVPN_USE_WINAPI
+#include <unistd.h>
 #include <base/BLog_syslog.h>
 #endif
 
@@ -76,6 +79,9 @@
 #define LOGGER_STDOUT 1
 #define LOGGER_SYSLOG 2
 
+// length of headers preceding the payload of a relayed message
+#define RELAY_HEADERS_LEN (sizeof(struct packetproto_header) + sizeof(struct sc_header) + sizeof(struct sc_server_inmsg))
+
 // parsed command-line options
 struct {
     int help;
@@ -90,6 +96,9 @@ struct {
     int threads;
     int use_threads_for_ssl_handshake;
     int use_threads_for_ssl_data;
+    #ifndef BADVPN_USE_WINAPI
+    int worker_threads;
+    #endif
     int ssl;
     char *nssdb;
     char *server_cert_name;
@@ -99,6 +108,7 @@ struct {
     char *relay_predicate;
     int client_socket_sndbuf;
     int max_clients;
+    char *flow_profile;
 } options;
 
 // listen addresses
@@ -141,6 +151,9 @@ BReactor ss;
 // thread work dispatcher
 BThreadWorkDispatcher twd;
 
+// flow profile dumper, if options.flow_profile
+FlowProfileDumper flow_profile_dumper;
+
 // server certificate if using SSL
 CERTCertificate *server_cert;
 
@@ -167,6 +180,26 @@ LinkedList1 clients;
 // clients tree (by ID)
 BAVL clients_tree;
 
+#ifndef BADVPN_USE_WINAPI
+
+// worker threads, if any
+struct worker *workers;
+int num_workers;
+
+// main thread context for queues to and from workers
+PacketPassThreadQueueContext main_qctx;
+
+// links with pending events from workers
+BMutex link_events_mutex;
+BThreadSignal link_events_signal;
+LinkedList1 link_events_list;
+int link_events_signaled;
+
+// all links
+LinkedList1 links;
+
+#endif
+
 // prints help text to standard output
 static void print_help (const char *name);
 
@@ -187,6 +220,27 @@ static void signal_handler (void *unused);
 // listener handler, accepts new clients
 static void listener_handler (BListener *listener);
 
+// initializes a client socket, with SSL on top if enabled
+static int conn_init (struct client_conn *c, struct BConnection_source source, BReactor *reactor, BThreadWorkDispatcher *twd, int ssl_flags,
+                      void *user, BConnection_handler handler, BSSLConnection_handler ssl_handler, BLog_logfunc logfunc);
+
+// frees a client socket
+static void conn_free (struct client_conn *c);
+
+// returns the interfaces for sending and receiving data
+static StreamPassInterface * conn_get_send_if (struct client_conn *c);
+static StreamRecvInterface * conn_get_recv_if (struct client_conn *c);
+
+// stores the certificate and common name of a client after the SSL handshake
+static int conn_read_cert (struct client_conn *c, void *user, BLog_logfunc logfunc, uint8_t *out_cert, int *out_cert_len,
+                           uint8_t *out_cert_old, int *out_cert_old_len, char **out_common_name);
+
+// accepts a client connection, handing it to a worker if using them
+static int client_init_connection (struct client_data *client, BListener *listener);
+
+// frees the client connection, or tells its worker to do so
+static void client_free_connection (struct client_data *client);
+
 // frees resources used by a client
 static void client_dealloc (struct client_data *client);
 
@@ -198,6 +252,9 @@ static int client_init_io (struct client_data *client);
 // deallocates the I/O portion of the client. Must have no outgoing flows.
 static void client_dealloc_io (struct client_data *client);
 
+// frees the parts of the I/O chains which connect to the socket
+static void client_free_io_ends (struct client_data *client);
+
 // removes a client
 static void client_remove (struct client_data *client);
 
@@ -219,6 +276,9 @@ static void client_connection_handler (struct client_data *client, int event);
 // BSSLConnection handler
 static void client_sslcon_handler (struct client_data *client, int event);
 
+// finishes initialization after the SSL handshake
+static void client_handshake_done (struct client_data *client);
+
 // decoder handler
 static void client_decoder_handler_error (struct client_data *client);
 
@@ -243,6 +303,10 @@ static void process_packet_hello (struct client_data *client, uint8_t *data, int
 // processes outmsg packets from clients
 static void process_packet_outmsg (struct client_data *client, uint8_t *data, int data_len);
 
+// provides the location of the packet relaying an outmsg payload from the client,
+// copying the payload there unless it can be relayed from where it was received
+static int client_get_relay_packet (struct client_data *client, uint8_t *payload, int payload_len, PacketChunk **out_chunk, uint8_t **out_packet);
+
 // processes resetpeer packets from clients
 static void process_packet_resetpeer (struct client_data *client, uint8_t *data, int data_len);
 
@@ -261,12 +325,6 @@ static void peer_flow_free_io (struct peer_flow *flow);
 // disconnects the source client from a peer flow
 static void peer_flow_disconnect (struct peer_flow *flow);
 
-// provides a buffer for sending a peer-to-peer packet
-static int peer_flow_start_packet (struct peer_flow *flow, void **data, int len);
-
-// submits a peer-to-peer packet written after peer_flow_start_packet
-static void peer_flow_end_packet (struct peer_flow *flow, uint8_t type);
-
 // handler called by the queue when a peer flow can be freed after its source has gone away
 static void peer_flow_handler_canremove (struct peer_flow *flow);
 
@@ -329,6 +387,40 @@ static int launch_pair (struct peer_flow *flow_to);
 // find flow from a client to some client
 static struct peer_flow * find_flow (struct client_data *client, peerid_t dest_id);
 
+#ifndef BADVPN_USE_WINAPI
+
+// starts and stops the worker threads
+static int init_workers (void);
+static void free_workers (void);
+
+// worker thread functions
+static int worker_init (struct worker *w);
+static void worker_free (struct worker *w);
+static void * worker_thread (void *arg);
+static void worker_cmd_signal_handler (BThreadSignal *signal);
+
+// link functions called in the main thread
+static struct client_link * link_create (struct client_data *client, int fd);
+static void link_free (struct client_link *link);
+static void link_post_cmd (struct client_link *link, int cmd);
+static void link_events_signal_handler (BThreadSignal *signal);
+static void link_handle_events (struct client_link *link, int events);
+
+// link functions called in the worker thread
+static void link_start (struct client_link *link);
+static void link_stop (struct client_link *link);
+static void link_down (struct client_link *link);
+static int link_init_io (struct client_link *link);
+static void link_free_io (struct client_link *link);
+static void link_post_event (struct client_link *link, int event);
+static void link_logfunc (struct client_link *link);
+static void link_log (struct client_link *link, int level, const char *fmt, ...);
+static void link_connection_handler (struct client_link *link, int event);
+static void link_sslcon_handler (struct client_link *link, int event);
+static void link_decoder_handler_error (struct client_link *link);
+
+#endif
+
 int main (int argc, char *argv[])
 {
     if (argc <= 0) {
@@ -489,10 +581,17 @@ int main (int argc, char *argv[])
         goto fail3;
     }
     
+    // init flow profile dumper, before any threads are started so that
+    // they don't receive the signal
+    if (options.flow_profile && !FlowProfileDumper_Init(&flow_profile_dumper, &ss, options.flow_profile)) {
+        BLog(BLOG_ERROR, "FlowProfileDumper_Init failed");
+        goto fail3a;
+    }
+    
     // init thread work dispatcher
     if (!BThreadWorkDispatcher_Init(&twd, &ss, options.threads)) {
         BLog(BLOG_ERROR, "BThreadWorkDispatcher_Init failed");
-        goto fail3a;
+        goto fail3b;
     }
     
     // setup signal handler
@@ -513,6 +612,14 @@ int main (int argc, char *argv[])
     // initialize clients tree
     BAVL_Init(&clients_tree, OFFSET_DIFF(struct client_data, id, tree_node), (BAVL_comparator)peerid_comparator, NULL);
     
+    #ifndef BADVPN_USE_WINAPI
+    // start worker threads; they inherit the signal mask set up above
+    if (!init_workers()) {
+        BLog(BLOG_ERROR, "init_workers failed");
+        goto fail5;
+    }
+    #endif
+    
     // initialize listeners
     num_listeners = 0;
     while (num_listeners < num_listen_addrs) {
@@ -568,9 +675,17 @@ fail10:
         BListener_Free(&listeners[num_listeners]);
     }
     
+    #ifndef BADVPN_USE_WINAPI
+    free_workers();
+fail5:
+    #endif
     BSignal_Finish();
 fail4:
     BThreadWorkDispatcher_Free(&twd);
+fail3b:
+    if (options.flow_profile) {
+        FlowProfileDumper_Free(&flow_profile_dumper);
+    }
 fail3a:
     BReactor_Free(&ss);
 fail3:
@@ -631,12 +746,16 @@ void print_help (const char *name)
         "        [--threads <integer>]\n"
         "        [--use-threads-for-ssl-handshake]\n"
         "        [--use-threads-for-ssl-data]\n"
+        #ifndef BADVPN_USE_WINAPI
+        "        [--worker-threads <integer>]\n"
+        #endif
         "        [--listen-addr <addr>] ...\n"
         "        [--ssl --nssdb <string> --server-cert-name <string>]\n"
         "        [--comm-predicate <string>]\n"
         "        [--relay-predicate <string>]\n"
         "        [--client-socket-sndbuf <bytes / 0>]\n"
         "        [--max-clients <number>]\n"
+        "        [--flow-profile <file>]\n"
         "Address format is a.b.c.d:port (IPv4) or [addr]:port (IPv6).\n",
         name
     );
@@ -663,6 +782,9 @@ int parse_arguments (int argc, char *argv[])
     options.threads = 0;
     options.use_threads_for_ssl_handshake = 0;
     options.use_threads_for_ssl_data = 0;
+    #ifndef BADVPN_USE_WINAPI
+    options.worker_threads = 0;
+    #endif
     options.ssl = 0;
     options.nssdb = NULL;
     options.server_cert_name = NULL;
@@ -671,6 +793,7 @@ int parse_arguments (int argc, char *argv[])
     options.relay_predicate = NULL;
     options.client_socket_sndbuf = CLIENT_DEFAULT_SOCKET_SNDBUF;
     options.max_clients = DEFAULT_MAX_CLIENTS;
+    options.flow_profile = NULL;
     
     for (int i = 1; i < argc; i++) {
         char *arg = argv[i];
@@ -761,6 +884,19 @@ int parse_arguments (int argc, char *argv[])
         else if (!strcmp(arg, "--use-threads-for-ssl-data")) {
             options.use_threads_for_ssl_data = 1;
         }
+        #ifndef BADVPN_USE_WINAPI
+        else if (!strcmp(arg, "--worker-threads")) {
+            if (1 >= argc - i) {
+                fprintf(stderr, "%s: requires an argument\n", arg);
+                return 0;
+            }
+            if ((options.worker_threads = atoi(argv[i + 1])) < 0 || options.worker_threads > MAX_WORKER_THREADS) {
+                fprintf(stderr, "%s: wrong argument\n", arg);
+                return 0;
+            }
+            i++;
+        }
+        #endif
         else if (!strcmp(arg, "--ssl")) {
             options.ssl = 1;
         }
@@ -809,6 +945,14 @@ int parse_arguments (int argc, char *argv[])
             options.relay_predicate = argv[i + 1];
             i++;
         }
+        else if (!strcmp(arg, "--flow-profile")) {
+            if (1 >= argc - i) {
+                fprintf(stderr, "%s: requires an argument\n", arg);
+                return 0;
+            }
+            options.flow_profile = argv[i + 1];
+            i++;
+        }
         else if (!strcmp(arg, "--client-socket-sndbuf")) {
             if (1 >= argc - i) {
                 fprintf(stderr, "%s: requires an argument\n", arg);
@@ -851,6 +995,13 @@ int parse_arguments (int argc, char *argv[])
         return 0;
     }
     
+    #ifndef BADVPN_USE_WINAPI
+    if (options.worker_threads > 0 && (options.use_threads_for_ssl_handshake || options.use_threads_for_ssl_data)) {
+        fprintf(stderr, "--use-threads-for-ssl-* cannot be used with --worker-threads, SSL is already done by the workers\n");
+        return 0;
+    }
+    #endif
+    
     return 1;
 }
 
@@ -903,64 +1054,18 @@ void listener_handler (BListener *listener)
         goto fail0;
     }
     
-    // accept connection
-    if (!BConnection_Init(&client->con, BConnection_source_listener(listener, &client->addr), &ss, client, (BConnection_handler)client_connection_handler)) {
-        BLog(BLOG_ERROR, "BConnection_Init failed");
-        goto fail1;
-    }
-    
-    // limit socket send buffer, else our scheduling is pointless
-    if (options.client_socket_sndbuf > 0) {
-        if (!BConnection_SetSendBuffer(&client->con, options.client_socket_sndbuf)) {
-            BLog(BLOG_WARNING, "BConnection_SetSendBuffer failed");
-        }
-    }
-    
     // assign ID
     client->id = new_client_id();
     
     // set no common name
     client->common_name = NULL;
     
-    // now client_log() works
-    
-    // init connection interfaces
-    BConnection_SendAsync_Init(&client->con);
-    BConnection_RecvAsync_Init(&client->con);
+    // accept connection
+    if (!client_init_connection(client, listener)) {
+        goto fail1;
+    }
     
-    if (options.ssl) {
-        // create bottom NSPR file descriptor
-        if (!BSSLConnection_MakeBackend(&client->bottom_prfd, BConnection_SendAsync_GetIf(&client->con), BConnection_RecvAsync_GetIf(&client->con), &twd, ssl_flags())) {
-            client_log(client, BLOG_ERROR, "BSSLConnection_MakeBackend failed");
-            goto fail2;
-        }
-        
-        // create SSL file descriptor from the bottom NSPR file descriptor
-        if (!(client->ssl_prfd = SSL_ImportFD(model_prfd, &client->bottom_prfd))) {
-            client_log(client, BLOG_ERROR, "SSL_ImportFD failed");
-            ASSERT_FORCE(PR_Close(&client->bottom_prfd) == PR_SUCCESS)
-            goto fail2;
-        }
-        
-        // set server mode
-        if (SSL_ResetHandshake(client->ssl_prfd, PR_TRUE) != SECSuccess) {
-            client_log(client, BLOG_ERROR, "SSL_ResetHandshake failed");
-            goto fail3;
-        }
-        
-        // set require client certificate
-        if (SSL_OptionSet(client->ssl_prfd, SSL_REQUEST_CERTIFICATE, PR_TRUE) != SECSuccess) {
-            client_log(client, BLOG_ERROR, "SSL_OptionSet(SSL_REQUEST_CERTIFICATE) failed");
-            goto fail3;
-        }
-        if (SSL_OptionSet(client->ssl_prfd, SSL_REQUIRE_CERTIFICATE, PR_TRUE) != SECSuccess) {
-            client_log(client, BLOG_ERROR, "SSL_OptionSet(SSL_REQUIRE_CERTIFICATE) failed");
-            goto fail3;
-        }
-        
-        // init SSL connection
-        BSSLConnection_Init(&client->sslcon, client->ssl_prfd, 1, BReactor_PendingGroup(&ss), client, (BSSLConnection_handler)client_sslcon_handler);
-    } else {
+    if (!options.ssl) {
         // initialize I/O
         if (!client_init_io(client)) {
             goto fail2;
@@ -995,20 +1100,211 @@ void listener_handler (BListener *listener)
     
     return;
     
-    if (options.ssl) {
-fail3:
-        ASSERT_FORCE(PR_Close(client->ssl_prfd) == PR_SUCCESS)
-    }
 fail2:
-    BConnection_RecvAsync_Free(&client->con);
-    BConnection_SendAsync_Free(&client->con);
-    BConnection_Free(&client->con);
+    client_free_connection(client);
 fail1:
     free(client);
 fail0:
     return;
 }
 
+int conn_init (struct client_conn *c, struct BConnection_source source, BReactor *reactor, BThreadWorkDispatcher *twd, int ssl_flags,
+               void *user, BConnection_handler handler, BSSLConnection_handler ssl_handler, BLog_logfunc logfunc)
+{
+    // init connection
+    if (!BConnection_Init(&c->con, source, reactor, user, handler)) {
+        BLog(BLOG_ERROR, "BConnection_Init failed");
+        goto fail0;
+    }
+    
+    // limit socket send buffer, else our scheduling is pointless
+    if (options.client_socket_sndbuf > 0) {
+        if (!BConnection_SetSendBuffer(&c->con, options.client_socket_sndbuf)) {
+            BLog(BLOG_WARNING, "BConnection_SetSendBuffer failed");
+        }
+    }
+    
+    // init connection interfaces
+    BConnection_SendAsync_Init(&c->con);
+    BConnection_RecvAsync_Init(&c->con);
+    
+    if (options.ssl) {
+        // create bottom NSPR file descriptor
+        if (!BSSLConnection_MakeBackend(&c->bottom_prfd, BConnection_SendAsync_GetIf(&c->con), BConnection_RecvAsync_GetIf(&c->con), twd, ssl_flags)) {
+            BLog_LogViaFunc(logfunc, user, BLOG_CURRENT_CHANNEL, BLOG_ERROR, "BSSLConnection_MakeBackend failed");
+            goto fail1;
+        }
+        
+        // create SSL file descriptor from the bottom NSPR file descriptor
+        if (!(c->ssl_prfd = SSL_ImportFD(model_prfd, &c->bottom_prfd))) {
+            BLog_LogViaFunc(logfunc, user, BLOG_CURRENT_CHANNEL, BLOG_ERROR, "SSL_ImportFD failed");
+            ASSERT_FORCE(PR_Close(&c->bottom_prfd) == PR_SUCCESS)
+            goto fail1;
+        }
+        
+        // set server mode
+        if (SSL_ResetHandshake(c->ssl_prfd, PR_TRUE) != SECSuccess) {
+            BLog_LogViaFunc(logfunc, user, BLOG_CURRENT_CHANNEL, BLOG_ERROR, "SSL_ResetHandshake failed");
+            goto fail2;
+        }
+        
+        // set require client certificate
+        if (SSL_OptionSet(c->ssl_prfd, SSL_REQUEST_CERTIFICATE, PR_TRUE) != SECSuccess) {
+            BLog_LogViaFunc(logfunc, user, BLOG_CURRENT_CHANNEL, BLOG_ERROR, "SSL_OptionSet(SSL_REQUEST_CERTIFICATE) failed");
+            goto fail2;
+        }
+        if (SSL_OptionSet(c->ssl_prfd, SSL_REQUIRE_CERTIFICATE, PR_TRUE) != SECSuccess) {
+            BLog_LogViaFunc(logfunc, user, BLOG_CURRENT_CHANNEL, BLOG_ERROR, "SSL_OptionSet(SSL_REQUIRE_CERTIFICATE) failed");
+            goto fail2;
+        }
+        
+        // init SSL connection
+        BSSLConnection_Init(&c->sslcon, c->ssl_prfd, 1, BReactor_PendingGroup(reactor), user, ssl_handler);
+    }
+    
+    return 1;
+    
+fail2:
+    ASSERT_FORCE(PR_Close(c->ssl_prfd) == PR_SUCCESS)
+fail1:
+    BConnection_RecvAsync_Free(&c->con);
+    BConnection_SendAsync_Free(&c->con);
+    BConnection_Free(&c->con);
+fail0:
+    return 0;
+}
+
+void conn_free (struct client_conn *c)
+{
+    // free SSL
+    if (options.ssl) {
+        BSSLConnection_Free(&c->sslcon);
+        ASSERT_FORCE(PR_Close(c->ssl_prfd) == PR_SUCCESS)
+    }
+    
+    // free connection interfaces
+    BConnection_RecvAsync_Free(&c->con);
+    BConnection_SendAsync_Free(&c->con);
+    
+    // free connection
+    BConnection_Free(&c->con);
+}
+
+StreamPassInterface * conn_get_send_if (struct client_conn *c)
+{
+    return (options.ssl ? BSSLConnection_GetSendIf(&c->sslcon) : BConnection_SendAsync_GetIf(&c->con));
+}
+
+StreamRecvInterface * conn_get_recv_if (struct client_conn *c)
+{
+    return (options.ssl ? BSSLConnection_GetRecvIf(&c->sslcon) : BConnection_RecvAsync_GetIf(&c->con));
+}
+
+int conn_read_cert (struct client_conn *c, void *user, BLog_logfunc logfunc, uint8_t *out_cert, int *out_cert_len,
+                    uint8_t *out_cert_old, int *out_cert_old_len, char **out_common_name)
+{
+    ASSERT(options.ssl)
+    
+    // get client certificate
+    CERTCertificate *cert = SSL_PeerCertificate(c->ssl_prfd);
+    if (!cert) {
+        BLog_LogViaFunc(logfunc, user, BLOG_CURRENT_CHANNEL, BLOG_ERROR, "SSL_PeerCertificate failed");
+        goto fail0;
+    }
+    
+    // remember common name
+    if (!(*out_common_name = CERT_GetCommonName(&cert->subject))) {
+        BLog_LogViaFunc(logfunc, user, BLOG_CURRENT_CHANNEL, BLOG_NOTICE, "CERT_GetCommonName failed");
+        goto fail1;
+    }
+    
+    // store certificate
+    SECItem der = cert->derCert;
+    if (der.len > SCID_NEWCLIENT_MAX_CERT_LEN) {
+        BLog_LogViaFunc(logfunc, user, BLOG_CURRENT_CHANNEL, BLOG_NOTICE, "client certificate too big");
+        goto fail1;
+    }
+    memcpy(out_cert, der.data, der.len);
+    *out_cert_len = der.len;
+    
+    PRArenaPool *arena = PORT_NewArena(DER_DEFAULT_CHUNKSIZE);
+    if (!arena) {
+        BLog_LogViaFunc(logfunc, user, BLOG_CURRENT_CHANNEL, BLOG_ERROR, "PORT_NewArena failed");
+        goto fail1;
+    }
+    
+    // encode certificate
+    memset(&der, 0, sizeof(der));
+    if (!SEC_ASN1EncodeItem(arena, &der, cert, SEC_ASN1_GET(CERT_CertificateTemplate))) {
+        BLog_LogViaFunc(logfunc, user, BLOG_CURRENT_CHANNEL, BLOG_ERROR, "SEC_ASN1EncodeItem failed");
+        goto fail2;
+    }
+    
+    // store re-encoded certificate (for compatibility with old clients)
+    if (der.len > SCID_NEWCLIENT_MAX_CERT_LEN) {
+        BLog_LogViaFunc(logfunc, user, BLOG_CURRENT_CHANNEL, BLOG_NOTICE, "client certificate too big");
+        goto fail2;
+    }
+    memcpy(out_cert_old, der.data, der.len);
+    *out_cert_old_len = der.len;
+    
+    PORT_FreeArena(arena, PR_FALSE);
+    CERT_DestroyCertificate(cert);
+    
+    return 1;
+    
+fail2:
+    PORT_FreeArena(arena, PR_FALSE);
+fail1:
+    CERT_DestroyCertificate(cert);
+fail0:
+    return 0;
+}
+
+int client_init_connection (struct client_data *client, BListener *listener)
+{
+#ifndef BADVPN_USE_WINAPI
+    client->link = NULL;
+    
+    if (num_workers > 0) {
+        // accept connection, to be handled by a worker
+        int fd = BListener_AcceptSocket(listener, &client->addr);
+        if (fd < 0) {
+            BLog(BLOG_ERROR, "BListener_AcceptSocket failed");
+            return 0;
+        }
+        
+        // create link
+        if (!(client->link = link_create(client, fd))) {
+            client_log(client, BLOG_ERROR, "link_create failed");
+            if (close(fd) < 0) {
+                BLog(BLOG_ERROR, "close failed");
+            }
+            return 0;
+        }
+        
+        return 1;
+    }
+#endif
+    
+    return conn_init(&client->conn, BConnection_source_listener(listener, &client->addr), &ss, &twd, ssl_flags(), client,
+                     (BConnection_handler)client_connection_handler, (BSSLConnection_handler)client_sslcon_handler, (BLog_logfunc)client_logfunc);
+}
+
+void client_free_connection (struct client_data *client)
+{
+#ifndef BADVPN_USE_WINAPI
+    if (client->link) {
+        // the worker frees its side, then the link is freed
+        client->link->client = NULL;
+        link_post_cmd(client->link, LINK_CMD_STOP);
+        return;
+    }
+#endif
+    
+    conn_free(&client->conn);
+}
+
 void client_dealloc (struct client_data *client)
 {
     ASSERT(LinkedList1_IsEmpty(&client->know_out_list))
@@ -1031,23 +1327,13 @@ void client_dealloc (struct client_data *client)
     // stop disconnect timer
     BReactor_RemoveTimer(&ss, &client->disconnect_timer);
     
-    // free SSL
-    if (options.ssl) {
-        BSSLConnection_Free(&client->sslcon);
-        ASSERT_FORCE(PR_Close(client->ssl_prfd) == PR_SUCCESS)
-    }
-    
     // free common name
     if (client->common_name) {
         PORT_Free(client->common_name);
     }
     
-    // free connection interfaces
-    BConnection_RecvAsync_Free(&client->con);
-    BConnection_SendAsync_Free(&client->con);
-    
     // free connection
-    BConnection_Free(&client->con);
+    client_free_connection(client);
     
     // free memory
     free(client);
@@ -1066,29 +1352,49 @@ int client_compute_buffer_size (struct client_data *client)
 
 int client_init_io (struct client_data *client)
 {
-    StreamPassInterface *send_if = (options.ssl ? BSSLConnection_GetSendIf(&client->sslcon) : BConnection_SendAsync_GetIf(&client->con));
-    StreamRecvInterface *recv_if = (options.ssl ? BSSLConnection_GetRecvIf(&client->sslcon) : BConnection_RecvAsync_GetIf(&client->con));
-    
     // init input
     
     // init interface
     PacketPassInterface_Init(&client->input_interface, SC_MAX_ENC, (PacketPassInterface_handler_send)client_input_handler_send, client, BReactor_PendingGroup(&ss));
+    PacketPassInterface_SetName(&client->input_interface, "server client input");
     
-    // init decoder
-    if (!PacketProtoDecoder_Init(&client->input_decoder, recv_if, &client->input_interface, BReactor_PendingGroup(&ss), client,
-        (PacketProtoDecoder_handler_error)client_decoder_handler_error
-    )) {
-        client_log(client, BLOG_ERROR, "PacketProtoDecoder_Init failed");
-        goto fail1;
+    // set no relay chunk
+    client->relay_chunk = NULL;
+    
+#ifndef BADVPN_USE_WINAPI
+    if (client->link) {
+        // receive packets decoded by the worker
+        PacketPassThreadQueue_InitOutput(&client->link->input_queue, &main_qctx, &client->input_interface);
+    } else
+#endif
+    {
+        // init decoder; receive into chunks so that messages can be relayed without copying
+        if (!PacketProtoDecoder_InitChunked(&client->input_decoder, conn_get_recv_if(&client->conn), &client->input_interface, CLIENT_INPUT_CHUNK_PACKETS, BReactor_PendingGroup(&ss), client,
+            (PacketProtoDecoder_handler_error)client_decoder_handler_error
+        )) {
+            client_log(client, BLOG_ERROR, "PacketProtoDecoder_Init failed");
+            goto fail1;
+        }
     }
     
     // init output common
     
-    // init sender
-    PacketStreamSender_Init(&client->output_sender, send_if, PACKETPROTO_ENCLEN(SC_MAX_ENC), BReactor_PendingGroup(&ss));
+    PacketPassInterface *output_if;
+#ifndef BADVPN_USE_WINAPI
+    if (client->link) {
+        // pass encoded packets to the worker for sending
+        PacketPassThreadQueue_InitInput(&client->link->output_queue, &main_qctx);
+        output_if = PacketPassThreadQueue_GetInput(&client->link->output_queue);
+    } else
+#endif
+    {
+        // init sender
+        PacketStreamSender_Init(&client->output_sender, conn_get_send_if(&client->conn), PACKETPROTO_ENCLEN(SC_MAX_ENC), BReactor_PendingGroup(&ss));
+        output_if = PacketStreamSender_GetInput(&client->output_sender);
+    }
     
     // init queue
-    PacketPassPriorityQueue_Init(&client->output_priorityqueue, PacketStreamSender_GetInput(&client->output_sender), BReactor_PendingGroup(&ss), 0);
+    PacketPassPriorityQueue_Init(&client->output_priorityqueue, output_if, BReactor_PendingGroup(&ss), 0);
     
     // init output control flow
     
@@ -1130,9 +1436,7 @@ fail2:
     PacketPassPriorityQueueFlow_Free(&client->output_control_qflow);
     // free output common
     PacketPassPriorityQueue_Free(&client->output_priorityqueue);
-    PacketStreamSender_Free(&client->output_sender);
-    // free input
-    PacketProtoDecoder_Free(&client->input_decoder);
+    client_free_io_ends(client);
 fail1:
     PacketPassInterface_Free(&client->input_interface);
     return 0;
@@ -1164,14 +1468,34 @@ void client_dealloc_io (struct client_data *client)
     
     // free output common
     PacketPassPriorityQueue_Free(&client->output_priorityqueue);
-    PacketStreamSender_Free(&client->output_sender);
+    
+    // free sender and decoder
+    client_free_io_ends(client);
+    
+    // release relay chunk
+    if (client->relay_chunk) {
+        PacketChunk_Deref(client->relay_chunk);
+    }
     
     // free input
-    PacketProtoDecoder_Free(&client->input_decoder);
     PacketPassInterface_Free(&client->input_interface);
 }
 
-void client_remove (struct client_data *client)
+void client_free_io_ends (struct client_data *client)
+{
+#ifndef BADVPN_USE_WINAPI
+    if (client->link) {
+        PacketPassThreadQueue_FreeInput(&client->link->output_queue);
+        PacketPassThreadQueue_FreeOutput(&client->link->input_queue);
+        return;
+    }
+#endif
+    
+    PacketStreamSender_Free(&client->output_sender);
+    PacketProtoDecoder_Free(&client->input_decoder);
+}
+
+void client_remove (struct client_data *client)
 {
     ASSERT(!client->dying)
     
@@ -1288,70 +1612,32 @@ void client_sslcon_handler (struct client_data *client, int event)
     }
     
     // get client certificate
-    CERTCertificate *cert = SSL_PeerCertificate(client->ssl_prfd);
-    if (!cert) {
-        client_log(client, BLOG_ERROR, "SSL_PeerCertificate failed");
-        goto fail0;
-    }
-    
-    // remember common name
-    if (!(client->common_name = CERT_GetCommonName(&cert->subject))) {
-        client_log(client, BLOG_NOTICE, "CERT_GetCommonName failed");
-        goto fail1;
-    }
-    
-    // store certificate
-    SECItem der = cert->derCert;
-    if (der.len > sizeof(client->cert)) {
-        client_log(client, BLOG_NOTICE, "client certificate too big");
-        goto fail1;
-    }
-    memcpy(client->cert, der.data, der.len);
-    client->cert_len = der.len;
-    
-    PRArenaPool *arena = PORT_NewArena(DER_DEFAULT_CHUNKSIZE);
-    if (!arena) {
-        client_log(client, BLOG_ERROR, "PORT_NewArena failed");
-        goto fail1;
-    }
-    
-    // encode certificate
-    memset(&der, 0, sizeof(der));
-    if (!SEC_ASN1EncodeItem(arena, &der, cert, SEC_ASN1_GET(CERT_CertificateTemplate))) {
-        client_log(client, BLOG_ERROR, "SEC_ASN1EncodeItem failed");
-        goto fail2;
+    if (!conn_read_cert(&client->conn, client, (BLog_logfunc)client_logfunc, client->cert, &client->cert_len,
+                        client->cert_old, &client->cert_old_len, &client->common_name)) {
+        client_remove(client);
+        return;
     }
     
-    // store re-encoded certificate (for compatibility with old clients)
-    if (der.len > sizeof(client->cert_old)) {
-        client_log(client, BLOG_NOTICE, "client certificate too big");
-        goto fail2;
-    }
-    memcpy(client->cert_old, der.data, der.len);
-    client->cert_old_len = der.len;
+    client_handshake_done(client);
+    return;
+}
+
+void client_handshake_done (struct client_data *client)
+{
+    ASSERT(options.ssl)
+    ASSERT(client->initstatus == INITSTATUS_HANDSHAKE)
+    ASSERT(!client->dying)
     
     // init I/O chains
     if (!client_init_io(client)) {
-        goto fail2;
+        client_remove(client);
+        return;
     }
     
-    PORT_FreeArena(arena, PR_FALSE);
-    CERT_DestroyCertificate(cert);
-    
     // set client state
     client->initstatus = INITSTATUS_WAITHELLO;
     
     client_log(client, BLOG_INFO, "handshake complete");
-    
-    return;
-    
-    // handle errors
-fail2:
-    PORT_FreeArena(arena, PR_FALSE);
-fail1:
-    CERT_DestroyCertificate(cert);
-fail0:
-    client_remove(client);
 }
 
 void client_decoder_handler_error (struct client_data *client)
@@ -1668,19 +1954,83 @@ void process_packet_outmsg (struct client_data *client, uint8_t *data, int data_
     }
 #endif
     
-    // send packet
+    // get location of packet
+    PacketChunk *chunk;
+    uint8_t *pack;
+    if (!client_get_relay_packet(client, payload, payload_size, &chunk, &pack)) {
+        client_log(client, BLOG_WARNING, "no memory for message; resetting to %d", (int)flow->dest_client->id);
+        peer_flow_start_reset(flow);
+        return;
+    }
+    
+    // write headers
+    struct packetproto_header pp;
+    pp.len = htol16(sizeof(struct sc_header) + sizeof(struct sc_server_inmsg) + payload_size);
+    struct sc_header header;
+    header.type = htol8(SCID_INMSG);
     struct sc_server_inmsg omsg;
-    void *pack;
-    if (!peer_flow_start_packet(flow, &pack, sizeof(omsg) + payload_size)) {
+    omsg.clientid = htol16(client->id);
+    memcpy(pack, &pp, sizeof(pp));
+    memcpy(pack + sizeof(pp), &header, sizeof(header));
+    memcpy(pack + sizeof(pp) + sizeof(header), &omsg, sizeof(omsg));
+    
+    // send packet
+    if (!PacketRefBuffer_Push(&flow->obuf, chunk, pack, RELAY_HEADERS_LEN + payload_size)) {
         // out of buffer, reset these two clients
         client_log(client, BLOG_WARNING, "out of buffer; resetting to %d", (int)flow->dest_client->id);
         peer_flow_start_reset(flow);
         return;
     }
-    omsg.clientid = htol16(client->id);
-    memcpy(pack, &omsg, sizeof(omsg));
-    memcpy((char *)pack + sizeof(omsg), payload, payload_size);
-    peer_flow_end_packet(flow, SCID_INMSG);
+}
+
+int client_get_relay_packet (struct client_data *client, uint8_t *payload, int payload_len, PacketChunk **out_chunk, uint8_t **out_packet)
+{
+    ASSERT(payload_len >= 0)
+    ASSERT(payload_len <= SC_MAX_MSGLEN)
+    ASSERT(sizeof(struct sc_server_inmsg) == sizeof(struct sc_client_outmsg))
+    
+    int chunked = 1;
+#ifndef BADVPN_USE_WINAPI
+    chunked = !client->link;
+#endif
+    
+    if (chunked) {
+        // The payload is in the decoder's chunk, preceded by the headers it was received
+        // with, which are the same size as those of the relayed packet. Build it in place.
+        *out_chunk = PacketProtoDecoder_GetChunk(&client->input_decoder);
+        *out_packet = payload - RELAY_HEADERS_LEN;
+        return 1;
+    }
+    
+    int len = RELAY_HEADERS_LEN + payload_len;
+    
+    // make sure there's space in the relay chunk
+    if (!client->relay_chunk || PacketChunk_Size(client->relay_chunk) - client->relay_chunk_used < len) {
+        if (client->relay_chunk && !PacketChunk_IsShared(client->relay_chunk)) {
+            // nothing in the chunk is referenced, reuse it
+            client->relay_chunk_used = 0;
+        } else {
+            PacketChunk *chunk = PacketChunk_New(CLIENT_INPUT_CHUNK_PACKETS * PACKETPROTO_ENCLEN(SC_MAX_ENC));
+            if (!chunk) {
+                client_log(client, BLOG_ERROR, "PacketChunk_New failed");
+                return 0;
+            }
+            if (client->relay_chunk) {
+                PacketChunk_Deref(client->relay_chunk);
+            }
+            client->relay_chunk = chunk;
+            client->relay_chunk_used = 0;
+        }
+    }
+    
+    // copy payload
+    uint8_t *packet = PacketChunk_Data(client->relay_chunk) + client->relay_chunk_used;
+    memcpy(packet + RELAY_HEADERS_LEN, payload, payload_len);
+    client->relay_chunk_used += len;
+    
+    *out_chunk = client->relay_chunk;
+    *out_packet = packet;
+    return 1;
 }
 
 void process_packet_resetpeer (struct client_data *client, uint8_t *data, int data_len)
@@ -1846,18 +2196,11 @@ int peer_flow_init_io (struct peer_flow *flow)
     // init queue flow
     PacketPassFairQueueFlow_Init(&flow->qflow, &flow->dest_client->output_peers_fairqueue);
     
-    // init PacketProtoFlow
-    if (!PacketProtoFlow_Init(
-        &flow->oflow, SC_MAX_ENC, CLIENT_PEER_FLOW_BUFFER_MIN_PACKETS,
-        PacketPassFairQueueFlow_GetInput(&flow->qflow), BReactor_PendingGroup(&ss)
-    )) {
-        BLog(BLOG_ERROR, "PacketProtoFlow_Init failed");
+    // init buffer
+    if (!PacketRefBuffer_Init(&flow->obuf, PacketPassFairQueueFlow_GetInput(&flow->qflow), CLIENT_PEER_FLOW_BUFFER_MIN_PACKETS)) {
+        BLog(BLOG_ERROR, "PacketRefBuffer_Init failed");
         goto fail1;
     }
-    flow->input = PacketProtoFlow_GetInput(&flow->oflow);
-    
-    // set no packet
-    flow->packet_len = -1;
     
     // set have I/O
     flow->have_io = 1;
@@ -1874,8 +2217,8 @@ void peer_flow_free_io (struct peer_flow *flow)
     ASSERT(flow->have_io)
     PacketPassFairQueueFlow_AssertFree(&flow->qflow);
     
-    // free PacketProtoFlow
-    PacketProtoFlow_Free(&flow->oflow);
+    // free buffer
+    PacketRefBuffer_Free(&flow->obuf);
     
     // free queue flow
     PacketPassFairQueueFlow_Free(&flow->qflow);
@@ -1906,52 +2249,6 @@ void peer_flow_disconnect (struct peer_flow *flow)
     PacketPassFairQueueFlow_SetBusyHandler(&flow->qflow, (PacketPassFairQueue_handler_busy)peer_flow_handler_canremove, flow);
 }
 
-int peer_flow_start_packet (struct peer_flow *flow, void **data, int len)
-{
-    ASSERT(flow->dest_client->initstatus == INITSTATUS_COMPLETE)
-    ASSERT(!flow->dest_client->dying)
-    ASSERT(flow->src_client->initstatus == INITSTATUS_COMPLETE)
-    ASSERT(!flow->src_client->dying)
-    ASSERT(!flow->resetting)
-    ASSERT(!flow->opposite->resetting)
-    ASSERT(flow->have_io)
-    ASSERT(flow->packet_len == -1)
-    ASSERT(len >= 0)
-    ASSERT(len <= SC_MAX_PAYLOAD)
-    ASSERT(!(len > 0) || data)
-    
-    // obtain location for writing the packet
-    if (!BufferWriter_StartPacket(flow->input, &flow->packet)) {
-        return 0;
-    }
-    
-    // remember packet length
-    flow->packet_len = len;
-    
-    if (data) {
-        *data = flow->packet + sizeof(struct sc_header);
-    }
-    return 1;
-}
-
-void peer_flow_end_packet (struct peer_flow *flow, uint8_t type)
-{
-    ASSERT(flow->have_io)
-    ASSERT(flow->packet_len >= 0)
-    ASSERT(flow->packet_len <= SC_MAX_PAYLOAD)
-    
-    // write header
-    struct sc_header header;
-    header.type = type;
-    memcpy(flow->packet, &header, sizeof(header));
-    
-    // finish writing packet
-    BufferWriter_EndPacket(flow->input, sizeof(struct sc_header) + flow->packet_len);
-    
-    // set have no packet
-    flow->packet_len = -1;
-}
-
 void peer_flow_handler_canremove (struct peer_flow *flow)
 {
     ASSERT(!flow->src_client)
@@ -2387,3 +2684,578 @@ struct peer_flow * find_flow (struct client_data *client, peerid_t dest_id)
     
     return flow;
 }
+
+#ifndef BADVPN_USE_WINAPI
+
+int init_workers (void)
+{
+    num_workers = 0;
+    LinkedList1_Init(&links);
+    
+    if (options.worker_threads == 0) {
+        return 1;
+    }
+    
+    // init main thread queue context
+    if (!PacketPassThreadQueueContext_Init(&main_qctx, &ss)) {
+        BLog(BLOG_ERROR, "PacketPassThreadQueueContext_Init failed");
+        goto fail0;
+    }
+    
+    // init link events
+    if (!BMutex_Init(&link_events_mutex)) {
+        BLog(BLOG_ERROR, "BMutex_Init failed");
+        goto fail1;
+    }
+    if (!BThreadSignal_Init(&link_events_signal, &ss, link_events_signal_handler)) {
+        BLog(BLOG_ERROR, "BThreadSignal_Init failed");
+        goto fail2;
+    }
+    LinkedList1_Init(&link_events_list);
+    link_events_signaled = 0;
+    
+    // allocate workers
+    if (!(workers = (struct worker *)BAllocArray(options.worker_threads, sizeof(workers[0])))) {
+        BLog(BLOG_ERROR, "BAllocArray failed");
+        goto fail3;
+    }
+    
+    // start workers
+    for (int i = 0; i < options.worker_threads; i++) {
+        if (!worker_init(&workers[i])) {
+            goto fail4;
+        }
+        num_workers++;
+    }
+    
+    BLog(BLOG_NOTICE, "started %d worker threads", num_workers);
+    
+    return 1;
+    
+fail4:
+    while (num_workers > 0) {
+        worker_free(&workers[--num_workers]);
+    }
+    BFree(workers);
+fail3:
+    BThreadSignal_Free(&link_events_signal);
+fail2:
+    BMutex_Free(&link_events_mutex);
+fail1:
+    PacketPassThreadQueueContext_Free(&main_qctx);
+fail0:
+    return 0;
+}
+
+void free_workers (void)
+{
+    if (num_workers == 0) {
+        ASSERT(LinkedList1_IsEmpty(&links))
+        return;
+    }
+    
+    // stop workers; they first execute any pending stop commands
+    for (int i = 0; i < num_workers; i++) {
+        worker_free(&workers[i]);
+    }
+    
+    // free links, whose events we will no longer process
+    LinkedList1Node *node;
+    while (node = LinkedList1_GetFirst(&links)) {
+        struct client_link *link = UPPER_OBJECT(node, struct client_link, list_node);
+        link_free(link);
+    }
+    
+    BFree(workers);
+    BThreadSignal_Free(&link_events_signal);
+    BMutex_Free(&link_events_mutex);
+    PacketPassThreadQueueContext_Free(&main_qctx);
+}
+
+int worker_init (struct worker *w)
+{
+    // init reactor
+    if (!BReactor_Init(&w->reactor)) {
+        BLog(BLOG_ERROR, "BReactor_Init failed");
+        goto fail0;
+    }
+    
+    // init queue context
+    if (!PacketPassThreadQueueContext_Init(&w->qctx, &w->reactor)) {
+        BLog(BLOG_ERROR, "PacketPassThreadQueueContext_Init failed");
+        goto fail1;
+    }
+    
+    // init commands
+    if (!BMutex_Init(&w->cmd_mutex)) {
+        BLog(BLOG_ERROR, "BMutex_Init failed");
+        goto fail2;
+    }
+    if (!BThreadSignal_Init(&w->cmd_signal, &w->reactor, worker_cmd_signal_handler)) {
+        BLog(BLOG_ERROR, "BThreadSignal_Init failed");
+        goto fail3;
+    }
+    LinkedList1_Init(&w->cmd_list);
+    w->cmd_signaled = 0;
+    w->quit = 0;
+    
+    w->num_links = 0;
+    
+    // start thread
+    if (pthread_create(&w->thread, NULL, worker_thread, w) != 0) {
+        BLog(BLOG_ERROR, "pthread_create failed");
+        goto fail4;
+    }
+    
+    return 1;
+    
+fail4:
+    BThreadSignal_Free(&w->cmd_signal);
+fail3:
+    BMutex_Free(&w->cmd_mutex);
+fail2:
+    PacketPassThreadQueueContext_Free(&w->qctx);
+fail1:
+    BReactor_Free(&w->reactor);
+fail0:
+    return 0;
+}
+
+void worker_free (struct worker *w)
+{
+    // tell the thread to quit
+    BMutex_Lock(&w->cmd_mutex);
+    w->quit = 1;
+    int signal = !w->cmd_signaled;
+    w->cmd_signaled = 1;
+    BMutex_Unlock(&w->cmd_mutex);
+    if (signal) {
+        BThreadSignal_Thread_Signal(&w->cmd_signal);
+    }
+    
+    // wait for it
+    ASSERT_FORCE(pthread_join(w->thread, NULL) == 0)
+    ASSERT(LinkedList1_IsEmpty(&w->cmd_list))
+    
+    BThreadSignal_Free(&w->cmd_signal);
+    BMutex_Free(&w->cmd_mutex);
+    PacketPassThreadQueueContext_Free(&w->qctx);
+    BReactor_Free(&w->reactor);
+}
+
+void * worker_thread (void *arg)
+{
+    struct worker *w = arg;
+    
+    BReactor_Exec(&w->reactor);
+    
+    return NULL;
+}
+
+void worker_cmd_signal_handler (BThreadSignal *signal)
+{
+    struct worker *w = UPPER_OBJECT(signal, struct worker, cmd_signal);
+    
+    while (1) {
+        BMutex_Lock(&w->cmd_mutex);
+        
+        LinkedList1Node *node = LinkedList1_GetFirst(&w->cmd_list);
+        if (!node) {
+            int quit = w->quit;
+            w->cmd_signaled = 0;
+            BMutex_Unlock(&w->cmd_mutex);
+            
+            if (quit) {
+                BReactor_Quit(&w->reactor, 0);
+            }
+            return;
+        }
+        
+        struct client_link *link = UPPER_OBJECT(node, struct client_link, cmd_node);
+        ASSERT(link->worker == w)
+        ASSERT(link->cmds)
+        LinkedList1_Remove(&w->cmd_list, &link->cmd_node);
+        int cmds = link->cmds;
+        link->cmds = 0;
+        
+        BMutex_Unlock(&w->cmd_mutex);
+        
+        // once stopped, the link may be freed by the main thread at any time
+        if ((cmds & LINK_CMD_STOP)) {
+            link_stop(link);
+        } else {
+            ASSERT(cmds == LINK_CMD_START)
+            link_start(link);
+        }
+    }
+}
+
+struct client_link * link_create (struct client_data *client, int fd)
+{
+    ASSERT(num_workers > 0)
+    
+    // pick the worker with the fewest links
+    struct worker *w = &workers[0];
+    for (int i = 1; i < num_workers; i++) {
+        if (workers[i].num_links < w->num_links) {
+            w = &workers[i];
+        }
+    }
+    
+    // allocate structure
+    struct client_link *link = (struct client_link *)malloc(sizeof(*link));
+    if (!link) {
+        goto fail0;
+    }
+    
+    // init queues
+    if (!PacketPassThreadQueue_Init(&link->input_queue, SC_MAX_ENC, CLIENT_LINK_QUEUE_PACKETS)) {
+        goto fail1;
+    }
+    if (!PacketPassThreadQueue_Init(&link->output_queue, PACKETPROTO_ENCLEN(SC_MAX_ENC), CLIENT_LINK_QUEUE_PACKETS)) {
+        goto fail2;
+    }
+    
+    // init arguments
+    link->client = client;
+    link->worker = w;
+    link->fd = fd;
+    link->addr = client->addr;
+    link->id = client->id;
+    
+    // set no commands and events
+    link->cmds = 0;
+    link->events = 0;
+    
+    // set worker state
+    link->state = LINK_STATE_NEW;
+    link->have_io = 0;
+    link->common_name = NULL;
+    
+    // link in
+    LinkedList1_Append(&links, &link->list_node);
+    w->num_links++;
+    
+    // let the worker start it
+    link_post_cmd(link, LINK_CMD_START);
+    
+    return link;
+    
+fail2:
+    PacketPassThreadQueue_Free(&link->input_queue);
+fail1:
+    free(link);
+fail0:
+    return NULL;
+}
+
+void link_free (struct client_link *link)
+{
+    ASSERT(!link->client)
+    
+    // link out
+    link->worker->num_links--;
+    LinkedList1_Remove(&links, &link->list_node);
+    
+    // free common name
+    if (link->common_name) {
+        PORT_Free(link->common_name);
+    }
+    
+    // free queues
+    PacketPassThreadQueue_Free(&link->output_queue);
+    PacketPassThreadQueue_Free(&link->input_queue);
+    
+    // free structure
+    free(link);
+}
+
+void link_post_cmd (struct client_link *link, int cmd)
+{
+    struct worker *w = link->worker;
+    int signal = 0;
+    
+    BMutex_Lock(&w->cmd_mutex);
+    
+    if (!link->cmds) {
+        LinkedList1_Append(&w->cmd_list, &link->cmd_node);
+    }
+    link->cmds |= cmd;
+    
+    if (!w->cmd_signaled) {
+        w->cmd_signaled = 1;
+        signal = 1;
+    }
+    
+    BMutex_Unlock(&w->cmd_mutex);
+    
+    if (signal) {
+        BThreadSignal_Thread_Signal(&w->cmd_signal);
+    }
+}
+
+void link_events_signal_handler (BThreadSignal *signal)
+{
+    while (1) {
+        BMutex_Lock(&link_events_mutex);
+        
+        LinkedList1Node *node = LinkedList1_GetFirst(&link_events_list);
+        if (!node) {
+            link_events_signaled = 0;
+            BMutex_Unlock(&link_events_mutex);
+            return;
+        }
+        
+        struct client_link *link = UPPER_OBJECT(node, struct client_link, event_node);
+        ASSERT(link->events)
+        LinkedList1_Remove(&link_events_list, &link->event_node);
+        int events = link->events;
+        link->events = 0;
+        
+        BMutex_Unlock(&link_events_mutex);
+        
+        link_handle_events(link, events);
+    }
+}
+
+void link_handle_events (struct client_link *link, int events)
+{
+    struct client_data *client = link->client;
+    
+    if (client && !client->dying) {
+        ASSERT(client->link == link)
+        
+        if ((events & LINK_EVENT_UP)) {
+            ASSERT(options.ssl)
+            
+            // take over client data gathered by the worker
+            memcpy(client->cert, link->cert, link->cert_len);
+            client->cert_len = link->cert_len;
+            memcpy(client->cert_old, link->cert_old, link->cert_old_len);
+            client->cert_old_len = link->cert_old_len;
+            if (!(client->common_name = PORT_Strdup(link->common_name))) {
+                client_log(client, BLOG_ERROR, "PORT_Strdup failed");
+                client_remove(client);
+                return;
+            }
+            
+            client_handshake_done(client);
+        }
+        
+        if ((events & LINK_EVENT_DOWN) && !client->dying) {
+            client_remove(client);
+        }
+    }
+    
+    if ((events & LINK_EVENT_STOPPED)) {
+        link_free(link);
+    }
+}
+
+void link_start (struct client_link *link)
+{
+    ASSERT(link->state == LINK_STATE_NEW)
+    
+    struct worker *w = link->worker;
+    
+    // init connection; SSL work is done right here in the worker
+    if (!conn_init(&link->conn, BConnection_source_socket(link->fd), &w->reactor, NULL, 0, link,
+                   (BConnection_handler)link_connection_handler, (BSSLConnection_handler)link_sslcon_handler, (BLog_logfunc)link_logfunc)) {
+        link->state = LINK_STATE_DOWN;
+        link_post_event(link, LINK_EVENT_DOWN);
+        return;
+    }
+    
+    link->state = LINK_STATE_RUNNING;
+    
+    if (!options.ssl) {
+        // init I/O
+        if (!link_init_io(link)) {
+            link_down(link);
+            return;
+        }
+    }
+}
+
+void link_stop (struct client_link *link)
+{
+    switch (link->state) {
+        case LINK_STATE_NEW: {
+            // connection was never created
+            if (close(link->fd) < 0) {
+                BLog(BLOG_ERROR, "close failed");
+            }
+        } break;
+        
+        case LINK_STATE_RUNNING: {
+            if (link->have_io) {
+                link_free_io(link);
+            }
+            conn_free(&link->conn);
+        } break;
+        
+        case LINK_STATE_DOWN:
+            break;
+        
+        default: ASSERT(0);
+    }
+    
+    link_post_event(link, LINK_EVENT_STOPPED);
+}
+
+void link_down (struct client_link *link)
+{
+    ASSERT(link->state == LINK_STATE_RUNNING)
+    
+    // free everything right away; the connection may not be used after an error
+    if (link->have_io) {
+        link_free_io(link);
+    }
+    conn_free(&link->conn);
+    
+    link->state = LINK_STATE_DOWN;
+    
+    // let the main thread remove the client
+    link_post_event(link, LINK_EVENT_DOWN);
+}
+
+int link_init_io (struct client_link *link)
+{
+    ASSERT(link->state == LINK_STATE_RUNNING)
+    ASSERT(!link->have_io)
+    
+    struct worker *w = link->worker;
+    
+    // init input; decoded packets go to the main thread
+    PacketPassThreadQueue_InitInput(&link->input_queue, &w->qctx);
+    if (!PacketProtoDecoder_Init(&link->input_decoder, conn_get_recv_if(&link->conn), PacketPassThreadQueue_GetInput(&link->input_queue),
+        BReactor_PendingGroup(&w->reactor), link, (PacketProtoDecoder_handler_error)link_decoder_handler_error
+    )) {
+        link_log(link, BLOG_ERROR, "PacketProtoDecoder_Init failed");
+        PacketPassThreadQueue_FreeInput(&link->input_queue);
+        return 0;
+    }
+    
+    // init output; packets from the main thread are already encoded
+    PacketStreamSender_Init(&link->output_sender, conn_get_send_if(&link->conn), PACKETPROTO_ENCLEN(SC_MAX_ENC), BReactor_PendingGroup(&w->reactor));
+    PacketPassThreadQueue_InitOutput(&link->output_queue, &w->qctx, PacketStreamSender_GetInput(&link->output_sender));
+    
+    link->have_io = 1;
+    
+    return 1;
+}
+
+void link_free_io (struct client_link *link)
+{
+    ASSERT(link->have_io)
+    
+    // free output
+    PacketPassThreadQueue_FreeOutput(&link->output_queue);
+    PacketStreamSender_Free(&link->output_sender);
+    
+    // free input
+    PacketProtoDecoder_Free(&link->input_decoder);
+    PacketPassThreadQueue_FreeInput(&link->input_queue);
+    
+    link->have_io = 0;
+}
+
+void link_post_event (struct client_link *link, int event)
+{
+    int signal = 0;
+    
+    BMutex_Lock(&link_events_mutex);
+    
+    if (!link->events) {
+        LinkedList1_Append(&link_events_list, &link->event_node);
+    }
+    link->events |= event;
+    
+    if (!link_events_signaled) {
+        link_events_signaled = 1;
+        signal = 1;
+    }
+    
+    BMutex_Unlock(&link_events_mutex);
+    
+    if (signal) {
+        BThreadSignal_Thread_Signal(&link_events_signal);
+    }
+}
+
+void link_logfunc (struct client_link *link)
+{
+    char addr[BADDR_MAX_PRINT_LEN];
+    BAddr_Print(&link->addr, addr);
+    
+    BLog_Append("client %d (%s)", (int)link->id, addr);
+    if (link->common_name) {
+        BLog_Append(" (%s)", link->common_name);
+    }
+    BLog_Append(": ");
+}
+
+void link_log (struct client_link *link, int level, const char *fmt, ...)
+{
+    va_list vl;
+    va_start(vl, fmt);
+    BLog_LogViaFuncVarArg((BLog_logfunc)link_logfunc, link, BLOG_CURRENT_CHANNEL, level, fmt, vl);
+    va_end(vl);
+}
+
+void link_connection_handler (struct client_link *link, int event)
+{
+    ASSERT(link->state == LINK_STATE_RUNNING)
+    
+    if (event == BCONNECTION_EVENT_RECVCLOSED) {
+        link_log(link, BLOG_INFO, "connection closed");
+    } else {
+        link_log(link, BLOG_INFO, "connection error");
+    }
+    
+    link_down(link);
+    return;
+}
+
+void link_sslcon_handler (struct client_link *link, int event)
+{
+    ASSERT(options.ssl)
+    ASSERT(link->state == LINK_STATE_RUNNING)
+    ASSERT(event == BSSLCONNECTION_EVENT_UP || event == BSSLCONNECTION_EVENT_ERROR)
+    ASSERT(!(event == BSSLCONNECTION_EVENT_UP) || !link->have_io)
+    
+    if (event == BSSLCONNECTION_EVENT_ERROR) {
+        link_log(link, BLOG_ERROR, "SSL error");
+        link_down(link);
+        return;
+    }
+    
+    // get client certificate
+    if (!conn_read_cert(&link->conn, link, (BLog_logfunc)link_logfunc, link->cert, &link->cert_len,
+                        link->cert_old, &link->cert_old_len, &link->common_name)) {
+        link_down(link);
+        return;
+    }
+    
+    // init I/O
+    if (!link_init_io(link)) {
+        link_down(link);
+        return;
+    }
+    
+    // let the main thread continue with the client
+    link_post_event(link, LINK_EVENT_UP);
+}
+
+void link_decoder_handler_error (struct client_link *link)
+{
+    ASSERT(link->state == LINK_STATE_RUNNING)
+    ASSERT(link->have_io)
+    
+    link_log(link, BLOG_ERROR, "decoder error");
+    
+    link_down(link);
+    return;
+}
+
+#endif
@@ -37,10 +37,19 @@
 #include <flow/PacketPassPriorityQueue.h>
 #include <flow/PacketPassFairQueue.h>
 #include <flow/PacketProtoFlow.h>
+#include <flow/PacketChunk.h>
+#include <flow/PacketRefBuffer.h>
 #include <system/BReactor.h>
 #include <system/BConnection.h>
 #include <nspr_support/BSSLConnection.h>
 
+#ifndef BADVPN_USE_WINAPI
+#include <pthread.h>
+#include <base/BMutex.h>
+#include <system/BThreadSignal.h>
+#include <threadwork/PacketPassThreadQueue.h>
+#endif
+
 // name of the program
 #define PROGRAM_NAME "server"
 
@@ -52,6 +61,10 @@
 #define CLIENT_CONTROL_BUFFER_MIN_PACKETS (1 + 2*(MAX_CLIENTS - 1))
 // size of client-to-client buffers in packets
 #define CLIENT_PEER_FLOW_BUFFER_MIN_PACKETS 10
+// size of client input chunks in packets; relayed messages are sent from the
+// chunk they were received into, so a chunk stays allocated until all of them
+// have been sent
+#define CLIENT_INPUT_CHUNK_PACKETS 4
 // after how long of not hearing anything from the client we disconnect it
 #define CLIENT_NO_DATA_TIME_LIMIT 30000
 // SO_SNDBFUF socket option for clients
@@ -62,6 +75,11 @@
 // maxiumum listen addresses
 #define MAX_LISTEN_ADDRS 16
 
+// maximum number of worker threads
+#define MAX_WORKER_THREADS 64
+// size of queues between a worker thread and the main thread, in packets
+#define CLIENT_LINK_QUEUE_PACKETS 8
+
 //#define SIMULATE_OUT_OF_CONTROL_BUFFER 20
 //#define SIMULATE_OUT_OF_FLOW_BUFFER 100
 
@@ -75,9 +93,92 @@
 
 #define INITSTATUS_HASLINK(status) ((status) == INITSTATUS_WAITHELLO || (status) == INITSTATUS_COMPLETE)
 
+// commands from the main thread to a worker
+#define LINK_CMD_START (1 << 0)
+#define LINK_CMD_STOP (1 << 1)
+
+// events from a worker to the main thread
+#define LINK_EVENT_UP (1 << 0)
+#define LINK_EVENT_DOWN (1 << 1)
+#define LINK_EVENT_STOPPED (1 << 2)
+
+// worker-side link states
+#define LINK_STATE_NEW 1
+#define LINK_STATE_RUNNING 2
+#define LINK_STATE_DOWN 3
+
 struct client_data;
 struct peer_know;
 
+// client socket, with SSL on top if enabled
+struct client_conn {
+    BConnection con;
+    PRFileDesc bottom_prfd;
+    PRFileDesc *ssl_prfd;
+    BSSLConnection sslcon;
+};
+
+#ifndef BADVPN_USE_WINAPI
+
+struct worker {
+    // event loop of the thread
+    BReactor reactor;
+    PacketPassThreadQueueContext qctx;
+    pthread_t thread;
+    
+    // commands from the main thread
+    BMutex cmd_mutex;
+    BThreadSignal cmd_signal;
+    LinkedList1 cmd_list;
+    int cmd_signaled;
+    int quit;
+    
+    // number of links, only used by the main thread
+    int num_links;
+};
+
+// client connection handled by a worker thread
+struct client_link {
+    // only used by the main thread
+    struct client_data *client;
+    LinkedList1Node list_node;
+    
+    // set before the link is started
+    struct worker *worker;
+    int fd;
+    BAddr addr;
+    peerid_t id;
+    
+    // pending commands, protected by the worker's mutex
+    int cmds;
+    LinkedList1Node cmd_node;
+    
+    // pending events, protected by the events mutex
+    int events;
+    LinkedList1Node event_node;
+    
+    // decoded packets to the main thread
+    PacketPassThreadQueue input_queue;
+    // encoded packets from the main thread
+    PacketPassThreadQueue output_queue;
+    
+    // only used by the worker
+    int state;
+    struct client_conn conn;
+    int have_io;
+    PacketProtoDecoder input_decoder;
+    PacketStreamSender output_sender;
+    
+    // written by the worker before LINK_EVENT_UP
+    uint8_t cert[SCID_NEWCLIENT_MAX_CERT_LEN];
+    int cert_len;
+    uint8_t cert_old[SCID_NEWCLIENT_MAX_CERT_LEN];
+    int cert_old_len;
+    char *common_name;
+};
+
+#endif
+
 struct peer_flow {
     // source client
     struct client_data *src_client;
@@ -93,10 +194,7 @@ struct peer_flow {
     // output chain
     int have_io;
     PacketPassFairQueueFlow qflow;
-    PacketProtoFlow oflow;
-    BufferWriter *input;
-    int packet_len;
-    uint8_t *packet;
+    PacketRefBuffer obuf;
     // reset timer
     BTimer reset_timer;
     // opposite flow
@@ -119,14 +217,14 @@ struct peer_know {
 };
 
 struct client_data {
-    // socket
-    BConnection con;
+    // socket, unless handled by a worker
+    struct client_conn conn;
     BAddr addr;
     
-    // SSL connection, if using SSL
-    PRFileDesc bottom_prfd;
-    PRFileDesc *ssl_prfd;
-    BSSLConnection sslcon;
+#ifndef BADVPN_USE_WINAPI
+    // connection handled by a worker, or NULL
+    struct client_link *link;
+#endif
     
     // initialization state
     int initstatus;
@@ -168,6 +266,10 @@ struct client_data {
     PacketProtoDecoder input_decoder;
     PacketPassInterface input_interface;
     
+    // chunk to copy relayed messages to, when the input is not chunked
+    PacketChunk *relay_chunk;
+    int relay_chunk_used;
+    
     // output common
     PacketStreamSender output_sender;
     PacketPassPriorityQueue output_priorityqueue;
@@ -132,6 +132,7 @@ void connector_handler (ServerConnection *o, int is_error)
     
     // init input chain
     PacketPassInterface_Init(&o->input_interface, SC_MAX_ENC, (PacketPassInterface_handler_send)input_handler_send, o, BReactor_PendingGroup(o->reactor));
+    PacketPassInterface_SetName(&o->input_interface, "ServerConnection");
     if (!PacketProtoDecoder_Init(&o->input_decoder, recv_iface, &o->input_interface, BReactor_PendingGroup(o->reactor), o, (PacketProtoDecoder_handler_error)decoder_handler_error)) {
         BLog(BLOG_ERROR, "PacketProtoDecoder_Init failed");
         goto fail2;
@@ -530,10 +530,11 @@ struct BSocksClient_auth_info BSocksClient_auth_password (const char *username,
 }
 
 int BSocksClient_Init (BSocksClient *o,
-                       BAddr server_addr, const struct BSocksClient_auth_info *auth_info, size_t num_auth_info,
+                       struct BConnection_addr server_addr, const struct BSocksClient_auth_info *auth_info, size_t num_auth_info,
                        BAddr dest_addr, BSocksClient_handler handler, void *user, BReactor *reactor)
 {
-    ASSERT(!BAddr_IsInvalid(&server_addr))
+    ASSERT(server_addr.type == BCONNECTION_ADDR_TYPE_BADDR || server_addr.type == BCONNECTION_ADDR_TYPE_UNIX)
+    ASSERT(server_addr.type != BCONNECTION_ADDR_TYPE_BADDR || !BAddr_IsInvalid(&server_addr.u.baddr))
     ASSERT(dest_addr.type == BADDR_TYPE_IPV4 || dest_addr.type == BADDR_TYPE_IPV6)
 #ifndef NDEBUG
     for (size_t i = 0; i < num_auth_info; i++) {
@@ -554,8 +555,8 @@ int BSocksClient_Init (BSocksClient *o,
     o->buffer = NULL;
     
     // init connector
-    if (!BConnector_Init(&o->connector, server_addr, o->reactor, o, (BConnector_handler)connector_handler)) {
-        BLog(BLOG_ERROR, "BConnector_Init failed");
+    if (!BConnector_InitGeneric(&o->connector, server_addr, o->reactor, o, (BConnector_handler)connector_handler)) {
+        BLog(BLOG_ERROR, "BConnector_InitGeneric failed");
         goto fail0;
     }
     
@@ -42,6 +42,7 @@
 #include <misc/packed.h>
 #include <base/DebugObject.h>
 #include <system/BConnection.h>
+#include <system/BConnectionGeneric.h>
 #include <flow/PacketStreamSender.h>
 
 #define BSOCKSCLIENT_EVENT_ERROR 1
@@ -108,7 +109,8 @@ struct BSocksClient_auth_info BSocksClient_auth_password (const char *username,
  * state before the user may begin any I/O.
  * 
  * @param o the object
- * @param server_addr SOCKS5 server address
+ * @param server_addr SOCKS5 server address, either a TCP address or a unix socket path.
+ *                    A unix socket path is only used during this call.
  * @param dest_addr remote address
  * @param handler handler for up and error events
  * @param user value passed to handler
@@ -116,7 +118,7 @@ struct BSocksClient_auth_info BSocksClient_auth_password (const char *username,
  * @return 1 on success, 0 on failure
  */
 int BSocksClient_Init (BSocksClient *o,
-                       BAddr server_addr, const struct BSocksClient_auth_info *auth_info, size_t num_auth_info,
+                       struct BConnection_addr server_addr, const struct BSocksClient_auth_info *auth_info, size_t num_auth_info,
                        BAddr dest_addr, BSocksClient_handler handler, void *user, BReactor *reactor) WARN_UNUSED;
 
 /**
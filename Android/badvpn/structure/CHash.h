@@ -31,9 +31,126 @@
 #define BADVPN_CHASH_H
 
 #include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
 
 #include <misc/debug.h>
 #include <misc/merge.h>
 #include <misc/balloc.h>
 
+// Control bytes and group matching for the open addressing variant
+// (CHASH_PARAM_OPEN_ADDRESSING). Each slot has a control byte which is
+// either CHASH_CTRL_EMPTY, CHASH_CTRL_DELETED or the low 7 bits of the
+// entry's hash. A group of CHASH_GROUP_WIDTH control bytes is matched at
+// once, with SSE2 where available and with 64-bit word operations otherwise.
+// Define BADVPN_CHASH_NO_SIMD to force the portable implementation.
+
+#if !defined(BADVPN_CHASH_NO_SIMD) && (defined(__x86_64__) || defined(__i386__)) && defined(__SSE2__)
+    #define BADVPN_CHASH_SSE2
+    #include <emmintrin.h>
+#endif
+
+#define CHASH_CTRL_EMPTY ((uint8_t)0x80)
+#define CHASH_CTRL_DELETED ((uint8_t)0xFE)
+
+#ifdef BADVPN_CHASH_SSE2
+#define CHASH_GROUP_WIDTH 16
+typedef uint32_t chash_bitmask;
+#else
+#define CHASH_GROUP_WIDTH 8
+typedef uint64_t chash_bitmask;
+#endif
+
+static int chash_ctrl_is_full (uint8_t c)
+{
+    return !(c & 0x80);
+}
+
+static size_t chash_mix (size_t hash)
+{
+    uint64_t x = (uint64_t)hash * UINT64_C(0x9E3779B97F4A7C15);
+    return (size_t)(x ^ (x >> 32));
+}
+
+static int chash_bitmask_index (chash_bitmask mask)
+{
+    ASSERT(mask != 0)
+    
+    int i = 0;
+#ifdef __GNUC__
+    i = (sizeof(mask) > sizeof(unsigned int) ? __builtin_ctzll(mask) : __builtin_ctz(mask));
+#else
+    while (!(mask & 1)) {
+        mask >>= 1;
+        i++;
+    }
+#endif
+    
+#ifdef BADVPN_CHASH_SSE2
+    return i;
+#else
+    return i / 8;
+#endif
+}
+
+static chash_bitmask chash_bitmask_next (chash_bitmask mask)
+{
+    return mask & (mask - 1);
+}
+
+#ifdef BADVPN_CHASH_SSE2
+
+static chash_bitmask chash_group_match (const uint8_t *ctrl, uint8_t h2)
+{
+    __m128i g = _mm_loadu_si128((const __m128i *)ctrl);
+    return (uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(g, _mm_set1_epi8((char)h2)));
+}
+
+static chash_bitmask chash_group_match_empty (const uint8_t *ctrl)
+{
+    __m128i g = _mm_loadu_si128((const __m128i *)ctrl);
+    return (uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(g, _mm_set1_epi8((char)CHASH_CTRL_EMPTY)));
+}
+
+static chash_bitmask chash_group_match_empty_or_deleted (const uint8_t *ctrl)
+{
+    __m128i g = _mm_loadu_si128((const __m128i *)ctrl);
+    return (uint16_t)_mm_movemask_epi8(g);
+}
+
+#else
+
+#define CHASH_GROUP_LSBS UINT64_C(0x0101010101010101)
+#define CHASH_GROUP_MSBS UINT64_C(0x8080808080808080)
+
+static uint64_t chash_group_load (const uint8_t *ctrl)
+{
+    // byte i of the group goes to bits 8i..8i+7 regardless of endianness
+    uint64_t g = 0;
+    for (int i = 0; i < 8; i++) {
+        g |= (uint64_t)ctrl[i] << (8 * i);
+    }
+    return g;
+}
+
+static chash_bitmask chash_group_match (const uint8_t *ctrl, uint8_t h2)
+{
+    // may report false positives, which are eliminated by comparing entries
+    uint64_t x = chash_group_load(ctrl) ^ (CHASH_GROUP_LSBS * h2);
+    return (x - CHASH_GROUP_LSBS) & ~x & CHASH_GROUP_MSBS;
+}
+
+static chash_bitmask chash_group_match_empty (const uint8_t *ctrl)
+{
+    uint64_t g = chash_group_load(ctrl);
+    return g & ~(g << 6) & CHASH_GROUP_MSBS;
+}
+
+static chash_bitmask chash_group_match_empty_or_deleted (const uint8_t *ctrl)
+{
+    return chash_group_load(ctrl) & CHASH_GROUP_MSBS;
+}
+
+#endif
+
 #endif
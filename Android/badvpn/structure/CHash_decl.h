@@ -29,11 +29,29 @@
 
 #include "CHash_header.h"
 
+#if CHASH_PARAM_OPEN_ADDRESSING
+
+typedef struct {
+    uint8_t ctrl[CHASH_GROUP_WIDTH];
+    CHashLink slots[CHASH_GROUP_WIDTH];
+} CHashGroup;
+
+typedef struct {
+    CHashGroup *groups;
+    size_t num_groups;
+    size_t num_used;
+    size_t num_deleted;
+} CHash;
+
+#else
+
 typedef struct {
     CHashLink *buckets;
     size_t num_buckets;
 } CHash;
 
+#endif
+
 typedef struct {
     CHashEntry *ptr;
     CHashLink link;
@@ -49,10 +67,14 @@ static CHashRef CHashDerefNonNull (CHashArg arg, CHashLink link);
 static int CHash_Init (CHash *o, size_t num_buckets);
 static void CHash_Free (CHash *o);
 static int CHash_Insert (CHash *o, CHashArg arg, CHashRef entry, CHashRef *out_existing);
+#if !CHASH_PARAM_OPEN_ADDRESSING
 static void CHash_InsertMulti (CHash *o, CHashArg arg, CHashRef entry);
+#endif
 static void CHash_Remove (CHash *o, CHashArg arg, CHashRef entry);
 static CHashRef CHash_Lookup (const CHash *o, CHashArg arg, CHashKey key);
+#if !CHASH_PARAM_OPEN_ADDRESSING
 static CHashRef CHash_GetNextEqual (const CHash *o, CHashArg arg, CHashRef entry);
+#endif
 static int CHash_MultiplyBuckets (CHash *o, CHashArg arg, int exp);
 static void CHash_Verify (const CHash *o, CHashArg arg);
 
@@ -41,6 +41,7 @@
 #undef CHASH_PARAM_COMPARE_ENTRIES
 #undef CHASH_PARAM_COMPARE_KEY_ENTRY
 #undef CHASH_PARAM_ENTRY_NEXT
+#undef CHASH_PARAM_OPEN_ADDRESSING
 
 // types
 #undef CHash
@@ -49,6 +50,7 @@
 #undef CHashRef
 #undef CHashArg
 #undef CHashKey
+#undef CHashGroup
 
 // non-object public functions
 #undef CHashNullLink
@@ -72,3 +74,11 @@
 // private things
 #undef CHash_next
 #undef CHash_assert_valid_entry
+#undef CHash_ctrl
+#undef CHash_slot
+#undef CHash_capacity
+#undef CHash_hash_of
+#undef CHash_find_slot
+#undef CHash_find_free_slot
+#undef CHash_rehash
+#undef CHash_grow
@@ -40,12 +40,19 @@
 // CHASH_PARAM_ENTRYHASH_IS_CHEAP - define to 1 if CHASH_PARAM_ENTRYHASH is cheap (e.g. hashes are precomputed)
 // CHASH_PARAM_COMPARE_ENTRIES(arg, entry1, entry2) - compares two entries; returns 1 for equality, 0 otherwise
 // CHASH_PARAM_COMPARE_KEY_ENTRY(arg, key1, entry2) - compares key and entry; returns 1 for equality, 0 otherwise
-// CHASH_PARAM_ENTRY_NEXT - next member in entry
+// CHASH_PARAM_ENTRY_NEXT - next member in entry (not needed with CHASH_PARAM_OPEN_ADDRESSING)
+// CHASH_PARAM_OPEN_ADDRESSING - optional; define to 1 to store links in an open addressed
+//                               table probed by control bytes instead of chaining entries.
+//                               CHash_InsertMulti and CHash_GetNextEqual are not available.
 
 #ifndef BADVPN_CHASH_H
 #error CHash.h has not been included
 #endif
 
+#ifndef CHASH_PARAM_OPEN_ADDRESSING
+#define CHASH_PARAM_OPEN_ADDRESSING 0
+#endif
+
 // types
 #define CHash CHASH_PARAM_NAME
 #define CHashEntry CHASH_PARAM_ENTRY
@@ -53,6 +60,7 @@
 #define CHashRef MERGE(CHash, Ref)
 #define CHashArg CHASH_PARAM_ARG
 #define CHashKey CHASH_PARAM_KEY
+#define CHashGroup MERGE(CHash, Group)
 
 // non-object public functions
 #define CHashNullLink MERGE(CHash, NullLink)
@@ -76,3 +84,11 @@
 // private things
 #define CHash_next(entry) ((entry).ptr->CHASH_PARAM_ENTRY_NEXT)
 #define CHash_assert_valid_entry MERGE(CHash, _assert_valid_entry)
+#define CHash_ctrl(o, i) ((o)->groups[(i) / CHASH_GROUP_WIDTH].ctrl[(i) % CHASH_GROUP_WIDTH])
+#define CHash_slot(o, i) ((o)->groups[(i) / CHASH_GROUP_WIDTH].slots[(i) % CHASH_GROUP_WIDTH])
+#define CHash_capacity MERGE(CHash, _capacity)
+#define CHash_hash_of MERGE(CHash, _hash_of)
+#define CHash_find_slot MERGE(CHash, _find_slot)
+#define CHash_find_free_slot MERGE(CHash, _find_free_slot)
+#define CHash_rehash MERGE(CHash, _rehash)
+#define CHash_grow MERGE(CHash, _grow)
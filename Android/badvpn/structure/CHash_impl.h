@@ -78,6 +78,12 @@ static CHashRef CHashDerefNonNull (CHashArg arg, CHashLink link)
     return entry;
 }
 
+#if CHASH_PARAM_OPEN_ADDRESSING
+
+#include "CHash_open_impl.h"
+
+#else
+
 static int CHash_Init (CHash *o, size_t num_buckets)
 {
     if (num_buckets == 0) {
@@ -309,4 +315,6 @@ static void CHash_Verify (const CHash *o, CHashArg arg)
     }
 }
 
+#endif
+
 #include "CHash_footer.h"
@@ -0,0 +1,354 @@
+/**
+ * @file CHash_open_impl.h
+ * @author Psiphon Inc.
+ * 
+ * @section LICENSE
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// Open addressing variant of CHash, included from CHash_impl.h when
+// CHASH_PARAM_OPEN_ADDRESSING is set.
+// Links are stored in groups of CHASH_GROUP_WIDTH slots, each group holding the
+// control bytes (see CHash.h) followed by the links, so that matching a group and
+// reading a matched link usually touch the same cache line. The upper bits of the hash select the
+// first group to probe and the lower 7 bits are stored in the control byte, so an
+// entry is only dereferenced when its control byte matches. Groups are probed
+// quadratically until a group with an empty slot is found. Removed entries leave
+// deleted markers behind unless their group already has an empty slot.
+// The table is kept at most 7/8 full, counting deleted slots. It grows by
+// reallocating the group array and rehashing the entries in place.
+
+static size_t CHash_capacity (const CHash *o)
+{
+    return o->num_groups * CHASH_GROUP_WIDTH;
+}
+
+static size_t CHash_hash_of (CHashArg arg, CHashRef entry)
+{
+    return chash_mix(CHASH_PARAM_ENTRYHASH(arg, entry));
+}
+
+static size_t CHash_find_slot (const CHash *o, CHashLink link, size_t hash)
+{
+    uint8_t h2 = hash & 0x7F;
+    size_t mask = o->num_groups - 1;
+    size_t group = (hash >> 7) & mask;
+    
+    for (size_t step = 1;; step++) {
+        const CHashGroup *g = &o->groups[group];
+        for (chash_bitmask m = chash_group_match(g->ctrl, h2); m; m = chash_bitmask_next(m)) {
+            int i = chash_bitmask_index(m);
+            if (g->slots[i] == link) {
+                return group * CHASH_GROUP_WIDTH + i;
+            }
+        }
+        ASSERT(!chash_group_match_empty(g->ctrl))
+        ASSERT(step < o->num_groups)
+        group = (group + step) & mask;
+    }
+}
+
+static size_t CHash_find_free_slot (const CHash *o, size_t hash)
+{
+    size_t mask = o->num_groups - 1;
+    size_t group = (hash >> 7) & mask;
+    
+    for (size_t step = 1;; step++) {
+        chash_bitmask m = chash_group_match_empty_or_deleted(o->groups[group].ctrl);
+        if (m) {
+            return group * CHASH_GROUP_WIDTH + chash_bitmask_index(m);
+        }
+        ASSERT(step < o->num_groups)
+        group = (group + step) & mask;
+    }
+}
+
+static void CHash_rehash (CHash *o, CHashArg arg)
+{
+    size_t capacity = CHash_capacity(o);
+    
+    // Drop deleted markers and mark all entries as deleted. Entries are then placed
+    // one by one; a slot marked deleted holds an entry which has not been placed yet.
+    for (size_t i = 0; i < capacity; i++) {
+        CHash_ctrl(o, i) = (chash_ctrl_is_full(CHash_ctrl(o, i)) ? CHASH_CTRL_DELETED : CHASH_CTRL_EMPTY);
+    }
+    
+    for (size_t i = 0; i < capacity; i++) {
+        if (CHash_ctrl(o, i) != CHASH_CTRL_DELETED) {
+            continue;
+        }
+        
+        size_t hash = CHash_hash_of(arg, CHashDerefNonNull(arg, CHash_slot(o, i)));
+        uint8_t h2 = hash & 0x7F;
+        size_t target = CHash_find_free_slot(o, hash);
+        
+        // already in the first group of its probe sequence with a free slot?
+        if (target / CHASH_GROUP_WIDTH == i / CHASH_GROUP_WIDTH) {
+            CHash_ctrl(o, i) = h2;
+            continue;
+        }
+        
+        if (CHash_ctrl(o, target) == CHASH_CTRL_EMPTY) {
+            CHash_slot(o, target) = CHash_slot(o, i);
+            CHash_ctrl(o, target) = h2;
+            CHash_ctrl(o, i) = CHASH_CTRL_EMPTY;
+        } else {
+            // target holds an entry not placed yet; swap and place that one next
+            CHashLink link = CHash_slot(o, target);
+            CHash_slot(o, target) = CHash_slot(o, i);
+            CHash_slot(o, i) = link;
+            CHash_ctrl(o, target) = h2;
+            i--;
+        }
+    }
+    
+    o->num_deleted = 0;
+}
+
+static int CHash_grow (CHash *o, CHashArg arg, size_t new_num_groups)
+{
+    ASSERT(new_num_groups >= o->num_groups)
+    
+    if (new_num_groups > SIZE_MAX / CHASH_GROUP_WIDTH) {
+        return 0;
+    }
+    
+    if (new_num_groups > o->num_groups) {
+        CHashGroup *new_groups = (CHashGroup *)BReallocArray(o->groups, new_num_groups, sizeof(new_groups[0]));
+        if (!new_groups) {
+            return 0;
+        }
+        o->groups = new_groups;
+        
+        for (size_t i = o->num_groups; i < new_num_groups; i++) {
+            memset(o->groups[i].ctrl, CHASH_CTRL_EMPTY, CHASH_GROUP_WIDTH);
+        }
+        o->num_groups = new_num_groups;
+    }
+    
+    CHash_rehash(o, arg);
+    
+    return 1;
+}
+
+static int CHash_Init (CHash *o, size_t num_buckets)
+{
+    // size the table so that num_buckets entries fit without growing
+    size_t num_groups = 1;
+    while (num_groups * CHASH_GROUP_WIDTH - num_groups * CHASH_GROUP_WIDTH / 8 < num_buckets) {
+        if (num_groups > SIZE_MAX / CHASH_GROUP_WIDTH / 2) {
+            return 0;
+        }
+        num_groups *= 2;
+    }
+    
+    o->num_groups = num_groups;
+    o->num_used = 0;
+    o->num_deleted = 0;
+    
+    o->groups = (CHashGroup *)BAllocArray(o->num_groups, sizeof(o->groups[0]));
+    if (!o->groups) {
+        return 0;
+    }
+    
+    for (size_t i = 0; i < o->num_groups; i++) {
+        memset(o->groups[i].ctrl, CHASH_CTRL_EMPTY, CHASH_GROUP_WIDTH);
+    }
+    
+    return 1;
+}
+
+static void CHash_Free (CHash *o)
+{
+    BFree(o->groups);
+}
+
+static int CHash_Insert (CHash *o, CHashArg arg, CHashRef entry, CHashRef *out_existing)
+{
+    CHash_assert_valid_entry(arg, entry);
+    
+    size_t hash = CHash_hash_of(arg, entry);
+    uint8_t h2 = hash & 0x7F;
+    size_t mask = o->num_groups - 1;
+    size_t group = (hash >> 7) & mask;
+    
+    for (size_t step = 1;; step++) {
+        const CHashGroup *g = &o->groups[group];
+        for (chash_bitmask m = chash_group_match(g->ctrl, h2); m; m = chash_bitmask_next(m)) {
+            CHashRef cur = CHashDerefNonNull(arg, g->slots[chash_bitmask_index(m)]);
+            if (CHASH_PARAM_COMPARE_ENTRIES(arg, cur, entry)) {
+                if (out_existing) {
+                    *out_existing = cur;
+                }
+                return 0;
+            }
+        }
+        if (chash_group_match_empty(g->ctrl)) {
+            break;
+        }
+        group = (group + step) & mask;
+    }
+    
+    size_t index = CHash_find_free_slot(o, hash);
+    
+    if (CHash_ctrl(o, index) == CHASH_CTRL_EMPTY) {
+        size_t capacity = CHash_capacity(o);
+        size_t max_load = capacity - capacity / 8;
+        
+        if (o->num_used + o->num_deleted >= max_load) {
+            // rehash at the same size if that frees enough slots, else double the size
+            size_t new_num_groups = (o->num_used < max_load / 2 ? o->num_groups : 2 * o->num_groups);
+            
+            // if growing fails, go on while an empty slot would remain,
+            // so that probing still terminates
+            if (!CHash_grow(o, arg, new_num_groups) && o->num_used + o->num_deleted + 1 >= capacity) {
+                if (out_existing) {
+                    *out_existing = CHashNullRef();
+                }
+                return 0;
+            }
+            
+            index = CHash_find_free_slot(o, hash);
+        }
+    }
+    
+    if (CHash_ctrl(o, index) == CHASH_CTRL_DELETED) {
+        o->num_deleted--;
+    }
+    
+    CHash_ctrl(o, index) = h2;
+    CHash_slot(o, index) = entry.link;
+    o->num_used++;
+    
+    return 1;
+}
+
+static void CHash_Remove (CHash *o, CHashArg arg, CHashRef entry)
+{
+    CHash_assert_valid_entry(arg, entry);
+    
+    size_t index = CHash_find_slot(o, entry.link, CHash_hash_of(arg, entry));
+    ASSERT(chash_ctrl_is_full(CHash_ctrl(o, index)))
+    
+    // Probing stops at a group with an empty slot, so if this group has one,
+    // the slot can become empty too; otherwise later entries may depend on it.
+    if (chash_group_match_empty(o->groups[index / CHASH_GROUP_WIDTH].ctrl)) {
+        CHash_ctrl(o, index) = CHASH_CTRL_EMPTY;
+    } else {
+        CHash_ctrl(o, index) = CHASH_CTRL_DELETED;
+        o->num_deleted++;
+    }
+    
+    o->num_used--;
+}
+
+static CHashRef CHash_Lookup (const CHash *o, CHashArg arg, CHashKey key)
+{
+    size_t hash = chash_mix(CHASH_PARAM_KEYHASH(arg, key));
+    uint8_t h2 = hash & 0x7F;
+    size_t mask = o->num_groups - 1;
+    size_t group = (hash >> 7) & mask;
+    
+    for (size_t step = 1;; step++) {
+        const CHashGroup *g = &o->groups[group];
+        for (chash_bitmask m = chash_group_match(g->ctrl, h2); m; m = chash_bitmask_next(m)) {
+            CHashRef cur = CHashDerefNonNull(arg, g->slots[chash_bitmask_index(m)]);
+            if (CHASH_PARAM_COMPARE_KEY_ENTRY(arg, key, cur)) {
+                return cur;
+            }
+        }
+        if (chash_group_match_empty(g->ctrl)) {
+            return CHashNullRef();
+        }
+        ASSERT(step < o->num_groups)
+        group = (group + step) & mask;
+    }
+}
+
+static int CHash_MultiplyBuckets (CHash *o, CHashArg arg, int exp)
+{
+    ASSERT(exp > 0)
+    
+    size_t new_num_groups = o->num_groups;
+    while (exp-- > 0) {
+        if (new_num_groups > SIZE_MAX / 2) {
+            return 0;
+        }
+        new_num_groups *= 2;
+    }
+    
+    return CHash_grow(o, arg, new_num_groups);
+}
+
+static void CHash_Verify (const CHash *o, CHashArg arg)
+{
+    ASSERT_FORCE(o->num_groups > 0)
+    ASSERT_FORCE(!(o->num_groups & (o->num_groups - 1)))
+    ASSERT_FORCE(o->groups)
+    
+    size_t capacity = CHash_capacity(o);
+    size_t mask = o->num_groups - 1;
+    size_t num_used = 0;
+    size_t num_deleted = 0;
+    
+    for (size_t i = 0; i < capacity; i++) {
+        uint8_t c = CHash_ctrl(o, i);
+        if (c == CHASH_CTRL_EMPTY) {
+            continue;
+        }
+        if (c == CHASH_CTRL_DELETED) {
+            num_deleted++;
+            continue;
+        }
+        ASSERT_FORCE(chash_ctrl_is_full(c))
+        num_used++;
+        
+        CHashRef cur = CHashDerefNonNull(arg, CHash_slot(o, i));
+        size_t hash = CHash_hash_of(arg, cur);
+        ASSERT_FORCE(c == (hash & 0x7F))
+        
+        // probing must reach the entry without passing an empty slot
+        // or another equal entry
+        size_t group = (hash >> 7) & mask;
+        int found = 0;
+        for (size_t step = 1; !found; step++) {
+            ASSERT_FORCE(step <= o->num_groups)
+            const CHashGroup *g = &o->groups[group];
+            for (chash_bitmask m = chash_group_match(g->ctrl, c); m && !found; m = chash_bitmask_next(m)) {
+                size_t index = group * CHASH_GROUP_WIDTH + chash_bitmask_index(m);
+                if (index == i) {
+                    found = 1;
+                } else {
+                    ASSERT_FORCE(!CHASH_PARAM_COMPARE_ENTRIES(arg, CHashDerefNonNull(arg, g->slots[index % CHASH_GROUP_WIDTH]), cur))
+                }
+            }
+            ASSERT_FORCE(found || !chash_group_match_empty(g->ctrl))
+            group = (group + step) & mask;
+        }
+    }
+    
+    ASSERT_FORCE(num_used == o->num_used)
+    ASSERT_FORCE(num_deleted == o->num_deleted)
+    ASSERT_FORCE(num_used + num_deleted < capacity)
+}
@@ -107,6 +107,20 @@ int BListener_InitUnix (BListener *o, const char *socket_path, BReactor *reactor
  */
 void BListener_Free (BListener *o);
 
+#ifndef BADVPN_USE_WINAPI
+/**
+ * Accepts a connection as a bare socket, so that it can be handed over to
+ * a reactor in another thread using {@link BConnection_source_socket}.
+ * Like initializing a {@link BConnection} from {@link BConnection_source_listener},
+ * this may only be called from the listener handler.
+ * 
+ * @param o the object
+ * @param out_addr the address of the client will be returned here. May be NULL.
+ * @return the non-blocking socket on success, -1 on failure
+ */
+int BListener_AcceptSocket (BListener *o, BAddr *out_addr);
+#endif
+
 
 
 struct BConnector_s;
@@ -172,6 +186,7 @@ void BConnector_Free (BConnector *o);
 #define BCONNECTION_SOURCE_TYPE_LISTENER 1
 #define BCONNECTION_SOURCE_TYPE_CONNECTOR 2
 #define BCONNECTION_SOURCE_TYPE_PIPE 3
+#define BCONNECTION_SOURCE_TYPE_SOCKET 4
 
 struct BConnection_source {
     int type;
@@ -187,6 +202,9 @@ struct BConnection_source {
         struct {
             int pipefd;
         } pipe;
+        struct {
+            int fd;
+        } socket;
 #endif
     } u;
 };
@@ -216,6 +234,14 @@ static struct BConnection_source BConnection_source_pipe (int pipefd)
     s.u.pipe.pipefd = pipefd;
     return s;
 }
+
+static struct BConnection_source BConnection_source_socket (int fd)
+{
+    struct BConnection_source s;
+    s.type = BCONNECTION_SOURCE_TYPE_SOCKET;
+    s.u.socket.fd = fd;
+    return s;
+}
 #endif
 
 struct BConnection_s;
@@ -264,6 +290,10 @@ typedef void (*BConnection_handler) (void *user, int event);
  *               - BCONNECTION_SOURCE_PIPE(int)
  *                 On Unix-like systems, uses the provided file descriptor. The file descriptor number must
  *                 be >=0.
+ *               - BCONNECTION_SOURCE_SOCKET(int)
+ *                 On Unix-like systems, takes ownership of a connected socket, usually one obtained with
+ *                 {@link BListener_AcceptSocket}. The socket is closed when the object is freed, or right
+ *                 away if initialization fails.
  * @param reactor reactor we live in
  * @param user argument to handler
  * @param handler handler called when an error occurs or the receive end of the connection was closed
@@ -33,6 +33,7 @@
 #include <errno.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <sys/un.h>
 
 #include <misc/nonblocking.h>
@@ -86,6 +87,7 @@ static void connection_fd_handler (BConnection *o, int events);
 static void connection_send_job_handler (BConnection *o);
 static void connection_recv_job_handler (BConnection *o);
 static void connection_send_if_handler_send (BConnection *o, uint8_t *data, int data_len);
+static void connection_send_if_handler_send_vec (BConnection *o, const struct StreamPassInterface_buf *bufs, int num_bufs);
 static void connection_recv_if_handler_recv (BConnection *o, uint8_t *data, int data_len);
 
 static int build_unix_address (struct unix_addr *out, const char *socket_path)
@@ -254,7 +256,17 @@ static void connection_send (BConnection *o)
     }
     
     // send
-    int bytes = write(o->fd, o->send.busy_data, o->send.busy_data_len);
+    int bytes;
+    if (o->send.busy_bufs) {
+        struct iovec iov[SPI_MAX_BUFS];
+        for (int i = 0; i < o->send.busy_num_bufs; i++) {
+            iov[i].iov_base = o->send.busy_bufs[i].data;
+            iov[i].iov_len = o->send.busy_bufs[i].len;
+        }
+        bytes = writev(o->fd, iov, o->send.busy_num_bufs);
+    } else {
+        bytes = write(o->fd, o->send.busy_data, o->send.busy_data_len);
+    }
     if (bytes < 0) {
         if (!o->is_hupd && (errno == EAGAIN || errno == EWOULDBLOCK)) {
             // wait for fd
@@ -411,6 +423,30 @@ static void connection_send_if_handler_send (BConnection *o, uint8_t *data, int
     // remember data
     o->send.busy_data = data;
     o->send.busy_data_len = data_len;
+    o->send.busy_bufs = NULL;
+    
+    // set busy
+    o->send.state = SEND_STATE_BUSY;
+    
+    connection_send(o);
+    return;
+}
+
+static void connection_send_if_handler_send_vec (BConnection *o, const struct StreamPassInterface_buf *bufs, int num_bufs)
+{
+    DebugObject_Access(&o->d_obj);
+    DebugError_AssertNoError(&o->d_err);
+    ASSERT(o->send.state == SEND_STATE_READY)
+    ASSERT(num_bufs > 0)
+    ASSERT(num_bufs <= SPI_MAX_BUFS)
+    
+    // remember data
+    o->send.busy_bufs = bufs;
+    o->send.busy_num_bufs = num_bufs;
+    o->send.busy_data_len = 0;
+    for (int i = 0; i < num_bufs; i++) {
+        o->send.busy_data_len += bufs[i].len;
+    }
     
     // set busy
     o->send.state = SEND_STATE_BUSY;
@@ -632,6 +668,40 @@ void BListener_Free (BListener *o)
     }
 }
 
+int BListener_AcceptSocket (BListener *o, BAddr *out_addr)
+{
+    DebugObject_Access(&o->d_obj);
+    ASSERT(BPending_IsSet(&o->default_job))
+    
+    // unset default job
+    BPending_Unset(&o->default_job);
+    
+    // accept
+    struct sys_addr sysaddr;
+    sysaddr.len = sizeof(sysaddr.addr);
+    int fd = accept(o->fd, &sysaddr.addr.generic, &sysaddr.len);
+    if (fd < 0) {
+        BLog(BLOG_ERROR, "accept failed");
+        return -1;
+    }
+    
+    // set non-blocking
+    if (!badvpn_set_nonblocking(fd)) {
+        BLog(BLOG_ERROR, "badvpn_set_nonblocking failed");
+        if (close(fd) < 0) {
+            BLog(BLOG_ERROR, "close failed");
+        }
+        return -1;
+    }
+    
+    // return address
+    if (out_addr) {
+        addr_sys_to_socket(out_addr, sysaddr);
+    }
+    
+    return fd;
+}
+
 int BConnector_Init (BConnector *o, BAddr addr, BReactor *reactor, void *user,
                      BConnector_handler handler)
 {
@@ -832,6 +902,9 @@ int BConnection_Init (BConnection *o, struct BConnection_source source, BReactor
         case BCONNECTION_SOURCE_TYPE_PIPE: {
             ASSERT(source.u.pipe.pipefd >= 0)
         } break;
+        case BCONNECTION_SOURCE_TYPE_SOCKET: {
+            ASSERT(source.u.socket.fd >= 0)
+        } break;
         default: ASSERT(0);
     }
     ASSERT(handler)
@@ -890,6 +963,12 @@ int BConnection_Init (BConnection *o, struct BConnection_source source, BReactor
                 goto fail1;
             }
         } break;
+        
+        case BCONNECTION_SOURCE_TYPE_SOCKET: {
+            // take over socket
+            o->fd = source.u.socket.fd;
+            o->close_fd = 1;
+        } break;
     }
     
     // set not HUPd
@@ -980,6 +1059,8 @@ void BConnection_SendAsync_Init (BConnection *o)
     
     // init interface
     StreamPassInterface_Init(&o->send.iface, (StreamPassInterface_handler_send)connection_send_if_handler_send, o, BReactor_PendingGroup(o->reactor));
+    StreamPassInterface_SetName(&o->send.iface, "BConnection");
+    StreamPassInterface_EnableVec(&o->send.iface, (StreamPassInterface_handler_send_vec)connection_send_if_handler_send_vec);
     
     // init job
     BPending_Init(&o->send.job, BReactor_PendingGroup(o->reactor), (BPending_handler)connection_send_job_handler, o);
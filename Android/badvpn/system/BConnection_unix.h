@@ -72,6 +72,8 @@ struct BConnection_s {
         BPending job;
         const uint8_t *busy_data;
         int busy_data_len;
+        const struct StreamPassInterface_buf *busy_bufs;
+        int busy_num_bufs;
         int state;
     } send;
     struct {
@@ -798,6 +798,7 @@ void BConnection_SendAsync_Init (BConnection *o)
     
     // init interface
     StreamPassInterface_Init(&o->send.iface, (StreamPassInterface_handler_send)connection_send_iface_handler_send, o, BReactor_PendingGroup(o->reactor));
+    StreamPassInterface_SetName(&o->send.iface, "BConnection");
     
     // set not busy
     o->send.busy = 0;
@@ -59,6 +59,26 @@ typedef struct BDatagram_s BDatagram;
  */
 typedef void (*BDatagram_handler) (void *user, int event);
 
+#ifndef BADVPN_USE_WINAPI
+/**
+ * A datagram to be sent with {@link BDatagram_SendBatch}.
+ */
+struct BDatagram_batch_msg {
+    const uint8_t *data;
+    int data_len;
+    BAddr remote_addr;
+    BIPAddr local_addr;
+};
+
+/**
+ * Handler called when the socket has become writable after {@link BDatagram_SendBatch}
+ * could not submit all datagrams.
+ * 
+ * @param user as in {@link BDatagram_SendBatch_Init}
+ */
+typedef void (*BDatagram_batch_handler) (void *user);
+#endif
+
 /**
  * Checks if the given address family (from {@link BAddr.h}) is supported by {@link BDatagram}
  * and related objects.
@@ -200,6 +220,48 @@ void BDatagram_RecvAsync_Free (BDatagram *o);
  */
 PacketRecvInterface * BDatagram_RecvAsync_GetIf (BDatagram *o);
 
+#ifndef BADVPN_USE_WINAPI
+/**
+ * Initializes batched sending, an alternative to the send interface for
+ * sending datagrams to many destinations from one socket.
+ * Neither the send interface nor batched sending must be initialized.
+ * Available on Unix-like systems only.
+ * 
+ * @param o the object
+ * @param handler handler called when the socket has become writable after
+ *                {@link BDatagram_SendBatch} could not submit everything
+ * @param user argument to handler
+ */
+void BDatagram_SendBatch_Init (BDatagram *o, BDatagram_batch_handler handler, void *user);
+
+/**
+ * Frees batched sending.
+ * Batched sending must be initialized.
+ * 
+ * @param o the object
+ */
+void BDatagram_SendBatch_Free (BDatagram *o);
+
+/**
+ * Submits datagrams to the system, using as few system calls as possible
+ * (sendmmsg on Linux, one sendmsg per datagram elsewhere).
+ * Batched sending must be initialized, and the handler must not be pending, i.e.
+ * this must not be called again after a short return until the handler was called.
+ * A datagram the system refuses for reasons other than a full socket buffer (e.g. the
+ * destination is unreachable) is dropped and counted as submitted; this is not
+ * reported as an error of the datagram object.
+ * 
+ * @param o the object
+ * @param msgs datagrams to send. The remote address families must be supported according
+ *             to {@link BDatagram_AddressFamilySupported}; the local addresses may be invalid.
+ * @param num number of datagrams. Must be >=0.
+ * @return number of datagrams from the start of msgs which were submitted. If this is less
+ *         than num, the socket buffer is full, and the handler will be called once the
+ *         socket becomes writable.
+ */
+int BDatagram_SendBatch (BDatagram *o, const struct BDatagram_batch_msg *msgs, int num);
+#endif
+
 #ifdef BADVPN_USE_WINAPI
 #include "BDatagram_win.h"
 #else
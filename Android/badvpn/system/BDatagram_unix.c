@@ -61,10 +61,24 @@ struct sys_addr {
     } addr;
 };
 
+struct send_msg_data {
+    struct sys_addr sysaddr;
+    struct iovec iov;
+    union {
+#ifdef BADVPN_FREEBSD
+        char in[CMSG_SPACE(sizeof(struct in_addr))];
+#else
+        char in[CMSG_SPACE(sizeof(struct in_pktinfo))];
+#endif
+        char in6[CMSG_SPACE(sizeof(struct in6_pktinfo))];
+    } cdata;
+};
+
 static int family_socket_to_sys (int family);
 static void addr_socket_to_sys (struct sys_addr *out, BAddr addr);
 static void addr_sys_to_socket (BAddr *out, struct sys_addr addr);
 static void set_pktinfo (int fd, int family);
+static void init_send_msg (struct msghdr *msg, struct send_msg_data *d, BAddr remote_addr, BIPAddr local_addr, const uint8_t *data, int data_len);
 static void report_error (BDatagram *o);
 static void do_send (BDatagram *o);
 static void do_recv (BDatagram *o);
@@ -231,61 +245,27 @@ static void set_pktinfo (int fd, int family)
     }
 }
 
-static void report_error (BDatagram *o)
+static void init_send_msg (struct msghdr *msg, struct send_msg_data *d, BAddr remote_addr, BIPAddr local_addr, const uint8_t *data, int data_len)
 {
-    DebugError_AssertNoError(&o->d_err);
-    
-    // report error
-    DEBUGERROR(&o->d_err, o->handler(o->user, BDATAGRAM_EVENT_ERROR));
-    return;
-}
-
-static void do_send (BDatagram *o)
-{
-    DebugError_AssertNoError(&o->d_err);
-    ASSERT(o->send.inited)
-    ASSERT(o->send.busy)
-    ASSERT(o->send.have_addrs)
-    
-    // limit
-    if (!BReactorLimit_Increment(&o->send.limit)) {
-        // wait for fd
-        o->wait_events |= BREACTOR_WRITE;
-        BReactor_SetFileDescriptorEvents(o->reactor, &o->bfd, o->wait_events);
-        return;
-    }
-    
     // convert destination address
-    struct sys_addr sysaddr;
-    addr_socket_to_sys(&sysaddr, o->send.remote_addr);
+    addr_socket_to_sys(&d->sysaddr, remote_addr);
     
-    struct iovec iov;
-    iov.iov_base = (uint8_t *)o->send.busy_data;
-    iov.iov_len = o->send.busy_data_len;
+    d->iov.iov_base = (uint8_t *)data;
+    d->iov.iov_len = data_len;
     
-    union {
-#ifdef BADVPN_FREEBSD
-        char in[CMSG_SPACE(sizeof(struct in_addr))];
-#else
-        char in[CMSG_SPACE(sizeof(struct in_pktinfo))];
-#endif
-        char in6[CMSG_SPACE(sizeof(struct in6_pktinfo))];
-    } cdata;
-    
-    struct msghdr msg;
-    memset(&msg, 0, sizeof(msg));
-    msg.msg_name = &sysaddr.addr.generic;
-    msg.msg_namelen = sysaddr.len;
-    msg.msg_iov = &iov;
-    msg.msg_iovlen = 1;
-    msg.msg_control = &cdata;
-    msg.msg_controllen = sizeof(cdata);
+    memset(msg, 0, sizeof(*msg));
+    msg->msg_name = &d->sysaddr.addr.generic;
+    msg->msg_namelen = d->sysaddr.len;
+    msg->msg_iov = &d->iov;
+    msg->msg_iovlen = 1;
+    msg->msg_control = &d->cdata;
+    msg->msg_controllen = sizeof(d->cdata);
     
-    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg);
     
     size_t controllen = 0;
     
-    switch (o->send.local_addr.type) {
+    switch (local_addr.type) {
         case BADDR_TYPE_IPV4: {
 #ifdef BADVPN_FREEBSD
             memset(cmsg, 0, CMSG_SPACE(sizeof(struct in_addr)));
@@ -293,7 +273,7 @@ static void do_send (BDatagram *o)
             cmsg->cmsg_type = IP_SENDSRCADDR;
             cmsg->cmsg_len = CMSG_LEN(sizeof(struct in_addr));
             struct in_addr *addrinfo = (struct in_addr *)CMSG_DATA(cmsg);
-            addrinfo->s_addr = o->send.local_addr.ipv4;
+            addrinfo->s_addr = local_addr.ipv4;
             controllen += CMSG_SPACE(sizeof(struct in_addr));
 #else
             memset(cmsg, 0, CMSG_SPACE(sizeof(struct in_pktinfo)));
@@ -301,7 +281,7 @@ static void do_send (BDatagram *o)
             cmsg->cmsg_type = IP_PKTINFO;
             cmsg->cmsg_len = CMSG_LEN(sizeof(struct in_pktinfo));
             struct in_pktinfo *pktinfo = (struct in_pktinfo *)CMSG_DATA(cmsg);
-            pktinfo->ipi_spec_dst.s_addr = o->send.local_addr.ipv4;
+            pktinfo->ipi_spec_dst.s_addr = local_addr.ipv4;
             controllen += CMSG_SPACE(sizeof(struct in_pktinfo));
 #endif
         } break;
@@ -312,17 +292,46 @@ static void do_send (BDatagram *o)
             cmsg->cmsg_type = IPV6_PKTINFO;
             cmsg->cmsg_len = CMSG_LEN(sizeof(struct in6_pktinfo));
             struct in6_pktinfo *pktinfo = (struct in6_pktinfo *)CMSG_DATA(cmsg);
-            memcpy(pktinfo->ipi6_addr.s6_addr, o->send.local_addr.ipv6, 16);
+            memcpy(pktinfo->ipi6_addr.s6_addr, local_addr.ipv6, 16);
             controllen += CMSG_SPACE(sizeof(struct in6_pktinfo));
         } break;
     }
     
-    msg.msg_controllen = controllen;
+    msg->msg_controllen = controllen;
+    
+    if (msg->msg_controllen == 0) {
+        msg->msg_control = NULL;
+    }
+}
+
+static void report_error (BDatagram *o)
+{
+    DebugError_AssertNoError(&o->d_err);
+    
+    // report error
+    DEBUGERROR(&o->d_err, o->handler(o->user, BDATAGRAM_EVENT_ERROR));
+    return;
+}
+
+static void do_send (BDatagram *o)
+{
+    DebugError_AssertNoError(&o->d_err);
+    ASSERT(o->send.inited)
+    ASSERT(o->send.busy)
+    ASSERT(o->send.have_addrs)
     
-    if (msg.msg_controllen == 0) {
-        msg.msg_control = NULL;
+    // limit
+    if (!BReactorLimit_Increment(&o->send.limit)) {
+        // wait for fd
+        o->wait_events |= BREACTOR_WRITE;
+        BReactor_SetFileDescriptorEvents(o->reactor, &o->bfd, o->wait_events);
+        return;
     }
     
+    struct send_msg_data d;
+    struct msghdr msg;
+    init_send_msg(&msg, &d, o->send.remote_addr, o->send.local_addr, o->send.busy_data, o->send.busy_data_len);
+    
     // send
     int bytes = sendmsg(o->fd, &msg, 0);
     if (bytes < 0) {
@@ -465,8 +474,16 @@ static void fd_handler (BDatagram *o, int events)
     
     int have_send = 0;
     int have_recv = 0;
+    int have_batch = 0;
     
-    if ((events & BREACTOR_WRITE) || ((events & (BREACTOR_ERROR|BREACTOR_HUP)) && o->send.inited && o->send.busy && o->send.have_addrs)) {
+    if (o->batch.inited) {
+        if ((events & BREACTOR_WRITE) || ((events & (BREACTOR_ERROR|BREACTOR_HUP)) && o->batch.waiting)) {
+            ASSERT(o->batch.waiting)
+            
+            have_batch = 1;
+        }
+    }
+    else if ((events & BREACTOR_WRITE) || ((events & (BREACTOR_ERROR|BREACTOR_HUP)) && o->send.inited && o->send.busy && o->send.have_addrs)) {
         ASSERT(o->send.inited)
         ASSERT(o->send.busy)
         ASSERT(o->send.have_addrs)
@@ -482,6 +499,19 @@ static void fd_handler (BDatagram *o, int events)
         have_recv = 1;
     }
     
+    if (have_batch) {
+        if (have_recv) {
+            BPending_Set(&o->recv.job);
+        }
+        
+        // set not waiting
+        o->batch.waiting = 0;
+        
+        // let the user continue sending
+        o->batch.handler(o->batch.user);
+        return;
+    }
+    
     if (have_send) {
         if (have_recv) {
             BPending_Set(&o->recv.job);
@@ -637,6 +667,7 @@ int BDatagram_Init (BDatagram *o, int family, BReactor *reactor, void *user,
     // set send and recv not inited
     o->send.inited = 0;
     o->recv.inited = 0;
+    o->batch.inited = 0;
     
     DebugError_Init(&o->d_err, BReactor_PendingGroup(o->reactor));
     DebugObject_Init(&o->d_obj);
@@ -656,6 +687,7 @@ void BDatagram_Free (BDatagram *o)
     DebugError_Free(&o->d_err);
     ASSERT(!o->recv.inited)
     ASSERT(!o->send.inited)
+    ASSERT(!o->batch.inited)
     
     // free limits
     BReactorLimit_Free(&o->recv.limit);
@@ -759,6 +791,7 @@ void BDatagram_SendAsync_Init (BDatagram *o, int mtu)
     DebugObject_Access(&o->d_obj);
     DebugError_AssertNoError(&o->d_err);
     ASSERT(!o->send.inited)
+    ASSERT(!o->batch.inited)
     ASSERT(mtu >= 0)
     
     // init arguments
@@ -766,6 +799,7 @@ void BDatagram_SendAsync_Init (BDatagram *o, int mtu)
     
     // init interface
     PacketPassInterface_Init(&o->send.iface, o->send.mtu, (PacketPassInterface_handler_send)send_if_handler_send, o, BReactor_PendingGroup(o->reactor));
+    PacketPassInterface_SetName(&o->send.iface, "BDatagram");
     
     // init job
     BPending_Init(&o->send.job, BReactor_PendingGroup(o->reactor), (BPending_handler)send_job_handler, o);
@@ -853,3 +887,121 @@ PacketRecvInterface * BDatagram_RecvAsync_GetIf (BDatagram *o)
     
     return &o->recv.iface;
 }
+
+void BDatagram_SendBatch_Init (BDatagram *o, BDatagram_batch_handler handler, void *user)
+{
+    DebugObject_Access(&o->d_obj);
+    DebugError_AssertNoError(&o->d_err);
+    ASSERT(!o->send.inited)
+    ASSERT(!o->batch.inited)
+    ASSERT(handler)
+    
+    // init arguments
+    o->batch.handler = handler;
+    o->batch.user = user;
+    
+    // set not waiting
+    o->batch.waiting = 0;
+    
+    // set inited
+    o->batch.inited = 1;
+}
+
+void BDatagram_SendBatch_Free (BDatagram *o)
+{
+    DebugObject_Access(&o->d_obj);
+    ASSERT(o->batch.inited)
+    
+    // update events
+    o->wait_events &= ~BREACTOR_WRITE;
+    BReactor_SetFileDescriptorEvents(o->reactor, &o->bfd, o->wait_events);
+    
+    // set not inited
+    o->batch.inited = 0;
+}
+
+int BDatagram_SendBatch (BDatagram *o, const struct BDatagram_batch_msg *msgs, int num)
+{
+    DebugObject_Access(&o->d_obj);
+    DebugError_AssertNoError(&o->d_err);
+    ASSERT(o->batch.inited)
+    ASSERT(!o->batch.waiting)
+    ASSERT(num >= 0)
+    
+    int done = 0;
+    
+    while (done < num) {
+        int count = num - done;
+        if (count > BDATAGRAM_BATCH_MAX) {
+            count = BDATAGRAM_BATCH_MAX;
+        }
+        
+#ifdef BADVPN_LINUX
+        struct send_msg_data d[BDATAGRAM_BATCH_MAX];
+        struct mmsghdr hdrs[BDATAGRAM_BATCH_MAX];
+        
+        for (int i = 0; i < count; i++) {
+            const struct BDatagram_batch_msg *m = &msgs[done + i];
+            ASSERT(BDatagram_AddressFamilySupported(m->remote_addr.type))
+            ASSERT(m->data_len >= 0)
+            
+            init_send_msg(&hdrs[i].msg_hdr, &d[i], m->remote_addr, m->local_addr, m->data, m->data_len);
+            hdrs[i].msg_len = 0;
+        }
+        
+        // send; this stops at the first datagram which fails, and if that is the first
+        // one, returns its error
+        int res = sendmmsg(o->fd, hdrs, count, 0);
+#else
+        int res = 0;
+        
+        while (res < count) {
+            const struct BDatagram_batch_msg *m = &msgs[done + res];
+            ASSERT(BDatagram_AddressFamilySupported(m->remote_addr.type))
+            ASSERT(m->data_len >= 0)
+            
+            struct send_msg_data d;
+            struct msghdr msg;
+            init_send_msg(&msg, &d, m->remote_addr, m->local_addr, m->data, m->data_len);
+            
+            if (sendmsg(o->fd, &msg, 0) < 0) {
+                if (res == 0) {
+                    res = -1;
+                }
+                break;
+            }
+            
+            res++;
+        }
+#endif
+        
+        if (res < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                // wait for fd
+                o->batch.waiting = 1;
+                o->wait_events |= BREACTOR_WRITE;
+                BReactor_SetFileDescriptorEvents(o->reactor, &o->bfd, o->wait_events);
+                break;
+            }
+            
+            // drop the datagram which failed
+            BLog(BLOG_INFO, "send failed");
+            res = 1;
+        }
+        
+        done += res;
+    }
+    
+    // if recv wasn't started yet, start it
+    if (done > 0 && !o->recv.started) {
+        // set recv started
+        o->recv.started = 1;
+        
+        // continue receiving
+        if (o->recv.inited && o->recv.busy) {
+            BPending_Set(&o->recv.job);
+        }
+    }
+    
+    return done;
+}
@@ -32,6 +32,7 @@
 
 #define BDATAGRAM_SEND_LIMIT 2
 #define BDATAGRAM_RECV_LIMIT 2
+#define BDATAGRAM_BATCH_MAX 64
 
 struct BDatagram_s {
     BReactor *reactor;
@@ -66,6 +67,12 @@ struct BDatagram_s {
         int busy;
         uint8_t *busy_data;
     } recv;
+    struct {
+        int inited;
+        BDatagram_batch_handler handler;
+        void *user;
+        int waiting;
+    } batch;
     DebugError d_err;
     DebugObject d_obj;
 };
@@ -663,6 +663,7 @@ void BDatagram_SendAsync_Init (BDatagram *o, int mtu)
     
     // init interface
     PacketPassInterface_Init(&o->send.iface, o->send.mtu, (PacketPassInterface_handler_send)send_if_handler_send, o, BReactor_PendingGroup(o->reactor));
+    PacketPassInterface_SetName(&o->send.iface, "BDatagram");
     
     // init job
     BPending_Init(&o->send.job, BReactor_PendingGroup(o->reactor), (BPending_handler)send_job_handler, o);
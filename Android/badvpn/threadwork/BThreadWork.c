@@ -211,6 +211,9 @@ int BThreadWorkDispatcher_Init (BThreadWorkDispatcher *o, BReactor *reactor, int
     
     #ifdef BADVPN_THREADWORK_USE_PTHREAD
     
+    // no threads unless we start some
+    o->num_threads = 0;
+    
     if (num_threads_hint > 0) {
         // init pending list
         LinkedList1_Init(&o->pending_list);
@@ -0,0 +1,400 @@
+/**
+ * @file PacketPassThreadQueue.c
+ * @author Psiphon Inc.
+ * 
+ * @section LICENSE
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <string.h>
+
+#include <misc/balloc.h>
+#include <misc/bsize.h>
+#include <misc/offset.h>
+
+#include "PacketPassThreadQueue.h"
+
+// every entry starts with its length and is padded so that the next one
+// starts aligned
+#define ENTRY_HEADER 8
+
+static size_t entry_size (int len)
+{
+    return ENTRY_HEADER + (((size_t)len + 7) & ~(size_t)7);
+}
+
+static void ctx_signal_handler (BThreadSignal *signal)
+{
+    PacketPassThreadQueueContext *o = UPPER_OBJECT(signal, PacketPassThreadQueueContext, signal);
+    DebugObject_Access(&o->d_obj);
+    
+    BMutex_Lock(&o->mutex);
+    
+    o->signaled = 0;
+    
+    // schedule the ends which were woken up
+    LinkedList1Node *node;
+    while (node = LinkedList1_GetFirst(&o->ready_list)) {
+        struct PacketPassThreadQueue_end *e = UPPER_OBJECT(node, struct PacketPassThreadQueue_end, ready_node);
+        ASSERT(e->ctx == o)
+        ASSERT(e->ready)
+        
+        LinkedList1_Remove(&o->ready_list, &e->ready_node);
+        e->ready = 0;
+        BPending_Set(&e->job);
+    }
+    
+    BMutex_Unlock(&o->mutex);
+}
+
+static void end_init (PacketPassThreadQueue *o, struct PacketPassThreadQueue_end *e, PacketPassThreadQueueContext *ctx, BPending_handler handler)
+{
+    BPending_Init(&e->job, BReactor_PendingGroup(ctx->reactor), handler, o);
+    e->ready = 0;
+    
+    BMutex_Lock(&o->mutex);
+    e->ctx = ctx;
+    BMutex_Unlock(&o->mutex);
+    
+    DebugCounter_Increment(&ctx->d_ends_ctr);
+}
+
+static void end_free (PacketPassThreadQueue *o, struct PacketPassThreadQueue_end *e)
+{
+    PacketPassThreadQueueContext *ctx = e->ctx;
+    ASSERT(ctx)
+    
+    DebugCounter_Decrement(&ctx->d_ends_ctr);
+    
+    // after this the other side can no longer reach us
+    BMutex_Lock(&o->mutex);
+    BMutex_Lock(&ctx->mutex);
+    if (e->ready) {
+        LinkedList1_Remove(&ctx->ready_list, &e->ready_node);
+        e->ready = 0;
+    }
+    BMutex_Unlock(&ctx->mutex);
+    e->ctx = NULL;
+    BMutex_Unlock(&o->mutex);
+    
+    BPending_Free(&e->job);
+}
+
+// called from the thread of the opposite end
+static void end_wake (PacketPassThreadQueue *o, struct PacketPassThreadQueue_end *e)
+{
+    BMutex_Lock(&o->mutex);
+    
+    PacketPassThreadQueueContext *ctx = e->ctx;
+    if (ctx) {
+        int signal = 0;
+        
+        BMutex_Lock(&ctx->mutex);
+        if (!e->ready) {
+            LinkedList1_Append(&ctx->ready_list, &e->ready_node);
+            e->ready = 1;
+            if (!ctx->signaled) {
+                ctx->signaled = 1;
+                signal = 1;
+            }
+        }
+        BMutex_Unlock(&ctx->mutex);
+        
+        if (signal) {
+            BThreadSignal_Thread_Signal(&ctx->signal);
+        }
+    }
+    
+    BMutex_Unlock(&o->mutex);
+}
+
+static void input_try (PacketPassThreadQueue *o)
+{
+    ASSERT(o->have_input)
+    ASSERT(o->in_len >= 0)
+    
+    size_t need = entry_size(o->in_len);
+    size_t tail = __atomic_load_n(&o->tail, __ATOMIC_RELAXED);
+    size_t head = __atomic_load_n(&o->head, __ATOMIC_ACQUIRE);
+    
+    if (o->capacity - (tail - head) < need) {
+        // go to sleep, re-checking afterwards so we can't miss the wakeup
+        __atomic_store_n(&o->input_waiting, 1, __ATOMIC_SEQ_CST);
+        head = __atomic_load_n(&o->head, __ATOMIC_SEQ_CST);
+        if (o->capacity - (tail - head) < need) {
+            return;
+        }
+        __atomic_store_n(&o->input_waiting, 0, __ATOMIC_RELAXED);
+    }
+    
+    // write entry; it may extend past the capacity into the slack area
+    uint8_t *p = o->buf + (tail % o->capacity);
+    int len = o->in_len;
+    memcpy(p, &len, sizeof(len));
+    memcpy(p + ENTRY_HEADER, o->in_data, len);
+    
+    // publish it
+    __atomic_store_n(&o->tail, tail + need, __ATOMIC_SEQ_CST);
+    
+    o->in_len = -1;
+    
+    // wake up output if it's waiting for data
+    if (__atomic_exchange_n(&o->output_waiting, 0, __ATOMIC_SEQ_CST)) {
+        end_wake(o, &o->output_end);
+    }
+    
+    PacketPassInterface_Done(&o->input);
+}
+
+static void input_handler_send (PacketPassThreadQueue *o, uint8_t *data, int data_len)
+{
+    DebugObject_Access(&o->d_obj);
+    ASSERT(o->have_input)
+    ASSERT(o->in_len == -1)
+    ASSERT(data_len >= 0)
+    ASSERT(data_len <= o->mtu)
+    
+    o->in_data = data;
+    o->in_len = data_len;
+    
+    input_try(o);
+}
+
+static void input_job_handler (PacketPassThreadQueue *o)
+{
+    DebugObject_Access(&o->d_obj);
+    ASSERT(o->have_input)
+    
+    if (o->in_len >= 0) {
+        input_try(o);
+    }
+}
+
+static void output_try (PacketPassThreadQueue *o)
+{
+    ASSERT(o->have_output)
+    ASSERT(o->out_len == -1)
+    
+    size_t head = __atomic_load_n(&o->head, __ATOMIC_RELAXED);
+    size_t tail = __atomic_load_n(&o->tail, __ATOMIC_ACQUIRE);
+    
+    if (tail == head) {
+        // go to sleep, re-checking afterwards so we can't miss the wakeup
+        __atomic_store_n(&o->output_waiting, 1, __ATOMIC_SEQ_CST);
+        tail = __atomic_load_n(&o->tail, __ATOMIC_SEQ_CST);
+        if (tail == head) {
+            return;
+        }
+        __atomic_store_n(&o->output_waiting, 0, __ATOMIC_RELAXED);
+    }
+    
+    // pass the entry directly from the ring
+    uint8_t *p = o->buf + (head % o->capacity);
+    int len;
+    memcpy(&len, p, sizeof(len));
+    ASSERT(len >= 0)
+    ASSERT(len <= o->mtu)
+    
+    o->out_len = len;
+    PacketPassInterface_Sender_Send(o->output, p + ENTRY_HEADER, len);
+}
+
+static void output_handler_done (PacketPassThreadQueue *o)
+{
+    DebugObject_Access(&o->d_obj);
+    ASSERT(o->have_output)
+    ASSERT(o->out_len >= 0)
+    
+    // release the entry
+    size_t head = __atomic_load_n(&o->head, __ATOMIC_RELAXED) + entry_size(o->out_len);
+    __atomic_store_n(&o->head, head, __ATOMIC_SEQ_CST);
+    
+    o->out_len = -1;
+    
+    // wake up input if it's waiting for space
+    if (__atomic_exchange_n(&o->input_waiting, 0, __ATOMIC_SEQ_CST)) {
+        end_wake(o, &o->input_end);
+    }
+    
+    output_try(o);
+}
+
+static void output_job_handler (PacketPassThreadQueue *o)
+{
+    DebugObject_Access(&o->d_obj);
+    ASSERT(o->have_output)
+    
+    if (o->out_len == -1) {
+        output_try(o);
+    }
+}
+
+int PacketPassThreadQueueContext_Init (PacketPassThreadQueueContext *o, BReactor *reactor)
+{
+    o->reactor = reactor;
+    
+    if (!BMutex_Init(&o->mutex)) {
+        goto fail0;
+    }
+    
+    if (!BThreadSignal_Init(&o->signal, o->reactor, ctx_signal_handler)) {
+        goto fail1;
+    }
+    
+    LinkedList1_Init(&o->ready_list);
+    o->signaled = 0;
+    
+    DebugCounter_Init(&o->d_ends_ctr);
+    DebugObject_Init(&o->d_obj);
+    return 1;
+    
+fail1:
+    BMutex_Free(&o->mutex);
+fail0:
+    return 0;
+}
+
+void PacketPassThreadQueueContext_Free (PacketPassThreadQueueContext *o)
+{
+    DebugObject_Free(&o->d_obj);
+    DebugCounter_Free(&o->d_ends_ctr);
+    ASSERT(LinkedList1_IsEmpty(&o->ready_list))
+    
+    BThreadSignal_Free(&o->signal);
+    BMutex_Free(&o->mutex);
+}
+
+int PacketPassThreadQueue_Init (PacketPassThreadQueue *o, int mtu, int num_packets)
+{
+    ASSERT(mtu >= 0)
+    ASSERT(num_packets > 0)
+    
+    o->mtu = mtu;
+    
+    // one extra entry of slack so entries never have to wrap around
+    bsize_t cap = bsize_mul(bsize_fromsize(entry_size(mtu)), bsize_fromint(num_packets));
+    bsize_t size = bsize_add(cap, bsize_fromsize(entry_size(mtu)));
+    if (size.is_overflow) {
+        goto fail0;
+    }
+    o->capacity = cap.value;
+    
+    if (!(o->buf = (uint8_t *)BAllocSize(size))) {
+        goto fail0;
+    }
+    
+    if (!BMutex_Init(&o->mutex)) {
+        goto fail1;
+    }
+    
+    o->head = 0;
+    o->tail = 0;
+    o->input_waiting = 0;
+    o->output_waiting = 0;
+    o->have_input = 0;
+    o->have_output = 0;
+    o->input_end.ctx = NULL;
+    o->output_end.ctx = NULL;
+    
+    DebugObject_Init(&o->d_obj);
+    return 1;
+    
+fail1:
+    BFree(o->buf);
+fail0:
+    return 0;
+}
+
+void PacketPassThreadQueue_Free (PacketPassThreadQueue *o)
+{
+    DebugObject_Free(&o->d_obj);
+    ASSERT(!o->have_input)
+    ASSERT(!o->have_output)
+    
+    BMutex_Free(&o->mutex);
+    BFree(o->buf);
+}
+
+void PacketPassThreadQueue_InitInput (PacketPassThreadQueue *o, PacketPassThreadQueueContext *ctx)
+{
+    DebugObject_Access(&o->d_obj);
+    DebugObject_Access(&ctx->d_obj);
+    ASSERT(!o->have_input)
+    
+    PacketPassInterface_Init(&o->input, o->mtu, (PacketPassInterface_handler_send)input_handler_send, o, BReactor_PendingGroup(ctx->reactor));
+    PacketPassInterface_SetName(&o->input, "PacketPassThreadQueue");
+    o->in_len = -1;
+    
+    end_init(o, &o->input_end, ctx, (BPending_handler)input_job_handler);
+    
+    o->have_input = 1;
+}
+
+void PacketPassThreadQueue_FreeInput (PacketPassThreadQueue *o)
+{
+    DebugObject_Access(&o->d_obj);
+    ASSERT(o->have_input)
+    
+    end_free(o, &o->input_end);
+    PacketPassInterface_Free(&o->input);
+    
+    o->have_input = 0;
+}
+
+PacketPassInterface * PacketPassThreadQueue_GetInput (PacketPassThreadQueue *o)
+{
+    DebugObject_Access(&o->d_obj);
+    ASSERT(o->have_input)
+    
+    return &o->input;
+}
+
+void PacketPassThreadQueue_InitOutput (PacketPassThreadQueue *o, PacketPassThreadQueueContext *ctx, PacketPassInterface *output)
+{
+    DebugObject_Access(&o->d_obj);
+    DebugObject_Access(&ctx->d_obj);
+    ASSERT(!o->have_output)
+    ASSERT(PacketPassInterface_GetMTU(output) >= o->mtu)
+    
+    o->output = output;
+    PacketPassInterface_Sender_Init(o->output, (PacketPassInterface_handler_done)output_handler_done, o);
+    o->out_len = -1;
+    
+    end_init(o, &o->output_end, ctx, (BPending_handler)output_job_handler);
+    
+    o->have_output = 1;
+    
+    // pass packets which are already queued
+    BPending_Set(&o->output_end.job);
+}
+
+void PacketPassThreadQueue_FreeOutput (PacketPassThreadQueue *o)
+{
+    DebugObject_Access(&o->d_obj);
+    ASSERT(o->have_output)
+    
+    end_free(o, &o->output_end);
+    
+    o->have_output = 0;
+}
@@ -0,0 +1,192 @@
+/**
+ * @file PacketPassThreadQueue.h
+ * @author Psiphon Inc.
+ * 
+ * @section LICENSE
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ * @section DESCRIPTION
+ * 
+ * Single-producer single-consumer packet queue between two threads, each running
+ * its own {@link BReactor}. Packets are accepted via a {@link PacketPassInterface}
+ * input in one thread and passed to a {@link PacketPassInterface} output in the
+ * other. The ring itself is lock-free; a thread only takes a lock when it has to
+ * wake up the other side.
+ */
+
+#ifndef BADVPN_THREADWORK_PACKETPASSTHREADQUEUE_H
+#define BADVPN_THREADWORK_PACKETPASSTHREADQUEUE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <misc/debug.h>
+#include <misc/debugcounter.h>
+#include <base/DebugObject.h>
+#include <base/BMutex.h>
+#include <base/BPending.h>
+#include <structure/LinkedList1.h>
+#include <system/BReactor.h>
+#include <system/BThreadSignal.h>
+#include <flow/PacketPassInterface.h>
+
+/**
+ * Per-thread object which receives wakeups for the queue ends living in
+ * that thread. Wakeups from other threads are coalesced into a single
+ * write to the thread's signal pipe.
+ */
+typedef struct {
+    BReactor *reactor;
+    BThreadSignal signal;
+    BMutex mutex;
+    LinkedList1 ready_list;
+    int signaled;
+    DebugCounter d_ends_ctr;
+    DebugObject d_obj;
+} PacketPassThreadQueueContext;
+
+struct PacketPassThreadQueue_end {
+    PacketPassThreadQueueContext *ctx;
+    BPending job;
+    LinkedList1Node ready_node;
+    int ready;
+};
+
+/**
+ * Cross-thread packet queue.
+ * 
+ * The two ends are attached separately with {@link PacketPassThreadQueue_InitInput}
+ * and {@link PacketPassThreadQueue_InitOutput}, each from the thread which owns
+ * the respective reactor, and must be detached from the same threads. The
+ * queue itself may only be freed once both ends are detached.
+ */
+typedef struct {
+    int mtu;
+    size_t capacity;
+    uint8_t *buf;
+    BMutex mutex;
+    
+    // ring positions, free-running
+    size_t head;
+    size_t tail;
+    
+    // set by a side which went to sleep waiting for the other one
+    int input_waiting;
+    int output_waiting;
+    
+    // input end
+    int have_input;
+    struct PacketPassThreadQueue_end input_end;
+    PacketPassInterface input;
+    uint8_t *in_data;
+    int in_len;
+    
+    // output end
+    int have_output;
+    struct PacketPassThreadQueue_end output_end;
+    PacketPassInterface *output;
+    int out_len;
+    
+    DebugObject d_obj;
+} PacketPassThreadQueue;
+
+/**
+ * Initializes the context.
+ * 
+ * @param o the object
+ * @param reactor reactor of the calling thread
+ * @return 1 on success, 0 on failure
+ */
+int PacketPassThreadQueueContext_Init (PacketPassThreadQueueContext *o, BReactor *reactor) WARN_UNUSED;
+
+/**
+ * Frees the context.
+ * There must be no queue ends attached to it.
+ * 
+ * @param o the object
+ */
+void PacketPassThreadQueueContext_Free (PacketPassThreadQueueContext *o);
+
+/**
+ * Initializes the queue, with neither end attached.
+ * May be called from any thread.
+ * 
+ * @param o the object
+ * @param mtu maximum packet size. Must be >=0.
+ * @param num_packets number of MTU-sized packets the queue must hold. Must be >0.
+ * @return 1 on success, 0 on failure
+ */
+int PacketPassThreadQueue_Init (PacketPassThreadQueue *o, int mtu, int num_packets) WARN_UNUSED;
+
+/**
+ * Frees the queue.
+ * Neither end may be attached. Packets still in the queue are discarded.
+ * 
+ * @param o the object
+ */
+void PacketPassThreadQueue_Free (PacketPassThreadQueue *o);
+
+/**
+ * Attaches the input end, exposing a {@link PacketPassInterface} in the
+ * thread of the context.
+ * 
+ * @param o the object
+ * @param ctx context of the calling thread
+ */
+void PacketPassThreadQueue_InitInput (PacketPassThreadQueue *o, PacketPassThreadQueueContext *ctx);
+
+/**
+ * Detaches the input end.
+ * 
+ * @param o the object
+ */
+void PacketPassThreadQueue_FreeInput (PacketPassThreadQueue *o);
+
+/**
+ * Returns the input interface.
+ * The input end must be attached.
+ * 
+ * @param o the object
+ * @return input interface, with MTU as in {@link PacketPassThreadQueue_Init}
+ */
+PacketPassInterface * PacketPassThreadQueue_GetInput (PacketPassThreadQueue *o);
+
+/**
+ * Attaches the output end. Packets already in the queue will be
+ * passed to the output.
+ * 
+ * @param o the object
+ * @param ctx context of the calling thread
+ * @param output output interface. Its MTU must be >= the queue MTU.
+ */
+void PacketPassThreadQueue_InitOutput (PacketPassThreadQueue *o, PacketPassThreadQueueContext *ctx, PacketPassInterface *output);
+
+/**
+ * Detaches the output end.
+ * 
+ * @param o the object
+ */
+void PacketPassThreadQueue_FreeOutput (PacketPassThreadQueue *o);
+
+#endif
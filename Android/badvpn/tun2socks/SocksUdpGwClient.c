@@ -33,120 +33,152 @@
 
 #include <generated/blog_channel_SocksUdpGwClient.h>
 
-static void free_socks (SocksUdpGwClient *o);
-static void try_connect (SocksUdpGwClient *o);
-static void reconnect_timer_handler (SocksUdpGwClient *o);
-static void socks_client_handler (SocksUdpGwClient *o, int event);
-static void udpgw_handler_servererror (SocksUdpGwClient *o);
+static void free_socks (struct SocksUdpGwClient_stream *s);
+static void try_connect (struct SocksUdpGwClient_stream *s);
+static void schedule_reconnect (struct SocksUdpGwClient_stream *s);
+static void reconnect_timer_handler (struct SocksUdpGwClient_stream *s);
+static void socks_client_handler (struct SocksUdpGwClient_stream *s, int event);
+static void udpgw_handler_servererror (SocksUdpGwClient *o, int stream);
 static void udpgw_handler_received (SocksUdpGwClient *o, BAddr local_addr, BAddr remote_addr, const uint8_t *data, int data_len);
 
-static void free_socks (SocksUdpGwClient *o)
+static void free_socks (struct SocksUdpGwClient_stream *s)
 {
-    ASSERT(o->have_socks)
+    SocksUdpGwClient *o = s->client;
+    ASSERT(s->have_socks)
     
     // disconnect udpgw client from SOCKS
-    if (o->socks_up) {
-        UdpGwClient_DisconnectServer(&o->udpgw_client);
+    if (s->socks_up) {
+        UdpGwClient_DisconnectServer(&o->udpgw_client, s->index);
+        
+        // reset backoff if the connection was stable, so that a server
+        // which accepts and drops right away doesn't get reconnected to in a loop
+        if (btime_gettime() - s->up_time >= SOCKSUDPGWCLIENT_STABLE_TIME) {
+            s->reconnect_delay = 0;
+        }
     }
     
     // free SOCKS client
-    BSocksClient_Free(&o->socks_client);
+    BSocksClient_Free(&s->socks_client);
     
     // set have no SOCKS
-    o->have_socks = 0;
+    s->have_socks = 0;
 }
 
-static void try_connect (SocksUdpGwClient *o)
+static void try_connect (struct SocksUdpGwClient_stream *s)
 {
-    ASSERT(!o->have_socks)
-    ASSERT(!BTimer_IsRunning(&o->reconnect_timer))
+    SocksUdpGwClient *o = s->client;
+    ASSERT(!s->have_socks)
+    ASSERT(!BTimer_IsRunning(&s->reconnect_timer))
     
     // init SOCKS client
-    if (!BSocksClient_Init(&o->socks_client, o->socks_server_addr, o->auth_info, o->num_auth_info, o->remote_udpgw_addr, (BSocksClient_handler)socks_client_handler, o, o->reactor)) {
+    if (!BSocksClient_Init(&s->socks_client, o->socks_server_addr, o->auth_info, o->num_auth_info, o->remote_udpgw_addr, (BSocksClient_handler)socks_client_handler, s, o->reactor)) {
         BLog(BLOG_ERROR, "BSocksClient_Init failed");
         goto fail0;
     }
     
     // set have SOCKS
-    o->have_socks = 1;
+    s->have_socks = 1;
     
     // set SOCKS not up
-    o->socks_up = 0;
+    s->socks_up = 0;
     
     return;
     
 fail0:
     // set reconnect timer
-    BReactor_SetTimer(o->reactor, &o->reconnect_timer);
+    schedule_reconnect(s);
 }
 
-static void reconnect_timer_handler (SocksUdpGwClient *o)
+static void schedule_reconnect (struct SocksUdpGwClient_stream *s)
 {
-    DebugObject_Access(&o->d_obj);
-    ASSERT(!o->have_socks)
+    SocksUdpGwClient *o = s->client;
+    ASSERT(!s->have_socks)
+    
+    BLog(BLOG_INFO, "reconnecting in %d ms (stream %d)", (int)s->reconnect_delay, s->index);
+    
+    // set reconnect timer
+    BReactor_SetTimerAfter(o->reactor, &s->reconnect_timer, s->reconnect_delay);
+    
+    // back off
+    s->reconnect_delay = (s->reconnect_delay < SOCKSUDPGWCLIENT_RECONNECT_MIN_TIME) ? SOCKSUDPGWCLIENT_RECONNECT_MIN_TIME : 2 * s->reconnect_delay;
+    if (s->reconnect_delay > o->reconnect_time) {
+        s->reconnect_delay = o->reconnect_time;
+    }
+}
+
+static void reconnect_timer_handler (struct SocksUdpGwClient_stream *s)
+{
+    DebugObject_Access(&s->client->d_obj);
+    ASSERT(!s->have_socks)
     
     // try connecting
-    try_connect(o);
+    try_connect(s);
 }
 
-static void socks_client_handler (SocksUdpGwClient *o, int event)
+static void socks_client_handler (struct SocksUdpGwClient_stream *s, int event)
 {
+    SocksUdpGwClient *o = s->client;
     DebugObject_Access(&o->d_obj);
-    ASSERT(o->have_socks)
+    ASSERT(s->have_socks)
     
     switch (event) {
         case BSOCKSCLIENT_EVENT_UP: {
-            ASSERT(!o->socks_up)
+            ASSERT(!s->socks_up)
             
-            BLog(BLOG_INFO, "SOCKS up");
+            BLog(BLOG_INFO, "SOCKS up (stream %d)", s->index);
             
             // connect udpgw client to SOCKS
-            if (!UdpGwClient_ConnectServer(&o->udpgw_client, BSocksClient_GetSendInterface(&o->socks_client), BSocksClient_GetRecvInterface(&o->socks_client))) {
+            if (!UdpGwClient_ConnectServer(&o->udpgw_client, s->index, BSocksClient_GetSendInterface(&s->socks_client), BSocksClient_GetRecvInterface(&s->socks_client))) {
                 BLog(BLOG_ERROR, "UdpGwClient_ConnectServer failed");
                 goto fail0;
             }
             
             // set SOCKS up
-            o->socks_up = 1;
+            s->socks_up = 1;
+            s->up_time = btime_gettime();
             
             return;
             
         fail0:
             // free SOCKS
-            free_socks(o);
+            free_socks(s);
             
             // set reconnect timer
-            BReactor_SetTimer(o->reactor, &o->reconnect_timer);
+            schedule_reconnect(s);
         } break;
         
         case BSOCKSCLIENT_EVENT_ERROR:
         case BSOCKSCLIENT_EVENT_ERROR_CLOSED: {
-            BLog(BLOG_INFO, "SOCKS error");
+            BLog(BLOG_INFO, "SOCKS error (stream %d)", s->index);
             
             // free SOCKS
-            free_socks(o);
+            free_socks(s);
             
             // set reconnect timer
-            BReactor_SetTimer(o->reactor, &o->reconnect_timer);
+            schedule_reconnect(s);
         } break;
         
         default: ASSERT(0);
     }
 }
 
-static void udpgw_handler_servererror (SocksUdpGwClient *o)
+static void udpgw_handler_servererror (SocksUdpGwClient *o, int stream)
 {
     DebugObject_Access(&o->d_obj);
-    ASSERT(o->have_socks)
-    ASSERT(o->socks_up)
+    ASSERT(stream >= 0)
+    ASSERT(stream < o->num_streams)
+    
+    struct SocksUdpGwClient_stream *s = &o->streams[stream];
+    ASSERT(s->have_socks)
+    ASSERT(s->socks_up)
     
-    BLog(BLOG_ERROR, "client reports server error");
+    BLog(BLOG_ERROR, "client reports server error (stream %d)", s->index);
     
     // free SOCKS
-    free_socks(o);
+    free_socks(s);
     
     // set reconnect timer
-    BReactor_SetTimer(o->reactor, &o->reconnect_timer);
+    schedule_reconnect(s);
 }
 
 static void udpgw_handler_received (SocksUdpGwClient *o, BAddr local_addr, BAddr remote_addr, const uint8_t *data, int data_len)
@@ -158,14 +190,16 @@ static void udpgw_handler_received (SocksUdpGwClient *o, BAddr local_addr, BAddr
     return;
 }
 
-int SocksUdpGwClient_Init (SocksUdpGwClient *o, int udp_mtu, int max_connections, int send_buffer_size, btime_t keepalive_time,
-                           BAddr socks_server_addr, const struct BSocksClient_auth_info *auth_info, size_t num_auth_info,
+int SocksUdpGwClient_Init (SocksUdpGwClient *o, int udp_mtu, int max_connections, int send_buffer_size, int replay_packets, btime_t keepalive_time,
+                           int num_streams, const uint8_t *session_id, struct BConnection_addr socks_server_addr, const struct BSocksClient_auth_info *auth_info, size_t num_auth_info,
                            BAddr remote_udpgw_addr, btime_t reconnect_time, BReactor *reactor, void *user,
                            SocksUdpGwClient_handler_received handler_received)
 {
     // see asserts in UdpGwClient_Init
-    ASSERT(!BAddr_IsInvalid(&socks_server_addr))
+    ASSERT(socks_server_addr.type == BCONNECTION_ADDR_TYPE_BADDR || socks_server_addr.type == BCONNECTION_ADDR_TYPE_UNIX)
+    ASSERT(socks_server_addr.type != BCONNECTION_ADDR_TYPE_BADDR || !BAddr_IsInvalid(&socks_server_addr.u.baddr))
     ASSERT(remote_udpgw_addr.type == BADDR_TYPE_IPV4 || remote_udpgw_addr.type == BADDR_TYPE_IPV6)
+    ASSERT(reconnect_time >= 0)
     
     // init arguments
     o->udp_mtu = udp_mtu;
@@ -173,26 +207,35 @@ int SocksUdpGwClient_Init (SocksUdpGwClient *o, int udp_mtu, int max_connections
     o->auth_info = auth_info;
     o->num_auth_info = num_auth_info;
     o->remote_udpgw_addr = remote_udpgw_addr;
+    o->reconnect_time = reconnect_time;
     o->reactor = reactor;
     o->user = user;
     o->handler_received = handler_received;
+    o->num_streams = num_streams;
     
     // init udpgw client
-    if (!UdpGwClient_Init(&o->udpgw_client, udp_mtu, max_connections, send_buffer_size, keepalive_time, o->reactor, o,
+    if (!UdpGwClient_Init(&o->udpgw_client, udp_mtu, max_connections, send_buffer_size, replay_packets, keepalive_time, num_streams, session_id, o->reactor, o,
                           (UdpGwClient_handler_servererror)udpgw_handler_servererror,
                           (UdpGwClient_handler_received)udpgw_handler_received
     )) {
         goto fail0;
     }
     
-    // init reconnect timer
-    BTimer_Init(&o->reconnect_timer, reconnect_time, (BTimer_handler)reconnect_timer_handler, o);
-    
-    // set have no SOCKS
-    o->have_socks = 0;
-    
-    // try connecting
-    try_connect(o);
+    for (int i = 0; i < o->num_streams; i++) {
+        struct SocksUdpGwClient_stream *s = &o->streams[i];
+        s->client = o;
+        s->index = i;
+        
+        // init reconnect timer
+        BTimer_Init(&s->reconnect_timer, 0, (BTimer_handler)reconnect_timer_handler, s);
+        s->reconnect_delay = 0;
+        
+        // set have no SOCKS
+        s->have_socks = 0;
+        
+        // try connecting
+        try_connect(s);
+    }
     
     DebugObject_Init(&o->d_obj);
     return 1;
@@ -205,14 +248,18 @@ void SocksUdpGwClient_Free (SocksUdpGwClient *o)
 {
     DebugObject_Free(&o->d_obj);
     
-    // free SOCKS
-    if (o->have_socks) {
-        free_socks(o);
+    for (int i = 0; i < o->num_streams; i++) {
+        struct SocksUdpGwClient_stream *s = &o->streams[i];
+        
+        // free SOCKS
+        if (s->have_socks) {
+            free_socks(s);
+        }
+        
+        // free reconnect timer
+        BReactor_RemoveTimer(o->reactor, &s->reconnect_timer);
     }
     
-    // free reconnect timer
-    BReactor_RemoveTimer(o->reactor, &o->reconnect_timer);
-    
     // free udpgw client
     UdpGwClient_Free(&o->udpgw_client);
 }
@@ -226,3 +273,10 @@ void SocksUdpGwClient_SubmitPacket (SocksUdpGwClient *o, BAddr local_addr, BAddr
     UdpGwClient_SubmitPacket(&o->udpgw_client, local_addr, remote_addr, is_dns, data, data_len);
 }
 
+void SocksUdpGwClient_SetStats (SocksUdpGwClient *o, struct flow_stats_class *stats)
+{
+    DebugObject_Access(&o->d_obj);
+    
+    UdpGwClient_SetStats(&o->udpgw_client, stats);
+}
+
@@ -32,33 +32,61 @@
 #include <misc/debug.h>
 #include <base/DebugObject.h>
 #include <system/BReactor.h>
+#include <system/BTime.h>
 #include <udpgw_client/UdpGwClient.h>
 #include <socksclient/BSocksClient.h>
 
+// first reconnect is immediate, then delays double from this up to reconnect_time
+#define SOCKSUDPGWCLIENT_RECONNECT_MIN_TIME 100
+
+// a stream needs to stay up this long for its next reconnect to be immediate again
+#define SOCKSUDPGWCLIENT_STABLE_TIME 5000
+
 typedef void (*SocksUdpGwClient_handler_received) (void *user, BAddr local_addr, BAddr remote_addr, const uint8_t *data, int data_len);
 
-typedef struct {
+struct _SocksUdpGwClient;
+
+struct SocksUdpGwClient_stream {
+    struct _SocksUdpGwClient *client;
+    int index;
+    BTimer reconnect_timer;
+    btime_t reconnect_delay;
+    int have_socks;
+    BSocksClient socks_client;
+    int socks_up;
+    btime_t up_time;
+};
+
+typedef struct _SocksUdpGwClient {
     int udp_mtu;
-    BAddr socks_server_addr;
+    struct BConnection_addr socks_server_addr;
     const struct BSocksClient_auth_info *auth_info;
     size_t num_auth_info;
     BAddr remote_udpgw_addr;
+    btime_t reconnect_time;
     BReactor *reactor;
     void *user;
     SocksUdpGwClient_handler_received handler_received;
     UdpGwClient udpgw_client;
-    BTimer reconnect_timer;
-    int have_socks;
-    BSocksClient socks_client;
-    int socks_up;
+    int num_streams;
+    struct SocksUdpGwClient_stream streams[UDPGWCLIENT_MAX_STREAMS];
     DebugObject d_obj;
 } SocksUdpGwClient;
 
-int SocksUdpGwClient_Init (SocksUdpGwClient *o, int udp_mtu, int max_connections, int send_buffer_size, btime_t keepalive_time,
-                           BAddr socks_server_addr, const struct BSocksClient_auth_info *auth_info, size_t num_auth_info,
+/**
+ * Initializes the object, which connects to udpgw through num_streams SOCKS
+ * connections. See {@link UdpGwClient_Init} for replay_packets, num_streams
+ * and session_id. A failed SOCKS connection is retried immediately, and then
+ * with exponential backoff up to reconnect_time. A unix socket path in
+ * socks_server_addr must remain valid for the lifetime of the object.
+ */
+int SocksUdpGwClient_Init (SocksUdpGwClient *o, int udp_mtu, int max_connections, int send_buffer_size, int replay_packets, btime_t keepalive_time,
+                           int num_streams, const uint8_t *session_id,
+                           struct BConnection_addr socks_server_addr, const struct BSocksClient_auth_info *auth_info, size_t num_auth_info,
                            BAddr remote_udpgw_addr, btime_t reconnect_time, BReactor *reactor, void *user,
                            SocksUdpGwClient_handler_received handler_received) WARN_UNUSED;
 void SocksUdpGwClient_Free (SocksUdpGwClient *o);
 void SocksUdpGwClient_SubmitPacket (SocksUdpGwClient *o, BAddr local_addr, BAddr remote_addr, int is_dns, const uint8_t *data, int data_len);
+void SocksUdpGwClient_SetStats (SocksUdpGwClient *o, struct flow_stats_class *stats);
 
 #endif
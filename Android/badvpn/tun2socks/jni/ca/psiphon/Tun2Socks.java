@@ -32,6 +32,16 @@ public class Tun2Socks {
     
     private native static int terminateTun2Socks();
 
+    // getTun2SocksStats returns a snapshot of the TCP and udpgw flow statistics
+    // accumulated since the library was loaded. The layout is defined by
+    // flow_stats_export in misc/flow_stats.h: for TCP and then UDP, the counters
+    // active, opened, closed, bytesUp, bytesDown and stalls, followed by the
+    // log2 histograms setupMs, lifetimeMs, flowBytesUp, flowBytesDown and
+    // flowStalls, each as count, sum and 32 buckets.
+    // It's safe to call getTun2SocksStats from a different thread.
+
+    private native static long[] getTun2SocksStats();
+
     public static void logTun2Socks(String level, String channel, String msg) {
     }
 
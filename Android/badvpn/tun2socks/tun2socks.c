@@ -35,6 +35,11 @@
 #include <stddef.h>
 #include <string.h>
 #include <limits.h>
+#include <inttypes.h>
+
+#ifdef PSIPHON
+#include <pthread.h>
+#endif
 
 // PSIPHON
 #include "jni.h"
@@ -53,14 +58,21 @@
 #include <misc/open_standard_streams.h>
 #include <misc/read_file.h>
 #include <misc/ipaddr6.h>
+#include <misc/string_begins_with.h>
 #include <misc/concat_strings.h>
+#include <misc/flow_stats.h>
 #include <structure/LinkedList1.h>
 #include <base/BLog.h>
 #include <system/BReactor.h>
 #include <system/BSignal.h>
 #include <system/BAddr.h>
 #include <system/BNetwork.h>
+#include <system/BConnectionGeneric.h>
+#ifdef PSIPHON
+#include <system/BThreadSignal.h>
+#endif
 #include <flow/SinglePacketBuffer.h>
+#include <flowextra/FlowProfileDumper.h>
 #include <socksclient/BSocksClient.h>
 #include <tuntap/BTap.h>
 #include <lwip/init.h>
@@ -71,6 +83,7 @@
 
 #ifndef BADVPN_USE_WINAPI
 #include <base/BLog_syslog.h>
+#include <random/BRandom2.h>
 #endif
 
 #include <tun2socks/tun2socks.h>
@@ -106,6 +119,9 @@ struct {
     int loglevel;
     int loglevels[BLOG_NUM_CHANNELS];
     char *tundev;
+    #ifdef BADVPN_LINUX
+    int tun_offload;
+    #endif
     char *netif_ipaddr;
     char *netif_netmask;
     char *netif_ip6addr;
@@ -117,7 +133,13 @@ struct {
     char *udpgw_remote_server_addr;
     int udpgw_max_connections;
     int udpgw_connection_buffer_size;
+    int udpgw_replay_packets;
+    int udpgw_streams;
     int udpgw_transparent_dns;
+    int stats_interval;
+    char *flow_profile;
+    int tcp_wnd;
+    int tcp_snd_buf;
 
     // ==== PSIPHON ====
     int tun_fd;
@@ -135,7 +157,9 @@ struct tcp_client {
     BAddr remote_addr;
     struct tcp_pcb *pcb;
     int client_closed;
-    uint8_t buf[TCP_WND];
+    uint8_t *buf;
+    int buf_size;
+    int buf_start;
     int buf_used;
     char *socks_username;
     BSocksClient socks_client;
@@ -148,6 +172,7 @@ struct tcp_client {
     int socks_recv_buf_sent;
     int socks_recv_waiting;
     int socks_recv_tcp_pending;
+    struct flow_stats_flow stats_flow;
 };
 
 // IP address of netif
@@ -160,7 +185,7 @@ BIPAddr netif_netmask;
 struct ipv6_addr netif_ip6addr;
 
 // SOCKS server address
-BAddr socks_server_addr;
+struct BConnection_addr socks_server_addr;
 
 // allocated password file contents
 uint8_t *password_file_contents;
@@ -194,6 +219,7 @@ int udp_mtu;
 
 // TCP timer
 BTimer tcp_timer;
+btime_t tcp_timer_deadline;
 
 // job for initializing lwip
 BPending lwip_init_job;
@@ -214,6 +240,15 @@ LinkedList1 tcp_clients;
 // number of clients
 int num_clients;
 
+// TCP and udpgw flow statistics, accumulated over the lifetime of the process
+struct flow_stats flow_stats;
+
+// timer for logging flow statistics
+BTimer stats_timer;
+
+// flow profile dumper, if options.flow_profile
+FlowProfileDumper flow_profile_dumper;
+
 // ==== PSIPHON ====
 static void run (void);
 static void init_arguments (const char* program_name);
@@ -228,6 +263,8 @@ static void signal_handler (void *unused);
 static BAddr baddr_from_lwip (int is_ipv6, const ipX_addr_t *ipx_addr, uint16_t port_hostorder);
 static void lwip_init_job_hadler (void *unused);
 static void tcp_timer_handler (void *unused);
+static void tcp_timer_update (void);
+static void stats_timer_handler (void *unused);
 static void device_error_handler (void *unused);
 static void device_read_handler_send (void *unused, uint8_t *data, int data_len);
 static int process_device_udp_packet (uint8_t *data, int data_len);
@@ -249,6 +286,7 @@ static void client_err_func (void *arg, err_t err);
 static err_t client_recv_func (void *arg, struct tcp_pcb *tpcb, struct pbuf *p, err_t err);
 static void client_socks_handler (struct tcp_client *client, int event);
 static void client_send_to_socks (struct tcp_client *client);
+static void client_send_buffered (struct tcp_client *client);
 static void client_socks_send_handler_done (struct tcp_client *client, int data_len);
 static void client_socks_recv_initiate (struct tcp_client *client);
 static void client_socks_recv_handler_done (struct tcp_client *client, int data_len);
@@ -265,6 +303,14 @@ int g_terminate = 0;
 JNIEnv* g_env = 0;
 int sendKeepAlive = 1;
 
+// signal used by terminateTun2Socks to wake up the event loop;
+// g_terminate_signal is non-NULL while run() has it initialized
+static pthread_mutex_t g_terminate_mutex = PTHREAD_MUTEX_INITIALIZER;
+static BThreadSignal *g_terminate_signal = NULL;
+BThreadSignal terminate_signal;
+
+static void terminate_signal_handler (BThreadSignal *thread_signal);
+
 void PsiphonLog(const char *levelStr, const char *channelStr, const char *msgStr)
 {
     if (!g_env)
@@ -320,7 +366,9 @@ JNIEXPORT jint JNICALL Java_ca_psiphon_PsiphonTunnel_runTun2Socks(
 
     BLog_InitPsiphon();
 
-    __sync_bool_compare_and_swap(&g_terminate, 1, 0);
+    pthread_mutex_lock(&g_terminate_mutex);
+    g_terminate = 0;
+    pthread_mutex_unlock(&g_terminate_mutex);
 
     run();
 
@@ -340,7 +388,16 @@ JNIEXPORT jint JNICALL Java_ca_psiphon_PsiphonTunnel_terminateTun2Socks(
     jclass cls,
     JNIEnv* env)
 {
-    __sync_bool_compare_and_swap(&g_terminate, 0, 1);
+    pthread_mutex_lock(&g_terminate_mutex);
+    
+    g_terminate = 1;
+    
+    if (g_terminate_signal) {
+        BThreadSignal_Thread_Signal(g_terminate_signal);
+    }
+    
+    pthread_mutex_unlock(&g_terminate_mutex);
+    
     return 0;
 }
 
@@ -360,6 +417,30 @@ JNIEXPORT jint JNICALL Java_ca_psiphon_PsiphonTunnel_enableUdpGwKeepalive(
     return 0;
 }
 
+JNIEXPORT jlongArray JNICALL Java_ca_psiphon_PsiphonTunnel_getTun2SocksStats(
+    JNIEnv* env,
+    jclass cls)
+{
+    struct flow_stats snapshot;
+    flow_stats_snapshot(&flow_stats, &snapshot);
+    
+    uint64_t values[FLOW_STATS_EXPORT_LEN];
+    flow_stats_export(&snapshot, values);
+    
+    jlong jvalues[FLOW_STATS_EXPORT_LEN];
+    for (int i = 0; i < FLOW_STATS_EXPORT_LEN; i++) {
+        jvalues[i] = (jlong)values[i];
+    }
+    
+    jlongArray result = (*env)->NewLongArray(env, FLOW_STATS_EXPORT_LEN);
+    if (!result) {
+        return NULL;
+    }
+    (*env)->SetLongArrayRegion(env, result, 0, FLOW_STATS_EXPORT_LEN, jvalues);
+    
+    return result;
+}
+
 // from tcp_helper.c
 /** Remove all pcbs on the given list. */
 static void tcp_remove(struct tcp_pcb* pcb_list)
@@ -479,19 +560,50 @@ void run()
             goto fail2;
         }
     }
+    
+#ifdef PSIPHON
+    // init terminate signal
+    if (!BThreadSignal_Init(&terminate_signal, &ss, terminate_signal_handler)) {
+        BLog(BLOG_ERROR, "BThreadSignal_Init failed");
+        goto fail3;
+    }
+    
+    // publish it, catching a terminate request that came in before
+    pthread_mutex_lock(&g_terminate_mutex);
+    g_terminate_signal = &terminate_signal;
+    if (g_terminate) {
+        BThreadSignal_Thread_Signal(g_terminate_signal);
+    }
+    pthread_mutex_unlock(&g_terminate_mutex);
+#endif
+    
+    // init flow profile dumper
+    if (options.flow_profile && !FlowProfileDumper_Init(&flow_profile_dumper, &ss, options.flow_profile)) {
+        BLog(BLOG_ERROR, "FlowProfileDumper_Init failed");
+        goto fail3b;
+    }
 
     // PSIPHON
     if (options.tun_fd) {
         // use supplied file descriptor
         if (!BTap_InitWithFD(&device, &ss, options.tun_fd, options.tun_mtu, device_error_handler, NULL, 1)) {
             BLog(BLOG_ERROR, "BTap_InitWithFD failed");
-            goto fail3;
+            goto fail3a;
         }
     } else {
         // init TUN device
-        if (!BTap_Init(&device, &ss, options.tundev, device_error_handler, NULL, 1)) {
-            BLog(BLOG_ERROR, "BTap_Init failed");
-            goto fail3;
+        struct BTap_init_data init_data;
+        init_data.dev_type = BTAP_DEV_TUN;
+        init_data.init_type = BTAP_INIT_STRING;
+        init_data.init.string = options.tundev;
+        #ifdef BADVPN_LINUX
+        init_data.offload = options.tun_offload;
+        #else
+        init_data.offload = 0;
+        #endif
+        if (!BTap_Init2(&device, &ss, init_data, device_error_handler, NULL)) {
+            BLog(BLOG_ERROR, "BTap_Init2 failed");
+            goto fail3a;
         }
     }
     
@@ -501,7 +613,8 @@ void run()
     // then device reading (so it can pass received packets to lwip).
     
     // init device reading
-    PacketPassInterface_Init(&device_read_interface, BTap_GetMTU(&device), device_read_handler_send, NULL, BReactor_PendingGroup(&ss));
+    PacketPassInterface_Init(&device_read_interface, PacketRecvInterface_GetMTU(BTap_GetOutput(&device)), device_read_handler_send, NULL, BReactor_PendingGroup(&ss));
+    PacketPassInterface_SetName(&device_read_interface, "tun2socks device read");
     if (!SinglePacketBuffer_Init(&device_read_buffer, BTap_GetOutput(&device), &device_read_interface, BReactor_PendingGroup(&ss))) {
         BLog(BLOG_ERROR, "SinglePacketBuffer_Init failed");
         goto fail4;
@@ -527,14 +640,36 @@ void run()
             goto fail4a;
         }
         
+        // generate session ID so that the udpgw server can join our streams
+        uint8_t udpgw_session_id[UDPGW_SESSION_ID_LEN];
+        memset(udpgw_session_id, 0, sizeof(udpgw_session_id));
+        #ifndef BADVPN_USE_WINAPI
+        if (options.udpgw_streams > 1) {
+            BRandom2 random2;
+            if (!BRandom2_Init(&random2, 0)) {
+                BLog(BLOG_ERROR, "BRandom2_Init failed");
+                goto fail4a;
+            }
+            int res = BRandom2_GenBytes(&random2, udpgw_session_id, sizeof(udpgw_session_id));
+            BRandom2_Free(&random2);
+            if (!res) {
+                BLog(BLOG_ERROR, "BRandom2_GenBytes failed");
+                goto fail4a;
+            }
+        }
+        #endif
+        
         // init udpgw client
-        if (!SocksUdpGwClient_Init(&udpgw_client, udp_mtu, DEFAULT_UDPGW_MAX_CONNECTIONS, options.udpgw_connection_buffer_size, UDPGW_KEEPALIVE_TIME,
-                                   socks_server_addr, socks_auth_info, socks_num_auth_info,
+        if (!SocksUdpGwClient_Init(&udpgw_client, udp_mtu, DEFAULT_UDPGW_MAX_CONNECTIONS, options.udpgw_connection_buffer_size, options.udpgw_replay_packets, UDPGW_KEEPALIVE_TIME,
+                                   options.udpgw_streams, udpgw_session_id, socks_server_addr, socks_auth_info, socks_num_auth_info,
                                    udpgw_remote_server_addr, UDPGW_RECONNECT_TIME, &ss, NULL, udpgw_client_handler_received
         )) {
             BLog(BLOG_ERROR, "SocksUdpGwClient_Init failed");
             goto fail4a;
         }
+        
+        // account udpgw connections
+        SocksUdpGwClient_SetStats(&udpgw_client, &flow_stats.udp);
     }
     
     // init lwip init job
@@ -548,9 +683,14 @@ void run()
     }
     
     // init TCP timer
-    // it won't trigger before lwip is initialized, becuase the lwip init is a job
+    // it is only armed while lwip has PCBs which need it, see tcp_timer_update
     BTimer_Init(&tcp_timer, TCP_TMR_INTERVAL, tcp_timer_handler, NULL);
-    BReactor_SetTimer(&ss, &tcp_timer);
+    
+    // init stats timer
+    BTimer_Init(&stats_timer, options.stats_interval, stats_timer_handler, NULL);
+    if (options.stats_interval > 0) {
+        BReactor_SetTimer(&ss, &stats_timer);
+    }
     
     // set no netif
     have_netif = 0;
@@ -607,6 +747,7 @@ void run()
     // ==== PSIPHON ====
     
 
+    BReactor_RemoveTimer(&ss, &stats_timer);
     BReactor_RemoveTimer(&ss, &tcp_timer);
     BFree(device_write_buf);
 fail5:
@@ -619,7 +760,18 @@ fail4a:
 fail4:
     PacketPassInterface_Free(&device_read_interface);
     BTap_Free(&device);
+fail3a:
+    if (options.flow_profile) {
+        FlowProfileDumper_Free(&flow_profile_dumper);
+    }
+fail3b:
+#ifdef PSIPHON
+    pthread_mutex_lock(&g_terminate_mutex);
+    g_terminate_signal = NULL;
+    pthread_mutex_unlock(&g_terminate_mutex);
+    BThreadSignal_Free(&terminate_signal);
 fail3:
+#endif
     BSignal_Finish();
 fail2:
     BReactor_Free(&ss);
@@ -661,9 +813,12 @@ void print_help (const char *name)
         "        [--loglevel <0-5/none/error/warning/notice/info/debug>]\n"
         "        [--channel-loglevel <channel-name> <0-5/none/error/warning/notice/info/debug>] ...\n"
         "        [--tundev <name>]\n"
+        #ifdef BADVPN_LINUX
+        "        [--tun-offload]\n"
+        #endif
         "        --netif-ipaddr <ipaddr>\n"
         "        --netif-netmask <ipnetmask>\n"
-        "        --socks-server-addr <addr>\n"
+        "        --socks-server-addr <addr>|unix:<path>\n"
         "        [--netif-ip6addr <addr>]\n"
         "        [--username <username>]\n"
         "        [--password <password>]\n"
@@ -672,7 +827,13 @@ void print_help (const char *name)
         "        [--udpgw-remote-server-addr <addr>]\n"
         "        [--udpgw-max-connections <number>]\n"
         "        [--udpgw-connection-buffer-size <number>]\n"
+        "        [--udpgw-replay-packets <number>]\n"
+        "        [--udpgw-streams <number>]\n"
         "        [--udpgw-transparent-dns]\n"
+        "        [--stats-interval <ms>]\n"
+        "        [--flow-profile <file>]\n"
+        "        [--tcp-wnd <bytes>]\n"
+        "        [--tcp-snd-buf <bytes>]\n"
         "Address format is a.b.c.d:port (IPv4) or [addr]:port (IPv6).\n",
         name
     );
@@ -699,6 +860,9 @@ void init_arguments (const char* program_name)
         options.loglevels[i] = -1;
     }
     options.tundev = NULL;
+    #ifdef BADVPN_LINUX
+    options.tun_offload = 0;
+    #endif
     options.netif_ipaddr = NULL;
     options.netif_netmask = NULL;
     options.netif_ip6addr = NULL;
@@ -710,7 +874,13 @@ void init_arguments (const char* program_name)
     options.udpgw_remote_server_addr = NULL;
     options.udpgw_max_connections = DEFAULT_UDPGW_MAX_CONNECTIONS;
     options.udpgw_connection_buffer_size = DEFAULT_UDPGW_CONNECTION_BUFFER_SIZE;
+    options.udpgw_replay_packets = DEFAULT_UDPGW_REPLAY_PACKETS;
+    options.udpgw_streams = DEFAULT_UDPGW_STREAMS;
     options.udpgw_transparent_dns = 0;
+    options.stats_interval = 0;
+    options.flow_profile = NULL;
+    options.tcp_wnd = TCP_WND;
+    options.tcp_snd_buf = TCP_SND_BUF;
 
     options.tun_fd = 0;
     options.set_signal = 1;
@@ -811,6 +981,11 @@ int parse_arguments (int argc, char *argv[])
             options.tundev = argv[i + 1];
             i++;
         }
+        #ifdef BADVPN_LINUX
+        else if (!strcmp(arg, "--tun-offload")) {
+            options.tun_offload = 1;
+        }
+        #endif
         else if (!strcmp(arg, "--netif-ipaddr")) {
             if (1 >= argc - i) {
                 fprintf(stderr, "%s: requires an argument\n", arg);
@@ -900,9 +1075,80 @@ int parse_arguments (int argc, char *argv[])
             }
             i++;
         }
+        else if (!strcmp(arg, "--udpgw-replay-packets")) {
+            if (1 >= argc - i) {
+                fprintf(stderr, "%s: requires an argument\n", arg);
+                return 0;
+            }
+            if ((options.udpgw_replay_packets = atoi(argv[i + 1])) < 0) {
+                fprintf(stderr, "%s: wrong argument\n", arg);
+                return 0;
+            }
+            i++;
+        }
+        else if (!strcmp(arg, "--udpgw-streams")) {
+            if (1 >= argc - i) {
+                fprintf(stderr, "%s: requires an argument\n", arg);
+                return 0;
+            }
+            if ((options.udpgw_streams = atoi(argv[i + 1])) <= 0 || options.udpgw_streams > UDPGWCLIENT_MAX_STREAMS) {
+                fprintf(stderr, "%s: wrong argument\n", arg);
+                return 0;
+            }
+            #ifdef BADVPN_USE_WINAPI
+            if (options.udpgw_streams > 1) {
+                fprintf(stderr, "%s: multiple streams are not supported on Windows\n", arg);
+                return 0;
+            }
+            #endif
+            i++;
+        }
         else if (!strcmp(arg, "--udpgw-transparent-dns")) {
             options.udpgw_transparent_dns = 1;
         }
+        else if (!strcmp(arg, "--stats-interval")) {
+            if (1 >= argc - i) {
+                fprintf(stderr, "%s: requires an argument\n", arg);
+                return 0;
+            }
+            if ((options.stats_interval = atoi(argv[i + 1])) <= 0) {
+                fprintf(stderr, "%s: wrong argument\n", arg);
+                return 0;
+            }
+            i++;
+        }
+        else if (!strcmp(arg, "--flow-profile")) {
+            if (1 >= argc - i) {
+                fprintf(stderr, "%s: requires an argument\n", arg);
+                return 0;
+            }
+            options.flow_profile = argv[i + 1];
+            i++;
+        }
+        else if (!strcmp(arg, "--tcp-wnd")) {
+            if (1 >= argc - i) {
+                fprintf(stderr, "%s: requires an argument\n", arg);
+                return 0;
+            }
+            options.tcp_wnd = atoi(argv[i + 1]);
+            if (options.tcp_wnd < TCP_MSS || options.tcp_wnd > TCP_WND_LIMIT) {
+                fprintf(stderr, "%s: wrong argument (must be between %d and %d)\n", arg, (int)TCP_MSS, (int)TCP_WND_LIMIT);
+                return 0;
+            }
+            i++;
+        }
+        else if (!strcmp(arg, "--tcp-snd-buf")) {
+            if (1 >= argc - i) {
+                fprintf(stderr, "%s: requires an argument\n", arg);
+                return 0;
+            }
+            options.tcp_snd_buf = atoi(argv[i + 1]);
+            if (options.tcp_snd_buf < 2 * TCP_MSS || options.tcp_snd_buf > TCP_SND_BUF_LIMIT) {
+                fprintf(stderr, "%s: wrong argument (must be between %d and %d)\n", arg, (int)(2 * TCP_MSS), (int)TCP_SND_BUF_LIMIT);
+                return 0;
+            }
+            i++;
+        }
         else {
             fprintf(stderr, "unknown option: %s\n", arg);
             return 0;
@@ -976,9 +1222,26 @@ int process_arguments (void)
     }
     
     // resolve SOCKS server address
-    if (!BAddr_Parse2(&socks_server_addr, options.socks_server_addr, NULL, 0, 0)) {
-        BLog(BLOG_ERROR, "socks server addr: BAddr_Parse2 failed");
+    size_t unix_prefix_len;
+    if ((unix_prefix_len = string_begins_with(options.socks_server_addr, "unix:"))) {
+#ifdef BADVPN_USE_WINAPI
+        BLog(BLOG_ERROR, "socks server addr: unix sockets not supported");
         return 0;
+#else
+        const char *path = options.socks_server_addr + unix_prefix_len;
+        if (!*path) {
+            BLog(BLOG_ERROR, "socks server addr: empty unix socket path");
+            return 0;
+        }
+        socks_server_addr = BConnection_addr_unix(path, strlen(path));
+#endif
+    } else {
+        BAddr addr;
+        if (!BAddr_Parse2(&addr, options.socks_server_addr, NULL, 0, 0)) {
+            BLog(BLOG_ERROR, "socks server addr: BAddr_Parse2 failed");
+            return 0;
+        }
+        socks_server_addr = BConnection_addr_baddr(addr);
     }
     
     // add none socks authentication method
@@ -1091,6 +1354,9 @@ void lwip_init_job_hadler (void *unused)
         goto fail;
     }
     
+    // set window sizes, inherited by accepted connections
+    tcp_set_wnd(l, options.tcp_wnd, options.tcp_snd_buf);
+    
     // bind listener
     if (tcp_bind_to_netif(l, "ho0") != ERR_OK) {
         BLog(BLOG_ERROR, "tcp_bind_to_netif failed");
@@ -1115,6 +1381,8 @@ void lwip_init_job_hadler (void *unused)
             goto fail;
         }
         
+        tcp_set_wnd(l_ip6, options.tcp_wnd, options.tcp_snd_buf);
+        
         if (tcp_bind_to_netif(l_ip6, "ho0") != ERR_OK) {
             BLog(BLOG_ERROR, "tcp_bind_to_netif failed");
             tcp_close(l_ip6);
@@ -1142,33 +1410,76 @@ void tcp_timer_handler (void *unused)
 {
     ASSERT(!quitting)
     
-    // ==== PSIPHON ====
+    BLog(BLOG_DEBUG, "TCP timer");
+    
+    tcp_tmr();
+    
+    // schedule next timer relative to the previous deadline so we don't drift,
+    // unless we fell behind by more than an interval (e.g. device suspended)
+    btime_t now = btime_gettime();
+    tcp_timer_deadline += TCP_TMR_INTERVAL;
+    if (tcp_timer_deadline <= now - TCP_TMR_INTERVAL) {
+        tcp_timer_deadline = now + TCP_TMR_INTERVAL;
+    }
+    
+    // keep ticking only while there are PCBs the timer has work for
+    if (tcp_active_pcbs || tcp_tw_pcbs) {
+        BReactor_SetTimerAbsolute(&ss, &tcp_timer, tcp_timer_deadline);
+    }
+}
 
-    // Check if the terminate flag has been set by Psiphon.
+void tcp_timer_update (void)
+{
+    // Listening and bound PCBs have no timers. Active and TIME_WAIT PCBs only
+    // come into existence as a result of lwip input, so checking after every
+    // input is enough to arm the timer when it becomes needed.
+    if (!BTimer_IsRunning(&tcp_timer) && (tcp_active_pcbs || tcp_tw_pcbs)) {
+        tcp_timer_deadline = btime_gettime() + TCP_TMR_INTERVAL;
+        BReactor_SetTimerAbsolute(&ss, &tcp_timer, tcp_timer_deadline);
+    }
+}
 
-    // TODO: instead of piggybacking on this timer,
-    // we could perhaps write to a pipe hooked into
-    // the BReactor event loop, which would eliminate
-    // any shutdown delay due to waiting for this timer.
+static void log_flow_stats_class (const char *name, const struct flow_stats_class *c)
+{
+    BLog(BLOG_NOTICE, "stats %s: active=%"PRIu64" opened=%"PRIu64" closed=%"PRIu64" up=%"PRIu64" down=%"PRIu64" stalls=%"PRIu64,
+         name, c->active, c->opened, c->closed, c->bytes_up, c->bytes_down, c->stalls);
+    BLog(BLOG_NOTICE, "stats %s: setup_ms p50<=%"PRIu64" p90<=%"PRIu64" p99<=%"PRIu64" lifetime_ms p50<=%"PRIu64" p90<=%"PRIu64" p99<=%"PRIu64,
+         name, flow_stats_hist_percentile(&c->setup_ms, 50), flow_stats_hist_percentile(&c->setup_ms, 90), flow_stats_hist_percentile(&c->setup_ms, 99),
+         flow_stats_hist_percentile(&c->lifetime_ms, 50), flow_stats_hist_percentile(&c->lifetime_ms, 90), flow_stats_hist_percentile(&c->lifetime_ms, 99));
+    BLog(BLOG_NOTICE, "stats %s: flow up p50<=%"PRIu64" p99<=%"PRIu64" down p50<=%"PRIu64" p99<=%"PRIu64" stalls p99<=%"PRIu64,
+         name, flow_stats_hist_percentile(&c->flow_bytes_up, 50), flow_stats_hist_percentile(&c->flow_bytes_up, 99),
+         flow_stats_hist_percentile(&c->flow_bytes_down, 50), flow_stats_hist_percentile(&c->flow_bytes_down, 99),
+         flow_stats_hist_percentile(&c->flow_stalls, 99));
+}
 
-    if (__sync_bool_compare_and_swap(&g_terminate, 1, 1)) {
-        BLog(BLOG_NOTICE, "g_terminate is set");
-        terminate();
-        return;
+void stats_timer_handler (void *unused)
+{
+    ASSERT(!quitting)
+    ASSERT(options.stats_interval > 0)
+    
+    log_flow_stats_class("tcp", &flow_stats.tcp);
+    if (options.udpgw_remote_server_addr) {
+        log_flow_stats_class("udp", &flow_stats.udp);
     }
+    
+    BReactor_SetTimer(&ss, &stats_timer);
+}
 
-    // ==== PSIPHON ====
+#ifdef PSIPHON
 
-    BLog(BLOG_DEBUG, "TCP timer");
+void terminate_signal_handler (BThreadSignal *thread_signal)
+{
+    if (quitting) {
+        return;
+    }
     
-    // schedule next timer
-    // TODO: calculate timeout so we don't drift
-    BReactor_SetTimer(&ss, &tcp_timer);
+    BLog(BLOG_NOTICE, "g_terminate is set");
     
-    tcp_tmr();
-    return;
+    terminate();
 }
 
+#endif
+
 void device_error_handler (void *unused)
 {
     ASSERT(!quitting)
@@ -1213,6 +1524,9 @@ void device_read_handler_send (void *unused, uint8_t *data, int data_len)
         BLog(BLOG_WARNING, "device read: input failed");
         pbuf_free(p);
     }
+    
+    // input may have created PCBs that need the TCP timer
+    tcp_timer_update();
 }
 
 int process_device_udp_packet (uint8_t *data, int data_len)
@@ -1444,12 +1758,15 @@ err_t listener_accept_func (void *arg, struct tcp_pcb *newpcb, err_t err)
     struct tcp_pcb *this_listener = (PCB_ISIPV6(newpcb) ? listener_ip6 : listener);
     tcp_accepted(this_listener);
     
-    // allocate client structure
-    struct tcp_client *client = (struct tcp_client *)malloc(sizeof(*client));
+    // allocate client structure, followed by a buffer for a full receive window
+    int buf_size = TCP_WND_MAX(newpcb);
+    struct tcp_client *client = (struct tcp_client *)malloc(sizeof(*client) + buf_size);
     if (!client) {
         BLog(BLOG_ERROR, "listener accept: malloc failed");
         goto fail0;
     }
+    client->buf = (uint8_t *)(client + 1);
+    client->buf_size = buf_size;
     client->socks_username = NULL;
     
     SYNC_DECL
@@ -1495,6 +1812,9 @@ err_t listener_accept_func (void *arg, struct tcp_pcb *newpcb, err_t err)
     ASSERT(num_clients >= 0)
     num_clients++;
     
+    // start accounting
+    flow_stats_flow_start(&flow_stats.tcp, &client->stats_flow, btime_gettime());
+    
     // set pcb
     client->pcb = newpcb;
     
@@ -1513,6 +1833,7 @@ err_t listener_accept_func (void *arg, struct tcp_pcb *newpcb, err_t err)
     tcp_recv(client->pcb, client_recv_func);
     
     // setup buffer
+    client->buf_start = 0;
     client->buf_used = 0;
     
     // set SOCKS not up, not closed
@@ -1667,6 +1988,9 @@ void client_dealloc (struct tcp_client *client)
     ASSERT(num_clients > 0)
     num_clients--;
     
+    // finish accounting
+    flow_stats_flow_end(&flow_stats.tcp, &client->stats_flow, btime_gettime());
+    
     // remove client entry
     LinkedList1_Remove(&tcp_clients, &client->list_node);
     
@@ -1705,13 +2029,18 @@ err_t client_recv_func (void *arg, struct tcp_pcb *tpcb, struct pbuf *p, err_t e
     ASSERT(p->tot_len > 0)
     
     // check if we have enough buffer
-    if (p->tot_len > sizeof(client->buf) - client->buf_used) {
+    if (p->tot_len > client->buf_size - client->buf_used) {
         client_log(client, BLOG_ERROR, "no buffer for data !?!");
         return ERR_MEM;
     }
     
-    // copy data to buffer
-    ASSERT_EXECUTE(pbuf_copy_partial(p, client->buf + client->buf_used, p->tot_len, 0) == p->tot_len)
+    // copy data to buffer, which is used as a ring so that data being sent is never moved
+    int end = (client->buf_start + client->buf_used) % client->buf_size;
+    int first = bmin_int(p->tot_len, client->buf_size - end);
+    ASSERT_EXECUTE(pbuf_copy_partial(p, client->buf + end, first, 0) == first)
+    if (first < p->tot_len) {
+        ASSERT_EXECUTE(pbuf_copy_partial(p, client->buf, p->tot_len - first, first) == p->tot_len - first)
+    }
     client->buf_used += p->tot_len;
     
     // if there was nothing in the buffer before, and SOCKS is up, start send data
@@ -1751,6 +2080,9 @@ void client_socks_handler (struct tcp_client *client, int event)
             
             client_log(client, BLOG_INFO, "SOCKS up");
             
+            // account setup latency
+            flow_stats_flow_setup(&flow_stats.tcp, &client->stats_flow, btime_gettime());
+            
             // init sending
             client->socks_send_if = BSocksClient_GetSendInterface(&client->socks_client);
             StreamPassInterface_Sender_Init(client->socks_send_if, (StreamPassInterface_handler_done)client_socks_send_handler_done, client);
@@ -1791,6 +2123,15 @@ void client_socks_handler (struct tcp_client *client, int event)
     }
 }
 
+void client_send_buffered (struct tcp_client *client)
+{
+    ASSERT(client->buf_used > 0)
+    
+    // send the contiguous part of the buffered data; the rest follows when it's done
+    int len = bmin_int(client->buf_used, client->buf_size - client->buf_start);
+    StreamPassInterface_Sender_Send(client->socks_send_if, client->buf + client->buf_start, len);
+}
+
 void client_send_to_socks (struct tcp_client *client)
 {
     ASSERT(!client->socks_closed)
@@ -1798,7 +2139,7 @@ void client_send_to_socks (struct tcp_client *client)
     ASSERT(client->buf_used > 0)
     
     // schedule sending
-    StreamPassInterface_Sender_Send(client->socks_send_if, client->buf, client->buf_used);
+    client_send_buffered(client);
 }
 
 void client_socks_send_handler_done (struct tcp_client *client, int data_len)
@@ -1809,18 +2150,32 @@ void client_socks_send_handler_done (struct tcp_client *client, int data_len)
     ASSERT(data_len > 0)
     ASSERT(data_len <= client->buf_used)
     
+    // account sent data
+    flow_stats_flow_up(&flow_stats.tcp, &client->stats_flow, data_len);
+    
     // remove sent data from buffer
-    memmove(client->buf, client->buf + data_len, client->buf_used - data_len);
+    client->buf_start += data_len;
+    if (client->buf_start == client->buf_size) {
+        client->buf_start = 0;
+    }
     client->buf_used -= data_len;
+    if (client->buf_used == 0) {
+        client->buf_start = 0;
+    }
     
     if (!client->client_closed) {
-        // confirm sent data
-        tcp_recved(client->pcb, data_len);
+        // confirm sent data; tcp_recved takes at most 0xffff bytes at once
+        int recved = data_len;
+        while (recved > 0) {
+            u16_t len = bmin_int(recved, UINT16_MAX);
+            tcp_recved(client->pcb, len);
+            recved -= len;
+        }
     }
     
     if (client->buf_used > 0) {
         // send any further data
-        StreamPassInterface_Sender_Send(client->socks_send_if, client->buf, client->buf_used);
+        client_send_buffered(client);
     }
     else if (client->client_closed) {
         // client was closed we've sent everything we had buffered; we're done with it
@@ -1853,6 +2208,9 @@ void client_socks_recv_handler_done (struct tcp_client *client, int data_len)
         return;
     }
     
+    // account received data
+    flow_stats_flow_down(&flow_stats.tcp, &client->stats_flow, data_len);
+    
     // set amount of data in buffer
     client->socks_recv_buf_used = data_len;
     client->socks_recv_buf_sent = 0;
@@ -1920,6 +2278,9 @@ int client_socks_recv_send_out (struct tcp_client *client)
             return -1;
         }
         
+        // account stall on lwIP send buffer
+        flow_stats_flow_stall(&flow_stats.tcp, &client->stats_flow);
+        
         // set waiting, continue in client_sent_func
         client->socks_recv_waiting = 1;
         return 0;
@@ -30,12 +30,21 @@
 // size of temporary buffer for passing data from the SOCKS server to TCP for sending
 #define CLIENT_SOCKS_RECV_BUF_SIZE 8192
 
+// largest per-connection TCP send buffer, bounded by the lwIP segment queue length
+#define TCP_SND_BUF_LIMIT ((TCP_SND_QUEUELEN / 2) * TCP_MSS)
+
 // maximum number of udpgw connections
 #define DEFAULT_UDPGW_MAX_CONNECTIONS 256
 
 // udpgw per-connection send buffer size, in number of packets
 #define DEFAULT_UDPGW_CONNECTION_BUFFER_SIZE 8
 
+// number of recent packets per udpgw connection replayed after reconnecting
+#define DEFAULT_UDPGW_REPLAY_PACKETS 0
+
+// number of parallel udpgw streams (connections to the udpgw server)
+#define DEFAULT_UDPGW_STREAMS 1
+
 // udpgw reconnect time after connection fails
 #define UDPGW_RECONNECT_TIME 5000
 
@@ -51,8 +51,11 @@
     #include <sys/socket.h>
     #include <net/if.h>
     #include <net/if_arp.h>
+    #include <sys/uio.h>
     #ifdef BADVPN_LINUX
+        #include <stddef.h>
         #include <linux/if_tun.h>
+        #include <linux/virtio_net.h>
     #endif
     #ifdef BADVPN_FREEBSD
         #include <net/if_tun.h>
@@ -60,6 +63,12 @@
     #endif
 #endif
 
+#include <misc/balloc.h>
+#include <misc/byteorder.h>
+#include <misc/inet_checksum.h>
+#include <misc/ipv4_proto.h>
+#include <misc/ipv6_proto.h>
+#include <misc/tcp_proto.h>
 #include <base/BLog.h>
 
 #include <tuntap/BTap.h>
@@ -95,6 +104,286 @@ static void recv_olap_handler (BTap *o, int event, DWORD bytes)
 
 #else
 
+static void write_packet (BTap *o, uint8_t *data, int data_len)
+{
+    int bytes = write(o->fd, data, data_len);
+    if (bytes < 0) {
+        // malformed packets will cause errors, ignore them and act like
+        // the packet was accepeted
+    } else {
+        if (bytes != data_len) {
+            BLog(BLOG_WARNING, "written %d expected %d", bytes, data_len);
+        }
+    }
+}
+
+#ifdef BADVPN_LINUX
+
+#define GSO_BUF_SIZE (sizeof(struct virtio_net_hdr) + BTAP_OFFLOAD_MAX_PACKET)
+#define GSO_MAX_HEADERS (sizeof(struct ipv6_header) + 60)
+
+static void offload_complete_checksum (uint8_t *data, int data_len, int start, int offset)
+{
+    if (start > data_len || offset > data_len - start - 2) {
+        return;
+    }
+    
+    // the checksum field holds the pseudo header sum, so summing over
+    // the field too gives the complete checksum
+    uint16_t sum = ~inet_checksum_fold(inet_checksum_add(0, data + start, data_len - start));
+    if (sum == 0) {
+        sum = 0xFFFF;
+    }
+    memcpy(data + start + offset, &sum, sizeof(sum));
+}
+
+// Checks whether a packet is a TCP data segment which may be merged with others,
+// and returns the length of its IP header and of its IP and TCP headers.
+static int gso_parse (uint8_t *data, int data_len, int *out_ip_hdr_len, int *out_hdr_len)
+{
+    int ip_hdr_len;
+    
+    if (data_len < 1) {
+        return 0;
+    }
+    
+    switch (data[0] >> 4) {
+        case 4: {
+            struct ipv4_header ip;
+            if (data_len < sizeof(ip)) {
+                return 0;
+            }
+            memcpy(&ip, data, sizeof(ip));
+            // no options, no fragments
+            if (IPV4_GET_IHL(ip) * 4 != sizeof(ip) || ip.protocol != IPV4_PROTOCOL_TCP ||
+                ntoh16(ip.total_length) != data_len || (ntoh16(ip.flags3_fragmentoffset13) & 0x3FFF)) {
+                return 0;
+            }
+            ip_hdr_len = sizeof(ip);
+        } break;
+        
+        case 6: {
+            struct ipv6_header ip;
+            if (data_len < sizeof(ip)) {
+                return 0;
+            }
+            memcpy(&ip, data, sizeof(ip));
+            // no extension headers
+            if (ip.next_header != IPV6_NEXT_TCP || ntoh16(ip.payload_length) != data_len - sizeof(ip)) {
+                return 0;
+            }
+            ip_hdr_len = sizeof(ip);
+        } break;
+        
+        default:
+            return 0;
+    }
+    
+    struct tcp_header tcp;
+    if (data_len - ip_hdr_len < sizeof(tcp)) {
+        return 0;
+    }
+    memcpy(&tcp, data + ip_hdr_len, sizeof(tcp));
+    
+    int tcp_hdr_len = TCP_GET_DATA_OFFSET(tcp) * 4;
+    if (tcp_hdr_len < sizeof(tcp) || tcp_hdr_len > data_len - ip_hdr_len) {
+        return 0;
+    }
+    
+    // only plain data segments, no control flags and no pure ACKs
+    if ((tcp.flags & ~TCP_PROTO_FLAG_PSH) != TCP_PROTO_FLAG_ACK || data_len - ip_hdr_len - tcp_hdr_len == 0) {
+        return 0;
+    }
+    
+    *out_ip_hdr_len = ip_hdr_len;
+    *out_hdr_len = ip_hdr_len + tcp_hdr_len;
+    return 1;
+}
+
+// Copies the headers of a segment, clearing the fields which may differ
+// between segments merged into one packet.
+static void gso_header_key (uint8_t *data, int ip_hdr_len, int hdr_len, uint8_t *out)
+{
+    ASSERT(hdr_len <= GSO_MAX_HEADERS)
+    
+    memcpy(out, data, hdr_len);
+    
+    if (ip_hdr_len == sizeof(struct ipv4_header)) {
+        memset(out + offsetof(struct ipv4_header, total_length), 0, 2);
+        memset(out + offsetof(struct ipv4_header, identification), 0, 2);
+        memset(out + offsetof(struct ipv4_header, checksum), 0, 2);
+    } else {
+        memset(out + offsetof(struct ipv6_header, payload_length), 0, 2);
+    }
+    
+    memset(out + ip_hdr_len + offsetof(struct tcp_header, seq_num), 0, 4);
+    memset(out + ip_hdr_len + offsetof(struct tcp_header, checksum), 0, 2);
+    out[ip_hdr_len + offsetof(struct tcp_header, flags)] &= ~TCP_PROTO_FLAG_PSH;
+}
+
+static void gso_flush (BTap *o)
+{
+    ASSERT(o->offload)
+    
+    if (o->gso_len == 0) {
+        return;
+    }
+    
+    BPending_Unset(&o->gso_job);
+    
+    struct virtio_net_hdr vh;
+    memset(&vh, 0, sizeof(vh));
+    uint8_t *pkt = o->gso_buf + sizeof(vh);
+    
+    if (o->gso_segs > 1) {
+        int is_ipv6 = ((pkt[0] >> 4) == 6);
+        int ip_hdr_len = (is_ipv6 ? sizeof(struct ipv6_header) : sizeof(struct ipv4_header));
+        uint16_t tcp_len = o->gso_len - ip_hdr_len;
+        uint64_t t;
+        
+        // fix up the IP header and start the TCP checksum with the pseudo header,
+        // the kernel completes it for each segment
+        if (is_ipv6) {
+            struct ipv6_header ip;
+            memcpy(&ip, pkt, sizeof(ip));
+            ip.payload_length = hton16(tcp_len);
+            memcpy(pkt, &ip, sizeof(ip));
+            t = inet_checksum_add(0, ip.source_address, 32);
+        } else {
+            struct ipv4_header ip;
+            memcpy(&ip, pkt, sizeof(ip));
+            ip.total_length = hton16(o->gso_len);
+            ip.checksum = hton16(0);
+            ip.checksum = ipv4_checksum(&ip, NULL, 0);
+            memcpy(pkt, &ip, sizeof(ip));
+            t = inet_checksum_add(0, &ip.source_address, 8);
+        }
+        uint16_t x[2] = {hton16(IPV4_PROTOCOL_TCP), hton16(tcp_len)};
+        t = inet_checksum_add(t, x, sizeof(x));
+        uint16_t pseudo_sum = inet_checksum_fold(t);
+        memcpy(pkt + ip_hdr_len + offsetof(struct tcp_header, checksum), &pseudo_sum, sizeof(pseudo_sum));
+        
+        vh.flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+        vh.gso_type = (is_ipv6 ? VIRTIO_NET_HDR_GSO_TCPV6 : VIRTIO_NET_HDR_GSO_TCPV4);
+        vh.hdr_len = o->gso_hdr_len;
+        vh.gso_size = o->gso_size;
+        vh.csum_start = ip_hdr_len;
+        vh.csum_offset = offsetof(struct tcp_header, checksum);
+    }
+    
+    memcpy(o->gso_buf, &vh, sizeof(vh));
+    write_packet(o, o->gso_buf, sizeof(vh) + o->gso_len);
+    
+    o->gso_len = 0;
+}
+
+static void gso_job_handler (BTap *o)
+{
+    DebugObject_Access(&o->d_obj);
+    ASSERT(o->offload)
+    ASSERT(o->gso_len > 0)
+    
+    gso_flush(o);
+}
+
+// Adds a packet to the one being built if it is a TCP data segment.
+// Returns 0 if the packet must be written on its own.
+static int gso_append (BTap *o, uint8_t *data, int data_len)
+{
+    ASSERT(o->offload)
+    
+    int ip_hdr_len;
+    int hdr_len;
+    if (!gso_parse(data, data_len, &ip_hdr_len, &hdr_len)) {
+        return 0;
+    }
+    
+    int payload_len = data_len - hdr_len;
+    uint8_t *pkt = o->gso_buf + sizeof(struct virtio_net_hdr);
+    
+    struct tcp_header tcp;
+    memcpy(&tcp, data + ip_hdr_len, sizeof(tcp));
+    
+    // the segment must continue the packet being built, with the same headers
+    if (o->gso_len > 0) {
+        uint8_t key[GSO_MAX_HEADERS];
+        uint8_t pkt_key[GSO_MAX_HEADERS];
+        
+        int ok = !o->gso_closed && hdr_len == o->gso_hdr_len && payload_len <= o->gso_size &&
+                 payload_len <= BTAP_OFFLOAD_MAX_PACKET - o->gso_len &&
+                 ntoh32(tcp.seq_num) == o->gso_next_seq;
+        if (ok) {
+            gso_header_key(data, ip_hdr_len, hdr_len, key);
+            gso_header_key(pkt, ip_hdr_len, hdr_len, pkt_key);
+            ok = !memcmp(key, pkt_key, hdr_len);
+        }
+        if (!ok) {
+            gso_flush(o);
+        }
+    }
+    
+    if (o->gso_len == 0) {
+        memcpy(pkt, data, data_len);
+        o->gso_len = data_len;
+        o->gso_hdr_len = hdr_len;
+        o->gso_size = payload_len;
+        o->gso_segs = 1;
+        o->gso_closed = 0;
+        BPending_Set(&o->gso_job);
+    } else {
+        memcpy(pkt + o->gso_len, data + hdr_len, payload_len);
+        o->gso_len += payload_len;
+        o->gso_segs++;
+    }
+    
+    o->gso_next_seq = ntoh32(tcp.seq_num) + payload_len;
+    
+    // a short segment or PSH ends the packet
+    if (payload_len < o->gso_size) {
+        o->gso_closed = 1;
+    }
+    if ((tcp.flags & TCP_PROTO_FLAG_PSH)) {
+        pkt[ip_hdr_len + offsetof(struct tcp_header, flags)] |= TCP_PROTO_FLAG_PSH;
+        o->gso_closed = 1;
+    }
+    
+    return 1;
+}
+
+#endif
+
+static int read_packet (BTap *o, uint8_t *data)
+{
+#ifdef BADVPN_LINUX
+    if (o->offload) {
+        struct virtio_net_hdr vh;
+        struct iovec iov[2];
+        iov[0].iov_base = &vh;
+        iov[0].iov_len = sizeof(vh);
+        iov[1].iov_base = data;
+        iov[1].iov_len = o->output_mtu;
+        
+        int bytes = readv(o->fd, iov, 2);
+        if (bytes < 0) {
+            return bytes;
+        }
+        if (bytes < sizeof(vh)) {
+            return 0;
+        }
+        bytes -= sizeof(vh);
+        
+        // GSO packets are passed on as they are, as one large segment
+        if ((vh.flags & VIRTIO_NET_HDR_F_NEEDS_CSUM)) {
+            offload_complete_checksum(data, bytes, vh.csum_start, vh.csum_offset);
+        }
+        
+        return bytes;
+    }
+#endif
+    
+    return read(o->fd, data, o->output_mtu);
+}
+
 static void fd_handler (BTap *o, int events)
 {
     DebugObject_Access(&o->d_obj);
@@ -108,7 +397,7 @@ static void fd_handler (BTap *o, int events)
         ASSERT(o->output_packet)
         
         // try reading into the buffer
-        int bytes = read(o->fd, o->output_packet, o->frame_mtu);
+        int bytes = read_packet(o, o->output_packet);
         if (bytes < 0) {
             if (errno == EAGAIN || errno == EWOULDBLOCK) {
                 // retry later
@@ -119,7 +408,7 @@ static void fd_handler (BTap *o, int events)
             return;
         }
         
-        ASSERT_FORCE(bytes <= o->frame_mtu)
+        ASSERT_FORCE(bytes <= o->output_mtu)
         
         // set no output packet
         o->output_packet = NULL;
@@ -164,7 +453,7 @@ void output_handler_recv (BTap *o, uint8_t *data)
 #else
     
     // attempt read
-    int bytes = read(o->fd, data, o->frame_mtu);
+    int bytes = read_packet(o, data);
     if (bytes < 0) {
         if (errno == EAGAIN || errno == EWOULDBLOCK) {
             // retry later in fd_handler
@@ -180,7 +469,7 @@ void output_handler_recv (BTap *o, uint8_t *data)
         return;
     }
     
-    ASSERT_FORCE(bytes <= o->frame_mtu)
+    ASSERT_FORCE(bytes <= o->output_mtu)
     
     PacketRecvInterface_Done(&o->output, bytes);
     
@@ -195,6 +484,7 @@ int BTap_Init (BTap *o, BReactor *reactor, char *devname, BTap_handler_error han
     init_data.dev_type = tun ? BTAP_DEV_TUN : BTAP_DEV_TAP;
     init_data.init_type = BTAP_INIT_STRING;
     init_data.init.string = devname;
+    init_data.offload = 0;
     
     return BTap_Init2(o, reactor, init_data, handler_error, handler_error_user);
 }
@@ -208,6 +498,19 @@ int BTap_Init2 (BTap *o, BReactor *reactor, struct BTap_init_data init_data, BTa
     o->handler_error = handler_error;
     o->handler_error_user = handler_error_user;
     
+    #ifdef BADVPN_LINUX
+    o->offload = init_data.offload;
+    if (o->offload && (init_data.dev_type != BTAP_DEV_TUN || init_data.init_type != BTAP_INIT_STRING)) {
+        BLog(BLOG_ERROR, "offload is only supported for TUN devices opened by name");
+        return 0;
+    }
+    #else
+    if (init_data.offload) {
+        BLog(BLOG_ERROR, "offload is not supported on this platform");
+        return 0;
+    }
+    #endif
+    
     #ifdef BADVPN_USE_WINAPI
     
     ASSERT(init_data.init_type == BTAP_INIT_STRING)
@@ -351,6 +654,9 @@ fail0:
             struct ifreq ifr;
             memset(&ifr, 0, sizeof(ifr));
             ifr.ifr_flags |= IFF_NO_PI;
+            if (o->offload) {
+                ifr.ifr_flags |= IFF_VNET_HDR;
+            }
             if (init_data.dev_type == BTAP_DEV_TUN) {
                 ifr.ifr_flags |= IFF_TUN;
             } else {
@@ -365,6 +671,19 @@ fail0:
                 goto fail1;
             }
             
+            // let the kernel pass us TSO packets with partial checksums
+            if (o->offload) {
+                if (ioctl(o->fd, TUNSETOFFLOAD, TUN_F_CSUM | TUN_F_TSO4 | TUN_F_TSO6) < 0) {
+                    BLog(BLOG_ERROR, "error enabling offloads");
+                    goto fail1;
+                }
+            } else {
+                // offloads are a property of the device and outlive the fd; if a previous
+                // user of a persistent device enabled them, we would get packets we can't
+                // handle, so turn them off (ignoring errors from kernels without the ioctl)
+                ioctl(o->fd, TUNSETOFFLOAD, 0);
+            }
+            
             strcpy(devname_real, ifr.ifr_name);
             
             #endif
@@ -448,8 +767,24 @@ fail0:
     }
     o->poll_events = 0;
     
+    #ifdef BADVPN_LINUX
+    if (o->offload) {
+        // init buffer for merging sent segments
+        if (!(o->gso_buf = (uint8_t *)BAlloc(GSO_BUF_SIZE))) {
+            BLog(BLOG_ERROR, "BAlloc failed");
+            goto fail2;
+        }
+        o->gso_len = 0;
+        BPending_Init(&o->gso_job, BReactor_PendingGroup(o->reactor), (BPending_handler)gso_job_handler, o);
+    }
+    #endif
+    
     goto success;
     
+    #ifdef BADVPN_LINUX
+fail2:
+    BReactor_RemoveFileDescriptor(o->reactor, &o->bfd);
+    #endif
 fail1:
     if (o->close_fd) {
         ASSERT_FORCE(close(o->fd) == 0)
@@ -460,8 +795,16 @@ fail0:
     #endif
     
 success:
+    // offload mode reads packets larger than the MTU
+    o->output_mtu = o->frame_mtu;
+    #ifdef BADVPN_LINUX
+    if (o->offload) {
+        o->output_mtu = BTAP_OFFLOAD_MAX_PACKET;
+    }
+    #endif
+    
     // init output
-    PacketRecvInterface_Init(&o->output, o->frame_mtu, (PacketRecvInterface_handler_recv)output_handler_recv, o, BReactor_PendingGroup(o->reactor));
+    PacketRecvInterface_Init(&o->output, o->output_mtu, (PacketRecvInterface_handler_recv)output_handler_recv, o, BReactor_PendingGroup(o->reactor));
     
     // set no output packet
     o->output_packet = NULL;
@@ -489,6 +832,10 @@ int BTap_InitWithFD (BTap *o, BReactor *reactor, int fd, int mtu, BTap_handler_e
     o->frame_mtu = mtu;
     o->fd = fd;
     o->close_fd = 1;
+    o->output_mtu = mtu;
+    #ifdef BADVPN_LINUX
+    o->offload = 0;
+    #endif
 
     // TODO: use BTap_Init2? Still some different behavior (we don't want the fcntl block; we do want close to be called)
 
@@ -555,6 +902,15 @@ void BTap_Free (BTap *o)
     
 #else
     
+    #ifdef BADVPN_LINUX
+    if (o->offload) {
+        // write any segments held back
+        gso_flush(o);
+        BPending_Free(&o->gso_job);
+        BFree(o->gso_buf);
+    }
+    #endif
+    
     // free BFileDescriptor
     BReactor_RemoveFileDescriptor(o->reactor, &o->bfd);
     
@@ -614,15 +970,31 @@ void BTap_Send (BTap *o, uint8_t *data, int data_len)
     
 #else
     
-    int bytes = write(o->fd, data, data_len);
-    if (bytes < 0) {
-        // malformed packets will cause errors, ignore them and act like
-        // the packet was accepeted
-    } else {
-        if (bytes != data_len) {
-            BLog(BLOG_WARNING, "written %d expected %d", bytes, data_len);
+    #ifdef BADVPN_LINUX
+    if (o->offload) {
+        if (gso_append(o, data, data_len)) {
+            return;
         }
+        
+        // keep the order of packets
+        gso_flush(o);
+        
+        // write with an empty virtio header
+        struct virtio_net_hdr vh;
+        memset(&vh, 0, sizeof(vh));
+        struct iovec iov[2];
+        iov[0].iov_base = &vh;
+        iov[0].iov_len = sizeof(vh);
+        iov[1].iov_base = data;
+        iov[1].iov_len = data_len;
+        if (writev(o->fd, iov, 2) < 0) {
+            // ignore errors as below
+        }
+        return;
     }
+    #endif
+    
+    write_packet(o, data, data_len);
     
 #endif
 }
@@ -52,11 +52,15 @@
 #include <misc/debug.h>
 #include <misc/debugerror.h>
 #include <base/DebugObject.h>
+#include <base/BPending.h>
 #include <system/BReactor.h>
 #include <flow/PacketRecvInterface.h>
 
 #define BTAP_ETHERNET_HEADER_LENGTH 14
 
+// largest packet read from or written to the device in offload mode
+#define BTAP_OFFLOAD_MAX_PACKET 65535
+
 /**
  * Handler called when an error occurs on the device.
  * The object must be destroyed from the job context of this
@@ -71,6 +75,7 @@ typedef struct {
     BTap_handler_error handler_error;
     void *handler_error_user;
     int frame_mtu;
+    int output_mtu;
     PacketRecvInterface output;
     uint8_t *output_packet;
     
@@ -84,6 +89,18 @@ typedef struct {
     BFileDescriptor bfd;
     int poll_events;
 #endif
+
+#ifdef BADVPN_LINUX
+    int offload;
+    uint8_t *gso_buf;
+    int gso_len;
+    int gso_hdr_len;
+    int gso_size;
+    int gso_segs;
+    int gso_closed;
+    uint32_t gso_next_seq;
+    BPending gso_job;
+#endif
     
     DebugError d_err;
     DebugObject d_obj;
@@ -137,6 +154,7 @@ struct BTap_init_data {
             int mtu;
         } fd;
     } init;
+    int offload;
 };
 
 /**
@@ -164,6 +182,13 @@ struct BTap_init_data {
  *                  and init_data.init.fd.mtu must be set to the largest IP packet or
  *                  Ethernet frame supported, for a TUN or TAP device, respectively.
  *                  File descriptor initialization is not supported on Windows.
+ *                  init_data.offload enables the offload mode if nonzero, which is only
+ *                  supported for TUN devices on Linux with BTAP_INIT_STRING. The device is
+ *                  then opened with IFF_VNET_HDR and the kernel may pass TCP packets of up to
+ *                  BTAP_OFFLOAD_MAX_PACKET bytes, each standing for several segments, to the
+ *                  output. Their checksums are completed before they are passed on.
+ *                  Consecutive TCP segments of one connection sent with {@link BTap_Send}
+ *                  are merged into such packets when written to the device.
  * @param handler_error error handler function
  * @param handler_error_user value passed to error handler
  * @return 1 on success, 0 on failure
@@ -188,6 +213,8 @@ int BTap_GetMTU (BTap *o);
 /**
  * Sends a packet to the device.
  * Any errors will be reported via a job.
+ * In offload mode, TCP segments may be held back until the current job
+ * finishes, to be merged with following segments of the same connection.
  * 
  * @param o the object
  * @param data packet to send
@@ -197,7 +224,8 @@ void BTap_Send (BTap *o, uint8_t *data, int data_len);
 
 /**
  * Returns a {@link PacketRecvInterface} for reading packets from the device.
- * The MTU of the interface will be {@link BTap_GetMTU}.
+ * The MTU of the interface will be {@link BTap_GetMTU}, or
+ * BTAP_OFFLOAD_MAX_PACKET in offload mode.
  * 
  * @param o the object
  * @return output interface
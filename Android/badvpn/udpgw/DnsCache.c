@@ -0,0 +1,773 @@
+/**
+ * @file DnsCache.c
+ * @author Psiphon Inc.
+ * 
+ * @section LICENSE
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+#include <misc/offset.h>
+#include <misc/byteorder.h>
+#include <misc/balloc.h>
+#include <misc/compare.h>
+#include <misc/read_write_int.h>
+#include <misc/dns_proto.h>
+#include <base/BLog.h>
+#include <system/BDatagram.h>
+#include <flow/PacketPassInterface.h>
+#include <flow/PacketRecvInterface.h>
+
+#include "DnsCache.h"
+
+#include <generated/blog_channel_DnsCache.h>
+
+#define STATE_PENDING 1
+#define STATE_CACHED 2
+
+struct entry {
+    DnsCache *o;
+    struct DnsCache__key key;
+    int qlen;
+    int state;
+    BAVLNode tree_node;
+    LinkedList1Node list_node;
+    // STATE_PENDING
+    BAddr server;
+    uint16_t upstream_id;
+    BDatagram dgram;
+    PacketPassInterface *send_if;
+    PacketRecvInterface *recv_if;
+    uint8_t *pending_buf;
+    BTimer timer;
+    LinkedList1 waiters_list;
+    int num_waiters;
+    // STATE_CACHED
+    uint8_t *response;
+    int response_len;
+    btime_t cached_time;
+    btime_t expire_time;
+};
+
+struct waiter {
+    void *user_waiter;
+    uint16_t id;
+    LinkedList1Node list_node;
+    // followed by the question as the client sent it
+};
+
+static int key_comparator (void *unused, struct DnsCache__key *k1, struct DnsCache__key *k2)
+{
+    int c = B_COMPARE(k1->len, k2->len);
+    if (c) {
+        return c;
+    }
+    c = memcmp(k1->data, k2->data, k1->len);
+    return B_COMPARE(c, 0);
+}
+
+static uint8_t ascii_tolower (uint8_t c)
+{
+    return (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+}
+
+static int parse_query (DnsCache *o, const uint8_t *data, int data_len, int *out_qlen)
+{
+    if (data_len < sizeof(struct dns_header) || data_len > DNSCACHE_MAX_QUERY_LEN) {
+        return 0;
+    }
+    
+    struct dns_header header;
+    memcpy(&header, data, sizeof(header));
+    
+    uint16_t flags = ntoh16(header.flags);
+    if ((flags & DNS_FLAG_QR) || (flags & DNS_OPCODE_MASK)) {
+        return 0;
+    }
+    
+    // allow a single question and an optional EDNS record
+    if (ntoh16(header.qdcount) != 1 || ntoh16(header.ancount) != 0 || ntoh16(header.nscount) != 0 || ntoh16(header.arcount) > 1) {
+        return 0;
+    }
+    
+    // the key is the whole message except the ID, with the name lowercased
+    memcpy(o->key_buf, data + sizeof(header.id), data_len - sizeof(header.id));
+    
+    int pos = sizeof(header);
+    while (1) {
+        if (pos >= data_len) {
+            return 0;
+        }
+        uint8_t len = data[pos];
+        if (len == 0) {
+            pos++;
+            break;
+        }
+        if (len > DNS_MAX_LABEL_LEN || len >= data_len - pos) {
+            return 0;
+        }
+        for (int i = pos + 1; i <= pos + len; i++) {
+            o->key_buf[i - sizeof(header.id)] = ascii_tolower(data[i]);
+        }
+        pos += 1 + len;
+    }
+    
+    // type and class
+    if (data_len - pos < 4) {
+        return 0;
+    }
+    pos += 4;
+    
+    *out_qlen = pos - sizeof(header);
+    return 1;
+}
+
+static int check_question (struct entry *e, const uint8_t *data, int data_len)
+{
+    const uint8_t *query = e->pending_buf + e->o->udp_mtu;
+    
+    if (data_len - sizeof(struct dns_header) < e->qlen) {
+        return 0;
+    }
+    
+    // the question must be the one we sent, including the case of the name
+    return !memcmp(data + sizeof(struct dns_header), query + sizeof(struct dns_header), e->qlen);
+}
+
+static int gen_upstream_id (DnsCache *o, uint16_t client_id, uint16_t *out_id)
+{
+#ifdef BADVPN_USE_WINAPI
+    return 0;
+#else
+    // never reuse the client's ID, which the client could tell others
+    do {
+        if (!BRandom2_GenBytes(&o->random, out_id, sizeof(*out_id))) {
+            return 0;
+        }
+    } while (*out_id == client_id);
+    
+    return 1;
+#endif
+}
+
+/**
+ * Walks the resource records of a reply, computing for how long it can be cached.
+ * If ttl_decrement is nonzero, TTLs are decremented by that amount (saturating at zero).
+ * Returns the cache time in seconds through out_ttl, or -1 if the reply should not be cached.
+ */
+static int process_records (uint8_t *data, int data_len, uint32_t ttl_decrement, int64_t *out_ttl)
+{
+    if (data_len < sizeof(struct dns_header)) {
+        return 0;
+    }
+    
+    struct dns_header header;
+    memcpy(&header, data, sizeof(header));
+    
+    uint16_t flags = ntoh16(header.flags);
+    int rcode = flags & DNS_RCODE_MASK;
+    int ancount = ntoh16(header.ancount);
+    int nscount = ntoh16(header.nscount);
+    int arcount = ntoh16(header.arcount);
+    
+    int pos = sizeof(header);
+    
+    // skip questions
+    for (int i = 0; i < ntoh16(header.qdcount); i++) {
+        if (!dns_skip_name(data, data_len, &pos) || data_len - pos < 4) {
+            return 0;
+        }
+        pos += 4;
+    }
+    
+    int64_t min_ttl = -1;
+    int64_t soa_ttl = -1;
+    
+    for (int i = 0; i < ancount + nscount + arcount; i++) {
+        if (!dns_skip_name(data, data_len, &pos) || data_len - pos < sizeof(struct dns_rr_fixed)) {
+            return 0;
+        }
+        
+        struct dns_rr_fixed rr;
+        memcpy(&rr, data + pos, sizeof(rr));
+        int rr_pos = pos;
+        pos += sizeof(rr);
+        
+        int rdlength = ntoh16(rr.rdlength);
+        if (data_len - pos < rdlength) {
+            return 0;
+        }
+        
+        // the OPT pseudo-record uses the TTL field for flags
+        if (ntoh16(rr.type) != DNS_TYPE_OPT) {
+            uint32_t ttl = ntoh32(rr.ttl);
+            
+            if (ttl_decrement > 0) {
+                uint32_t new_ttl = (ttl > ttl_decrement) ? ttl - ttl_decrement : 0;
+                rr.ttl = hton32(new_ttl);
+                memcpy(data + rr_pos, &rr, sizeof(rr));
+            }
+            
+            // clamp values with the high bit set, per RFC 2181
+            if (ttl > INT32_MAX) {
+                ttl = 0;
+            }
+            
+            if (min_ttl < 0 || ttl < min_ttl) {
+                min_ttl = ttl;
+            }
+            
+            // negative answers are cached per the SOA in the authority section (RFC 2308)
+            if (i >= ancount && i < ancount + nscount && ntoh16(rr.type) == DNS_TYPE_SOA && rdlength >= 4) {
+                uint32_t minimum = badvpn_read_be32((const char *)data + pos + rdlength - 4);
+                soa_ttl = (minimum < ttl) ? minimum : ttl;
+            }
+        }
+        
+        pos += rdlength;
+    }
+    
+    int64_t ttl;
+    if ((flags & DNS_FLAG_TC)) {
+        ttl = -1;
+    }
+    else if (rcode == DNS_RCODE_NXDOMAIN || (rcode == DNS_RCODE_NOERROR && ancount == 0)) {
+        ttl = soa_ttl;
+    }
+    else if (rcode == DNS_RCODE_NOERROR) {
+        ttl = min_ttl;
+    }
+    else {
+        ttl = -1;
+    }
+    
+    *out_ttl = ttl;
+    return 1;
+}
+
+static struct entry * find_entry (DnsCache *o, struct DnsCache__key *key)
+{
+    BAVLNode *tree_node = BAVL_LookupExact(&o->entries_tree, key);
+    if (!tree_node) {
+        return NULL;
+    }
+    
+    return UPPER_OBJECT(tree_node, struct entry, tree_node);
+}
+
+static void free_waiters (struct entry *e)
+{
+    while (!LinkedList1_IsEmpty(&e->waiters_list)) {
+        struct waiter *w = UPPER_OBJECT(LinkedList1_GetFirst(&e->waiters_list), struct waiter, list_node);
+        LinkedList1_Remove(&e->waiters_list, &w->list_node);
+        free(w);
+    }
+    e->num_waiters = 0;
+}
+
+static void free_pending (struct entry *e)
+{
+    ASSERT(e->state == STATE_PENDING)
+    DnsCache *o = e->o;
+    
+    BReactor_RemoveTimer(o->reactor, &e->timer);
+    BDatagram_RecvAsync_Free(&e->dgram);
+    BDatagram_SendAsync_Free(&e->dgram);
+    BDatagram_Free(&e->dgram);
+    
+    LinkedList1_Remove(&o->pending_list, &e->list_node);
+    o->num_pending--;
+}
+
+static void entry_free (struct entry *e)
+{
+    DnsCache *o = e->o;
+    
+    if (e->state == STATE_PENDING) {
+        free_waiters(e);
+        free_pending(e);
+        BFree(e->pending_buf);
+    } else {
+        LinkedList1_Remove(&o->cached_list, &e->list_node);
+        o->num_cached--;
+        BFree(e->response);
+    }
+    
+    BAVL_Remove(&o->entries_tree, &e->tree_node);
+    
+    BFree(e);
+}
+
+static void entry_complete (struct entry *e, int data_len)
+{
+    ASSERT(e->state == STATE_PENDING)
+    DnsCache *o = e->o;
+    
+    uint8_t *data = e->pending_buf;
+    int qlen = e->qlen;
+    
+    int64_t ttl;
+    if (!process_records(data, data_len, 0, &ttl)) {
+        BLog(BLOG_INFO, "cannot parse reply, not caching");
+        ttl = -1;
+    }
+    if (ttl > o->max_ttl) {
+        ttl = o->max_ttl;
+    }
+    
+    // take the waiters, so the entry is consistent while we report
+    LinkedList1 waiters = e->waiters_list;
+    LinkedList1_Init(&e->waiters_list);
+    e->num_waiters = 0;
+    
+    // stop resolving
+    free_pending(e);
+    
+    uint8_t *response = (ttl > 0) ? (uint8_t *)BAlloc(data_len) : NULL;
+    
+    if (response) {
+        memcpy(response, data, data_len);
+        
+        // turn into cached entry
+        e->state = STATE_CACHED;
+        e->pending_buf = NULL;
+        e->response = response;
+        e->response_len = data_len;
+        e->cached_time = btime_gettime();
+        e->expire_time = btime_add(e->cached_time, ttl * 1000);
+        LinkedList1_Append(&o->cached_list, &e->list_node);
+        o->num_cached++;
+    } else {
+        // nothing to cache, forget about the query
+        BAVL_Remove(&o->entries_tree, &e->tree_node);
+        BFree(e);
+    }
+    
+    // report to waiters, with their own transaction IDs and questions
+    while (!LinkedList1_IsEmpty(&waiters)) {
+        struct waiter *w = UPPER_OBJECT(LinkedList1_GetFirst(&waiters), struct waiter, list_node);
+        LinkedList1_Remove(&waiters, &w->list_node);
+        
+        memcpy(data, &w->id, sizeof(w->id));
+        memcpy(data + sizeof(struct dns_header), w + 1, qlen);
+        o->handler_reply(o->user, w->user_waiter, data, data_len);
+        
+        free(w);
+    }
+    
+    BFree(data);
+}
+
+static int check_reply (struct entry *e, int data_len)
+{
+    BAddr remote_addr;
+    BIPAddr local_addr;
+    if (!BDatagram_GetLastReceiveAddrs(&e->dgram, &remote_addr, &local_addr) || !BAddr_Compare(&remote_addr, &e->server)) {
+        return 0;
+    }
+    
+    struct dns_header header;
+    if (data_len < sizeof(header)) {
+        return 0;
+    }
+    memcpy(&header, e->pending_buf, sizeof(header));
+    
+    if (header.id != e->upstream_id || !(ntoh16(header.flags) & DNS_FLAG_QR) || ntoh16(header.qdcount) != 1) {
+        return 0;
+    }
+    
+    return check_question(e, e->pending_buf, data_len);
+}
+
+static void entry_dgram_handler (struct entry *e, int event)
+{
+    ASSERT(e->state == STATE_PENDING)
+    DebugObject_Access(&e->o->d_obj);
+    
+    BLog(BLOG_INFO, "upstream socket error");
+    
+    entry_free(e);
+}
+
+static void entry_send_if_handler_done (struct entry *e)
+{
+    ASSERT(e->state == STATE_PENDING)
+    DebugObject_Access(&e->o->d_obj);
+}
+
+static void entry_recv_if_handler_done (struct entry *e, int data_len)
+{
+    ASSERT(e->state == STATE_PENDING)
+    ASSERT(data_len >= 0)
+    ASSERT(data_len <= e->o->udp_mtu)
+    DnsCache *o = e->o;
+    DebugObject_Access(&o->d_obj);
+    
+    // check that the reply is from the server and is for our question
+    if (!check_reply(e, data_len)) {
+        BLog(BLOG_WARNING, "ignoring unexpected reply");
+        PacketRecvInterface_Receiver_Recv(e->recv_if, e->pending_buf);
+        return;
+    }
+    
+    o->stats.answered++;
+    
+    entry_complete(e, data_len);
+    return;
+}
+
+static void entry_timer_handler (struct entry *e)
+{
+    ASSERT(e->state == STATE_PENDING)
+    DnsCache *o = e->o;
+    DebugObject_Access(&o->d_obj);
+    
+    BLog(BLOG_INFO, "query timed out");
+    
+    o->stats.timeouts++;
+    
+    // waiters will retry on their own
+    entry_free(e);
+}
+
+static struct entry * entry_init_pending (DnsCache *o, struct DnsCache__key *key, int qlen, BAddr server, const uint8_t *data)
+{
+    ASSERT(o->num_cached + o->num_pending < o->max_entries)
+    
+    // pick an ID the upstream reply must carry
+    uint16_t client_id;
+    memcpy(&client_id, data, sizeof(client_id));
+    uint16_t id;
+    if (!gen_upstream_id(o, client_id, &id)) {
+        BLog(BLOG_ERROR, "gen_upstream_id failed");
+        goto fail0;
+    }
+    
+    // allocate structure with room for the key
+    struct entry *e = (struct entry *)BAllocSize(bsize_add(bsize_fromsize(sizeof(*e)), bsize_fromint(key->len)));
+    if (!e) {
+        BLog(BLOG_ERROR, "BAlloc failed");
+        goto fail0;
+    }
+    
+    e->o = o;
+    uint8_t *key_data = (uint8_t *)(e + 1);
+    memcpy(key_data, key->data, key->len);
+    e->key.data = key_data;
+    e->key.len = key->len;
+    e->qlen = qlen;
+    e->state = STATE_PENDING;
+    e->server = server;
+    e->upstream_id = id;
+    
+    // allocate buffer for the reply, followed by the query
+    e->pending_buf = (uint8_t *)BAllocSize(bsize_add(bsize_fromint(o->udp_mtu), bsize_fromint(DNSCACHE_MAX_QUERY_LEN)));
+    if (!e->pending_buf) {
+        BLog(BLOG_ERROR, "BAlloc failed");
+        goto fail1;
+    }
+    
+    // init dgram
+    if (!BDatagram_Init(&e->dgram, server.type, o->reactor, e, (BDatagram_handler)entry_dgram_handler)) {
+        BLog(BLOG_ERROR, "BDatagram_Init failed");
+        goto fail2;
+    }
+    
+    // set send address
+    BIPAddr local_addr;
+    BIPAddr_InitInvalid(&local_addr);
+    BDatagram_SetSendAddrs(&e->dgram, server, local_addr);
+    
+    // init interfaces
+    BDatagram_SendAsync_Init(&e->dgram, DNSCACHE_MAX_QUERY_LEN);
+    e->send_if = BDatagram_SendAsync_GetIf(&e->dgram);
+    PacketPassInterface_Sender_Init(e->send_if, (PacketPassInterface_handler_done)entry_send_if_handler_done, e);
+    BDatagram_RecvAsync_Init(&e->dgram, o->udp_mtu);
+    e->recv_if = BDatagram_RecvAsync_GetIf(&e->dgram);
+    PacketRecvInterface_Receiver_Init(e->recv_if, (PacketRecvInterface_handler_done)entry_recv_if_handler_done, e);
+    
+    // init timer
+    BTimer_Init(&e->timer, DNSCACHE_QUERY_TIMEOUT, (BTimer_handler)entry_timer_handler, e);
+    BReactor_SetTimer(o->reactor, &e->timer);
+    
+    // init waiters list
+    LinkedList1_Init(&e->waiters_list);
+    e->num_waiters = 0;
+    
+    // insert to tree and pending list
+    ASSERT_EXECUTE(BAVL_Insert(&o->entries_tree, &e->tree_node, NULL))
+    LinkedList1_Append(&o->pending_list, &e->list_node);
+    o->num_pending++;
+    
+    // build and send the query, as the client asked it but with our ID
+    uint8_t *query = e->pending_buf + o->udp_mtu;
+    memcpy(query, &id, sizeof(id));
+    memcpy(query + sizeof(id), data + sizeof(id), key->len);
+    PacketPassInterface_Sender_Send(e->send_if, query, sizeof(id) + key->len);
+    
+    // start receiving
+    PacketRecvInterface_Receiver_Recv(e->recv_if, e->pending_buf);
+    
+    return e;
+    
+fail2:
+    BFree(e->pending_buf);
+fail1:
+    BFree(e);
+fail0:
+    return NULL;
+}
+
+static int entry_add_waiter (struct entry *e, void *user_waiter, const uint8_t *data)
+{
+    ASSERT(e->state == STATE_PENDING)
+    
+    if (e->num_waiters == DNSCACHE_MAX_WAITERS) {
+        return 0;
+    }
+    
+    // allocate structure with room for the question
+    struct waiter *w = (struct waiter *)malloc(sizeof(*w) + e->qlen);
+    if (!w) {
+        BLog(BLOG_ERROR, "malloc failed");
+        return 0;
+    }
+    
+    w->user_waiter = user_waiter;
+    memcpy(&w->id, data, sizeof(w->id));
+    memcpy(w + 1, data + sizeof(struct dns_header), e->qlen);
+    LinkedList1_Append(&e->waiters_list, &w->list_node);
+    e->num_waiters++;
+    
+    return 1;
+}
+
+int DnsCache_Init (DnsCache *o, BReactor *reactor, int max_entries, int udp_mtu, int max_ttl, void *user, DnsCache_handler_reply handler_reply)
+{
+    ASSERT(max_entries > 0)
+    ASSERT(udp_mtu > 0)
+    ASSERT(max_ttl > 0)
+    ASSERT(handler_reply)
+    
+    // init arguments
+    o->reactor = reactor;
+    o->max_entries = max_entries;
+    o->udp_mtu = udp_mtu;
+    o->max_ttl = max_ttl;
+    o->user = user;
+    o->handler_reply = handler_reply;
+    
+    // allocate key buffer
+    if (!(o->key_buf = (uint8_t *)BAlloc(DNSCACHE_MAX_QUERY_LEN))) {
+        BLog(BLOG_ERROR, "BAlloc failed");
+        goto fail0;
+    }
+    
+    // allocate reply buffer
+    if (!(o->reply_buf = (uint8_t *)BAlloc(udp_mtu))) {
+        BLog(BLOG_ERROR, "BAlloc failed");
+        goto fail1;
+    }
+    
+    // init random source for upstream IDs
+#ifdef BADVPN_USE_WINAPI
+    BLog(BLOG_ERROR, "not supported on Windows");
+    goto fail2;
+#else
+    if (!BRandom2_Init(&o->random, 0)) {
+        BLog(BLOG_ERROR, "BRandom2_Init failed");
+        goto fail2;
+    }
+#endif
+    
+    // init entries tree
+    BAVL_Init(&o->entries_tree, OFFSET_DIFF(struct entry, key, tree_node), (BAVL_comparator)key_comparator, NULL);
+    
+    // init lists
+    LinkedList1_Init(&o->cached_list);
+    LinkedList1_Init(&o->pending_list);
+    o->num_cached = 0;
+    o->num_pending = 0;
+    
+    // zero stats
+    memset(&o->stats, 0, sizeof(o->stats));
+    
+    DebugObject_Init(&o->d_obj);
+    return 1;
+    
+fail2:
+    BFree(o->reply_buf);
+fail1:
+    BFree(o->key_buf);
+fail0:
+    return 0;
+}
+
+void DnsCache_Free (DnsCache *o)
+{
+    DebugObject_Free(&o->d_obj);
+    
+    // free pending entries
+    while (!LinkedList1_IsEmpty(&o->pending_list)) {
+        entry_free(UPPER_OBJECT(LinkedList1_GetFirst(&o->pending_list), struct entry, list_node));
+    }
+    
+    // free cached entries
+    while (!LinkedList1_IsEmpty(&o->cached_list)) {
+        entry_free(UPPER_OBJECT(LinkedList1_GetFirst(&o->cached_list), struct entry, list_node));
+    }
+    
+    #ifndef BADVPN_USE_WINAPI
+    // free random source
+    BRandom2_Free(&o->random);
+    #endif
+    
+    // free buffers
+    BFree(o->reply_buf);
+    BFree(o->key_buf);
+}
+
+int DnsCache_Query (DnsCache *o, BAddr server, void *waiter, const uint8_t *data, int data_len, const uint8_t **out_reply, int *out_reply_len)
+{
+    DebugObject_Access(&o->d_obj);
+    ASSERT(server.type == BADDR_TYPE_IPV4 || server.type == BADDR_TYPE_IPV6)
+    ASSERT(data_len >= 0)
+    
+    o->stats.queries++;
+    
+    int qlen;
+    if (!parse_query(o, data, data_len, &qlen)) {
+        goto pass;
+    }
+    
+    struct DnsCache__key key;
+    key.data = o->key_buf;
+    key.len = data_len - sizeof(uint16_t);
+    
+    uint16_t id;
+    memcpy(&id, data, sizeof(id));
+    
+    btime_t now = btime_gettime();
+    
+    struct entry *e = find_entry(o, &key);
+    
+    // drop expired answer
+    if (e && e->state == STATE_CACHED && now >= e->expire_time) {
+        entry_free(e);
+        e = NULL;
+    }
+    
+    if (e && e->state == STATE_CACHED) {
+        if (e->response_len > o->udp_mtu) {
+            goto pass;
+        }
+        
+        // copy answer, with our ID and question and remaining TTLs
+        memcpy(o->reply_buf, e->response, e->response_len);
+        memcpy(o->reply_buf, &id, sizeof(id));
+        memcpy(o->reply_buf + sizeof(struct dns_header), data + sizeof(struct dns_header), qlen);
+        int64_t ttl;
+        ASSERT_EXECUTE(process_records(o->reply_buf, e->response_len, (now - e->cached_time) / 1000, &ttl))
+        
+        // move to end of LRU list
+        LinkedList1_Remove(&o->cached_list, &e->list_node);
+        LinkedList1_Append(&o->cached_list, &e->list_node);
+        
+        o->stats.hits++;
+        
+        *out_reply = o->reply_buf;
+        *out_reply_len = e->response_len;
+        return DNSCACHE_RESULT_HIT;
+    }
+    
+    if (e) {
+        // join the query in progress
+        if (!entry_add_waiter(e, waiter, data)) {
+            goto pass;
+        }
+        
+        o->stats.coalesced++;
+        return DNSCACHE_RESULT_WAIT;
+    }
+    
+    // make room, evicting the least recently used answer
+    if (o->num_cached + o->num_pending == o->max_entries) {
+        if (LinkedList1_IsEmpty(&o->cached_list)) {
+            goto pass;
+        }
+        entry_free(UPPER_OBJECT(LinkedList1_GetFirst(&o->cached_list), struct entry, list_node));
+        o->stats.evictions++;
+    }
+    
+    // forward the query
+    if (!(e = entry_init_pending(o, &key, qlen, server, data))) {
+        goto pass;
+    }
+    
+    if (!entry_add_waiter(e, waiter, data)) {
+        entry_free(e);
+        goto pass;
+    }
+    
+    o->stats.forwarded++;
+    return DNSCACHE_RESULT_WAIT;
+    
+pass:
+    o->stats.passed++;
+    return DNSCACHE_RESULT_PASS;
+}
+
+void DnsCache_CancelWaiter (DnsCache *o, void *waiter)
+{
+    DebugObject_Access(&o->d_obj);
+    
+    for (LinkedList1Node *ln = LinkedList1_GetFirst(&o->pending_list); ln; ln = LinkedList1Node_Next(ln)) {
+        struct entry *e = UPPER_OBJECT(ln, struct entry, list_node);
+        ASSERT(e->state == STATE_PENDING)
+        
+        LinkedList1Node *wn = LinkedList1_GetFirst(&e->waiters_list);
+        while (wn) {
+            struct waiter *w = UPPER_OBJECT(wn, struct waiter, list_node);
+            wn = LinkedList1Node_Next(wn);
+            
+            if (w->user_waiter == waiter) {
+                LinkedList1_Remove(&e->waiters_list, &w->list_node);
+                e->num_waiters--;
+                free(w);
+            }
+        }
+    }
+}
+
+void DnsCache_GetStats (DnsCache *o, struct DnsCache_stats *out)
+{
+    DebugObject_Access(&o->d_obj);
+    
+    *out = o->stats;
+    out->num_cached = o->num_cached;
+    out->num_pending = o->num_pending;
+}
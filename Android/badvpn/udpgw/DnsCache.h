@@ -0,0 +1,177 @@
+/**
+ * @file DnsCache.h
+ * @author Psiphon Inc.
+ * 
+ * @section LICENSE
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ * @section DESCRIPTION
+ * 
+ * Server-wide DNS answer cache with coalescing of identical in-flight queries.
+ */
+
+#ifndef BADVPN_UDPGW_DNSCACHE_H
+#define BADVPN_UDPGW_DNSCACHE_H
+
+#include <stdint.h>
+
+#include <misc/debug.h>
+#include <structure/BAVL.h>
+#include <structure/LinkedList1.h>
+#include <base/DebugObject.h>
+#include <system/BReactor.h>
+#include <system/BAddr.h>
+
+#ifndef BADVPN_USE_WINAPI
+#include <random/BRandom2.h>
+#endif
+
+// largest query we will consider for caching
+#define DNSCACHE_MAX_QUERY_LEN 512
+
+// how long to wait for the upstream server before giving up on a query
+#define DNSCACHE_QUERY_TIMEOUT 5000
+
+// maximum number of clients waiting for the same query
+#define DNSCACHE_MAX_WAITERS 256
+
+#define DNSCACHE_RESULT_PASS 0
+#define DNSCACHE_RESULT_HIT 1
+#define DNSCACHE_RESULT_WAIT 2
+
+/**
+ * Handler called when the answer to a query submitted with {@link DnsCache_Query}
+ * arrives from the upstream server.
+ * The transaction ID and question in the message have been rewritten to those
+ * of the query.
+ * The handler must not free the cache or cancel waiters other than its own.
+ * 
+ * @param user as in {@link DnsCache_Init}
+ * @param waiter waiter as passed to {@link DnsCache_Query}
+ * @param data reply message. Only valid until the handler returns.
+ * @param data_len length of reply message
+ */
+typedef void (*DnsCache_handler_reply) (void *user, void *waiter, const uint8_t *data, int data_len);
+
+struct DnsCache_stats {
+    uint64_t queries;
+    uint64_t hits;
+    uint64_t coalesced;
+    uint64_t forwarded;
+    uint64_t answered;
+    uint64_t timeouts;
+    uint64_t passed;
+    uint64_t evictions;
+    int num_cached;
+    int num_pending;
+};
+
+struct DnsCache__key {
+    const uint8_t *data;
+    int len;
+};
+
+typedef struct {
+    BReactor *reactor;
+    int max_entries;
+    int udp_mtu;
+    int max_ttl;
+    void *user;
+    DnsCache_handler_reply handler_reply;
+    BAVL entries_tree;
+    LinkedList1 cached_list;
+    LinkedList1 pending_list;
+    int num_cached;
+    int num_pending;
+    uint8_t *key_buf;
+    uint8_t *reply_buf;
+    #ifndef BADVPN_USE_WINAPI
+    BRandom2 random;
+    #endif
+    struct DnsCache_stats stats;
+    DebugObject d_obj;
+} DnsCache;
+
+/**
+ * Initializes the cache.
+ * Not supported on Windows, where there is no source of random upstream
+ * transaction IDs.
+ * 
+ * @param o the object
+ * @param reactor reactor we live in
+ * @param max_entries maximum number of cached and in-flight queries. Must be >0.
+ * @param udp_mtu maximum size of reply messages. Must be >0.
+ * @param max_ttl upper bound for how long answers are cached, in seconds. Must be >0.
+ * @param user value passed to handler
+ * @param handler_reply handler called when answers to waiting queries arrive
+ * @return 1 on success, 0 on failure
+ */
+int DnsCache_Init (DnsCache *o, BReactor *reactor, int max_entries, int udp_mtu, int max_ttl, void *user, DnsCache_handler_reply handler_reply) WARN_UNUSED;
+
+/**
+ * Frees the cache. Any waiting queries are dropped without calling the handler.
+ * 
+ * @param o the object
+ */
+void DnsCache_Free (DnsCache *o);
+
+/**
+ * Submits a DNS query.
+ * 
+ * If the answer is cached, returns {@link DNSCACHE_RESULT_HIT} and provides the
+ * answer with the transaction ID, question and TTLs adjusted; the answer is valid until the
+ * next call into the cache. If an identical query is already being resolved, or the
+ * query was forwarded to the server, returns {@link DNSCACHE_RESULT_WAIT}, and the
+ * answer will be reported via the reply handler. Otherwise, for example if the query
+ * is not cacheable, returns {@link DNSCACHE_RESULT_PASS}, and the caller should
+ * forward the query itself.
+ * 
+ * @param o the object
+ * @param server upstream server to forward the query to. Must be an IPv4 or IPv6 address.
+ * @param waiter value passed to the reply handler
+ * @param data query message
+ * @param data_len length of query message. Must be >=0.
+ * @param out_reply on HIT, returns the answer
+ * @param out_reply_len on HIT, returns the length of the answer
+ * @return one of DNSCACHE_RESULT_*
+ */
+int DnsCache_Query (DnsCache *o, BAddr server, void *waiter, const uint8_t *data, int data_len, const uint8_t **out_reply, int *out_reply_len);
+
+/**
+ * Drops all queries waiting on behalf of the given waiter.
+ * 
+ * @param o the object
+ * @param waiter waiter as passed to {@link DnsCache_Query}
+ */
+void DnsCache_CancelWaiter (DnsCache *o, void *waiter);
+
+/**
+ * Returns statistics.
+ * 
+ * @param o the object
+ * @param out returns statistics
+ */
+void DnsCache_GetStats (DnsCache *o, struct DnsCache_stats *out);
+
+#endif
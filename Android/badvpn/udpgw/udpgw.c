@@ -44,6 +44,7 @@
 #include <misc/balloc.h>
 #include <misc/compare.h>
 #include <misc/print_macros.h>
+#include <misc/minmax.h>
 #include <structure/LinkedList1.h>
 #include <structure/BAVL.h>
 #include <base/BLog.h>
@@ -54,9 +55,11 @@
 #include <system/BSignal.h>
 #include <flow/PacketProtoDecoder.h>
 #include <flow/PacketPassFairQueue.h>
-#include <flow/PacketStreamSender.h>
+#include <flowextra/PacketStreamCoalescer.h>
+#include <flowextra/FlowProfileDumper.h>
 #include <flow/PacketProtoFlow.h>
-#include <flow/SinglePacketBuffer.h>
+#include <flow/PacketPassConnector.h>
+#include <flow/PacketPassPriorityQueue.h>
 
 #ifndef BADVPN_USE_WINAPI
 #include <base/BLog_syslog.h>
@@ -65,6 +68,7 @@
 #endif
 
 #include <udpgw/udpgw.h>
+#include <udpgw/DnsCache.h>
 
 #include <generated/blog_channel_udpgw.h>
 
@@ -73,6 +77,25 @@
 
 #define DNS_UPDATE_TIME 2000
 
+// token bucket; counts thousandths of a byte so that slow rates refill
+// exactly with millisecond timestamps, and may go negative
+struct token_bucket {
+    int64_t tokens;
+    btime_t last_time;
+};
+
+struct session {
+    struct token_bucket rate_bucket;
+    BAVL connections_tree;
+    LinkedList1 connections_list;
+    int num_connections;
+    LinkedList1 clients_list;
+    int has_id;
+    uint8_t id[UDPGW_SESSION_ID_LEN];
+    BAVLNode sessions_tree_node;
+    LinkedList1Node sessions_list_node;
+};
+
 struct client {
     BConnection con;
     BAddr addr;
@@ -80,35 +103,47 @@ struct client {
     PacketProtoDecoder recv_decoder;
     PacketPassInterface recv_if;
     PacketPassFairQueue send_queue;
-    PacketStreamSender send_sender;
-    BAVL connections_tree;
-    LinkedList1 connections_list;
-    int num_connections;
+    PacketPassPriorityQueueFlow send_other_qflow;
+    PacketPassFairQueue send_dns_queue;
+    PacketPassPriorityQueueFlow send_dns_qflow;
+    PacketPassPriorityQueue send_priorityqueue;
+    PacketStreamCoalescer send_sender;
+    struct session *session;
     LinkedList1 closing_connections_list;
+    LinkedList1Node session_clients_list_node;
     LinkedList1Node clients_list_node;
 };
 
 struct connection {
     struct client *client;
+    struct session *session;
     uint16_t conid;
     BAddr addr;
     BAddr orig_addr;
+    int is_dns;
     const uint8_t *first_data;
     int first_data_len;
     btime_t last_use_time;
     int closing;
+    struct token_bucket rate_bucket;
     BPending first_job;
+    int udp_inplace;
     BufferWriter *send_if;
+    PacketRecvInterface udp_recv_if;
     PacketProtoFlow send_ppflow;
+    PacketPassConnector send_connector;
     PacketPassFairQueueFlow send_qflow;
     union {
         struct {
+            int have_udp;
             BDatagram udp_dgram;
             int local_port_index;
             BufferWriter udp_send_writer;
             PacketBuffer udp_send_buffer;
-            SinglePacketBuffer udp_recv_buffer;
-            PacketPassInterface udp_recv_if;
+            uint8_t *udp_recv_buf;
+            uint8_t *udp_recv_out;
+            int udp_recv_data_len;
+            BTimer rate_timer;
             BAVLNode connections_tree_node;
             LinkedList1Node connections_list_node;
         };
@@ -140,6 +175,13 @@ struct {
     int local_udp_ip6_num_ports;
     char *local_udp_ip6_addr;
     int unique_local_ports;
+    int dns_cache_size;
+    int dns_cache_max_ttl;
+    int session_rate_limit;
+    int session_rate_burst;
+    int connection_rate_limit;
+    int connection_rate_burst;
+    char *flow_profile;
 } options;
 
 // MTUs
@@ -160,6 +202,23 @@ BAddr local_udp_ip6_addr;
 BAddr dns_addr;
 btime_t last_dns_update_time;
 
+// DNS cache, if options.dns_cache_size>0
+DnsCache dns_cache;
+BTimer dns_cache_stats_timer;
+
+// flow profile dumper, if options.flow_profile
+FlowProfileDumper flow_profile_dumper;
+
+// rate limiting, if options.session_rate_limit>0 or options.connection_rate_limit>0
+int rate_limiting;
+BTimer rate_stats_timer;
+struct {
+    uint64_t delayed;
+    uint64_t dropped;
+    uint64_t dropped_bytes;
+    int num_waiting;
+} rate_stats;
+
 // reactor
 BReactor ss;
 
@@ -171,6 +230,11 @@ int num_listeners;
 LinkedList1 clients_list;
 int num_clients;
 
+// sessions; each client has its own session until it joins another
+// one by sending that session's ID
+LinkedList1 sessions_list;
+BAVL sessions_tree;
+
 static void print_help (const char *name);
 static void print_version (void);
 static int parse_arguments (int argc, char *argv[]);
@@ -184,24 +248,43 @@ static void client_disconnect_timer_handler (struct client *client);
 static void client_connection_handler (struct client *client, int event);
 static void client_decoder_handler_error (struct client *client);
 static void client_recv_if_handler_send (struct client *client, uint8_t *data, int data_len);
+static void client_join_session (struct client *client, const uint8_t *id);
+static struct session * session_init (void);
+static void session_free (struct session *session);
 static int get_local_num_ports (int addr_type);
 static BAddr get_local_addr (int addr_type);
 static uint8_t * build_port_usage_array_and_find_least_used_connection (BAddr remote_addr, struct connection **out_con);
-static void connection_init (struct client *client, uint16_t conid, BAddr addr, BAddr orig_addr, const uint8_t *data, int data_len);
+static void connection_init (struct client *client, uint16_t conid, BAddr addr, BAddr orig_addr, int is_dns, const uint8_t *data, int data_len);
+static int connection_init_udp (struct connection *con);
 static void connection_free (struct connection *con);
 static void connection_logfunc (struct connection *con);
 static void connection_log (struct connection *con, int level, const char *fmt, ...);
 static void connection_free_udp (struct connection *con);
 static void connection_first_job_handler (struct connection *con);
+static int connection_header_len (struct connection *con);
+static int connection_write_header (struct connection *con, uint8_t flags, uint8_t *out);
 static void connection_send_to_client (struct connection *con, uint8_t flags, const uint8_t *data, int data_len);
 static int connection_send_to_udp (struct connection *con, const uint8_t *data, int data_len);
 static void connection_close (struct connection *con);
 static void connection_send_qflow_busy_handler (struct connection *con);
 static void connection_dgram_handler_event (struct connection *con, int event);
-static void connection_udp_recv_if_handler_send (struct connection *con, uint8_t *data, int data_len);
-static struct connection * find_connection (struct client *client, uint16_t conid);
+static void connection_udp_recv_if_handler_recv (struct connection *con, uint8_t *data);
+static void connection_udp_recv_handler_done (struct connection *con, int data_len);
+static void connection_forward_from_udp (struct connection *con);
+static void connection_rate_timer_handler (struct connection *con);
+static void connection_move (struct connection *con, struct client *client);
+static struct connection * find_connection (struct session *session, uint16_t conid);
 static int uint16_comparator (void *unused, uint16_t *v1, uint16_t *v2);
+static int session_id_comparator (void *unused, uint8_t *v1, uint8_t *v2);
 static void maybe_update_dns (void);
+static void dns_cache_handler_reply (void *unused, struct connection *con, const uint8_t *data, int data_len);
+static void dns_cache_stats_timer_handler (void *unused);
+static void token_bucket_init (struct token_bucket *b, int burst);
+static btime_t token_bucket_wait (struct token_bucket *b, int rate, int burst, btime_t now);
+static void token_bucket_take (struct token_bucket *b, int amount);
+static btime_t rate_limit_wait (struct connection *con, btime_t now);
+static void rate_limit_take (struct connection *con, int amount);
+static void rate_stats_timer_handler (void *unused);
 
 int main (int argc, char **argv)
 {
@@ -292,10 +375,36 @@ int main (int argc, char **argv)
         goto fail1;
     }
     
+    // init DNS cache
+    if (options.dns_cache_size > 0) {
+        if (!DnsCache_Init(&dns_cache, &ss, options.dns_cache_size, options.udp_mtu, options.dns_cache_max_ttl, NULL, (DnsCache_handler_reply)dns_cache_handler_reply)) {
+            BLog(BLOG_ERROR, "DnsCache_Init failed");
+            goto fail2;
+        }
+        
+        // init stats timer
+        BTimer_Init(&dns_cache_stats_timer, DNS_CACHE_STATS_INTERVAL, dns_cache_stats_timer_handler, NULL);
+        BReactor_SetTimer(&ss, &dns_cache_stats_timer);
+    }
+    
+    // init rate limiting
+    rate_limiting = (options.session_rate_limit > 0 || options.connection_rate_limit > 0);
+    if (rate_limiting) {
+        memset(&rate_stats, 0, sizeof(rate_stats));
+        BTimer_Init(&rate_stats_timer, RATE_LIMIT_STATS_INTERVAL, rate_stats_timer_handler, NULL);
+        BReactor_SetTimer(&ss, &rate_stats_timer);
+    }
+    
     // setup signal handler
     if (!BSignal_Init(&ss, signal_handler, NULL)) {
         BLog(BLOG_ERROR, "BSignal_Init failed");
-        goto fail2;
+        goto fail2a;
+    }
+    
+    // init flow profile dumper
+    if (options.flow_profile && !FlowProfileDumper_Init(&flow_profile_dumper, &ss, options.flow_profile)) {
+        BLog(BLOG_ERROR, "FlowProfileDumper_Init failed");
+        goto fail2b;
     }
     
     // initialize listeners
@@ -312,6 +421,10 @@ int main (int argc, char **argv)
     LinkedList1_Init(&clients_list);
     num_clients = 0;
     
+    // init sessions
+    LinkedList1_Init(&sessions_list);
+    BAVL_Init(&sessions_tree, OFFSET_DIFF(struct session, id, sessions_tree_node), (BAVL_comparator)session_id_comparator, NULL);
+    
     // enter event loop
     BLog(BLOG_NOTICE, "entering event loop");
     BReactor_Exec(&ss);
@@ -321,14 +434,31 @@ int main (int argc, char **argv)
         struct client *client = UPPER_OBJECT(LinkedList1_GetFirst(&clients_list), struct client, clients_list_node);
         client_free(client);
     }
+    ASSERT(LinkedList1_IsEmpty(&sessions_list))
 fail3:
     // free listeners
     while (num_listeners > 0) {
         num_listeners--;
         BListener_Free(&listeners[num_listeners]);
     }
+    // free flow profile dumper
+    if (options.flow_profile) {
+        FlowProfileDumper_Free(&flow_profile_dumper);
+    }
+fail2b:
     // finish signal handling
     BSignal_Finish();
+fail2a:
+    // free rate limiting
+    if (rate_limiting) {
+        BReactor_RemoveTimer(&ss, &rate_stats_timer);
+    }
+    
+    // free DNS cache
+    if (options.dns_cache_size > 0) {
+        BReactor_RemoveTimer(&ss, &dns_cache_stats_timer);
+        DnsCache_Free(&dns_cache);
+    }
 fail2:
     // free reactor
     BReactor_Free(&ss);
@@ -367,6 +497,11 @@ void print_help (const char *name)
         "        [--local-udp-addrs <addr> <num_ports>]\n"
         "        [--local-udp-ip6-addrs <addr> <num_ports>]\n"
         "        [--unique-local-ports]\n"
+        "        [--dns-cache-size <entries / 0>]\n"
+        "        [--dns-cache-max-ttl <seconds>]\n"
+        "        [--session-rate-limit <bytes/s / 0> [--session-rate-burst <bytes>]]\n"
+        "        [--connection-rate-limit <bytes/s / 0> [--connection-rate-burst <bytes>]]\n"
+        "        [--flow-profile <file>]\n"
         "Address format is a.b.c.d:port (IPv4) or [addr]:port (IPv6).\n",
         name
     );
@@ -402,6 +537,13 @@ int parse_arguments (int argc, char *argv[])
     options.local_udp_num_ports = -1;
     options.local_udp_ip6_num_ports = -1;
     options.unique_local_ports = 0;
+    options.dns_cache_size = DEFAULT_DNS_CACHE_SIZE;
+    options.dns_cache_max_ttl = DEFAULT_DNS_CACHE_MAX_TTL;
+    options.session_rate_limit = 0;
+    options.session_rate_burst = DEFAULT_RATE_LIMIT_BURST;
+    options.connection_rate_limit = 0;
+    options.connection_rate_burst = DEFAULT_RATE_LIMIT_BURST;
+    options.flow_profile = NULL;
     
     int i;
     for (i = 1; i < argc; i++) {
@@ -563,6 +705,86 @@ int parse_arguments (int argc, char *argv[])
         else if (!strcmp(arg, "--unique-local-ports")) {
             options.unique_local_ports = 1;
         }
+        else if (!strcmp(arg, "--dns-cache-size")) {
+            if (1 >= argc - i) {
+                fprintf(stderr, "%s: requires an argument\n", arg);
+                return 0;
+            }
+            if ((options.dns_cache_size = atoi(argv[i + 1])) < 0) {
+                fprintf(stderr, "%s: wrong argument\n", arg);
+                return 0;
+            }
+            #ifdef BADVPN_USE_WINAPI
+            if (options.dns_cache_size > 0) {
+                fprintf(stderr, "%s: the DNS cache is not supported on Windows\n", arg);
+                return 0;
+            }
+            #endif
+            i++;
+        }
+        else if (!strcmp(arg, "--dns-cache-max-ttl")) {
+            if (1 >= argc - i) {
+                fprintf(stderr, "%s: requires an argument\n", arg);
+                return 0;
+            }
+            if ((options.dns_cache_max_ttl = atoi(argv[i + 1])) <= 0) {
+                fprintf(stderr, "%s: wrong argument\n", arg);
+                return 0;
+            }
+            i++;
+        }
+        else if (!strcmp(arg, "--session-rate-limit")) {
+            if (1 >= argc - i) {
+                fprintf(stderr, "%s: requires an argument\n", arg);
+                return 0;
+            }
+            if ((options.session_rate_limit = atoi(argv[i + 1])) < 0) {
+                fprintf(stderr, "%s: wrong argument\n", arg);
+                return 0;
+            }
+            i++;
+        }
+        else if (!strcmp(arg, "--session-rate-burst")) {
+            if (1 >= argc - i) {
+                fprintf(stderr, "%s: requires an argument\n", arg);
+                return 0;
+            }
+            if ((options.session_rate_burst = atoi(argv[i + 1])) <= 0) {
+                fprintf(stderr, "%s: wrong argument\n", arg);
+                return 0;
+            }
+            i++;
+        }
+        else if (!strcmp(arg, "--connection-rate-limit")) {
+            if (1 >= argc - i) {
+                fprintf(stderr, "%s: requires an argument\n", arg);
+                return 0;
+            }
+            if ((options.connection_rate_limit = atoi(argv[i + 1])) < 0) {
+                fprintf(stderr, "%s: wrong argument\n", arg);
+                return 0;
+            }
+            i++;
+        }
+        else if (!strcmp(arg, "--connection-rate-burst")) {
+            if (1 >= argc - i) {
+                fprintf(stderr, "%s: requires an argument\n", arg);
+                return 0;
+            }
+            if ((options.connection_rate_burst = atoi(argv[i + 1])) <= 0) {
+                fprintf(stderr, "%s: wrong argument\n", arg);
+                return 0;
+            }
+            i++;
+        }
+        else if (!strcmp(arg, "--flow-profile")) {
+            if (1 >= argc - i) {
+                fprintf(stderr, "%s: requires an argument\n", arg);
+                return 0;
+            }
+            options.flow_profile = argv[i + 1];
+            i++;
+        }
         else {
             fprintf(stderr, "unknown option: %s\n", arg);
             return 0;
@@ -660,6 +882,7 @@ void listener_handler (BListener *listener)
     
     // init recv interface
     PacketPassInterface_Init(&client->recv_if, udpgw_mtu, (PacketPassInterface_handler_send)client_recv_if_handler_send, client, BReactor_PendingGroup(&ss));
+    PacketPassInterface_SetName(&client->recv_if, "udpgw client receive");
     
     // init recv decoder
     if (!PacketProtoDecoder_Init(&client->recv_decoder, BConnection_RecvAsync_GetIf(&client->con), &client->recv_if, BReactor_PendingGroup(&ss), client,
@@ -670,22 +893,39 @@ void listener_handler (BListener *listener)
     }
     
     // init send sender
-    PacketStreamSender_Init(&client->send_sender, BConnection_SendAsync_GetIf(&client->con), pp_mtu, BReactor_PendingGroup(&ss));
+    if (!PacketStreamCoalescer_Init(&client->send_sender, BConnection_SendAsync_GetIf(&client->con), pp_mtu, CLIENT_SEND_COALESCE_SIZE, 0, &ss)) {
+        BLog(BLOG_ERROR, "PacketStreamCoalescer_Init failed");
+        goto fail2a;
+    }
+    
+    // init send priority queue
+    PacketPassPriorityQueue_Init(&client->send_priorityqueue, PacketStreamCoalescer_GetInput(&client->send_sender), BReactor_PendingGroup(&ss), 0);
     
-    // init send queue
-    if (!PacketPassFairQueue_Init(&client->send_queue, PacketStreamSender_GetInput(&client->send_sender), BReactor_PendingGroup(&ss), 0, 1)) {
+    // init DNS queue flow, so that DNS replies go ahead of other traffic
+    PacketPassPriorityQueueFlow_Init(&client->send_dns_qflow, &client->send_priorityqueue, 0);
+    
+    // init DNS send queue (for different DNS connections)
+    if (!PacketPassFairQueue_Init(&client->send_dns_queue, PacketPassPriorityQueueFlow_GetInput(&client->send_dns_qflow), BReactor_PendingGroup(&ss), 0, 1)) {
         BLog(BLOG_ERROR, "PacketPassFairQueue_Init failed");
         goto fail3;
     }
     
-    // init connections tree
-    BAVL_Init(&client->connections_tree, OFFSET_DIFF(struct connection, conid, connections_tree_node), (BAVL_comparator)uint16_comparator, NULL);
+    // init other queue flow
+    // use lower priority than DNS flow (higher number)
+    PacketPassPriorityQueueFlow_Init(&client->send_other_qflow, &client->send_priorityqueue, 1);
     
-    // init connections list
-    LinkedList1_Init(&client->connections_list);
+    // init send queue (for different connections)
+    if (!PacketPassFairQueue_Init(&client->send_queue, PacketPassPriorityQueueFlow_GetInput(&client->send_other_qflow), BReactor_PendingGroup(&ss), 0, 1)) {
+        BLog(BLOG_ERROR, "PacketPassFairQueue_Init failed");
+        goto fail3a;
+    }
     
-    // set zero connections
-    client->num_connections = 0;
+    // init own session
+    if (!(client->session = session_init())) {
+        BLog(BLOG_ERROR, "session_init failed");
+        goto fail4;
+    }
+    LinkedList1_Append(&client->session->clients_list, &client->session_clients_list_node);
     
     // init closing connections list
     LinkedList1_Init(&client->closing_connections_list);
@@ -698,8 +938,16 @@ void listener_handler (BListener *listener)
     
     return;
     
+fail4:
+    PacketPassFairQueue_Free(&client->send_queue);
+fail3a:
+    PacketPassPriorityQueueFlow_Free(&client->send_other_qflow);
+    PacketPassFairQueue_Free(&client->send_dns_queue);
 fail3:
-    PacketStreamSender_Free(&client->send_sender);
+    PacketPassPriorityQueueFlow_Free(&client->send_dns_qflow);
+    PacketPassPriorityQueue_Free(&client->send_priorityqueue);
+    PacketStreamCoalescer_Free(&client->send_sender);
+fail2a:
     PacketProtoDecoder_Free(&client->recv_decoder);
 fail2:
     PacketPassInterface_Free(&client->recv_if);
@@ -715,13 +963,37 @@ fail0:
 
 void client_free (struct client *client)
 {
+    struct session *session = client->session;
+    
     // allow freeing send queue flows
     PacketPassFairQueue_PrepareFree(&client->send_queue);
+    PacketPassFairQueue_PrepareFree(&client->send_dns_queue);
+    PacketPassPriorityQueue_PrepareFree(&client->send_priorityqueue);
+    
+    // remove from session's clients list
+    LinkedList1_Remove(&session->clients_list, &client->session_clients_list_node);
+    
+    // move our connections to another client of the session, or free them
+    // if there is none; a packet being sent is resent to the new client
+    LinkedList1Node *other_node = LinkedList1_GetFirst(&session->clients_list);
+    struct client *other = (other_node ? UPPER_OBJECT(other_node, struct client, session_clients_list_node) : NULL);
+    LinkedList1Node *ln = LinkedList1_GetFirst(&session->connections_list);
+    while (ln) {
+        struct connection *con = UPPER_OBJECT(ln, struct connection, connections_list_node);
+        ln = LinkedList1Node_Next(ln);
+        if (con->client != client) {
+            continue;
+        }
+        if (other) {
+            connection_move(con, other);
+        } else {
+            connection_free(con);
+        }
+    }
     
-    // free connections
-    while (!LinkedList1_IsEmpty(&client->connections_list)) {
-        struct connection *con = UPPER_OBJECT(LinkedList1_GetFirst(&client->connections_list), struct connection, connections_list_node);
-        connection_free(con);
+    // free session if this was its last client
+    if (!other) {
+        session_free(session);
     }
     
     // free closing connections
@@ -734,11 +1006,15 @@ void client_free (struct client *client)
     LinkedList1_Remove(&clients_list, &client->clients_list_node);
     num_clients--;
     
-    // free send queue
+    // free send queues
     PacketPassFairQueue_Free(&client->send_queue);
+    PacketPassPriorityQueueFlow_Free(&client->send_other_qflow);
+    PacketPassFairQueue_Free(&client->send_dns_queue);
+    PacketPassPriorityQueueFlow_Free(&client->send_dns_qflow);
+    PacketPassPriorityQueue_Free(&client->send_priorityqueue);
     
     // free send sender
-    PacketStreamSender_Free(&client->send_sender);
+    PacketStreamCoalescer_Free(&client->send_sender);
     
     // free recv decoder
     PacketProtoDecoder_Free(&client->recv_decoder);
@@ -827,8 +1103,18 @@ void client_recv_if_handler_send (struct client *client, uint8_t *data, int data
     // reset disconnect timer
     BReactor_SetTimer(&ss, &client->disconnect_timer);
     
-    // if this is keepalive, ignore any payload
+    // if this is keepalive, ignore any payload other than a session ID
     if ((flags & UDPGW_CLIENT_FLAG_KEEPALIVE)) {
+        if ((flags & UDPGW_CLIENT_FLAG_SESSION)) {
+            if (data_len < sizeof(struct udpgw_session)) {
+                client_log(client, BLOG_ERROR, "missing session ID");
+                return;
+            }
+            struct udpgw_session session;
+            memcpy(&session, data, sizeof(session));
+            client_join_session(client, session.id);
+            return;
+        }
         client_log(client, BLOG_DEBUG, "received keepalive");
         return;
     }
@@ -863,8 +1149,10 @@ void client_recv_if_handler_send (struct client *client, uint8_t *data, int data
         return;
     }
     
+    struct session *session = client->session;
+    
     // find connection
-    struct connection *con = find_connection(client, conid);
+    struct connection *con = find_connection(session, conid);
     ASSERT(!con || !con->closing)
     
     // if connection exists, close it if needed
@@ -877,14 +1165,15 @@ void client_recv_if_handler_send (struct client *client, uint8_t *data, int data
     // if connection doesn't exists, create it
     if (!con) {
         // check number of connections
-        if (client->num_connections == options.max_connections_for_client) {
+        if (session->num_connections == options.max_connections_for_client) {
             // close least recently used connection
-            con = UPPER_OBJECT(LinkedList1_GetFirst(&client->connections_list), struct connection, connections_list_node);
+            con = UPPER_OBJECT(LinkedList1_GetFirst(&session->connections_list), struct connection, connections_list_node);
             connection_close(con);
         }
         
         // if this is DNS, replace actual address, but keep still remember the orig_addr
         BAddr addr = orig_addr;
+        int is_dns = 0;
         if ((flags & UDPGW_CLIENT_FLAG_DNS)) {
             maybe_update_dns();
             if (dns_addr.type == BADDR_TYPE_NONE) {
@@ -892,17 +1181,133 @@ void client_recv_if_handler_send (struct client *client, uint8_t *data, int data
             } else {
                 client_log(client, BLOG_DEBUG, "received DNS");
                 addr = dns_addr;
+                is_dns = 1;
             }
         }
         
         // create new connection
-        connection_init(client, conid, addr, orig_addr, data, data_len);
+        connection_init(client, conid, addr, orig_addr, is_dns, data, data_len);
     } else {
+        // the client has moved the connection to this stream; follow it
+        // if there's nothing in flight on the old one
+        if (con->client != client && !PacketPassFairQueueFlow_IsBusy(&con->send_qflow)) {
+            connection_move(con, client);
+        }
+        
         // submit packet to existing connection
         connection_send_to_udp(con, data, data_len);
     }
 }
 
+void client_join_session (struct client *client, const uint8_t *id)
+{
+    struct session *session = client->session;
+    
+    if (session->has_id) {
+        if (memcmp(session->id, id, UDPGW_SESSION_ID_LEN)) {
+            client_log(client, BLOG_WARNING, "session ID changed, ignoring");
+        }
+        return;
+    }
+    
+    // look for an existing session with this ID
+    BAVLNode *tree_node = BAVL_LookupExact(&sessions_tree, (void *)id);
+    
+    if (!tree_node) {
+        // first stream of the session; give our session the ID
+        memcpy(session->id, id, UDPGW_SESSION_ID_LEN);
+        ASSERT_EXECUTE(BAVL_Insert(&sessions_tree, &session->sessions_tree_node, NULL))
+        session->has_id = 1;
+        
+        client_log(client, BLOG_INFO, "started session");
+        return;
+    }
+    
+    struct session *target = UPPER_OBJECT(tree_node, struct session, sessions_tree_node);
+    ASSERT(target != session)
+    ASSERT(LinkedList1_GetFirst(&session->clients_list) == &client->session_clients_list_node)
+    ASSERT(!LinkedList1Node_Next(&client->session_clients_list_node))
+    
+    client_log(client, BLOG_INFO, "joined session");
+    
+    // take over connections the client opened before joining, unless they collide
+    while (!LinkedList1_IsEmpty(&session->connections_list)) {
+        struct connection *con = UPPER_OBJECT(LinkedList1_GetFirst(&session->connections_list), struct connection, connections_list_node);
+        ASSERT(con->client == client)
+        
+        if (find_connection(target, con->conid) || target->num_connections == options.max_connections_for_client) {
+            connection_close(con);
+            continue;
+        }
+        
+        session->num_connections--;
+        LinkedList1_Remove(&session->connections_list, &con->connections_list_node);
+        BAVL_Remove(&session->connections_tree, &con->connections_tree_node);
+        
+        con->session = target;
+        ASSERT_EXECUTE(BAVL_Insert(&target->connections_tree, &con->connections_tree_node, NULL))
+        LinkedList1_Append(&target->connections_list, &con->connections_list_node);
+        target->num_connections++;
+    }
+    
+    // move client to the session
+    LinkedList1_Remove(&session->clients_list, &client->session_clients_list_node);
+    LinkedList1_Append(&target->clients_list, &client->session_clients_list_node);
+    client->session = target;
+    
+    // free our own session
+    session_free(session);
+}
+
+struct session * session_init (void)
+{
+    struct session *session = (struct session *)malloc(sizeof(*session));
+    if (!session) {
+        return NULL;
+    }
+    
+    // init connections tree
+    BAVL_Init(&session->connections_tree, OFFSET_DIFF(struct connection, conid, connections_tree_node), (BAVL_comparator)uint16_comparator, NULL);
+    
+    // init connections list
+    LinkedList1_Init(&session->connections_list);
+    
+    // set zero connections
+    session->num_connections = 0;
+    
+    // init clients list
+    LinkedList1_Init(&session->clients_list);
+    
+    // have no ID until a client sends one
+    session->has_id = 0;
+    
+    // init rate limit bucket
+    token_bucket_init(&session->rate_bucket, options.session_rate_burst);
+    
+    // insert to sessions list
+    LinkedList1_Append(&sessions_list, &session->sessions_list_node);
+    
+    return session;
+}
+
+void session_free (struct session *session)
+{
+    ASSERT(LinkedList1_IsEmpty(&session->connections_list))
+    ASSERT(LinkedList1_IsEmpty(&session->clients_list))
+    ASSERT(session->num_connections == 0)
+    
+    // remove from sessions tree
+    if (session->has_id) {
+        BAVL_Remove(&sessions_tree, &session->sessions_tree_node);
+    }
+    
+    // remove from sessions list
+    LinkedList1_Remove(&sessions_list, &session->sessions_list_node);
+    
+    // free structure
+    free(session);
+}
+
 int get_local_num_ports (int addr_type)
 {
     switch (addr_type) {
@@ -942,12 +1347,12 @@ uint8_t * build_port_usage_array_and_find_least_used_connection (BAddr remote_ad
     struct connection *least_con = NULL;
     
     // flag inappropriate ports (those with the same remote address)
-    for (LinkedList1Node *ln = LinkedList1_GetFirst(&clients_list); ln; ln = LinkedList1Node_Next(ln)) {
-        struct client *client = UPPER_OBJECT(ln, struct client, clients_list_node);
+    for (LinkedList1Node *ln = LinkedList1_GetFirst(&sessions_list); ln; ln = LinkedList1Node_Next(ln)) {
+        struct session *session = UPPER_OBJECT(ln, struct session, sessions_list_node);
         
-        for (LinkedList1Node *ln2 = LinkedList1_GetFirst(&client->connections_list); ln2; ln2 = LinkedList1Node_Next(ln2)) {
+        for (LinkedList1Node *ln2 = LinkedList1_GetFirst(&session->connections_list); ln2; ln2 = LinkedList1Node_Next(ln2)) {
             struct connection *con = UPPER_OBJECT(ln2, struct connection, connections_list_node);
-            ASSERT(con->client == client)
+            ASSERT(con->session == session)
             ASSERT(!con->closing)
             
             if (con->addr.type != remote_addr.type || con->local_port_index < 0) {
@@ -983,10 +1388,11 @@ uint8_t * build_port_usage_array_and_find_least_used_connection (BAddr remote_ad
     return port_usage;
 }
 
-void connection_init (struct client *client, uint16_t conid, BAddr addr, BAddr orig_addr, const uint8_t *data, int data_len)
+void connection_init (struct client *client, uint16_t conid, BAddr addr, BAddr orig_addr, int is_dns, const uint8_t *data, int data_len)
 {
-    ASSERT(client->num_connections < options.max_connections_for_client)
-    ASSERT(!find_connection(client, conid))
+    struct session *session = client->session;
+    ASSERT(session->num_connections < options.max_connections_for_client)
+    ASSERT(!find_connection(session, conid))
     BAddr_Assert(&addr);
     ASSERT(addr.type == BADDR_TYPE_IPV4 || addr.type == BADDR_TYPE_IPV6)
     ASSERT(orig_addr.type == BADDR_TYPE_IPV4 || orig_addr.type == BADDR_TYPE_IPV6)
@@ -1002,9 +1408,11 @@ void connection_init (struct client *client, uint16_t conid, BAddr addr, BAddr o
     
     // init arguments
     con->client = client;
+    con->session = session;
     con->conid = conid;
     con->addr = addr;
     con->orig_addr = orig_addr;
+    con->is_dns = is_dns;
     con->first_data = data;
     con->first_data_len = data_len;
     
@@ -1014,34 +1422,105 @@ void connection_init (struct client *client, uint16_t conid, BAddr addr, BAddr o
     // set not closing
     con->closing = 0;
     
+    // init rate limit bucket
+    token_bucket_init(&con->rate_bucket, options.connection_rate_burst);
+    
     // init first job
     BPending_Init(&con->first_job, BReactor_PendingGroup(&ss), (BPending_handler)connection_first_job_handler, con);
     BPending_Set(&con->first_job);
     
-    // init send queue flow
-    PacketPassFairQueueFlow_Init(&con->send_qflow, &client->send_queue);
+    // init send queue flow, in the DNS queue for DNS
+    PacketPassFairQueueFlow_Init(&con->send_qflow, (is_dns ? &client->send_dns_queue : &client->send_queue));
     
-    // init send PacketProtoFlow
-    if (!PacketProtoFlow_Init(&con->send_ppflow, udpgw_mtu, CONNECTION_CLIENT_BUFFER_SIZE, PacketPassFairQueueFlow_GetInput(&con->send_qflow), BReactor_PendingGroup(&ss))) {
-        client_log(client, BLOG_ERROR, "PacketProtoFlow_Init failed");
-        goto fail1;
+    // init send connector, so that the connection can be moved to another
+    // client of the session
+    PacketPassConnector_Init(&con->send_connector, pp_mtu, BReactor_PendingGroup(&ss));
+    PacketPassConnector_ConnectOutput(&con->send_connector, PacketPassFairQueueFlow_GetInput(&con->send_qflow));
+    
+    // receive packets from UDP directly into the send buffer, writing the header
+    // in front of them, unless DNS cache replies need to be written there too
+    // or a packet might not fit
+    con->udp_inplace = !(is_dns && options.dns_cache_size > 0) && options.udp_mtu <= udpgw_mtu - connection_header_len(con);
+    
+    if (con->udp_inplace) {
+        // init UDP recv interface
+        PacketRecvInterface_Init(&con->udp_recv_if, udpgw_mtu, (PacketRecvInterface_handler_recv)connection_udp_recv_if_handler_recv, con, BReactor_PendingGroup(&ss));
+        
+        // init send PacketProtoFlow
+        if (!PacketProtoFlow_InitRecv(&con->send_ppflow, &con->udp_recv_if, CONNECTION_CLIENT_BUFFER_SIZE, PacketPassConnector_GetInput(&con->send_connector), BReactor_PendingGroup(&ss))) {
+            client_log(client, BLOG_ERROR, "PacketProtoFlow_InitRecv failed");
+            PacketRecvInterface_Free(&con->udp_recv_if);
+            goto fail1;
+        }
+        con->send_if = NULL;
+    } else {
+        // init send PacketProtoFlow
+        if (!PacketProtoFlow_Init(&con->send_ppflow, udpgw_mtu, CONNECTION_CLIENT_BUFFER_SIZE, PacketPassConnector_GetInput(&con->send_connector), BReactor_PendingGroup(&ss))) {
+            client_log(client, BLOG_ERROR, "PacketProtoFlow_Init failed");
+            goto fail1;
+        }
+        con->send_if = PacketProtoFlow_GetInput(&con->send_ppflow);
+    }
+    
+    // init rate limit timer
+    BTimer_Init(&con->rate_timer, 0, (BTimer_handler)connection_rate_timer_handler, con);
+    
+    con->local_port_index = -1;
+    con->have_udp = 0;
+    
+    // DNS connections with the cache forward most queries through the cache's
+    // own sockets, so only init UDP once a query has to bypass the cache
+    if (!(is_dns && options.dns_cache_size > 0)) {
+        if (!connection_init_udp(con)) {
+            goto fail2;
+        }
+    }
+    
+    // insert to session's connections tree
+    ASSERT_EXECUTE(BAVL_Insert(&session->connections_tree, &con->connections_tree_node, NULL))
+    
+    // insert to session's connections list
+    LinkedList1_Append(&session->connections_list, &con->connections_list_node);
+    
+    // increment number of connections
+    session->num_connections++;
+    
+    connection_log(con, BLOG_DEBUG, "initialized");
+    
+    return;
+    
+fail2:
+    PacketProtoFlow_Free(&con->send_ppflow);
+    if (con->udp_inplace) {
+        PacketRecvInterface_Free(&con->udp_recv_if);
     }
-    con->send_if = PacketProtoFlow_GetInput(&con->send_ppflow);
+fail1:
+    PacketPassConnector_Free(&con->send_connector);
+    PacketPassFairQueueFlow_Free(&con->send_qflow);
+    BPending_Free(&con->first_job);
+    free(con);
+fail0:
+    return;
+}
+
+int connection_init_udp (struct connection *con)
+{
+    struct client *client = con->client;
+    ASSERT(!con->have_udp)
+    ASSERT(con->local_port_index == -1)
     
     // init UDP dgram
-    if (!BDatagram_Init(&con->udp_dgram, addr.type, &ss, con, (BDatagram_handler)connection_dgram_handler_event)) {
+    if (!BDatagram_Init(&con->udp_dgram, con->addr.type, &ss, con, (BDatagram_handler)connection_dgram_handler_event)) {
         client_log(client, BLOG_ERROR, "BDatagram_Init failed");
-        goto fail2;
+        goto fail0;
     }
     
-    con->local_port_index = -1;
-    
-    int local_num_ports = get_local_num_ports(addr.type);
+    int local_num_ports = get_local_num_ports(con->addr.type);
     
     if (local_num_ports >= 0) {
         // build port usage array, find least used connection
         struct connection *least_con;
-        uint8_t *port_usage = build_port_usage_array_and_find_least_used_connection(addr, &least_con);
+        uint8_t *port_usage = build_port_usage_array_and_find_least_used_connection(con->addr, &least_con);
         if (!port_usage) {
             client_log(client, BLOG_ERROR, "build_port_usage_array failed");
             goto failed;
@@ -1054,7 +1533,7 @@ void connection_init (struct client *client, uint16_t conid, BAddr addr, BAddr o
         }
         
         // get starting local address
-        BAddr local_addr = get_local_addr(addr.type);
+        BAddr local_addr = get_local_addr(con->addr.type);
         
         // try different ports
         for (int i = 0; i < local_num_ports; i++) {
@@ -1077,7 +1556,7 @@ void connection_init (struct client *client, uint16_t conid, BAddr addr, BAddr o
             goto failed;
         }
         
-        ASSERT(least_con->addr.type == addr.type)
+        ASSERT(least_con->addr.type == con->addr.type)
         ASSERT(least_con->local_port_index >= 0)
         ASSERT(least_con->local_port_index < local_num_ports)
         ASSERT(!PacketPassFairQueueFlow_IsBusy(&least_con->send_qflow))
@@ -1107,7 +1586,7 @@ void connection_init (struct client *client, uint16_t conid, BAddr addr, BAddr o
     // set UDP dgram send address
     BIPAddr ipaddr;
     BIPAddr_InitInvalid(&ipaddr);
-    BDatagram_SetSendAddrs(&con->udp_dgram, addr, ipaddr);
+    BDatagram_SetSendAddrs(&con->udp_dgram, con->addr, ipaddr);
     
     // init UDP dgram interfaces
     BDatagram_SendAsync_Init(&con->udp_dgram, options.udp_mtu);
@@ -1119,52 +1598,44 @@ void connection_init (struct client *client, uint16_t conid, BAddr addr, BAddr o
     // init UDP buffer
     if (!PacketBuffer_Init(&con->udp_send_buffer, BufferWriter_GetOutput(&con->udp_send_writer), BDatagram_SendAsync_GetIf(&con->udp_dgram), CONNECTION_UDP_BUFFER_SIZE, BReactor_PendingGroup(&ss))) {
         client_log(client, BLOG_ERROR, "PacketBuffer_Init failed");
-        goto fail4;
-    }
-    
-    // init UDP recv interface
-    PacketPassInterface_Init(&con->udp_recv_if, options.udp_mtu, (PacketPassInterface_handler_send)connection_udp_recv_if_handler_send, con, BReactor_PendingGroup(&ss));
-    
-    // init UDP recv buffer
-    if (!SinglePacketBuffer_Init(&con->udp_recv_buffer, BDatagram_RecvAsync_GetIf(&con->udp_dgram), &con->udp_recv_if, BReactor_PendingGroup(&ss))) {
-        client_log(client, BLOG_ERROR, "SinglePacketBuffer_Init failed");
-        goto fail5;
+        goto fail1;
     }
     
-    // insert to client's connections tree
-    ASSERT_EXECUTE(BAVL_Insert(&client->connections_tree, &con->connections_tree_node, NULL))
+    // receive from UDP dgram
+    PacketRecvInterface_Receiver_Init(BDatagram_RecvAsync_GetIf(&con->udp_dgram), (PacketRecvInterface_handler_done)connection_udp_recv_handler_done, con);
     
-    // insert to client's connections list
-    LinkedList1_Append(&client->connections_list, &con->connections_list_node);
+    con->udp_recv_buf = NULL;
     
-    // increment number of connections
-    client->num_connections++;
+    if (!con->udp_inplace) {
+        // allocate UDP recv buffer
+        if (!(con->udp_recv_buf = (uint8_t *)BAlloc(options.udp_mtu))) {
+            client_log(client, BLOG_ERROR, "BAlloc failed");
+            goto fail2;
+        }
+        
+        // start receiving
+        PacketRecvInterface_Receiver_Recv(BDatagram_RecvAsync_GetIf(&con->udp_dgram), con->udp_recv_buf);
+    }
     
-    connection_log(con, BLOG_DEBUG, "initialized");
+    con->have_udp = 1;
     
-    return;
+    return 1;
     
-fail5:
-    PacketPassInterface_Free(&con->udp_recv_if);
+fail2:
     PacketBuffer_Free(&con->udp_send_buffer);
-fail4:
+fail1:
     BufferWriter_Free(&con->udp_send_writer);
     BDatagram_RecvAsync_Free(&con->udp_dgram);
     BDatagram_SendAsync_Free(&con->udp_dgram);
     BDatagram_Free(&con->udp_dgram);
-fail2:
-    PacketProtoFlow_Free(&con->send_ppflow);
-fail1:
-    PacketPassFairQueueFlow_Free(&con->send_qflow);
-    BPending_Free(&con->first_job);
-    free(con);
 fail0:
-    return;
+    return 0;
 }
 
 void connection_free (struct connection *con)
 {
     struct client *client = con->client;
+    struct session *session = con->session;
     PacketPassFairQueueFlow_AssertFree(&con->send_qflow);
     
     if (con->closing) {
@@ -1172,13 +1643,13 @@ void connection_free (struct connection *con)
         LinkedList1_Remove(&client->closing_connections_list, &con->closing_connections_list_node);
     } else {
         // decrement number of connections
-        client->num_connections--;
+        session->num_connections--;
         
-        // remove from client's connections list
-        LinkedList1_Remove(&client->connections_list, &con->connections_list_node);
+        // remove from session's connections list
+        LinkedList1_Remove(&session->connections_list, &con->connections_list_node);
         
-        // remove from client's connections tree
-        BAVL_Remove(&client->connections_tree, &con->connections_tree_node);
+        // remove from session's connections tree
+        BAVL_Remove(&session->connections_tree, &con->connections_tree_node);
         
         // free UDP
         connection_free_udp(con);
@@ -1187,6 +1658,14 @@ void connection_free (struct connection *con)
     // free send PacketProtoFlow
     PacketProtoFlow_Free(&con->send_ppflow);
     
+    // free UDP recv interface
+    if (con->udp_inplace) {
+        PacketRecvInterface_Free(&con->udp_recv_if);
+    }
+    
+    // free send connector
+    PacketPassConnector_Free(&con->send_connector);
+    
     // free send queue flow
     PacketPassFairQueueFlow_Free(&con->send_qflow);
     
@@ -1218,11 +1697,25 @@ void connection_log (struct connection *con, int level, const char *fmt, ...)
 
 void connection_free_udp (struct connection *con)
 {
-    // free UDP receive buffer
-    SinglePacketBuffer_Free(&con->udp_recv_buffer);
+    // forget about any queries waiting in the DNS cache
+    if (con->is_dns && options.dns_cache_size > 0) {
+        DnsCache_CancelWaiter(&dns_cache, con);
+    }
     
-    // free UDP receive interface
-    PacketPassInterface_Free(&con->udp_recv_if);
+    // stop waiting for the rate limit
+    if (BTimer_IsRunning(&con->rate_timer)) {
+        BReactor_RemoveTimer(&ss, &con->rate_timer);
+        rate_stats.num_waiting--;
+    }
+    
+    if (!con->have_udp) {
+        return;
+    }
+    
+    // free UDP recv buffer
+    if (con->udp_recv_buf) {
+        BFree(con->udp_recv_buf);
+    }
     
     // free UDP buffer
     PacketBuffer_Free(&con->udp_send_buffer);
@@ -1245,24 +1738,16 @@ void connection_first_job_handler (struct connection *con)
     connection_send_to_udp(con, con->first_data, con->first_data_len);
 }
 
-void connection_send_to_client (struct connection *con, uint8_t flags, const uint8_t *data, int data_len)
+int connection_header_len (struct connection *con)
 {
-    ASSERT(data_len >= 0)
-    ASSERT(data_len <= options.udp_mtu)
-    
     size_t addr_len = (con->orig_addr.type == BADDR_TYPE_IPV6) ? sizeof(struct udpgw_addr_ipv6) :
                       (con->orig_addr.type == BADDR_TYPE_IPV4) ? sizeof(struct udpgw_addr_ipv4) : 0;
-    if (data_len > udpgw_mtu - (int)(sizeof(struct udpgw_header) + addr_len)) {
-        connection_log(con, BLOG_WARNING, "packet is too large, cannot send to client");
-        return;
-    }
     
-    // get buffer location
-    uint8_t *out;
-    if (!BufferWriter_StartPacket(con->send_if, &out)) {
-        connection_log(con, BLOG_ERROR, "out of client buffer");
-        return;
-    }
+    return sizeof(struct udpgw_header) + addr_len;
+}
+
+int connection_write_header (struct connection *con, uint8_t flags, uint8_t *out)
+{
     int out_pos = 0;
     
     if (con->orig_addr.type == BADDR_TYPE_IPV6) {
@@ -1294,6 +1779,32 @@ void connection_send_to_client (struct connection *con, uint8_t flags, const uin
         } break;
     }
     
+    ASSERT(out_pos == connection_header_len(con))
+    
+    return out_pos;
+}
+
+void connection_send_to_client (struct connection *con, uint8_t flags, const uint8_t *data, int data_len)
+{
+    ASSERT(!con->udp_inplace)
+    ASSERT(data_len >= 0)
+    ASSERT(data_len <= options.udp_mtu)
+    
+    if (data_len > udpgw_mtu - connection_header_len(con)) {
+        connection_log(con, BLOG_WARNING, "packet is too large, cannot send to client");
+        return;
+    }
+    
+    // get buffer location
+    uint8_t *out;
+    if (!BufferWriter_StartPacket(con->send_if, &out)) {
+        connection_log(con, BLOG_ERROR, "out of client buffer");
+        return;
+    }
+    
+    // write header
+    int out_pos = connection_write_header(con, flags, out);
+    
     // write message
     memcpy(out + out_pos, data, data_len);
     out_pos += data_len;
@@ -1305,7 +1816,7 @@ void connection_send_to_client (struct connection *con, uint8_t flags, const uin
 
 int connection_send_to_udp (struct connection *con, const uint8_t *data, int data_len)
 {
-    struct client *client = con->client;
+    struct session *session = con->session;
     ASSERT(!con->closing)
     ASSERT(data_len >= 0)
     ASSERT(data_len <= options.udp_mtu)
@@ -1316,8 +1827,39 @@ int connection_send_to_udp (struct connection *con, const uint8_t *data, int dat
     con->last_use_time = btime_gettime();
     
     // move connection to front
-    LinkedList1_Remove(&client->connections_list, &con->connections_list_node);
-    LinkedList1_Append(&client->connections_list, &con->connections_list_node);
+    LinkedList1_Remove(&session->connections_list, &con->connections_list_node);
+    LinkedList1_Append(&session->connections_list, &con->connections_list_node);
+    
+    // drop the packet if over the rate limit; holding it back would
+    // stall all other connections of the client, including DNS
+    if (rate_limiting && !con->is_dns) {
+        if (rate_limit_wait(con, con->last_use_time) > 0) {
+            connection_log(con, BLOG_DEBUG, "over rate limit, dropping");
+            rate_stats.dropped++;
+            rate_stats.dropped_bytes += data_len;
+            return 0;
+        }
+        rate_limit_take(con, data_len);
+    }
+    
+    // try to answer DNS from the cache, or wait for an identical query
+    if (con->is_dns && options.dns_cache_size > 0) {
+        const uint8_t *reply;
+        int reply_len;
+        switch (DnsCache_Query(&dns_cache, con->addr, con, data, data_len, &reply, &reply_len)) {
+            case DNSCACHE_RESULT_HIT:
+                connection_log(con, BLOG_DEBUG, "answered from DNS cache");
+                connection_send_to_client(con, 0, reply, reply_len);
+                return 1;
+            case DNSCACHE_RESULT_WAIT:
+                return 1;
+        }
+        
+        // the query bypasses the cache, init UDP for it
+        if (!con->have_udp && !connection_init_udp(con)) {
+            return 0;
+        }
+    }
     
     // get buffer location
     uint8_t *out;
@@ -1338,6 +1880,7 @@ int connection_send_to_udp (struct connection *con, const uint8_t *data, int dat
 void connection_close (struct connection *con)
 {
     struct client *client = con->client;
+    struct session *session = con->session;
     ASSERT(!con->closing)
     
     // if possible, free connection immediately
@@ -1349,13 +1892,13 @@ void connection_close (struct connection *con)
     connection_log(con, BLOG_DEBUG, "closing later");
     
     // decrement number of connections
-    client->num_connections--;
+    session->num_connections--;
     
-    // remove from client's connections list
-    LinkedList1_Remove(&client->connections_list, &con->connections_list_node);
+    // remove from session's connections list
+    LinkedList1_Remove(&session->connections_list, &con->connections_list_node);
     
-    // remove from client's connections tree
-    BAVL_Remove(&client->connections_tree, &con->connections_tree_node);
+    // remove from session's connections tree
+    BAVL_Remove(&session->connections_tree, &con->connections_tree_node);
     
     // free UDP
     connection_free_udp(con);
@@ -1394,9 +1937,23 @@ void connection_dgram_handler_event (struct connection *con, int event)
     connection_close(con);
 }
 
-void connection_udp_recv_if_handler_send (struct connection *con, uint8_t *data, int data_len)
+void connection_udp_recv_if_handler_recv (struct connection *con, uint8_t *data)
 {
-    struct client *client = con->client;
+    ASSERT(con->udp_inplace)
+    
+    // when closing, UDP is gone and the packet is never finished
+    if (con->closing) {
+        return;
+    }
+    
+    // receive the packet from UDP after space for the header
+    con->udp_recv_out = data;
+    PacketRecvInterface_Receiver_Recv(BDatagram_RecvAsync_GetIf(&con->udp_dgram), con->udp_recv_out + connection_header_len(con));
+}
+
+void connection_udp_recv_handler_done (struct connection *con, int data_len)
+{
+    struct session *session = con->session;
     ASSERT(!con->closing)
     ASSERT(data_len >= 0)
     ASSERT(data_len <= options.udp_mtu)
@@ -1407,19 +1964,83 @@ void connection_udp_recv_if_handler_send (struct connection *con, uint8_t *data,
     con->last_use_time = btime_gettime();
     
     // move connection to front
-    LinkedList1_Remove(&client->connections_list, &con->connections_list_node);
-    LinkedList1_Append(&client->connections_list, &con->connections_list_node);
+    LinkedList1_Remove(&session->connections_list, &con->connections_list_node);
+    LinkedList1_Append(&session->connections_list, &con->connections_list_node);
     
-    // accept packet
-    PacketPassInterface_Done(&con->udp_recv_if);
+    // remember packet
+    con->udp_recv_data_len = data_len;
     
-    // send packet to client
-    connection_send_to_client(con, 0, data, data_len);
+    connection_forward_from_udp(con);
+}
+
+void connection_forward_from_udp (struct connection *con)
+{
+    ASSERT(!con->closing)
+    ASSERT(!BTimer_IsRunning(&con->rate_timer))
+    
+    // if over the rate limit, hold the packet back until there are tokens;
+    // meanwhile nothing is read from the socket and the flow doesn't compete
+    // in the client's send queue
+    if (rate_limiting && !con->is_dns) {
+        btime_t now = btime_gettime();
+        btime_t wait = rate_limit_wait(con, now);
+        if (wait > 0) {
+            connection_log(con, BLOG_DEBUG, "over rate limit, waiting %d ms", (int)wait);
+            BReactor_SetTimerAfter(&ss, &con->rate_timer, wait);
+            rate_stats.delayed++;
+            rate_stats.num_waiting++;
+            return;
+        }
+        rate_limit_take(con, con->udp_recv_data_len);
+    }
+    
+    if (con->udp_inplace) {
+        // write header in front of the packet and pass it on
+        int header_len = connection_write_header(con, 0, con->udp_recv_out);
+        PacketRecvInterface_Done(&con->udp_recv_if, header_len + con->udp_recv_data_len);
+    } else {
+        // send packet to client
+        connection_send_to_client(con, 0, con->udp_recv_buf, con->udp_recv_data_len);
+        
+        // receive next packet
+        PacketRecvInterface_Receiver_Recv(BDatagram_RecvAsync_GetIf(&con->udp_dgram), con->udp_recv_buf);
+    }
+}
+
+void connection_rate_timer_handler (struct connection *con)
+{
+    ASSERT(!con->closing)
+    ASSERT(rate_limiting)
+    
+    rate_stats.num_waiting--;
+    
+    connection_forward_from_udp(con);
+}
+
+void connection_move (struct connection *con, struct client *client)
+{
+    ASSERT(!con->closing)
+    ASSERT(client != con->client)
+    ASSERT(client->session == con->session)
+    
+    connection_log(con, BLOG_DEBUG, "moving to another client of the session");
+    
+    // disconnect from old queue flow; the connector keeps any packet
+    // in progress and resends it to the new queue flow
+    PacketPassConnector_DisconnectOutput(&con->send_connector);
+    PacketPassFairQueueFlow_Free(&con->send_qflow);
+    
+    // set client
+    con->client = client;
+    
+    // connect to new queue flow
+    PacketPassFairQueueFlow_Init(&con->send_qflow, (con->is_dns ? &client->send_dns_queue : &client->send_queue));
+    PacketPassConnector_ConnectOutput(&con->send_connector, PacketPassFairQueueFlow_GetInput(&con->send_qflow));
 }
 
-struct connection * find_connection (struct client *client, uint16_t conid)
+struct connection * find_connection (struct session *session, uint16_t conid)
 {
-    BAVLNode *tree_node = BAVL_LookupExact(&client->connections_tree, &conid);
+    BAVLNode *tree_node = BAVL_LookupExact(&session->connections_tree, &conid);
     if (!tree_node) {
         return NULL;
     }
@@ -1435,6 +2056,12 @@ int uint16_comparator (void *unused, uint16_t *v1, uint16_t *v2)
     return B_COMPARE(*v1, *v2);
 }
 
+int session_id_comparator (void *unused, uint8_t *v1, uint8_t *v2)
+{
+    int c = memcmp(v1, v2, UDPGW_SESSION_ID_LEN);
+    return B_COMPARE(c, 0);
+}
+
 void maybe_update_dns (void)
 {
 #ifndef BADVPN_USE_WINAPI
@@ -1471,3 +2098,121 @@ fail:
     BAddr_InitNone(&dns_addr);
 #endif
 }
+
+void dns_cache_handler_reply (void *unused, struct connection *con, const uint8_t *data, int data_len)
+{
+    ASSERT(options.dns_cache_size > 0)
+    ASSERT(con->is_dns)
+    ASSERT(!con->closing)
+    
+    connection_log(con, BLOG_DEBUG, "from DNS cache %d bytes", data_len);
+    
+    if (data_len > options.udp_mtu) {
+        connection_log(con, BLOG_WARNING, "DNS reply too large");
+        return;
+    }
+    
+    // set last use time
+    con->last_use_time = btime_gettime();
+    
+    // send packet to client
+    connection_send_to_client(con, 0, data, data_len);
+}
+
+void dns_cache_stats_timer_handler (void *unused)
+{
+    ASSERT(options.dns_cache_size > 0)
+    
+    // restart timer
+    BReactor_SetTimer(&ss, &dns_cache_stats_timer);
+    
+    struct DnsCache_stats stats;
+    DnsCache_GetStats(&dns_cache, &stats);
+    
+    BLog(BLOG_INFO, "DNS cache: queries=%"PRIu64" hits=%"PRIu64" coalesced=%"PRIu64" forwarded=%"PRIu64" answered=%"PRIu64" timeouts=%"PRIu64" passed=%"PRIu64" evictions=%"PRIu64" cached=%d pending=%d",
+         stats.queries, stats.hits, stats.coalesced, stats.forwarded, stats.answered, stats.timeouts, stats.passed, stats.evictions, stats.num_cached, stats.num_pending);
+}
+
+void token_bucket_init (struct token_bucket *b, int burst)
+{
+    ASSERT(burst > 0)
+    
+    b->tokens = (int64_t)burst * 1000;
+    b->last_time = btime_gettime();
+}
+
+btime_t token_bucket_wait (struct token_bucket *b, int rate, int burst, btime_t now)
+{
+    ASSERT(rate > 0)
+    ASSERT(burst > 0)
+    
+    // refill
+    if (now > b->last_time) {
+        int64_t max_tokens = (int64_t)burst * 1000;
+        btime_t elapsed = now - b->last_time;
+        if (elapsed > max_tokens / rate + 1) {
+            b->tokens = max_tokens;
+        } else {
+            b->tokens = bmin_int64(max_tokens, b->tokens + elapsed * rate);
+        }
+        b->last_time = now;
+    }
+    
+    // a packet may go through as long as the bucket isn't empty, taking it
+    // into debt; this way packets larger than the bucket can pass too
+    if (b->tokens > 0) {
+        return 0;
+    }
+    
+    return -b->tokens / rate + 1;
+}
+
+void token_bucket_take (struct token_bucket *b, int amount)
+{
+    ASSERT(amount >= 0)
+    
+    b->tokens -= (int64_t)amount * 1000;
+}
+
+btime_t rate_limit_wait (struct connection *con, btime_t now)
+{
+    ASSERT(rate_limiting)
+    ASSERT(!con->closing)
+    
+    btime_t wait = 0;
+    
+    if (options.connection_rate_limit > 0) {
+        wait = token_bucket_wait(&con->rate_bucket, options.connection_rate_limit, options.connection_rate_burst, now);
+    }
+    
+    if (options.session_rate_limit > 0) {
+        wait = bmax_int64(wait, token_bucket_wait(&con->session->rate_bucket, options.session_rate_limit, options.session_rate_burst, now));
+    }
+    
+    return wait;
+}
+
+void rate_limit_take (struct connection *con, int amount)
+{
+    ASSERT(rate_limiting)
+    ASSERT(!con->closing)
+    
+    if (options.connection_rate_limit > 0) {
+        token_bucket_take(&con->rate_bucket, amount);
+    }
+    
+    if (options.session_rate_limit > 0) {
+        token_bucket_take(&con->session->rate_bucket, amount);
+    }
+}
+
+void rate_stats_timer_handler (void *unused)
+{
+    ASSERT(rate_limiting)
+    
+    // restart timer
+    BReactor_SetTimer(&ss, &rate_stats_timer);
+    
+    BLog(BLOG_INFO, "rate limit: delayed=%"PRIu64" dropped=%"PRIu64" dropped_bytes=%"PRIu64" waiting=%d",
+         rate_stats.delayed, rate_stats.dropped, rate_stats.dropped_bytes, rate_stats.num_waiting);
+}
@@ -48,5 +48,23 @@
 // how long after nothing has been received to disconnect a client
 #define CLIENT_DISCONNECT_TIMEOUT 20000
 
+// size of the buffer for coalescing packets sent to a client, in bytes
+#define CLIENT_SEND_COALESCE_SIZE 4096
+
 // SO_SNDBFUF socket option for clients, 0 to not set
 #define CLIENT_DEFAULT_SOCKET_SEND_BUFFER 1048576
+
+// maximum number of entries in the DNS cache, 0 to disable
+#define DEFAULT_DNS_CACHE_SIZE 0
+
+// maximum time to cache DNS answers, in seconds
+#define DEFAULT_DNS_CACHE_MAX_TTL 3600
+
+// how often to log DNS cache statistics
+#define DNS_CACHE_STATS_INTERVAL 60000
+
+// token bucket size for --session-rate-limit and --connection-rate-limit, in bytes
+#define DEFAULT_RATE_LIMIT_BURST 65536
+
+// how often to log rate limiting statistics
+#define RATE_LIMIT_STATS_INTERVAL 60000
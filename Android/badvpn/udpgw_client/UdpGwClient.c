@@ -32,7 +32,9 @@
 #include <misc/offset.h>
 #include <misc/byteorder.h>
 #include <misc/compare.h>
+#include <misc/balloc.h>
 #include <base/BLog.h>
+#include <system/BTime.h>
 
 #include <udpgw_client/UdpGwClient.h>
 
@@ -40,11 +42,15 @@
 
 static int uint16_comparator (void *unused, uint16_t *v1, uint16_t *v2);
 static int conaddr_comparator (void *unused, struct UdpGwClient_conaddr *v1, struct UdpGwClient_conaddr *v2);
-static void free_server (UdpGwClient *o);
-static void decoder_handler_error (UdpGwClient *o);
-static void recv_interface_handler_send (UdpGwClient *o, uint8_t *data, int data_len);
-static void send_monitor_handler (UdpGwClient *o);
-static void keepalive_if_handler_done (UdpGwClient *o);
+static void free_server (struct UdpGwClient_stream *s);
+static void decoder_handler_error (struct UdpGwClient_stream *s);
+static void recv_interface_handler_send (struct UdpGwClient_stream *s, uint8_t *data, int data_len);
+static void send_monitor_handler (struct UdpGwClient_stream *s);
+static void keepalive_if_handler_done (struct UdpGwClient_stream *s);
+static void send_session (struct UdpGwClient_stream *s);
+static struct UdpGwClient_stream * choose_stream (UdpGwClient *o, uint16_t conid);
+static int stream_init (UdpGwClient *o, struct UdpGwClient_stream *s, int index);
+static void stream_free (struct UdpGwClient_stream *s);
 static struct UdpGwClient_connection * find_connection_by_conaddr (UdpGwClient *o, struct UdpGwClient_conaddr conaddr);
 static struct UdpGwClient_connection * find_connection_by_conid (UdpGwClient *o, uint16_t conid);
 static uint16_t find_unused_conid (UdpGwClient *o);
@@ -52,6 +58,10 @@ static void connection_init (UdpGwClient *o, struct UdpGwClient_conaddr conaddr,
 static void connection_free (struct UdpGwClient_connection *con);
 static void connection_first_job_handler (struct UdpGwClient_connection *con);
 static void connection_send (struct UdpGwClient_connection *con, uint8_t flags, const uint8_t *data, int data_len);
+static int connection_write (struct UdpGwClient_connection *con, uint8_t flags, const uint8_t *data, int data_len);
+static void connection_move (struct UdpGwClient_connection *con, struct UdpGwClient_stream *s);
+static void connection_update_stream (struct UdpGwClient_connection *con);
+static void connection_replay_job_handler (struct UdpGwClient_connection *con);
 static struct UdpGwClient_connection * reuse_connection (UdpGwClient *o, struct UdpGwClient_conaddr conaddr);
 
 // PSIPHON
@@ -71,42 +81,44 @@ static int conaddr_comparator (void *unused, struct UdpGwClient_conaddr *v1, str
     return BAddr_CompareOrder(&v1->local_addr, &v2->local_addr);
 }
 
-static void free_server (UdpGwClient *o)
+static void free_server (struct UdpGwClient_stream *s)
 {
     // disconnect send connector
-    PacketPassConnector_DisconnectOutput(&o->send_connector);
+    PacketPassConnector_DisconnectOutput(&s->send_connector);
     
     // free send sender
-    PacketStreamSender_Free(&o->send_sender);
+    PacketStreamCoalescer_Free(&s->send_sender);
     
     // free receive decoder
-    PacketProtoDecoder_Free(&o->recv_decoder);
+    PacketProtoDecoder_Free(&s->recv_decoder);
     
     // free receive interface
-    PacketPassInterface_Free(&o->recv_if);
+    PacketPassInterface_Free(&s->recv_if);
 }
 
-static void decoder_handler_error (UdpGwClient *o)
+static void decoder_handler_error (struct UdpGwClient_stream *s)
 {
+    UdpGwClient *o = s->client;
     DebugObject_Access(&o->d_obj);
-    ASSERT(o->have_server)
+    ASSERT(s->have_server)
     
     BLog(BLOG_ERROR, "decoder error");
     
     // report error
-    o->handler_servererror(o->user);
+    o->handler_servererror(o->user, s->index);
     return;
 }
 
-static void recv_interface_handler_send (UdpGwClient *o, uint8_t *data, int data_len)
+static void recv_interface_handler_send (struct UdpGwClient_stream *s, uint8_t *data, int data_len)
 {
+    UdpGwClient *o = s->client;
     DebugObject_Access(&o->d_obj);
-    ASSERT(o->have_server)
+    ASSERT(s->have_server)
     ASSERT(data_len >= 0)
     ASSERT(data_len <= o->udpgw_mtu)
     
     // accept packet
-    PacketPassInterface_Done(&o->recv_if);
+    PacketPassInterface_Done(&s->recv_if);
     
     // check header
     if (data_len < sizeof(struct udpgw_header)) {
@@ -167,12 +179,21 @@ static void recv_interface_handler_send (UdpGwClient *o, uint8_t *data, int data
     LinkedList1_Remove(&o->connections_list, &con->connections_list_node);
     LinkedList1_Append(&o->connections_list, &con->connections_list_node);
     
+    // account received data, and setup latency on the first reply
+    if (o->stats) {
+        if (!con->got_reply) {
+            con->got_reply = 1;
+            flow_stats_flow_setup(o->stats, &con->stats_flow, btime_gettime());
+        }
+        flow_stats_flow_down(o->stats, &con->stats_flow, data_len);
+    }
+    
     // pass packet to user
     o->handler_received(o->user, con->conaddr.local_addr, con->conaddr.remote_addr, data, data_len);
     return;
 }
 
-static void send_monitor_handler (UdpGwClient *o)
+static void send_monitor_handler (struct UdpGwClient_stream *s)
 {
     //==== PSIPHON ====
     if (sendKeepAlive == 0) {
@@ -180,28 +201,123 @@ static void send_monitor_handler (UdpGwClient *o)
     }
     //==== PSIPHON ====
 
+    UdpGwClient *o = s->client;
     DebugObject_Access(&o->d_obj);
     
-    if (o->keepalive_sending) {
+    if (s->keepalive_sending) {
         return;
     }
     
     BLog(BLOG_INFO, "keepalive");
     
     // send keepalive
-    PacketPassInterface_Sender_Send(o->keepalive_if, (uint8_t *)&o->keepalive_packet, sizeof(o->keepalive_packet));
+    PacketPassInterface_Sender_Send(s->keepalive_if, (uint8_t *)&o->keepalive_packet, sizeof(o->keepalive_packet));
     
     // set sending keep-alive
-    o->keepalive_sending = 1;
+    s->keepalive_sending = 1;
 }
 
-static void keepalive_if_handler_done (UdpGwClient *o)
+static void keepalive_if_handler_done (struct UdpGwClient_stream *s)
 {
+    UdpGwClient *o = s->client;
     DebugObject_Access(&o->d_obj);
-    ASSERT(o->keepalive_sending)
+    ASSERT(s->keepalive_sending)
+    
+    // set not sending keepalive
+    s->keepalive_sending = 0;
+    
+    // send session packet if it was waiting for the keepalive
+    if (s->session_pending) {
+        send_session(s);
+    }
+}
+
+static void send_session (struct UdpGwClient_stream *s)
+{
+    UdpGwClient *o = s->client;
+    ASSERT(o->num_streams > 1)
+    ASSERT(!s->keepalive_sending)
+    
+    // send session packet through the keepalive interface
+    PacketPassInterface_Sender_Send(s->keepalive_if, (uint8_t *)&o->session_packet, sizeof(o->session_packet));
+    
+    // set sending
+    s->keepalive_sending = 1;
+    s->session_pending = 0;
+}
+
+static struct UdpGwClient_stream * choose_stream (UdpGwClient *o, uint16_t conid)
+{
+    // use the conid's own stream, or if that is down, the next one which is up
+    for (int i = 0; i < o->num_streams; i++) {
+        struct UdpGwClient_stream *s = &o->streams[(conid + i) % o->num_streams];
+        if (s->have_server) {
+            return s;
+        }
+    }
+    
+    // no stream is up, queue on the conid's own stream
+    return &o->streams[conid % o->num_streams];
+}
+
+static int stream_init (UdpGwClient *o, struct UdpGwClient_stream *s, int index)
+{
+    s->client = o;
+    s->index = index;
+    
+    // init send connector
+    PacketPassConnector_Init(&s->send_connector, o->pp_mtu, BReactor_PendingGroup(o->reactor));
+    
+    // init send monitor
+    PacketPassInactivityMonitor_Init(&s->send_monitor, PacketPassConnector_GetInput(&s->send_connector), o->reactor, o->keepalive_time, (PacketPassInactivityMonitor_handler)send_monitor_handler, s);
+    
+    // init send queue
+    if (!PacketPassFairQueue_Init(&s->send_queue, PacketPassInactivityMonitor_GetInput(&s->send_monitor), BReactor_PendingGroup(o->reactor), 0, 1)) {
+        goto fail0;
+    }
+    
+    // init keepalive queue flow
+    PacketPassFairQueueFlow_Init(&s->keepalive_qflow, &s->send_queue);
+    s->keepalive_if = PacketPassFairQueueFlow_GetInput(&s->keepalive_qflow);
+    
+    // init keepalive output
+    PacketPassInterface_Sender_Init(s->keepalive_if, (PacketPassInterface_handler_done)keepalive_if_handler_done, s);
     
     // set not sending keepalive
-    o->keepalive_sending = 0;
+    s->keepalive_sending = 0;
+    
+    // set no session packet waiting
+    s->session_pending = 0;
+    
+    // set have no server
+    s->have_server = 0;
+    
+    return 1;
+    
+fail0:
+    PacketPassInactivityMonitor_Free(&s->send_monitor);
+    PacketPassConnector_Free(&s->send_connector);
+    return 0;
+}
+
+static void stream_free (struct UdpGwClient_stream *s)
+{
+    // free server
+    if (s->have_server) {
+        free_server(s);
+    }
+    
+    // free keepalive queue flow
+    PacketPassFairQueueFlow_Free(&s->keepalive_qflow);
+    
+    // free send queue
+    PacketPassFairQueue_Free(&s->send_queue);
+    
+    // free send
+    PacketPassInactivityMonitor_Free(&s->send_monitor);
+    
+    // free send connector
+    PacketPassConnector_Free(&s->send_connector);
 }
 
 static struct UdpGwClient_connection * find_connection_by_conaddr (UdpGwClient *o, struct UdpGwClient_conaddr conaddr)
@@ -265,15 +381,48 @@ static void connection_init (UdpGwClient *o, struct UdpGwClient_conaddr conaddr,
     // allocate conid
     con->conid = find_unused_conid(o);
     
+    // choose stream
+    con->stream = choose_stream(o, con->conid);
+    
+    // allocate replay queue
+    if (o->replay_packets > 0) {
+        if (!(con->replay_entries = (struct UdpGwClient__replay_entry *)BAllocArray(o->replay_packets, sizeof(con->replay_entries[0])))) {
+            BLog(BLOG_ERROR, "BAllocArray failed");
+            goto fail0a;
+        }
+        if (!(con->replay_data = (uint8_t *)BAllocArray(o->replay_packets, o->udp_mtu))) {
+            BLog(BLOG_ERROR, "BAllocArray failed");
+            goto fail0b;
+        }
+    }
+    con->replay_start = 0;
+    con->replay_count = 0;
+    con->replay_pos = 0;
+    
+    // the server knows about the connection once it's sent
+    con->server_epoch = o->server_epoch;
+    
     // init first job
     BPending_Init(&con->first_job, BReactor_PendingGroup(o->reactor), (BPending_handler)connection_first_job_handler, con);
     BPending_Set(&con->first_job);
     
+    // init replay job
+    BPending_Init(&con->replay_job, BReactor_PendingGroup(o->reactor), (BPending_handler)connection_replay_job_handler, con);
+    
     // init queue flow
-    PacketPassFairQueueFlow_Init(&con->send_qflow, &o->send_queue);
+    PacketPassFairQueueFlow_Init(&con->send_qflow, &con->stream->send_queue);
+    
+    // with more than one stream, connect through a connector so that
+    // the connection can be moved to a different stream
+    PacketPassInterface *ppflow_output = PacketPassFairQueueFlow_GetInput(&con->send_qflow);
+    if (o->num_streams > 1) {
+        PacketPassConnector_Init(&con->send_connector, o->pp_mtu, BReactor_PendingGroup(o->reactor));
+        PacketPassConnector_ConnectOutput(&con->send_connector, ppflow_output);
+        ppflow_output = PacketPassConnector_GetInput(&con->send_connector);
+    }
     
     // init PacketProtoFlow
-    if (!PacketProtoFlow_Init(&con->send_ppflow, o->udpgw_mtu, o->send_buffer_size, PacketPassFairQueueFlow_GetInput(&con->send_qflow), BReactor_PendingGroup(o->reactor))) {
+    if (!PacketProtoFlow_Init(&con->send_ppflow, o->udpgw_mtu, o->send_buffer_size, ppflow_output, BReactor_PendingGroup(o->reactor))) {
         BLog(BLOG_ERROR, "PacketProtoFlow_Init failed");
         goto fail1;
     }
@@ -291,11 +440,29 @@ static void connection_init (UdpGwClient *o, struct UdpGwClient_conaddr conaddr,
     // increment number of connections
     o->num_connections++;
     
+    // start accounting
+    con->got_reply = 0;
+    if (o->stats) {
+        flow_stats_flow_start(o->stats, &con->stats_flow, btime_gettime());
+    }
+    
     return;
     
 fail1:
+    if (o->num_streams > 1) {
+        PacketPassConnector_Free(&con->send_connector);
+    }
     PacketPassFairQueueFlow_Free(&con->send_qflow);
+    BPending_Free(&con->replay_job);
     BPending_Free(&con->first_job);
+    if (o->replay_packets > 0) {
+        BFree(con->replay_data);
+    }
+fail0b:
+    if (o->replay_packets > 0) {
+        BFree(con->replay_entries);
+    }
+fail0a:
     free(con);
 fail0:
     return;
@@ -306,6 +473,11 @@ static void connection_free (struct UdpGwClient_connection *con)
     UdpGwClient *o = con->client;
     PacketPassFairQueueFlow_AssertFree(&con->send_qflow);
     
+    // finish accounting
+    if (o->stats) {
+        flow_stats_flow_end(o->stats, &con->stats_flow, btime_gettime());
+    }
+    
     // decrement number of connections
     o->num_connections--;
     
@@ -321,12 +493,26 @@ static void connection_free (struct UdpGwClient_connection *con)
     // free PacketProtoFlow
     PacketProtoFlow_Free(&con->send_ppflow);
     
+    // free connector
+    if (o->num_streams > 1) {
+        PacketPassConnector_Free(&con->send_connector);
+    }
+    
     // free queue flow
     PacketPassFairQueueFlow_Free(&con->send_qflow);
     
+    // free replay job
+    BPending_Free(&con->replay_job);
+    
     // free first job
     BPending_Free(&con->first_job);
     
+    // free replay queue
+    if (o->replay_packets > 0) {
+        BFree(con->replay_data);
+        BFree(con->replay_entries);
+    }
+    
     // free structure
     free(con);
 }
@@ -339,7 +525,36 @@ static void connection_first_job_handler (struct UdpGwClient_connection *con)
 static void connection_send (struct UdpGwClient_connection *con, uint8_t flags, const uint8_t *data, int data_len)
 {
     UdpGwClient *o = con->client;
-    B_USE(o)
+    ASSERT(data_len >= 0)
+    ASSERT(data_len <= o->udp_mtu)
+    
+    // remember packet for replay, replacing the oldest one if full; packets sent
+    // while the server is lost stay in our buffers and don't need it
+    if (o->replay_packets > 0 && !o->server_lost) {
+        int index;
+        if (con->replay_count < o->replay_packets) {
+            index = (con->replay_start + con->replay_count) % o->replay_packets;
+            con->replay_count++;
+        } else {
+            index = con->replay_start;
+            con->replay_start = (con->replay_start + 1) % o->replay_packets;
+            if (con->replay_pos > 0) {
+                con->replay_pos--;
+            }
+        }
+        struct UdpGwClient__replay_entry *e = &con->replay_entries[index];
+        e->time = btime_gettime();
+        e->flags = flags & ~UDPGW_CLIENT_FLAG_REBIND;
+        e->data_len = data_len;
+        memcpy(con->replay_data + (size_t)index * o->udp_mtu, data, data_len);
+    }
+    
+    connection_write(con, flags, data, data_len);
+}
+
+static int connection_write (struct UdpGwClient_connection *con, uint8_t flags, const uint8_t *data, int data_len)
+{
+    UdpGwClient *o = con->client;
     ASSERT(data_len >= 0)
     ASSERT(data_len <= o->udp_mtu)
     
@@ -347,10 +562,19 @@ static void connection_send (struct UdpGwClient_connection *con, uint8_t flags,
     uint8_t *out;
     if (!BufferWriter_StartPacket(con->send_if, &out)) {
         BLog(BLOG_ERROR, "out of buffer");
-        return;
+        if (o->stats) {
+            flow_stats_flow_stall(o->stats, &con->stats_flow);
+        }
+        return 0;
     }
     int out_pos = 0;
     
+    // if the server was lost since this connection last sent, have it bind anew
+    if (con->server_epoch != o->server_epoch) {
+        flags |= UDPGW_CLIENT_FLAG_REBIND;
+        con->server_epoch = o->server_epoch;
+    }
+    
     if (con->conaddr.remote_addr.type == BADDR_TYPE_IPV6) {
         flags |= UDPGW_CLIENT_FLAG_IPV6;
     }
@@ -386,6 +610,81 @@ static void connection_send (struct UdpGwClient_connection *con, uint8_t flags,
     
     // submit packet to buffer
     BufferWriter_EndPacket(con->send_if, out_pos);
+    
+    // account sent data
+    if (o->stats) {
+        flow_stats_flow_up(o->stats, &con->stats_flow, data_len);
+    }
+    
+    return 1;
+}
+
+static void connection_move (struct UdpGwClient_connection *con, struct UdpGwClient_stream *s)
+{
+    ASSERT(con->client->num_streams > 1)
+    ASSERT(s != con->stream)
+    ASSERT(!PacketPassFairQueueFlow_IsBusy(&con->send_qflow))
+    
+    BLog(BLOG_DEBUG, "moving connection %"PRIu16" from stream %d to stream %d", con->conid, con->stream->index, s->index);
+    
+    // disconnect from old queue flow; the connector keeps any packet
+    // in progress and resends it to the new queue flow
+    PacketPassConnector_DisconnectOutput(&con->send_connector);
+    PacketPassFairQueueFlow_Free(&con->send_qflow);
+    
+    // set stream
+    con->stream = s;
+    
+    // connect to new queue flow
+    PacketPassFairQueueFlow_Init(&con->send_qflow, &s->send_queue);
+    PacketPassConnector_ConnectOutput(&con->send_connector, PacketPassFairQueueFlow_GetInput(&con->send_qflow));
+}
+
+static void connection_update_stream (struct UdpGwClient_connection *con)
+{
+    UdpGwClient *o = con->client;
+    
+    // if the connection's stream went down, or its own stream came back,
+    // move it; it can't move while a packet of it is being sent
+    if (o->num_streams > 1) {
+        struct UdpGwClient_stream *s = choose_stream(o, con->conid);
+        if (s != con->stream && !PacketPassFairQueueFlow_IsBusy(&con->send_qflow)) {
+            connection_move(con, s);
+        }
+    }
+}
+
+static void connection_replay_job_handler (struct UdpGwClient_connection *con)
+{
+    UdpGwClient *o = con->client;
+    ASSERT(o->replay_packets > 0)
+    ASSERT(con->replay_pos >= 0)
+    ASSERT(con->replay_pos <= con->replay_count)
+    
+    btime_t now = btime_gettime();
+    
+    // send the next remembered packet which is recent enough, oldest first
+    while (con->replay_pos < con->replay_count) {
+        int index = (con->replay_start + con->replay_pos) % o->replay_packets;
+        struct UdpGwClient__replay_entry *e = &con->replay_entries[index];
+        con->replay_pos++;
+        
+        if (now - e->time > UDPGWCLIENT_REPLAY_MAX_AGE) {
+            continue;
+        }
+        
+        // the buffer takes one packet per job; setting the job before
+        // writing makes it run after the buffer has taken this one
+        if (con->replay_pos < con->replay_count) {
+            BPending_Set(&con->replay_job);
+        }
+        
+        // stop if the buffer is full
+        if (!connection_write(con, e->flags, con->replay_data + (size_t)index * o->udp_mtu, e->data_len)) {
+            BPending_Unset(&con->replay_job);
+        }
+        return;
+    }
 }
 
 static struct UdpGwClient_connection * reuse_connection (UdpGwClient *o, struct UdpGwClient_conaddr conaddr)
@@ -402,13 +701,27 @@ static struct UdpGwClient_connection * reuse_connection (UdpGwClient *o, struct
     // set new conaddr
     con->conaddr = conaddr;
     
+    // packets of the old flow must not be replayed
+    con->replay_count = 0;
+    con->replay_pos = 0;
+    BPending_Unset(&con->replay_job);
+    
+    // account as a new flow
+    con->got_reply = 0;
+    if (o->stats) {
+        btime_t now = btime_gettime();
+        flow_stats_flow_end(o->stats, &con->stats_flow, now);
+        flow_stats_flow_start(o->stats, &con->stats_flow, now);
+    }
+    
     // insert to connections tree by conaddr
     ASSERT_EXECUTE(BAVL_Insert(&o->connections_tree_by_conaddr, &con->connections_tree_by_conaddr_node, NULL))
     
     return con;
 }
 
-int UdpGwClient_Init (UdpGwClient *o, int udp_mtu, int max_connections, int send_buffer_size, btime_t keepalive_time, BReactor *reactor, void *user,
+int UdpGwClient_Init (UdpGwClient *o, int udp_mtu, int max_connections, int send_buffer_size, int replay_packets, btime_t keepalive_time,
+                      int num_streams, const uint8_t *session_id, BReactor *reactor, void *user,
                       UdpGwClient_handler_servererror handler_servererror,
                       UdpGwClient_handler_received handler_received)
 {
@@ -417,12 +730,18 @@ int UdpGwClient_Init (UdpGwClient *o, int udp_mtu, int max_connections, int send
     ASSERT(udpgw_compute_mtu(udp_mtu) <= PACKETPROTO_MAXPAYLOAD)
     ASSERT(max_connections > 0)
     ASSERT(send_buffer_size > 0)
+    ASSERT(replay_packets >= 0)
+    ASSERT(num_streams > 0)
+    ASSERT(num_streams <= UDPGWCLIENT_MAX_STREAMS)
+    ASSERT(num_streams == 1 || session_id)
     
     // init arguments
     o->udp_mtu = udp_mtu;
     o->max_connections = max_connections;
     o->send_buffer_size = send_buffer_size;
+    o->replay_packets = replay_packets;
     o->keepalive_time = keepalive_time;
+    o->num_streams = num_streams;
     o->reactor = reactor;
     o->user = user;
     o->handler_servererror = handler_servererror;
@@ -452,41 +771,41 @@ int UdpGwClient_Init (UdpGwClient *o, int udp_mtu, int max_connections, int send
     // set next conid
     o->next_conid = 0;
     
-    // init send connector
-    PacketPassConnector_Init(&o->send_connector, o->pp_mtu, BReactor_PendingGroup(o->reactor));
-    
-    // init send monitor
-    PacketPassInactivityMonitor_Init(&o->send_monitor, PacketPassConnector_GetInput(&o->send_connector), o->reactor, o->keepalive_time, (PacketPassInactivityMonitor_handler)send_monitor_handler, o);
-    
-    // init send queue
-    if (!PacketPassFairQueue_Init(&o->send_queue, PacketPassInactivityMonitor_GetInput(&o->send_monitor), BReactor_PendingGroup(o->reactor), 0, 1)) {
-        goto fail0;
-    }
-    
     // construct keepalive packet
     o->keepalive_packet.pp.len = sizeof(o->keepalive_packet.udpgw);
     memset(&o->keepalive_packet.udpgw, 0, sizeof(o->keepalive_packet.udpgw));
     o->keepalive_packet.udpgw.flags = UDPGW_CLIENT_FLAG_KEEPALIVE;
     
-    // init keepalive queue flow
-    PacketPassFairQueueFlow_Init(&o->keepalive_qflow, &o->send_queue);
-    o->keepalive_if = PacketPassFairQueueFlow_GetInput(&o->keepalive_qflow);
+    // construct session packet
+    memset(&o->session_packet, 0, sizeof(o->session_packet));
+    o->session_packet.pp.len = htol16(sizeof(o->session_packet) - sizeof(o->session_packet.pp));
+    o->session_packet.udpgw.flags = htol8(UDPGW_CLIENT_FLAG_KEEPALIVE|UDPGW_CLIENT_FLAG_SESSION);
+    if (o->num_streams > 1) {
+        memcpy(o->session_packet.session.id, session_id, sizeof(o->session_packet.session.id));
+    }
     
-    // init keepalive output
-    PacketPassInterface_Sender_Init(o->keepalive_if, (PacketPassInterface_handler_done)keepalive_if_handler_done, o);
+    // init streams
+    int i;
+    for (i = 0; i < o->num_streams; i++) {
+        if (!stream_init(o, &o->streams[i], i)) {
+            goto fail0;
+        }
+    }
     
-    // set not sending keepalive
-    o->keepalive_sending = 0;
+    // set server not lost; it can only be lost after it was there
+    o->server_lost = 0;
+    o->server_epoch = 0;
     
-    // set have no server
-    o->have_server = 0;
+    // set no stats
+    o->stats = NULL;
     
     DebugObject_Init(&o->d_obj);
     return 1;
     
 fail0:
-    PacketPassInactivityMonitor_Free(&o->send_monitor);
-    PacketPassConnector_Free(&o->send_connector);
+    while (i-- > 0) {
+        stream_free(&o->streams[i]);
+    }
     return 0;
 }
 
@@ -495,7 +814,9 @@ void UdpGwClient_Free (UdpGwClient *o)
     DebugObject_Free(&o->d_obj);
     
     // allow freeing send queue flows
-    PacketPassFairQueue_PrepareFree(&o->send_queue);
+    for (int i = 0; i < o->num_streams; i++) {
+        PacketPassFairQueue_PrepareFree(&o->streams[i].send_queue);
+    }
     
     // free connections
     while (!LinkedList1_IsEmpty(&o->connections_list)) {
@@ -503,22 +824,10 @@ void UdpGwClient_Free (UdpGwClient *o)
         connection_free(con);
     }
     
-    // free server
-    if (o->have_server) {
-        free_server(o);
+    // free streams
+    for (int i = 0; i < o->num_streams; i++) {
+        stream_free(&o->streams[i]);
     }
-    
-    // free keepalive queue flow
-    PacketPassFairQueueFlow_Free(&o->keepalive_qflow);
-    
-    // free send queue
-    PacketPassFairQueue_Free(&o->send_queue);
-    
-    // free send
-    PacketPassInactivityMonitor_Free(&o->send_monitor);
-    
-    // free send connector
-    PacketPassConnector_Free(&o->send_connector);
 }
 
 void UdpGwClient_SubmitPacket (UdpGwClient *o, BAddr local_addr, BAddr remote_addr, int is_dns, const uint8_t *data, int data_len)
@@ -558,49 +867,116 @@ void UdpGwClient_SubmitPacket (UdpGwClient *o, BAddr local_addr, BAddr remote_ad
         LinkedList1_Remove(&o->connections_list, &con->connections_list_node);
         LinkedList1_Append(&o->connections_list, &con->connections_list_node);
         
+        // move connection to the right stream
+        connection_update_stream(con);
+        
         // send packet to existing connection
         connection_send(con, flags, data, data_len);
     }
 }
 
-int UdpGwClient_ConnectServer (UdpGwClient *o, StreamPassInterface *send_if, StreamRecvInterface *recv_if)
+int UdpGwClient_ConnectServer (UdpGwClient *o, int stream, StreamPassInterface *send_if, StreamRecvInterface *recv_if)
 {
     DebugObject_Access(&o->d_obj);
-    ASSERT(!o->have_server)
+    ASSERT(stream >= 0)
+    ASSERT(stream < o->num_streams)
+    
+    struct UdpGwClient_stream *s = &o->streams[stream];
+    ASSERT(!s->have_server)
     
     // init receive interface
-    PacketPassInterface_Init(&o->recv_if, o->udpgw_mtu, (PacketPassInterface_handler_send)recv_interface_handler_send, o, BReactor_PendingGroup(o->reactor));
+    PacketPassInterface_Init(&s->recv_if, o->udpgw_mtu, (PacketPassInterface_handler_send)recv_interface_handler_send, s, BReactor_PendingGroup(o->reactor));
+    PacketPassInterface_SetName(&s->recv_if, "UdpGwClient receive");
     
     // init receive decoder
-    if (!PacketProtoDecoder_Init(&o->recv_decoder, recv_if, &o->recv_if, BReactor_PendingGroup(o->reactor), o, (PacketProtoDecoder_handler_error)decoder_handler_error)) {
+    if (!PacketProtoDecoder_Init(&s->recv_decoder, recv_if, &s->recv_if, BReactor_PendingGroup(o->reactor), s, (PacketProtoDecoder_handler_error)decoder_handler_error)) {
         BLog(BLOG_ERROR, "PacketProtoDecoder_Init failed");
         goto fail1;
     }
     
     // init send sender
-    PacketStreamSender_Init(&o->send_sender, send_if, o->pp_mtu, BReactor_PendingGroup(o->reactor));
+    if (!PacketStreamCoalescer_Init(&s->send_sender, send_if, o->pp_mtu, UDPGWCLIENT_SEND_COALESCE_SIZE, 0, o->reactor)) {
+        BLog(BLOG_ERROR, "PacketStreamCoalescer_Init failed");
+        goto fail2;
+    }
     
     // connect send connector
-    PacketPassConnector_ConnectOutput(&o->send_connector, PacketStreamSender_GetInput(&o->send_sender));
+    PacketPassConnector_ConnectOutput(&s->send_connector, PacketStreamCoalescer_GetInput(&s->send_sender));
     
     // set have server
-    o->have_server = 1;
+    s->have_server = 1;
+    
+    // join the session; if a keepalive is being sent, this happens after it
+    if (o->num_streams > 1) {
+        if (s->keepalive_sending) {
+            s->session_pending = 1;
+        } else {
+            send_session(s);
+        }
+    }
+    
+    // if all streams were down, the server may have forgotten our connections;
+    // send again what they sent recently and wasn't answered
+    if (o->server_lost) {
+        o->server_lost = 0;
+        
+        if (o->replay_packets > 0) {
+            for (LinkedList1Node *ln = LinkedList1_GetFirst(&o->connections_list); ln; ln = LinkedList1Node_Next(ln)) {
+                struct UdpGwClient_connection *con = UPPER_OBJECT(ln, struct UdpGwClient_connection, connections_list_node);
+                connection_update_stream(con);
+                
+                // start replay
+                con->replay_pos = 0;
+                BPending_Set(&con->replay_job);
+            }
+        }
+    }
     
     return 1;
     
+fail2:
+    PacketProtoDecoder_Free(&s->recv_decoder);
 fail1:
-    PacketPassInterface_Free(&o->recv_if);
+    PacketPassInterface_Free(&s->recv_if);
     return 0;
 }
 
-void UdpGwClient_DisconnectServer (UdpGwClient *o)
+void UdpGwClient_DisconnectServer (UdpGwClient *o, int stream)
 {
     DebugObject_Access(&o->d_obj);
-    ASSERT(o->have_server)
+    ASSERT(stream >= 0)
+    ASSERT(stream < o->num_streams)
+    
+    struct UdpGwClient_stream *s = &o->streams[stream];
+    ASSERT(s->have_server)
     
     // free server
-    free_server(o);
+    free_server(s);
     
     // set have no server
-    o->have_server = 0;
+    s->have_server = 0;
+    
+    // the session packet will be sent again on the next connection
+    s->session_pending = 0;
+    
+    // check if this was the last stream up
+    for (int i = 0; i < o->num_streams; i++) {
+        if (o->streams[i].have_server) {
+            return;
+        }
+    }
+    
+    BLog(BLOG_INFO, "lost server");
+    
+    // set server lost; connections will have the server bind them anew
+    o->server_lost = 1;
+    o->server_epoch++;
+}
+
+void UdpGwClient_SetStats (UdpGwClient *o, struct flow_stats_class *stats)
+{
+    DebugObject_Access(&o->d_obj);
+    ASSERT(o->num_connections == 0)
+    
+    o->stats = stats;
 }
@@ -34,19 +34,29 @@
 #include <protocol/udpgw_proto.h>
 #include <misc/debug.h>
 #include <misc/packed.h>
+#include <misc/flow_stats.h>
 #include <structure/BAVL.h>
 #include <structure/LinkedList1.h>
 #include <base/DebugObject.h>
 #include <system/BAddr.h>
 #include <base/BPending.h>
 #include <flow/PacketPassFairQueue.h>
-#include <flow/PacketStreamSender.h>
 #include <flow/PacketProtoFlow.h>
 #include <flow/PacketProtoDecoder.h>
 #include <flow/PacketPassConnector.h>
 #include <flowextra/PacketPassInactivityMonitor.h>
+#include <flowextra/PacketStreamCoalescer.h>
 
-typedef void (*UdpGwClient_handler_servererror) (void *user);
+// size of the buffer for coalescing packets sent to the server, in bytes
+#define UDPGWCLIENT_SEND_COALESCE_SIZE 4096
+
+// maximum number of server connections (streams) connections are spread over
+#define UDPGWCLIENT_MAX_STREAMS 16
+
+// packets older than this are not replayed after the server was lost
+#define UDPGWCLIENT_REPLAY_MAX_AGE 2000
+
+typedef void (*UdpGwClient_handler_servererror) (void *user, int stream);
 typedef void (*UdpGwClient_handler_received) (void *user, BAddr local_addr, BAddr remote_addr, const uint8_t *data, int data_len);
 
 B_START_PACKED
@@ -56,10 +66,43 @@ struct UdpGwClient__keepalive_packet {
 } B_PACKED;
 B_END_PACKED
 
-typedef struct {
+B_START_PACKED
+struct UdpGwClient__session_packet {
+    struct packetproto_header pp;
+    struct udpgw_header udpgw;
+    struct udpgw_session session;
+} B_PACKED;
+B_END_PACKED
+
+struct _UdpGwClient;
+
+struct UdpGwClient_stream {
+    struct _UdpGwClient *client;
+    int index;
+    PacketPassFairQueue send_queue;
+    PacketPassInactivityMonitor send_monitor;
+    PacketPassConnector send_connector;
+    PacketPassInterface *keepalive_if;
+    PacketPassFairQueueFlow keepalive_qflow;
+    int keepalive_sending;
+    int session_pending;
+    int have_server;
+    PacketStreamCoalescer send_sender;
+    PacketProtoDecoder recv_decoder;
+    PacketPassInterface recv_if;
+};
+
+struct UdpGwClient__replay_entry {
+    btime_t time;
+    uint8_t flags;
+    int data_len;
+};
+
+typedef struct _UdpGwClient {
     int udp_mtu;
     int max_connections;
     int send_buffer_size;
+    int replay_packets;
     btime_t keepalive_time;
     BReactor *reactor;
     void *user;
@@ -72,17 +115,13 @@ typedef struct {
     LinkedList1 connections_list;
     int num_connections;
     int next_conid;
-    PacketPassFairQueue send_queue;
-    PacketPassInactivityMonitor send_monitor;
-    PacketPassConnector send_connector;
     struct UdpGwClient__keepalive_packet keepalive_packet;
-    PacketPassInterface *keepalive_if;
-    PacketPassFairQueueFlow keepalive_qflow;
-    int keepalive_sending;
-    int have_server;
-    PacketStreamSender send_sender;
-    PacketProtoDecoder recv_decoder;
-    PacketPassInterface recv_if;
+    struct UdpGwClient__session_packet session_packet;
+    int num_streams;
+    struct UdpGwClient_stream streams[UDPGWCLIENT_MAX_STREAMS];
+    int server_lost;
+    uint32_t server_epoch;
+    struct flow_stats_class *stats;
     DebugObject d_obj;
 } UdpGwClient;
 
@@ -98,21 +137,59 @@ struct UdpGwClient_connection {
     const uint8_t *first_data;
     int first_data_len;
     uint16_t conid;
+    struct UdpGwClient_stream *stream;
     BPending first_job;
     BufferWriter *send_if;
     PacketProtoFlow send_ppflow;
+    PacketPassConnector send_connector; // only used with more than one stream
     PacketPassFairQueueFlow send_qflow;
+    uint32_t server_epoch;
+    struct UdpGwClient__replay_entry *replay_entries; // only used with replay_packets>0
+    uint8_t *replay_data;
+    int replay_start;
+    int replay_count;
+    int replay_pos;
+    BPending replay_job;
     BAVLNode connections_tree_by_conaddr_node;
     BAVLNode connections_tree_by_conid_node;
     LinkedList1Node connections_list_node;
+    struct flow_stats_flow stats_flow;
+    int got_reply;
 };
 
-int UdpGwClient_Init (UdpGwClient *o, int udp_mtu, int max_connections, int send_buffer_size, btime_t keepalive_time, BReactor *reactor, void *user,
+/**
+ * Initializes the udpgw client.
+ * 
+ * Connections are spread over num_streams server connections (streams) by
+ * conid, so that a stalled stream only delays the connections on it. While a
+ * connection's stream is down, its packets are sent over another stream which is
+ * up. With more than one stream, every stream starts with a session packet
+ * carrying session_id, so that the server treats the streams as one client.
+ * 
+ * The last replay_packets packets every connection sent while a stream was up
+ * are remembered. If all streams go down, these may have been lost with the
+ * connection; when a stream comes back, those not older than
+ * UDPGWCLIENT_REPLAY_MAX_AGE are sent again, after the packets buffered in the
+ * meantime. Since it isn't known which of them got through, the destination
+ * may see some packets twice. After all streams went down, the next packet of every connection
+ * carries UDPGW_CLIENT_FLAG_REBIND, since the server may have lost or kept a
+ * stale binding of the conid.
+ * 
+ * @param replay_packets number of packets to remember per connection for replay;
+ *        0 disables replay. Must be >=0. Replayed packets need room in the
+ *        connection's send buffer, so this should be well below send_buffer_size.
+ * @param num_streams number of streams. Must be >0 and <=UDPGWCLIENT_MAX_STREAMS.
+ * @param session_id session ID, UDPGW_SESSION_ID_LEN bytes; only used if num_streams>1,
+ *        and should then be unpredictable.
+ */
+int UdpGwClient_Init (UdpGwClient *o, int udp_mtu, int max_connections, int send_buffer_size, int replay_packets, btime_t keepalive_time,
+                      int num_streams, const uint8_t *session_id, BReactor *reactor, void *user,
                       UdpGwClient_handler_servererror handler_servererror,
                       UdpGwClient_handler_received handler_received) WARN_UNUSED;
 void UdpGwClient_Free (UdpGwClient *o);
 void UdpGwClient_SubmitPacket (UdpGwClient *o, BAddr local_addr, BAddr remote_addr, int is_dns, const uint8_t *data, int data_len);
-int UdpGwClient_ConnectServer (UdpGwClient *o, StreamPassInterface *send_if, StreamRecvInterface *recv_if) WARN_UNUSED;
-void UdpGwClient_DisconnectServer (UdpGwClient *o);
+int UdpGwClient_ConnectServer (UdpGwClient *o, int stream, StreamPassInterface *send_if, StreamRecvInterface *recv_if) WARN_UNUSED;
+void UdpGwClient_DisconnectServer (UdpGwClient *o, int stream);
+void UdpGwClient_SetStats (UdpGwClient *o, struct flow_stats_class *stats);
 
 #endif